@@ -89,7 +89,7 @@ static void *publish_thread_direct(void *usr)
         DATA->send_time = wallclock();
         DATA->msg_size = st->msg_size;
 
-        zcm_msg_t msg[1];
+        zcm_msg_t msg[1] = {{0}};
         msg->utime = 0;
         msg->channel = "BLOB";
         msg->len = offsetof(data_t, BLOB) + st->msg_size;
@@ -121,7 +121,7 @@ static void *handle_thread_direct(void *usr)
 
     zcm_trans_recvmsg_enable(trans, "BLOB", true);
 
-    zcm_msg_t msg[1];
+    zcm_msg_t msg[1] = {{0}};
     while (st->res->num_messages < st->limit) {
         i64 start = wallclock();
         int ret = zcm_trans_recvmsg(trans, msg, 0);
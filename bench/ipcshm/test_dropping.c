@@ -56,7 +56,7 @@ static void *publish_thread_direct(void *usr)
         DATA->send_time = wallclock();
         DATA->seq = seq++;
 
-        zcm_msg_t msg[1];
+        zcm_msg_t msg[1] = {{0}};
         msg->utime = 0;
         msg->channel = "BLOB";
         msg->len = sizeof(data_t);
@@ -81,7 +81,7 @@ static void *handle_thread_direct(void *usr)
 
     zcm_trans_recvmsg_enable(trans, "BLOB", true);
 
-    zcm_msg_t msg[1];
+    zcm_msg_t msg[1] = {{0}};
     while (1) {
         uint64_t drops = 0;
         int ret = zcm_trans_query_drops(trans, &drops);
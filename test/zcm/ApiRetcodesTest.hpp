@@ -214,6 +214,21 @@ class ApiRetcodesTest : public CxxTest::TestSuite
 
         zcm_cleanup(&zcm);
     }
+
+    void testQueryUnimpl(void)
+    {
+        zcm_t zcm;
+        zcm_init(&zcm, "test-generic", NULL);
+
+        uint64_t drops;
+        TS_ASSERT_EQUALS(ZCM_EUNIMPL, zcm_query_drops(&zcm, &drops));
+
+        zcm_stat_t stats[4];
+        size_t nstats = 4;
+        TS_ASSERT_EQUALS(ZCM_EUNIMPL, zcm_query_stats(&zcm, stats, &nstats));
+
+        zcm_cleanup(&zcm);
+    }
 };
 
 
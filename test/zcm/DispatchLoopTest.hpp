@@ -32,6 +32,11 @@ static void killThread()
     }
 }
 
+static void countHandler(const zcm_recv_buf_t *rbuf, const char *channel, void *usr)
+{
+    (*(std::atomic<int>*)usr)++;
+}
+
 static void controlThread(zcm_t *zcm)
 {
     // sleep 10 ms and then shut down zcm
@@ -107,6 +112,30 @@ class DispatchLoopTest : public CxxTest::TestSuite
 
         zcm_destroy(zcm);
     }
+
+    void testInlineDispatch() {
+        zcm_t *zcm = zcm_create("block-inproc");
+        TS_ASSERT(zcm);
+
+        std::atomic<int> nrecv {0};
+        zcm_subscribe(zcm, "INLINE", countHandler, &nrecv);
+        zcm_set_inline_dispatch(zcm, 1);
+
+        running = true;
+        std::thread kill {killThread};
+        zcm_start(zcm);
+
+        uint8_t data = 'A';
+        for (int i = 0; i < 10; i++) zcm_publish(zcm, "INLINE", &data, 1);
+        for (int i = 0; i < 100 && nrecv < 10; i++) usleep(1000);
+        TS_ASSERT_EQUALS(nrecv, 10);
+
+        zcm_stop(zcm);
+        running = false;
+
+        kill.join();
+        zcm_destroy(zcm);
+    }
 };
 
 #endif // DISPATCHLOOPTEST_H
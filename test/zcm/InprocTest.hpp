@@ -0,0 +1,157 @@
+#ifndef INPROCTEST_HPP
+#define INPROCTEST_HPP
+
+#include <unistd.h>
+#include <cstring>
+#include <thread>
+
+#include <zcm/zcm.h>
+#include "cxxtest/TestSuite.h"
+
+struct InprocCounter
+{
+    int recvd = 0;
+    int misordered = 0;
+};
+
+static void inprocHandler(const zcm_recv_buf_t *rbuf, const char *channel, void *usr)
+{
+    InprocCounter *c = (InprocCounter*)usr;
+    int val;
+    memcpy(&val, rbuf->data, sizeof(val));
+    if (val != c->recvd) c->misordered++;
+    c->recvd++;
+}
+
+struct InprocThreadCounter
+{
+    static const int THREADS = 4;
+    int recvd = 0;
+    int misordered = 0;
+    int next[THREADS] = {};
+};
+
+// Payload is { thread, seq }: each publishing thread's messages must arrive in order
+static void inprocThreadHandler(const zcm_recv_buf_t *rbuf, const char *channel, void *usr)
+{
+    InprocThreadCounter *c = (InprocThreadCounter*)usr;
+    int msg[2];
+    memcpy(msg, rbuf->data, sizeof(msg));
+    if (msg[0] < 0 || msg[0] >= InprocThreadCounter::THREADS || msg[1] != c->next[msg[0]]) {
+        c->misordered++;
+        return;
+    }
+    c->next[msg[0]]++;
+    c->recvd++;
+}
+
+class InprocTest : public CxxTest::TestSuite
+{
+  public:
+    void setUp() override {}
+    void tearDown() override {}
+
+    void testBlocking()
+    {
+        const int N = 2500;
+        const int T = InprocThreadCounter::THREADS;
+
+        zcm_t *zcm = zcm_create("block-inproc");
+        TS_ASSERT(zcm);
+        InprocThreadCounter c;
+        zcm_subscribe(zcm, "INPROC", inprocThreadHandler, &c);
+        zcm_start(zcm);
+
+        // Publish from a few threads at once: sends are lock-free but each thread's must stay
+        // in order
+        std::thread threads[T];
+        for (int t = 0; t < T; t++) {
+            threads[t] = std::thread([zcm, t, N](){
+                for (int i = 0; i < N;) {
+                    int msg[2] = { t, i };
+                    if (zcm_publish(zcm, "INPROC", (uint8_t*)msg, sizeof(msg)) == ZCM_EOK) i++;
+                    else usleep(100);
+                }
+            });
+        }
+        for (auto& t : threads) t.join();
+
+        for (int i = 0; i < 500 && c.recvd < N * T; i++) usleep(10000);
+        zcm_stop(zcm);
+
+        TS_ASSERT_EQUALS(c.recvd, N * T);
+        TS_ASSERT_EQUALS(c.misordered, 0);
+        zcm_destroy(zcm);
+    }
+
+    void testDirectPublish()
+    {
+        const int N = 1000;
+
+        zcm_t *zcm = zcm_create("block-inproc://?depth=8");
+        TS_ASSERT(zcm);
+        TS_ASSERT_EQUALS(zcm_set_direct_publish(zcm, 1), ZCM_EOK);
+        InprocCounter c;
+        zcm_subscribe(zcm, "INPROC", inprocHandler, &c);
+        zcm_start(zcm);
+
+        // Publishing faster than the transport holds falls back to the send thread,
+        // without reordering anything
+        for (int i = 0; i < N; i++) {
+            while (zcm_publish(zcm, "INPROC", (uint8_t*)&i, sizeof(i)) != ZCM_EOK) usleep(100);
+        }
+        zcm_flush(zcm);
+
+        // The send thread waits for room rather than drop what publish() accepted
+        for (int i = 0; i < 500 && c.recvd < N; i++) usleep(10000);
+        zcm_stop(zcm);
+
+        uint64_t drops = 0;
+        TS_ASSERT_EQUALS(zcm_query_drops(zcm, &drops), ZCM_EOK);
+        TS_ASSERT_EQUALS(drops, 0);
+        TS_ASSERT_EQUALS(c.recvd, N);
+        TS_ASSERT_EQUALS(c.misordered, 0);
+        zcm_destroy(zcm);
+    }
+
+    void testNonblocking()
+    {
+        zcm_t *zcm = zcm_create("nonblock-inproc");
+        TS_ASSERT(zcm);
+        InprocCounter c;
+        zcm_subscribe(zcm, "INPROC", inprocHandler, &c);
+
+        for (int i = 0; i < 100; i++) {
+            TS_ASSERT_EQUALS(zcm_publish(zcm, "INPROC", (uint8_t*)&i, sizeof(i)), ZCM_EOK);
+        }
+        zcm_flush(zcm);
+
+        TS_ASSERT_EQUALS(c.recvd, 100);
+        TS_ASSERT_EQUALS(c.misordered, 0);
+        zcm_destroy(zcm);
+    }
+
+    void testDepth()
+    {
+        zcm_t *zcm = zcm_create("nonblock-inproc://?depth=4");
+        TS_ASSERT(zcm);
+        InprocCounter c;
+        zcm_subscribe(zcm, "INPROC", inprocHandler, &c);
+
+        // Sends fail once the transport is full, and are counted as drops
+        int i = 0;
+        for (; i < 4; i++) {
+            TS_ASSERT_EQUALS(zcm_publish(zcm, "INPROC", (uint8_t*)&i, sizeof(i)), ZCM_EOK);
+        }
+        TS_ASSERT_DIFFERS(zcm_publish(zcm, "INPROC", (uint8_t*)&i, sizeof(i)), ZCM_EOK);
+        uint64_t drops = 0;
+        zcm_query_drops(zcm, &drops);
+        TS_ASSERT_EQUALS(drops, 1);
+
+        zcm_flush(zcm);
+        TS_ASSERT_EQUALS(c.recvd, 4);
+        zcm_destroy(zcm);
+    }
+};
+
+#endif // INPROCTEST_HPP
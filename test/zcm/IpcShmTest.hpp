@@ -0,0 +1,435 @@
+#ifndef IPCSHMTEST_H
+#define IPCSHMTEST_H
+
+#include <vector>
+#include <thread>
+#include <set>
+#include <cstdlib>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "cxxtest/TestSuite.h"
+#include "zcm/transport_registrar.h"
+#include "util/TimeUtil.hpp"
+
+// After the std headers, see lf_machine_assumptions.h
+#include "zcm/transport/lockfree/lf_bcast.h"
+#include "zcm/transport/lockfree/lf_shm.h"
+
+using namespace std;
+
+static zcm_trans_t *makeIpcShmTransport(const char *url)
+{
+    auto *u = zcm_url_create(url);
+    auto *creator = zcm_transport_find(zcm_url_protocol(u));
+    TSM_ASSERT("Failed to find ipcshm transport", creator);
+    zcm_trans_t *ret = creator ? creator(u, NULL) : NULL;
+    zcm_url_destroy(u);
+    return ret;
+}
+
+static int tryPublishValue(zcm_trans_t *trans, uint8_t val, size_t len = 100,
+                           const char *channel = "IPCSHM_TEST")
+{
+    vector<uint8_t> data(len, val);
+    zcm_msg_t msg = {};
+    msg.channel = channel;
+    msg.len = data.size();
+    msg.buf = data.data();
+    return zcm_trans_sendmsg(trans, msg);
+}
+
+static void publishValue(zcm_trans_t *trans, uint8_t val, size_t len = 100,
+                         const char *channel = "IPCSHM_TEST")
+{
+    TS_ASSERT_EQUALS(tryPublishValue(trans, val, len, channel), ZCM_EOK);
+}
+
+class IpcShmTest : public CxxTest::TestSuite
+{
+  public:
+    void setUp() override {}
+    void tearDown() override {}
+
+    // A slow reader of a lent message learns that it was overwritten
+    void testZeroCopyOverwrite()
+    {
+        (void)system("rm -f /dev/shm/zcm/ipcshm/zerocopy_test");
+        zcm_trans_t *pub = makeIpcShmTransport("ipcshm://zerocopy_test?depth=4&mlock=0");
+        zcm_trans_t *sub = makeIpcShmTransport("ipcshm://zerocopy_test?depth=4&mlock=0&zerocopy=1");
+        TS_ASSERT(pub && sub);
+        if (!pub || !sub) return;
+
+        publishValue(pub, 1);
+        zcm_msg_t msg = {};
+        TS_ASSERT_EQUALS(zcm_trans_recvmsg(sub, &msg, 10), ZCM_EOK);
+        TS_ASSERT_EQUALS(msg.buf[0], 1);
+        TS_ASSERT_EQUALS(zcm_trans_recvmsg_validate(sub, &msg), ZCM_EOK);
+
+        for (uint8_t i = 2; i < 20; i++) publishValue(pub, i);
+        TS_ASSERT_EQUALS(zcm_trans_recvmsg_validate(sub, &msg), ZCM_EAGAIN);
+        zcm_trans_recvmsg_release(sub, &msg);
+
+        uint64_t drops = 0;
+        TS_ASSERT_EQUALS(zcm_trans_query_drops(sub, &drops), ZCM_EOK);
+        TS_ASSERT_EQUALS(drops, 1);
+
+        zcm_trans_destroy(sub);
+        zcm_trans_destroy(pub);
+    }
+
+    // A pinned message stays intact until it's released, however far publishers get ahead
+    void testPinnedMessage()
+    {
+        (void)system("rm -f /dev/shm/zcm/ipcshm/pin_test");
+        zcm_trans_t *pub = makeIpcShmTransport("ipcshm://pin_test?depth=4&mlock=0");
+        zcm_trans_t *sub = makeIpcShmTransport("ipcshm://pin_test?depth=4&mlock=0&pin=1");
+        TS_ASSERT(pub && sub);
+        if (!pub || !sub) return;
+
+        publishValue(pub, 1);
+        zcm_msg_t msg = {};
+        TS_ASSERT_EQUALS(zcm_trans_recvmsg(sub, &msg, 10), ZCM_EOK);
+
+        for (uint8_t i = 2; i < 20; i++) publishValue(pub, i);
+        TS_ASSERT_EQUALS(zcm_trans_recvmsg_validate(sub, &msg), ZCM_EOK);
+        TS_ASSERT_EQUALS(msg.len, 100);
+        TS_ASSERT_EQUALS(msg.buf[0], 1);
+        TS_ASSERT_EQUALS(msg.buf[99], 1);
+        zcm_trans_recvmsg_release(sub, &msg);
+
+        // The pinned buffer went back to the pool: publishing keeps working
+        for (uint8_t i = 20; i < 40; i++) publishValue(pub, i);
+        msg = {};
+        TS_ASSERT_EQUALS(zcm_trans_recvmsg(sub, &msg, 10), ZCM_EOK);
+        TS_ASSERT_EQUALS(msg.buf[0], 36);
+        zcm_trans_recvmsg_release(sub, &msg);
+
+        zcm_trans_destroy(sub);
+        zcm_trans_destroy(pub);
+    }
+
+    // Lossless publishers wait for live subscribers, but not for dead ones
+    void testLossless()
+    {
+        (void)system("rm -f /dev/shm/zcm/ipcshm/lossless_test");
+        const char *url = "ipcshm://lossless_test?depth=4&mlock=0&lossless=1";
+        zcm_trans_t *pub = makeIpcShmTransport(
+            "ipcshm://lossless_test?depth=4&mlock=0&lossless=1&send_timeout_ms=0");
+        zcm_trans_t *sub = makeIpcShmTransport(url);
+        TS_ASSERT(pub && sub);
+        if (!pub || !sub) return;
+        zcm_trans_recvmsg_enable(sub, ".*", true);
+
+        // Without a send timeout, sends may wait indefinitely: not safe to call from any thread
+        TS_ASSERT(zcm_trans_caps(pub) & ZCM_TRANS_CAP_THREADSAFE_SEND);
+        TS_ASSERT(!(zcm_trans_caps(sub) & ZCM_TRANS_CAP_THREADSAFE_SEND));
+
+        for (uint8_t i = 0; i < 4; i++) publishValue(pub, i);
+        TS_ASSERT_EQUALS(tryPublishValue(pub, 4), ZCM_EAGAIN);
+
+        zcm_msg_t msg = {};
+        TS_ASSERT_EQUALS(zcm_trans_recvmsg(sub, &msg, 0), ZCM_EOK);
+        TS_ASSERT_EQUALS(msg.buf[0], 0);
+        publishValue(pub, 4);
+        TS_ASSERT_EQUALS(tryPublishValue(pub, 5), ZCM_EAGAIN);
+
+        // A subscriber that exits without unregistering
+        pid_t child = fork();
+        if (child == 0) {
+            zcm_trans_t *dead = makeIpcShmTransport(url);
+            if (dead) zcm_trans_recvmsg_enable(dead, ".*", true);
+            _exit(0);
+        }
+        waitpid(child, NULL, 0);
+
+        for (uint8_t i = 1; i < 5; i++) {
+            msg = {};
+            TS_ASSERT_EQUALS(zcm_trans_recvmsg(sub, &msg, 0), ZCM_EOK);
+            TS_ASSERT_EQUALS(msg.buf[0], i);
+        }
+        for (uint8_t i = 5; i < 9; i++) publishValue(pub, i);
+
+        uint64_t drops = 0;
+        TS_ASSERT_EQUALS(zcm_trans_query_drops(sub, &drops), ZCM_EOK);
+        TS_ASSERT_EQUALS(drops, 0);
+
+        zcm_trans_destroy(sub);
+
+        // A lossless subscriber joining a ring that already went around only holds on to
+        // what it will read, from the tail on, so publishers aren't stalled by the backlog
+        for (uint8_t i = 9; i < 15; i++) publishValue(pub, i);
+        sub = makeIpcShmTransport(url);
+        TS_ASSERT(sub);
+        if (!sub) { zcm_trans_destroy(pub); return; }
+        zcm_trans_recvmsg_enable(sub, ".*", true);
+        for (uint8_t i = 15; i < 19; i++) publishValue(pub, i);
+        TS_ASSERT_EQUALS(tryPublishValue(pub, 19), ZCM_EAGAIN);
+        for (uint8_t i = 15; i < 19; i++) {
+            msg = {};
+            TS_ASSERT_EQUALS(zcm_trans_recvmsg(sub, &msg, 0), ZCM_EOK);
+            TS_ASSERT_EQUALS(msg.buf[0], i);
+        }
+        TS_ASSERT_EQUALS(zcm_trans_recvmsg(sub, &msg, 0), ZCM_EAGAIN);
+
+        zcm_trans_destroy(sub);
+        zcm_trans_destroy(pub);
+    }
+
+    // Messages go in the smallest slots they fit in, and spill into larger ones
+    void testSlotClasses()
+    {
+        (void)system("rm -f /dev/shm/zcm/ipcshm/slots_test");
+        const char *url = "ipcshm://slots_test?slots=100000x2,128x4&mlock=0";
+        zcm_trans_t *pub = makeIpcShmTransport(url);
+        zcm_trans_t *sub = makeIpcShmTransport(url);
+        TS_ASSERT(pub && sub);
+        if (!pub || !sub) return;
+        TS_ASSERT_EQUALS(zcm_trans_get_mtu(pub), 100000);
+
+        publishValue(pub, 1, 100000);
+        for (uint8_t i = 2; i < 7; i++) publishValue(pub, i);
+        TS_ASSERT_EQUALS(tryPublishValue(pub, 7, 100001), ZCM_EINVALID);
+
+        zcm_msg_t msg = {};
+        TS_ASSERT_EQUALS(zcm_trans_recvmsg(sub, &msg, 10), ZCM_EOK);
+        TS_ASSERT_EQUALS(msg.len, 100000);
+        TS_ASSERT_EQUALS(msg.buf[0], 1);
+        TS_ASSERT_EQUALS(msg.buf[99999], 1);
+        for (uint8_t i = 2; i < 7; i++) {
+            msg = {};
+            TS_ASSERT_EQUALS(zcm_trans_recvmsg(sub, &msg, 10), ZCM_EOK);
+            TS_ASSERT_EQUALS(msg.len, 100);
+            TS_ASSERT_EQUALS(msg.buf[0], i);
+        }
+
+        zcm_trans_destroy(sub);
+        zcm_trans_destroy(pub);
+
+        // A large message rolls off small ones until a large slot frees up
+        (void)system("rm -f /dev/shm/zcm/ipcshm/slots_test");
+        url = "ipcshm://slots_test?slots=100000x1,128x4&mlock=0";
+        pub = makeIpcShmTransport(url);
+        sub = makeIpcShmTransport(url);
+        TS_ASSERT(pub && sub);
+        if (!pub || !sub) return;
+
+        for (uint8_t i = 1; i < 6; i++) publishValue(pub, i);
+        publishValue(pub, 6, 100000);
+
+        // The messages that were rolled off fail to be received, one call each
+        int ret = ZCM_EAGAIN;
+        for (int i = 0; i < 6 && ret != ZCM_EOK; i++) {
+            msg = {};
+            ret = zcm_trans_recvmsg(sub, &msg, 10);
+        }
+        TS_ASSERT_EQUALS(ret, ZCM_EOK);
+        if (ret != ZCM_EOK) return;
+        TS_ASSERT_EQUALS(msg.len, 100000);
+        TS_ASSERT_EQUALS(msg.buf[99999], 6);
+
+        uint64_t drops = 0;
+        TS_ASSERT_EQUALS(zcm_trans_query_drops(sub, &drops), ZCM_EOK);
+        TS_ASSERT_EQUALS(drops, 5);
+
+        zcm_trans_destroy(sub);
+        zcm_trans_destroy(pub);
+    }
+
+    // Subscribers skip the messages of channels they didn't enable
+    void testChannelFilter()
+    {
+        (void)system("rm -f /dev/shm/zcm/ipcshm/filter_test");
+        for (int zerocopy = 0; zerocopy < 2; zerocopy++) {
+            zcm_trans_t *pub = makeIpcShmTransport("ipcshm://filter_test?mlock=0");
+            zcm_trans_t *sub = makeIpcShmTransport(zerocopy ? "ipcshm://filter_test?mlock=0&zerocopy=1"
+                                                            : "ipcshm://filter_test?mlock=0");
+            TS_ASSERT(pub && sub);
+            if (!pub || !sub) return;
+            zcm_trans_recvmsg_enable(sub, "WANTED", true);
+
+            for (uint8_t i = 0; i < 10; i++)
+                publishValue(pub, i, 100, i % 2 ? "WANTED" : "UNWANTED");
+
+            for (uint8_t i = 1; i < 10; i += 2) {
+                zcm_msg_t msg = {};
+                TS_ASSERT_EQUALS(zcm_trans_recvmsg(sub, &msg, 10), ZCM_EOK);
+                TS_ASSERT_EQUALS(string(msg.channel), "WANTED");
+                TS_ASSERT_EQUALS(msg.buf[0], i);
+                zcm_trans_recvmsg_release(sub, &msg);
+            }
+            zcm_msg_t msg = {};
+            TS_ASSERT_EQUALS(zcm_trans_recvmsg(sub, &msg, 0), ZCM_EAGAIN);
+
+            zcm_stat_t stats[8];
+            size_t nstats = 8;
+            TS_ASSERT_EQUALS(zcm_trans_query_stats(sub, stats, &nstats), ZCM_EOK);
+            for (size_t i = 0; i < nstats; i++)
+                if (string(stats[i].name) == "msgs_filtered")
+                    TS_ASSERT_EQUALS(stats[i].value, 5);
+
+            // A regex turns the filter off
+            zcm_trans_recvmsg_enable(sub, ".*", true);
+            publishValue(pub, 42, 100, "UNWANTED");
+            msg = {};
+            TS_ASSERT_EQUALS(zcm_trans_recvmsg(sub, &msg, 10), ZCM_EOK);
+            TS_ASSERT_EQUALS(string(msg.channel), "UNWANTED");
+            zcm_trans_recvmsg_release(sub, &msg);
+
+            // Disabling once undoes any number of enables, as the core only disables a
+            // channel once its last subscription goes
+            zcm_trans_recvmsg_enable(sub, ".*", true);
+            zcm_trans_recvmsg_enable(sub, ".*", false);
+            zcm_trans_recvmsg_enable(sub, "OTHER", true);
+            zcm_trans_recvmsg_enable(sub, "WANTED", true);
+            zcm_trans_recvmsg_enable(sub, "WANTED", false);
+            publishValue(pub, 43, 100, "UNWANTED");
+            publishValue(pub, 44, 100, "WANTED");
+            publishValue(pub, 45, 100, "OTHER");
+            msg = {};
+            TS_ASSERT_EQUALS(zcm_trans_recvmsg(sub, &msg, 10), ZCM_EOK);
+            TS_ASSERT_EQUALS(string(msg.channel), "OTHER");
+            zcm_trans_recvmsg_release(sub, &msg);
+            TS_ASSERT_EQUALS(zcm_trans_recvmsg(sub, &msg, 0), ZCM_EAGAIN);
+
+            zcm_trans_destroy(sub);
+            zcm_trans_destroy(pub);
+        }
+    }
+
+    // Channels spread over shards reach the subscribers of any of them
+    void testShards()
+    {
+        (void)system("rm -f /dev/shm/zcm/ipcshm/shards_test");
+        const char *url = "ipcshm://shards_test?mlock=0&depth=16&shards=4&shard_map=B:3,C:3";
+        zcm_trans_t *pub = makeIpcShmTransport(url);
+        zcm_trans_t *all = makeIpcShmTransport(url);
+        zcm_trans_t *some = makeIpcShmTransport(url);
+        TS_ASSERT(pub && all && some);
+        if (!pub || !all || !some) return;
+        zcm_trans_recvmsg_enable(all, ".*", true);
+        zcm_trans_recvmsg_enable(some, "B", true);
+        zcm_trans_recvmsg_enable(some, "E", true);
+
+        const char *channels[] = {"A", "B", "C", "D", "E", "F", "G", "H"};
+        for (uint8_t i = 0; i < 8; i++) publishValue(pub, i, 100, channels[i]);
+
+        set<string> got;
+        zcm_msg_t msg = {};
+        while (zcm_trans_recvmsg(all, &msg, 0) == ZCM_EOK) got.insert(msg.channel);
+        TS_ASSERT_EQUALS(got.size(), 8);
+
+        got.clear();
+        while (zcm_trans_recvmsg(some, &msg, 0) == ZCM_EOK) got.insert(msg.channel);
+        TS_ASSERT_EQUALS(got, set<string>({"B", "E"}));
+
+        // A subscriber waiting on several shards is woken up by any of them
+        int ret = ZCM_EAGAIN;
+        thread waiter([&]() { ret = zcm_trans_recvmsg(some, &msg, 2000); });
+        usleep(50000);
+        uint64_t start = TimeUtil::utime();
+        publishValue(pub, 42, 100, "E");
+        waiter.join();
+        TS_ASSERT_EQUALS(ret, ZCM_EOK);
+        TS_ASSERT_LESS_THAN(TimeUtil::utime() - start, 1000000);
+
+        zcm_trans_destroy(some);
+        zcm_trans_destroy(all);
+        zcm_trans_destroy(pub);
+    }
+
+    // Subscribers leave a status record in the region that tools can read
+    void testSubscriberStatus()
+    {
+        (void)system("rm -f /dev/shm/zcm/ipcshm/status_test");
+        zcm_trans_t *pub = makeIpcShmTransport("ipcshm://status_test?depth=4&mlock=0");
+        zcm_trans_t *sub = makeIpcShmTransport("ipcshm://status_test?depth=4&mlock=0");
+        TS_ASSERT(pub && sub);
+        if (!pub || !sub) return;
+
+        size_t size;
+        lf_bcast_t *b = (lf_bcast_t*)lf_shm_open("/dev/shm/zcm/ipcshm/status_test",
+                                                 LF_SHM_FLAG_RDONLY, &size, NULL);
+        TS_ASSERT(b);
+        if (!b) return;
+        lf_bcast_sub_status_t st[LF_BCAST_MAX_CURSORS];
+
+        // Only processes that subscribe register
+        TS_ASSERT_EQUALS(lf_bcast_sub_statuses(b, st, LF_BCAST_MAX_CURSORS), 0);
+        zcm_trans_recvmsg_enable(sub, "IPCSHM_TEST", true);
+        TS_ASSERT_EQUALS(lf_bcast_sub_statuses(b, st, LF_BCAST_MAX_CURSORS), 1);
+        TS_ASSERT_EQUALS(st[0].pid, (uint64_t)getpid());
+        TS_ASSERT_EQUALS(string(st[0].name), string(program_invocation_short_name).substr(0, LF_BCAST_NAME_LEN - 1));
+        TS_ASSERT(!st[0].lossless);
+        TS_ASSERT_EQUALS(st[0].last_consume_ns, 0);
+
+        // Lapped by 4 messages, then 2 consumed and 2 more still queued
+        for (uint8_t i = 0; i < 8; i++) publishValue(pub, i);
+        zcm_msg_t msg = {};
+        int received = 0;
+        for (int i = 0; i < 4 && received < 2; i++)
+            if (zcm_trans_recvmsg(sub, &msg, 0) == ZCM_EOK) received++;
+        TS_ASSERT_EQUALS(received, 2);
+
+        lf_bcast_stats_t stats;
+        lf_bcast_stats(b, &stats);
+        TS_ASSERT_EQUALS(lf_bcast_sub_statuses(b, st, LF_BCAST_MAX_CURSORS), 1);
+        TS_ASSERT_EQUALS(stats.tail_idx - st[0].idx, 2);
+        TS_ASSERT_EQUALS(st[0].drops, 4);
+        TS_ASSERT_LESS_THAN(0, st[0].last_consume_ns);
+        TS_ASSERT_EQUALS(stats.classes[0].num_elts - stats.classes[0].num_free, 4);
+
+        zcm_trans_destroy(sub);
+        TS_ASSERT_EQUALS(lf_bcast_sub_statuses(b, st, LF_BCAST_MAX_CURSORS), 0);
+
+        lf_shm_close(b, size);
+        zcm_trans_destroy(pub);
+    }
+
+    // A subscriber too far behind jumps to the newest messages, without counting drops
+    void testCatchUp()
+    {
+        (void)system("rm -f /dev/shm/zcm/ipcshm/catchup_test");
+        zcm_trans_t *pub = makeIpcShmTransport("ipcshm://catchup_test?depth=16&mlock=0");
+        zcm_trans_t *sub = makeIpcShmTransport("ipcshm://catchup_test?depth=16&mlock=0"
+                                               "&catchup=4&catchup_keep=2");
+        TS_ASSERT(pub && sub);
+        if (!pub || !sub) return;
+        zcm_trans_recvmsg_enable(sub, ".*", true);
+
+        auto receiveAll = [&]() {
+            vector<uint8_t> vals;
+            zcm_msg_t msg = {};
+            while (zcm_trans_recvmsg(sub, &msg, 0) == ZCM_EOK) vals.push_back(msg.buf[0]);
+            return vals;
+        };
+
+        for (uint8_t i = 0; i < 10; i++) publishValue(pub, i);
+        TS_ASSERT_EQUALS(receiveAll(), vector<uint8_t>({8, 9}));
+
+        // Within the threshold, nothing is skipped
+        for (uint8_t i = 10; i < 14; i++) publishValue(pub, i);
+        TS_ASSERT_EQUALS(receiveAll(), vector<uint8_t>({10, 11, 12, 13}));
+
+        uint64_t drops = 1;
+        TS_ASSERT_EQUALS(zcm_trans_query_drops(sub, &drops), ZCM_EOK);
+        TS_ASSERT_EQUALS(drops, 0);
+
+        zcm_stat_t stats[8];
+        size_t nstats = 8;
+        TS_ASSERT_EQUALS(zcm_trans_query_stats(sub, stats, &nstats), ZCM_EOK);
+        bool found = false;
+        for (size_t i = 0; i < nstats && i < 8; i++) {
+            if (string(stats[i].name) != "msgs_skipped") continue;
+            TS_ASSERT_EQUALS(stats[i].value, 8);
+            found = true;
+        }
+        TS_ASSERT(found);
+
+        zcm_trans_destroy(sub);
+        zcm_trans_destroy(pub);
+    }
+};
+
+#endif // IPCSHMTEST_H
@@ -0,0 +1,104 @@
+#ifndef UDPNACKTEST_H
+#define UDPNACKTEST_H
+
+#include <atomic>
+#include <thread>
+#include <unistd.h>
+
+#include "cxxtest/TestSuite.h"
+#include "zcm/transport_registrar.h"
+
+using namespace std;
+
+#define NACK_MSG_COUNT 50
+#define NACK_MSG_SIZE 200000
+
+static zcm_trans_t *makeUdpTransport(const char *url)
+{
+    auto *u = zcm_url_create(url);
+    auto *creator = zcm_transport_find(zcm_url_protocol(u));
+    TSM_ASSERT("Failed to find udp transport", creator);
+    zcm_trans_t *ret = creator ? creator(u, NULL) : NULL;
+    zcm_url_destroy(u);
+    return ret;
+}
+
+// Sends fragmented messages over loopback to a receiver that drops a share of the
+// fragments it gets, and returns how many arrived intact
+static int sendWithLoss(const char *recvUrl, const char *sendUrl)
+{
+    zcm_trans_t *recvTrans = makeUdpTransport(recvUrl);
+    zcm_trans_t *sendTrans = makeUdpTransport(sendUrl);
+    TSM_ASSERT("Failed to create receiving transport", recvTrans);
+    TSM_ASSERT("Failed to create sending transport", sendTrans);
+    if (!recvTrans || !sendTrans) return -1;
+
+    zcm_trans_recvmsg_enable(recvTrans, ".*", true);
+
+    vector<uint8_t> data(NACK_MSG_SIZE);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = (uint8_t)(i * 7);
+
+    // Results are only checked once the receive thread is joined: assertions have to
+    // run on the test's own thread
+    atomic<bool> done {false};
+    int received = 0;
+    int corrupt = 0;
+    thread recvThread([&]() {
+        while (!done) {
+            zcm_msg_t msg = {};
+            if (zcm_trans_recvmsg(recvTrans, &msg, 10) != ZCM_EOK)
+                continue;
+            if (string(msg.channel) == "NACK_TEST" && msg.len == data.size() &&
+                memcmp(msg.buf, data.data(), msg.len) == 0)
+                received++;
+            else
+                corrupt++;
+        }
+    });
+
+    usleep(10000); // sleep 10ms so the recv thread can come up
+
+    for (int i = 0; i < NACK_MSG_COUNT; i++) {
+        zcm_msg_t msg;
+        msg.utime = 0;
+        msg.channel = "NACK_TEST";
+        msg.len = data.size();
+        msg.buf = data.data();
+        TS_ASSERT_EQUALS(zcm_trans_sendmsg(sendTrans, msg), ZCM_EOK);
+        usleep(10000);
+    }
+
+    // give the last messages time to be recovered
+    usleep(500000);
+    done = true;
+    recvThread.join();
+    TS_ASSERT_EQUALS(corrupt, 0);
+
+    zcm_trans_destroy(sendTrans);
+    zcm_trans_destroy(recvTrans);
+    return received;
+}
+
+class UdpNackTest : public CxxTest::TestSuite
+{
+  public:
+    void setUp() override {}
+    void tearDown() override {}
+
+    void testLossWithoutNack()
+    {
+        int received = sendWithLoss("udp://127.0.0.1:9400:9401?sim_loss=10",
+                                    "udp://127.0.0.1:9401:9400");
+        TS_ASSERT_LESS_THAN(received, NACK_MSG_COUNT);
+    }
+
+    void testRecoveryWithNack()
+    {
+        int received = sendWithLoss("udp://127.0.0.1:9402:9403?nack=1&sim_loss=10",
+                                    "udp://127.0.0.1:9403:9402?nack=1");
+        TS_ASSERT_EQUALS(received, NACK_MSG_COUNT);
+    }
+};
+
+#endif // UDPNACKTEST_H
@@ -0,0 +1,911 @@
+#ifndef UDPTEST_H
+#define UDPTEST_H
+
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cxxtest/TestSuite.h"
+#include "zcm/transport_registrar.h"
+#include "zcm/transport/udp/fec.hpp"
+#include "zcm/transport/udp/mempool.hpp"
+#include "zcm/transport/udp/pacer.hpp"
+#include "util/TimeUtil.hpp"
+
+using namespace std;
+
+static zcm_trans_t *makeUdp(const char *url)
+{
+    auto *u = zcm_url_create(url);
+    auto *creator = zcm_transport_find(zcm_url_protocol(u));
+    TSM_ASSERT("Failed to find udp transport", creator);
+    zcm_trans_t *ret = creator ? creator(u, NULL) : NULL;
+    zcm_url_destroy(u);
+    TSM_ASSERT("Failed to create udp transport", ret);
+    return ret;
+}
+
+static int sendUdp(zcm_trans_t *trans, const char *channel, const void *data, size_t len)
+{
+    zcm_msg_t msg = {};
+    msg.channel = channel;
+    msg.len = len;
+    msg.buf = (uint8_t*)data;
+    return zcm_trans_sendmsg(trans, msg);
+}
+
+struct UdpRecvd
+{
+    string channel;
+    vector<uint8_t> data;
+    uint64_t kernel_ns;
+    uint64_t dequeue_ns;
+};
+
+// Receives on its own thread and keeps a copy of everything that arrives. Tests only
+// look at the copies after stop(): assertions have to run on the test's own thread
+class UdpReceiver
+{
+  public:
+    UdpReceiver(zcm_trans_t *trans) : trans(trans)
+    {
+        thr = thread([this]() {
+            while (!done) {
+                zcm_msg_t msg = {};
+                if (zcm_trans_recvmsg(this->trans, &msg, 10) != ZCM_EOK) continue;
+                UdpRecvd r;
+                r.channel = msg.channel;
+                r.data.assign(msg.buf, msg.buf + msg.len);
+                r.kernel_ns = msg.recv_kernel_ns;
+                r.dequeue_ns = msg.recv_dequeue_ns;
+                unique_lock<mutex> lk(mut);
+                msgs.push_back(std::move(r));
+            }
+        });
+        usleep(10000); // sleep 10ms so the recv thread can come up
+    }
+
+    ~UdpReceiver() { stop(); }
+
+    size_t count()
+    {
+        unique_lock<mutex> lk(mut);
+        return msgs.size();
+    }
+
+    // Waits until n messages arrived or nothing arrived for quietMs
+    void waitFor(size_t n, int quietMs = 200)
+    {
+        size_t last = count();
+        for (int idle = 0; last < n && idle < quietMs; idle += 10) {
+            usleep(10000);
+            size_t now = count();
+            if (now != last) idle = 0;
+            last = now;
+        }
+    }
+
+    vector<UdpRecvd>& stop()
+    {
+        done = true;
+        if (thr.joinable()) thr.join();
+        return msgs;
+    }
+
+  private:
+    zcm_trans_t *trans;
+    thread thr;
+    atomic<bool> done {false};
+    mutex mut;
+    vector<UdpRecvd> msgs;
+};
+
+static vector<uint8_t> udpPattern(size_t len, uint8_t seed)
+{
+    vector<uint8_t> data(len);
+    for (size_t i = 0; i < len; i++) data[i] = (uint8_t)(i * 7 + seed);
+    return data;
+}
+
+// Sends large messages from sendUrl to recvUrl and returns how many arrived intact
+static int sendLarge(const char *recvUrl, const char *sendUrl, int count, size_t size)
+{
+    zcm_trans_t *recvTrans = makeUdp(recvUrl);
+    zcm_trans_t *sendTrans = makeUdp(sendUrl);
+    if (!recvTrans || !sendTrans) return -1;
+    zcm_trans_recvmsg_enable(recvTrans, ".*", true);
+
+    auto data = udpPattern(size, 0);
+    int intact = 0;
+    {
+        UdpReceiver rx(recvTrans);
+        for (int i = 0; i < count; i++) {
+            TS_ASSERT_EQUALS(sendUdp(sendTrans, "UDP_LARGE", data.data(), data.size()),
+                             ZCM_EOK);
+            usleep(10000);
+        }
+        rx.waitFor(count);
+        for (auto& r : rx.stop())
+            if (r.channel == "UDP_LARGE" && r.data == data) intact++;
+    }
+
+    zcm_trans_destroy(sendTrans);
+    zcm_trans_destroy(recvTrans);
+    return intact;
+}
+
+static uint64_t udpStat(zcm_trans_t *trans, const char *name)
+{
+    zcm_stat_t stats[64];
+    size_t nstats = 64;
+    if (zcm_trans_query_stats(trans, stats, &nstats) != ZCM_EOK) return 0;
+    for (size_t i = 0; i < nstats && i < 64; i++)
+        if (strcmp(stats[i].name, name) == 0) return stats[i].value;
+    TS_FAIL(name);
+    return 0;
+}
+
+// A batch datagram as coalescing senders build them: a header with the seqno of the
+// first message and the number of messages, then each message's length, channel and
+// data. The count can be overstated to make a truncated batch
+static vector<uint8_t> udpBatch(uint32_t seqno, const vector<string>& channels,
+                                int extraCount = 0)
+{
+    vector<uint8_t> dgram(12);
+    uint32_t magic = htonl(0x4c433036), seq = htonl(seqno);
+    uint16_t nmsgs = htons(channels.size() + extraCount);
+    memcpy(&dgram[0], &magic, 4);
+    memcpy(&dgram[4], &seq, 4);
+    memcpy(&dgram[8], &nmsgs, 2);
+    for (auto& ch : channels) {
+        uint16_t len = htons(ch.size() + 1 + sizeof(uint32_t));
+        dgram.insert(dgram.end(), (uint8_t*)&len, (uint8_t*)&len + 2);
+        dgram.insert(dgram.end(), ch.begin(), ch.end());
+        dgram.push_back(0);
+        dgram.insert(dgram.end(), (uint8_t*)&seqno, (uint8_t*)&seqno + sizeof(seqno));
+        seqno++;
+    }
+    return dgram;
+}
+
+// A short message, a header followed by its channel and data
+static vector<uint8_t> udpShort(uint32_t seqno, const string& channel)
+{
+    vector<uint8_t> dgram(8);
+    uint32_t hdr[2] = {htonl(0x4c433032), htonl(seqno)};
+    memcpy(&dgram[0], hdr, 8);
+    dgram.insert(dgram.end(), channel.begin(), channel.end());
+    dgram.push_back(0);
+    dgram.insert(dgram.end(), (uint8_t*)&seqno, (uint8_t*)&seqno + sizeof(seqno));
+    return dgram;
+}
+
+// A fragment of a large message, laid out as senders build them. Fragment 0 carries
+// the channel ahead of its data
+static vector<uint8_t> udpFragment(uint32_t seqno, uint32_t msgSize, uint32_t offset,
+                                   uint16_t fragmentNo, uint16_t fragments,
+                                   const string& channel, const uint8_t *data, size_t len)
+{
+    vector<uint8_t> dgram(20);
+    uint32_t hdr[4] = {htonl(0x4c433033), htonl(seqno), htonl(msgSize), htonl(offset)};
+    uint16_t nos[2] = {htons(fragmentNo), htons(fragments)};
+    memcpy(&dgram[0], hdr, 16);
+    memcpy(&dgram[16], nos, 4);
+    if (fragmentNo == 0) {
+        dgram.insert(dgram.end(), channel.begin(), channel.end());
+        dgram.push_back(0);
+    }
+    dgram.insert(dgram.end(), data, data + len);
+    return dgram;
+}
+
+// Every fragment of a message, with fragSize bytes of data in each
+static vector<vector<uint8_t>> udpFragments(uint32_t seqno, const string& channel,
+                                            const vector<uint8_t>& data, size_t fragSize)
+{
+    vector<vector<uint8_t>> ret;
+    uint16_t fragments = (data.size() + fragSize - 1) / fragSize;
+    for (uint16_t i = 0; i < fragments; i++) {
+        size_t off = i * fragSize, len = min(fragSize, data.size() - off);
+        ret.push_back(udpFragment(seqno, data.size(), off, i, fragments, channel,
+                                  data.data() + off, len));
+    }
+    return ret;
+}
+
+static void sendRaw(int fd, uint16_t port, const vector<uint8_t>& dgram)
+{
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ssize_t sent = sendto(fd, dgram.data(), dgram.size(), 0,
+                          (struct sockaddr*)&addr, sizeof(addr));
+    TS_ASSERT_EQUALS(sent, (ssize_t)dgram.size());
+}
+
+static long minorFaults()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt;
+}
+
+// The VmFlags of the mapping that holds addr, from /proc/self/smaps
+static string vmFlags(const void *addr)
+{
+    ifstream smaps("/proc/self/smaps");
+    string line;
+    bool inMapping = false;
+    while (getline(smaps, line)) {
+        unsigned long lo, hi;
+        if (sscanf(line.c_str(), "%lx-%lx ", &lo, &hi) == 2)
+            inMapping = lo <= (unsigned long)addr && (unsigned long)addr < hi;
+        else if (inMapping && line.compare(0, 8, "VmFlags:") == 0)
+            return line.substr(8) + " ";
+    }
+    return "";
+}
+
+// Sends a small message on each channel and returns the channels that got through
+static set<string> channelsThrough(zcm_trans_t *sendTrans, zcm_trans_t *recvTrans,
+                                   const vector<string>& channels)
+{
+    set<string> ret;
+    UdpReceiver rx(recvTrans);
+    for (auto& ch : channels) {
+        int val = 0;
+        TS_ASSERT_EQUALS(sendUdp(sendTrans, ch.c_str(), &val, sizeof(val)), ZCM_EOK);
+    }
+    rx.waitFor(channels.size(), 100);
+    for (auto& r : rx.stop()) ret.insert(r.channel);
+    return ret;
+}
+
+class UdpTest : public CxxTest::TestSuite
+{
+  public:
+    void setUp() override {}
+    void tearDown() override {}
+
+    void testFecCodecErasures()
+    {
+        const size_t N = 8, K = 3, SYMSZ = 64;
+        FecCodec codec(N, K);
+
+        vector<vector<uint8_t>> data(N);
+        vector<const uint8_t*> dataPtrs(N);
+        for (size_t i = 0; i < N; i++) {
+            data[i] = udpPattern(SYMSZ, (uint8_t)(i * 31));
+            dataPtrs[i] = data[i].data();
+        }
+        vector<vector<uint8_t>> parity(K, vector<uint8_t>(SYMSZ));
+        for (size_t j = 0; j < K; j++)
+            codec.encode(dataPtrs.data(), N, SYMSZ, (uint8_t)j, parity[j].data());
+
+        // Every pattern of up to K erased data symbols, rebuilt from the last parity
+        // symbols so that the plain XOR row isn't always the one used
+        for (unsigned mask = 0; mask < (1u << N); mask++) {
+            size_t nerased = __builtin_popcount(mask);
+            if (nerased > K) continue;
+
+            auto copy = data;
+            vector<uint8_t*> ptrs(N);
+            bool have[N];
+            for (size_t i = 0; i < N; i++) {
+                have[i] = !(mask & (1u << i));
+                if (!have[i]) memset(copy[i].data(), 0xA5, SYMSZ);
+                ptrs[i] = copy[i].data();
+            }
+            vector<const uint8_t*> par;
+            vector<uint8_t> parNo;
+            for (size_t j = K - nerased; j < K; j++) {
+                par.push_back(parity[j].data());
+                parNo.push_back((uint8_t)j);
+            }
+            TS_ASSERT(codec.decode(ptrs.data(), have, N, par.data(), parNo.data(),
+                                   par.size(), SYMSZ));
+            TS_ASSERT(copy == data);
+        }
+
+        // One more erasure than there is parity can't be recovered
+        bool have[N] = {};
+        for (size_t i = K + 1; i < N; i++) have[i] = true;
+        vector<uint8_t*> ptrs(N);
+        auto copy = data;
+        for (size_t i = 0; i < N; i++) ptrs[i] = copy[i].data();
+        vector<const uint8_t*> par;
+        vector<uint8_t> parNo;
+        for (size_t j = 0; j < K; j++) {
+            par.push_back(parity[j].data());
+            parNo.push_back((uint8_t)j);
+        }
+        TS_ASSERT(!codec.decode(ptrs.data(), have, N, par.data(), parNo.data(),
+                                par.size(), SYMSZ));
+    }
+
+    void testFecRecovery()
+    {
+        const int COUNT = 50;
+        const size_t SIZE = 2000000; // 31 fragments over loopback
+        int plain = sendLarge("udp://127.0.0.1:9410:9411?sim_loss=5",
+                              "udp://127.0.0.1:9411:9410", COUNT, SIZE);
+        int fec = sendLarge("udp://127.0.0.1:9412:9413?sim_loss=5",
+                            "udp://127.0.0.1:9413:9412?fec=8:2", COUNT, SIZE);
+        // Without parity most messages lose a fragment, while a block of 8 rarely
+        // loses more than the 2 its parity can rebuild
+        TS_ASSERT_LESS_THAN(plain, COUNT / 2);
+        TS_ASSERT_LESS_THAN(COUNT * 9 / 10, fec);
+    }
+
+    void testSegmentationOffload()
+    {
+        const int COUNT = 50;
+        const size_t SIZE = 200000; // 136 datagrams of 1472 bytes over loopback
+        // Senders using gso and receivers using gro interoperate with those that don't
+        TS_ASSERT_EQUALS(sendLarge("udp://127.0.0.1:9460:9461?gro=1",
+                                   "udp://127.0.0.1:9461:9460?gso=1&gso_size=1472",
+                                   COUNT, SIZE), COUNT);
+        TS_ASSERT_EQUALS(sendLarge("udp://127.0.0.1:9462:9463",
+                                   "udp://127.0.0.1:9463:9462?gso=1&gso_size=1472",
+                                   COUNT, SIZE), COUNT);
+        TS_ASSERT_EQUALS(sendLarge("udp://127.0.0.1:9464:9465?gro=1",
+                                   "udp://127.0.0.1:9465:9464",
+                                   COUNT, SIZE), COUNT);
+        TS_ASSERT_EQUALS(sendLarge("udp://127.0.0.1:9466:9467?gro=1&nack=1",
+                                   "udp://127.0.0.1:9467:9466?gso=1&gso_size=1472&nack=1",
+                                   COUNT, SIZE), COUNT);
+        // Multicast fragments are sized to the route's MTU, whatever interface it's on
+        const char *url = "udpm://239.255.76.67:7684?gso=1&gro=1";
+        TS_ASSERT_EQUALS(sendLarge(url, url, COUNT, SIZE), COUNT);
+    }
+
+    void testGroupMembership()
+    {
+        // GROUP_A and GROUP_B hash to the first two of the four groups
+        const char *url = "udpm://239.255.76.67:7680?groups=4";
+        zcm_trans_t *recvTrans = makeUdp(url);
+        zcm_trans_t *sendTrans = makeUdp(url);
+        if (!recvTrans || !sendTrans) return;
+        vector<string> both {"GROUP_A", "GROUP_B"};
+        set<string> all(both.begin(), both.end());
+
+        // The core enables a channel for every subscription to it, but only disables
+        // it when the last one goes
+        zcm_trans_recvmsg_enable(recvTrans, "GROUP_A", true);
+        zcm_trans_recvmsg_enable(recvTrans, "GROUP_A", true);
+        zcm_trans_recvmsg_enable(recvTrans, "GROUP_B", true);
+        TS_ASSERT_EQUALS(channelsThrough(sendTrans, recvTrans, both), all);
+
+        zcm_trans_recvmsg_enable(recvTrans, "GROUP_A", false);
+        TS_ASSERT_EQUALS(channelsThrough(sendTrans, recvTrans, both),
+                         set<string>{"GROUP_B"});
+
+        // A regex joins every group, and leaving it only keeps the channels' groups
+        zcm_trans_recvmsg_enable(recvTrans, ".*", true);
+        TS_ASSERT_EQUALS(channelsThrough(sendTrans, recvTrans, both), all);
+        zcm_trans_recvmsg_enable(recvTrans, ".*", false);
+        TS_ASSERT_EQUALS(channelsThrough(sendTrans, recvTrans, both),
+                         set<string>{"GROUP_B"});
+
+        zcm_trans_recvmsg_enable(recvTrans, "GROUP_B", false);
+        TS_ASSERT(channelsThrough(sendTrans, recvTrans, both).empty());
+
+        zcm_trans_destroy(sendTrans);
+        zcm_trans_destroy(recvTrans);
+    }
+
+    void testChannelFilter()
+    {
+        zcm_trans_t *recvTrans = makeUdp("udp://127.0.0.1:9420:9421?bpf=1");
+        zcm_trans_t *sendTrans = makeUdp("udp://127.0.0.1:9421:9420");
+        if (!recvTrans || !sendTrans) return;
+        vector<string> chans {"BPF_A", "BPF_B", "BPF_C"};
+
+        // Nothing gets through until something is enabled
+        TS_ASSERT(channelsThrough(sendTrans, recvTrans, chans).empty());
+
+        zcm_trans_recvmsg_enable(recvTrans, "BPF_A", true);
+        zcm_trans_recvmsg_enable(recvTrans, "BPF_A", true);
+        zcm_trans_recvmsg_enable(recvTrans, "BPF_B", true);
+        TS_ASSERT_EQUALS(channelsThrough(sendTrans, recvTrans, chans),
+                         (set<string>{"BPF_A", "BPF_B"}));
+
+        // Disabling once undoes any number of enables
+        zcm_trans_recvmsg_enable(recvTrans, "BPF_A", false);
+        TS_ASSERT_EQUALS(channelsThrough(sendTrans, recvTrans, chans),
+                         set<string>{"BPF_B"});
+
+        // A regex lifts the filter until it's disabled, however often it was enabled
+        zcm_trans_recvmsg_enable(recvTrans, ".*", true);
+        zcm_trans_recvmsg_enable(recvTrans, ".*", true);
+        TS_ASSERT_EQUALS(channelsThrough(sendTrans, recvTrans, chans),
+                         set<string>(chans.begin(), chans.end()));
+        zcm_trans_recvmsg_enable(recvTrans, ".*", false);
+        TS_ASSERT_EQUALS(channelsThrough(sendTrans, recvTrans, chans),
+                         set<string>{"BPF_B"});
+
+        zcm_trans_recvmsg_enable(recvTrans, "BPF_B", false);
+        TS_ASSERT(channelsThrough(sendTrans, recvTrans, chans).empty());
+
+        zcm_trans_destroy(sendTrans);
+        zcm_trans_destroy(recvTrans);
+
+        // The filter would keep continuation fragments from starting a message, so it's
+        // ignored where lost first fragments are meant to be recovered
+        for (const char *url : {"udp://127.0.0.1:9422:9423?bpf=1&nack=1",
+                                "udp://127.0.0.1:9422:9423?bpf=1&fec=8:2"}) {
+            recvTrans = makeUdp(url);
+            sendTrans = makeUdp("udp://127.0.0.1:9423:9422");
+            if (!recvTrans || !sendTrans) return;
+            TS_ASSERT_EQUALS(channelsThrough(sendTrans, recvTrans, chans),
+                             set<string>(chans.begin(), chans.end()));
+            zcm_trans_destroy(sendTrans);
+            zcm_trans_destroy(recvTrans);
+        }
+    }
+
+    void testRecvTimestamps()
+    {
+        zcm_trans_t *recvTrans = makeUdp("udp://127.0.0.1:9430:9431");
+        zcm_trans_t *sendTrans = makeUdp("udp://127.0.0.1:9431:9430");
+        if (!recvTrans || !sendTrans) return;
+        zcm_trans_recvmsg_enable(recvTrans, "TIMESTAMPS", true);
+
+        auto nowNs = []() {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        };
+
+        // A small message and a fragmented one
+        vector<size_t> sizes {100, 200000};
+        vector<UdpRecvd> msgs;
+        uint64_t before = nowNs();
+        {
+            UdpReceiver rx(recvTrans);
+            for (size_t sz : sizes) {
+                auto data = udpPattern(sz, 0);
+                TS_ASSERT_EQUALS(sendUdp(sendTrans, "TIMESTAMPS", data.data(), sz),
+                                 ZCM_EOK);
+            }
+            rx.waitFor(sizes.size());
+            msgs = rx.stop();
+        }
+        uint64_t after = nowNs();
+
+        TS_ASSERT_EQUALS(msgs.size(), sizes.size());
+        for (auto& m : msgs) {
+            TS_ASSERT_LESS_THAN_EQUALS(before, m.kernel_ns);
+            TS_ASSERT_LESS_THAN_EQUALS(m.kernel_ns, m.dequeue_ns);
+            TS_ASSERT_LESS_THAN_EQUALS(m.dequeue_ns, after);
+        }
+
+        zcm_trans_destroy(sendTrans);
+        zcm_trans_destroy(recvTrans);
+    }
+
+    void testPacer()
+    {
+        // 1MB/s with a 10kB bucket, which starts full
+        Pacer pacer(1000000, 10000);
+
+        uint64_t start = TimeUtil::utime();
+        pacer.pace(5000);
+        pacer.pace(5000);
+        TS_ASSERT_EQUALS(pacer.delays.load(), 0);
+
+        // The next 50kB go at the refill rate
+        for (int i = 0; i < 50; i++) pacer.pace(1000);
+        uint64_t elapsed = TimeUtil::utime() - start;
+        TS_ASSERT_LESS_THAN_EQUALS(45000, elapsed);
+        TS_ASSERT_LESS_THAN(elapsed, 500000);
+        TS_ASSERT_LESS_THAN(0, pacer.delays.load());
+        TS_ASSERT_EQUALS(pacer.bytes_paced.load(), 60000);
+
+        // An idle pacer saves up to a bucket, not more
+        usleep(100000);
+        uint64_t delays = pacer.delays;
+        pacer.pace(10000);
+        TS_ASSERT_EQUALS(pacer.delays.load(), delays);
+        pacer.pace(1000);
+        TS_ASSERT_EQUALS(pacer.delays.load(), delays + 1);
+
+        // A datagram bigger than the bucket still goes, and the rate still holds after it
+        start = TimeUtil::utime();
+        pacer.pace(30000);
+        pacer.pace(1000);
+        elapsed = TimeUtil::utime() - start;
+        TS_ASSERT_LESS_THAN_EQUALS(27000, elapsed);
+        TS_ASSERT_LESS_THAN(elapsed, 500000);
+    }
+
+    void testShardedReceive()
+    {
+        const int SENDERS = 4, COUNT = 500;
+        const char *url = "udpm://239.255.76.67:7682";
+        zcm_trans_t *recvTrans = makeUdp("udpm://239.255.76.67:7682?rx_shards=2");
+        vector<zcm_trans_t*> sendTrans;
+        for (int i = 0; i < SENDERS; i++) sendTrans.push_back(makeUdp(url));
+        if (!recvTrans) return;
+        zcm_trans_recvmsg_enable(recvTrans, "SHARDED", true);
+
+        // Each message starts with its sender and seqno. Every 50th is large enough to
+        // be fragmented
+        vector<UdpRecvd> msgs;
+        {
+            UdpReceiver rx(recvTrans);
+            vector<thread> threads;
+            for (int i = 0; i < SENDERS; i++) {
+                threads.emplace_back([&, i]() {
+                    vector<uint32_t> buf(50000);
+                    for (int seq = 0; seq < COUNT; seq++) {
+                        buf[0] = i;
+                        buf[1] = seq;
+                        size_t len = seq % 50 == 0 ? buf.size() * 4 : 64;
+                        sendUdp(sendTrans[i], "SHARDED", buf.data(), len);
+                        usleep(200);
+                    }
+                });
+            }
+            for (auto& t : threads) t.join();
+            rx.waitFor(SENDERS * COUNT);
+            msgs = rx.stop();
+        }
+
+        // Every message arrives, in order for each sender
+        TS_ASSERT_EQUALS(msgs.size(), (size_t)(SENDERS * COUNT));
+        vector<uint32_t> next(SENDERS, 0);
+        int misordered = 0;
+        for (auto& m : msgs) {
+            uint32_t hdr[2];
+            memcpy(hdr, m.data.data(), sizeof(hdr));
+            if (hdr[0] >= (uint32_t)SENDERS) { misordered++; continue; }
+            if (hdr[1] != next[hdr[0]]) misordered++;
+            next[hdr[0]] = hdr[1] + 1;
+        }
+        TS_ASSERT_EQUALS(misordered, 0);
+
+        // Tearing down with the shards blocked on a full queue doesn't hang
+        for (int seq = 0; seq < 1500; seq++) {
+            uint32_t buf[2] = {0, (uint32_t)seq};
+            sendUdp(sendTrans[0], "SHARDED", buf, sizeof(buf));
+            if (seq % 100 == 0) usleep(1000);
+        }
+        usleep(100000);
+        uint64_t start = TimeUtil::utime();
+        zcm_trans_destroy(recvTrans);
+        TS_ASSERT_LESS_THAN(TimeUtil::utime() - start, 1000000);
+
+        for (auto *t : sendTrans) zcm_trans_destroy(t);
+    }
+
+    void testCoalescing()
+    {
+        const int COUNT = 300;
+        zcm_trans_t *recvTrans = makeUdp("udp://127.0.0.1:9440:9441");
+        zcm_trans_t *sendTrans = makeUdp("udp://127.0.0.1:9441:9440?coalesce_us=5000");
+        if (!recvTrans || !sendTrans) return;
+        zcm_trans_recvmsg_enable(recvTrans, ".*", true);
+
+        vector<UdpRecvd> msgs;
+        {
+            UdpReceiver rx(recvTrans);
+            for (uint32_t i = 0; i < COUNT; i++) {
+                const char *ch = i % 3 == 0 ? "COALESCE_A" : "COALESCE_B";
+                TS_ASSERT_EQUALS(sendUdp(sendTrans, ch, &i, sizeof(i)), ZCM_EOK);
+            }
+            zcm_trans_update(sendTrans); // sends the last batch
+            rx.waitFor(COUNT);
+            msgs = rx.stop();
+        }
+
+        // Back to back messages share datagrams, yet arrive in order on their channels
+        // and each still counts as a message of its sender
+        TS_ASSERT_LESS_THAN(udpStat(sendTrans, "batches_sent"), (uint64_t)COUNT / 10);
+        TS_ASSERT_EQUALS(msgs.size(), (size_t)COUNT);
+        for (uint32_t i = 0; i < msgs.size(); i++) {
+            uint32_t val = ~0u;
+            if (msgs[i].data.size() == sizeof(val)) memcpy(&val, msgs[i].data.data(), 4);
+            TS_ASSERT_EQUALS(val, i);
+            TS_ASSERT_EQUALS(msgs[i].channel, i % 3 == 0 ? "COALESCE_A" : "COALESCE_B");
+        }
+        TS_ASSERT_EQUALS(udpStat(recvTrans, "msgs_missed"), 0);
+        TS_ASSERT_EQUALS(udpStat(recvTrans, "datagrams_bad"), 0);
+
+        // Messages missing from between batches are counted by their seqnos
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        {
+            UdpReceiver rx(recvTrans);
+            sendRaw(fd, 9440, udpBatch(0, {"RAW", "RAW", "RAW"}));
+            sendRaw(fd, 9440, udpBatch(5, {"RAW", "RAW"}));
+            rx.waitFor(5);
+            TS_ASSERT_EQUALS(rx.stop().size(), 5);
+        }
+        TS_ASSERT_EQUALS(udpStat(recvTrans, "msgs_missed"), 2);
+
+        // Malformed batches are counted, after delivering the messages ahead of the
+        // damage: one cut short of its count, one whose entry overruns the datagram,
+        // one whose channel isn't terminated and one too short for the header
+        auto overrun = udpBatch(20, {"RAW", "RAW"});
+        overrun.resize(overrun.size() - 2);
+        auto unterminated = udpBatch(0x01010101, {"RAW"}); // no zero in the data either
+        unterminated[12 + 2 + 3] = 'X';
+        auto shortHeader = udpBatch(40, {});
+        shortHeader.resize(10);
+        {
+            UdpReceiver rx(recvTrans);
+            sendRaw(fd, 9440, udpBatch(10, {"RAW"}, 2));
+            sendRaw(fd, 9440, overrun);
+            sendRaw(fd, 9440, unterminated);
+            sendRaw(fd, 9440, shortHeader);
+            rx.waitFor(2);
+            TS_ASSERT_EQUALS(rx.stop().size(), 2);
+        }
+        TS_ASSERT_EQUALS(udpStat(recvTrans, "datagrams_bad"), 4);
+        close(fd);
+
+        zcm_trans_destroy(sendTrans);
+        zcm_trans_destroy(recvTrans);
+    }
+
+    void testReassembly()
+    {
+        zcm_trans_t *recvTrans = makeUdp("udp://127.0.0.1:9450:9451");
+        if (!recvTrans) return;
+        zcm_trans_recvmsg_enable(recvTrans, ".*", true);
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        const size_t FRAG = 1000;
+
+        // A sender can have several messages in flight, their fragments interleaved
+        auto dataA = udpPattern(3 * FRAG, 1), dataB = udpPattern(3 * FRAG, 2);
+        auto fragsA = udpFragments(1, "REASM_A", dataA, FRAG);
+        auto fragsB = udpFragments(2, "REASM_B", dataB, FRAG);
+        {
+            UdpReceiver rx(recvTrans);
+            for (auto *f : {&fragsA[0], &fragsB[0], &fragsB[1], &fragsA[1],
+                            &fragsA[2], &fragsB[2]})
+                sendRaw(fd, 9450, *f);
+            rx.waitFor(2);
+            auto& msgs = rx.stop();
+            TS_ASSERT_EQUALS(msgs.size(), 2);
+            if (msgs.size() == 2) {
+                TS_ASSERT_EQUALS(msgs[0].channel, "REASM_A");
+                TS_ASSERT(msgs[0].data == dataA);
+                TS_ASSERT_EQUALS(msgs[1].channel, "REASM_B");
+                TS_ASSERT(msgs[1].data == dataB);
+            }
+        }
+        TS_ASSERT_EQUALS(udpStat(recvTrans, "msgs_incomplete"), 0);
+
+        // Messages that stop receiving fragments for 100ms are dropped once another
+        // message starts, those that got one more recently are kept
+        auto dataC = udpPattern(3 * FRAG, 3);
+        auto fragsC = udpFragments(3, "REASM_C", dataC, FRAG);
+        auto fragsD = udpFragments(4, "REASM_D", dataC, FRAG);
+        auto fragsE = udpFragments(5, "REASM_E", dataC, FRAG);
+        {
+            UdpReceiver rx(recvTrans);
+            sendRaw(fd, 9450, fragsC[0]);
+            usleep(150000);
+            sendRaw(fd, 9450, fragsD[0]);
+            usleep(20000);
+            for (auto& f : fragsE) sendRaw(fd, 9450, f);
+            for (size_t i = 1; i < 3; i++) {
+                sendRaw(fd, 9450, fragsC[i]);
+                sendRaw(fd, 9450, fragsD[i]);
+            }
+            rx.waitFor(3);
+            set<string> got;
+            for (auto& r : rx.stop()) got.insert(r.channel);
+            TS_ASSERT_EQUALS(got, (set<string>{"REASM_D", "REASM_E"}));
+        }
+        TS_ASSERT_EQUALS(udpStat(recvTrans, "msgs_incomplete"), 1);
+
+        // Past 16MB of partial messages, the one least recently added to is evicted to
+        // make room. Each of these only gets three fragments, spread over its 6MB
+        const uint32_t BIG = 6 << 20;
+        vector<vector<uint8_t>> parts {udpPattern(FRAG, 4), udpPattern(FRAG, 5),
+                                       udpPattern(FRAG, 6)};
+        vector<uint32_t> offsets {0, BIG / 2, BIG - (uint32_t)FRAG};
+        auto bigFrag = [&](uint32_t seqno, uint16_t no, const string& ch) {
+            return udpFragment(seqno, BIG, offsets[no], no, 3, ch, parts[no].data(), FRAG);
+        };
+        {
+            UdpReceiver rx(recvTrans);
+            sendRaw(fd, 9450, bigFrag(10, 0, "REASM_F"));
+            sendRaw(fd, 9450, bigFrag(11, 0, "REASM_G"));
+            sendRaw(fd, 9450, bigFrag(10, 1, "REASM_F"));
+            usleep(20000);
+            sendRaw(fd, 9450, bigFrag(12, 0, "REASM_H")); // evicts G
+            for (uint16_t no = 1; no < 3; no++) {
+                if (no > 1) sendRaw(fd, 9450, bigFrag(10, no, "REASM_F"));
+                sendRaw(fd, 9450, bigFrag(11, no, "REASM_G"));
+                sendRaw(fd, 9450, bigFrag(12, no, "REASM_H"));
+            }
+            rx.waitFor(3);
+            set<string> got;
+            for (auto& r : rx.stop()) {
+                got.insert(r.channel);
+                TS_ASSERT_EQUALS(r.data.size(), BIG);
+                if (r.data.size() != BIG) continue;
+                for (size_t i = 0; i < 3; i++)
+                    TS_ASSERT(equal(parts[i].begin(), parts[i].end(),
+                                    r.data.begin() + offsets[i]));
+            }
+            TS_ASSERT_EQUALS(got, (set<string>{"REASM_F", "REASM_H"}));
+        }
+        TS_ASSERT_EQUALS(udpStat(recvTrans, "frag_bufs_evicted"), 1);
+        TS_ASSERT_EQUALS(udpStat(recvTrans, "msgs_incomplete"), 2);
+        close(fd);
+
+        zcm_trans_destroy(recvTrans);
+    }
+
+    void testDropStats()
+    {
+        zcm_trans_t *recvTrans = makeUdp("udp://127.0.0.1:9470:9471");
+        if (!recvTrans) return;
+        zcm_trans_recvmsg_enable(recvTrans, ".*", true);
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+        // Each kind of loss is counted under its own name, and all of them as drops:
+        // two seqnos skipped, three datagrams that aren't ZCM or are malformed, and a
+        // message that stopped receiving fragments
+        auto data = udpPattern(2000, 0);
+        auto partial = udpFragments(4, "DROPS", data, 1000);
+        auto whole = udpFragments(5, "DROPS", data, 2000);
+        auto badFragment = udpFragment(6, 1000, 0, 1, 1, "DROPS", data.data(), 1000);
+        {
+            UdpReceiver rx(recvTrans);
+            sendRaw(fd, 9470, udpShort(0, "DROPS"));
+            sendRaw(fd, 9470, udpShort(3, "DROPS"));
+            sendRaw(fd, 9470, {1, 2, 3, 4});
+            sendRaw(fd, 9470, {1, 2, 3, 4, 5, 6, 7, 8});
+            sendRaw(fd, 9470, badFragment);
+            sendRaw(fd, 9470, partial[0]);
+            usleep(150000);
+            sendRaw(fd, 9470, whole[0]);
+            rx.waitFor(3);
+            TS_ASSERT_EQUALS(rx.stop().size(), 3);
+        }
+        TS_ASSERT_EQUALS(udpStat(recvTrans, "msgs_missed"), 2);
+        TS_ASSERT_EQUALS(udpStat(recvTrans, "datagrams_bad"), 3);
+        TS_ASSERT_EQUALS(udpStat(recvTrans, "msgs_incomplete"), 1);
+        TS_ASSERT_EQUALS(udpStat(recvTrans, "frag_bufs_evicted"), 0);
+        uint64_t drops = 0;
+        TS_ASSERT_EQUALS(zcm_trans_query_drops(recvTrans, &drops), ZCM_EOK);
+        TS_ASSERT_EQUALS(drops, 6);
+        close(fd);
+
+        zcm_trans_destroy(recvTrans);
+    }
+
+    void testMemPoolReserve()
+    {
+        const size_t SZ = 1 << 22;
+
+        // Reserved blocks come out of the free lists zeroed and already faulted in,
+        // where fresh ones fault in a page at a time as they are first written
+        long faults = minorFaults();
+        {
+            MemPool pool;
+            char *buf = pool.alloc(SZ);
+            memset(buf, 1, SZ);
+            pool.free(buf, SZ);
+        }
+        long unreservedFaults = minorFaults() - faults;
+
+        MemPool pool;
+        pool.reserve(SZ, 2);
+        faults = minorFaults();
+        char *bufs[2];
+        for (auto& b : bufs) {
+            b = pool.alloc(SZ);
+            // The free list's link was the only thing written after zeroing
+            TS_ASSERT(all_of(b + sizeof(void*), b + SZ, [](char c) { return c == 0; }));
+            memset(b, 1, SZ);
+        }
+        long reservedFaults = minorFaults() - faults;
+        TS_ASSERT_DIFFERS(bufs[0], bufs[1]);
+        TS_ASSERT_LESS_THAN(reservedFaults, 16);
+        TS_ASSERT_LESS_THAN((long)(SZ / 4096 / 2), unreservedFaults);
+
+        // Every smaller size class is reserved as well
+        for (size_t sz = 64; sz < SZ; sz *= 2) {
+            char *a = pool.alloc(sz), *b = pool.alloc(sz);
+            TS_ASSERT(a && b && a != b);
+            TS_ASSERT_EQUALS(a[sz - 1], 0);
+            TS_ASSERT_EQUALS(b[sz - 1], 0);
+            pool.free(a, sz);
+            pool.free(b, sz);
+        }
+        for (auto& b : bufs) pool.free(b, SZ);
+    }
+
+    void testMemPoolHugePages()
+    {
+        // Blocks of 2MB and up are hugepages when some are reserved, or otherwise
+        // advised for transparent ones. Smaller blocks come from malloc as usual
+        MemPool pool;
+        pool.useHugePages();
+        pool.reserve(1 << 21, 1);
+        for (size_t sz : {(size_t)1 << 21, (size_t)1 << 23}) {
+            char *buf = pool.alloc(sz);
+            TS_ASSERT(buf);
+            if (!buf) continue;
+            memset(buf, 1, sz);
+            string flags = vmFlags(buf);
+            TSM_ASSERT(flags.c_str(), flags.find(" ht ") != string::npos ||
+                                      flags.find(" hg ") != string::npos);
+            pool.free(buf, sz);
+            TS_ASSERT_EQUALS(pool.alloc(sz), buf);
+            pool.free(buf, sz);
+        }
+        char *small = pool.alloc(4096);
+        TS_ASSERT(small);
+        string flags = vmFlags(small);
+        TS_ASSERT(flags.find(" ht ") == string::npos && flags.find(" hg ") == string::npos);
+        pool.free(small, 4096);
+    }
+
+    void testPreallocReceive()
+    {
+        // Preallocated reassembly buffers, of a size short of the messages or not, and
+        // hugepage ones, all deliver every message intact
+        const int COUNT = 20;
+        const size_t SIZE = 3000000;
+        TS_ASSERT_EQUALS(sendLarge("udp://127.0.0.1:9480:9481?prealloc=4000000",
+                                   "udp://127.0.0.1:9481:9480", COUNT, SIZE), COUNT);
+        TS_ASSERT_EQUALS(sendLarge("udp://127.0.0.1:9482:9483?prealloc=100000",
+                                   "udp://127.0.0.1:9483:9482", COUNT, SIZE), COUNT);
+        TS_ASSERT_EQUALS(sendLarge("udp://127.0.0.1:9484:9485?prealloc=4000000&hugepages=1",
+                                   "udp://127.0.0.1:9485:9484", COUNT, SIZE), COUNT);
+    }
+
+    void testBusyPoll()
+    {
+        const int COUNT = 20;
+        zcm_trans_t *recvTrans = makeUdp("udp://127.0.0.1:9490:9491?busy_poll_us=50000");
+        zcm_trans_t *sendTrans = makeUdp("udp://127.0.0.1:9491:9490");
+        if (!recvTrans || !sendTrans) return;
+        zcm_trans_recvmsg_enable(recvTrans, ".*", true);
+        TS_ASSERT_EQUALS(udpStat(recvTrans, "busy_polls"), 0);
+
+        // Messages a millisecond apart are each caught while spinning
+        {
+            UdpReceiver rx(recvTrans);
+            for (uint32_t i = 0; i < COUNT; i++) {
+                TS_ASSERT_EQUALS(sendUdp(sendTrans, "BUSY_POLL", &i, sizeof(i)), ZCM_EOK);
+                usleep(1000);
+            }
+            rx.waitFor(COUNT);
+            TS_ASSERT_EQUALS(rx.stop().size(), COUNT);
+        }
+        uint64_t hits = udpStat(recvTrans, "busy_poll_hits");
+        TS_ASSERT_LESS_THAN_EQUALS(COUNT / 2, hits);
+        TS_ASSERT_LESS_THAN_EQUALS(hits, udpStat(recvTrans, "busy_polls"));
+
+        // With nothing arriving, a read spins for the whole budget before it waits
+        uint64_t polls = udpStat(recvTrans, "busy_polls");
+        uint64_t us = udpStat(recvTrans, "busy_poll_us");
+        zcm_msg_t msg = {};
+        TS_ASSERT_DIFFERS(zcm_trans_recvmsg(recvTrans, &msg, 100), ZCM_EOK);
+        TS_ASSERT_LESS_THAN(polls, udpStat(recvTrans, "busy_polls"));
+        TS_ASSERT_EQUALS(udpStat(recvTrans, "busy_poll_hits"), hits);
+        TS_ASSERT_LESS_THAN_EQUALS(us + 50000, udpStat(recvTrans, "busy_poll_us"));
+
+        zcm_trans_destroy(sendTrans);
+        zcm_trans_destroy(recvTrans);
+    }
+};
+
+#endif // UDPTEST_H
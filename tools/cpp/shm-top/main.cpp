@@ -0,0 +1,361 @@
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zcm/url.h"
+#include "zcm/json/json.h"
+
+// Ahead of these, the std headers: the lockfree headers can define a static_assert() macro
+#include "zcm/transport/lockfree/lf_bcast.h"
+#include "zcm/transport/lockfree/lf_shm.h"
+#include "zcm/transport/ipcshm_region.hpp"
+
+using namespace std;
+
+static volatile bool done = false;
+
+static void sighandler(int signal)
+{
+    done = true;
+}
+
+struct Args
+{
+    const char *zcmurl = nullptr;
+    double hz = 4;
+    bool json = false;
+    u64 count = 0; // refreshes before exiting, 0 for no limit
+
+    bool parse(int argc, char *argv[])
+    {
+        const char *optstring = "hu:f:jn:";
+        struct option long_opts[] = {
+            { "help",      no_argument,       0, 'h' },
+            { "zcm-url",   required_argument, 0, 'u' },
+            { "frequency", required_argument, 0, 'f' },
+            { "json",      no_argument,       0, 'j' },
+            { "count",     required_argument, 0, 'n' },
+            { 0, 0, 0, 0 }
+        };
+
+        int c;
+        while ((c = getopt_long(argc, argv, optstring, long_opts, 0)) >= 0) {
+            switch (c) {
+                case 'u': zcmurl = optarg; break;
+                case 'f': hz     = atof(optarg); break;
+                case 'j': json   = true; break;
+                case 'n': count  = strtoull(optarg, nullptr, 10); break;
+                case 'h': default: usage(); return false;
+            };
+        }
+
+        if (!zcmurl) zcmurl = getenv("ZCM_DEFAULT_URL");
+        if (!zcmurl) {
+            fprintf(stderr, "Please specify the region's url with -u\n");
+            return false;
+        }
+        if (hz <= 0) {
+            fprintf(stderr, "Please specify valid refresh frequency\n");
+            return false;
+        }
+        return true;
+    }
+
+    void usage()
+    {
+        fprintf(stderr, "usage: zcm-shm-top [options]\n"
+                "\n"
+                "    Shows how the processes sharing an ipcshm region are doing: how full\n"
+                "    its rings and slot pools are, how fast messages are published, and\n"
+                "    how far behind each subscriber is and how many messages it dropped\n"
+                "    or skipped to catch up.\n"
+                "    The region is only read, and never created.\n"
+                "\n"
+                "Example:\n"
+                "    zcm-shm-top -u 'ipcshm://robot?shards=4'\n"
+                "\n"
+                "Options:\n"
+                "\n"
+                "  -h, --help                 Shows this help text and exits\n"
+                "  -u, --zcm-url=URL          The ipcshm url of the region. Its shards and\n"
+                "                             hugetlbfs options must match the processes'\n"
+                "  -f, --frequency=HZ         Screen refresh frequency in Hz, 4 by default\n"
+                "  -j, --json                 Print each refresh as a line of JSON instead\n"
+                "  -n, --count=N              Exit after N refreshes\n"
+                "\n");
+    }
+};
+
+// One snapshot of a shard of the region
+struct ShardStats
+{
+    lf_bcast_stats_t stats;
+    vector<lf_bcast_sub_status_t> subs;
+};
+
+struct Region
+{
+    string name;
+    void *mem = nullptr;
+    size_t size = 0;
+    vector<lf_bcast_t*> shards;
+
+    ~Region()
+    {
+        if (mem) lf_shm_close(mem, size);
+    }
+
+    bool open(const char *url)
+    {
+        zcm_url_t *u = zcm_url_create(url);
+        if (!u) {
+            fprintf(stderr, "Invalid url '%s'\n", url);
+            return false;
+        }
+        bool ret = open(u);
+        zcm_url_destroy(u);
+        return ret;
+    }
+
+    bool open(zcm_url_t *u)
+    {
+        if (0 != strcmp(zcm_url_protocol(u), "ipcshm")) {
+            fprintf(stderr, "Only ipcshm regions can be inspected, not '%s'\n", zcm_url_protocol(u));
+            return false;
+        }
+
+        name = zcm_url_address(u);
+        if (name.empty()) name = "default";
+
+        u64 nshards = 1;
+        string hugetlbfs;
+        zcm_url_opts_t *opts = zcm_url_opts(u);
+        for (size_t i = 0; i < opts->numopts; i++) {
+            if (0 == strcmp(opts->name[i], "shards")) nshards = strtoull(opts->value[i], nullptr, 10);
+            if (0 == strcmp(opts->name[i], "hugetlbfs")) hugetlbfs = opts->value[i];
+        }
+        if (nshards == 0) nshards = 1;
+
+        string path = ipcshm_region_path(hugetlbfs, name.c_str());
+        int err = 0;
+        mem = lf_shm_open(path.c_str(), LF_SHM_FLAG_RDONLY, &size, &err);
+        if (!mem) {
+            fprintf(stderr, "Failed to open region '%s': %s (%s)\n",
+                    path.c_str(), lf_shm_errstr(err), strerror(errno));
+            return false;
+        }
+
+        if (nshards == 1) {
+            shards.push_back((lf_bcast_t*)mem);
+            return true;
+        }
+
+        ShardedRegion *sharded = (ShardedRegion*)mem;
+        if (size < sizeof(ShardedRegion) || sharded->nshards != nshards ||
+            sizeof(ShardedRegion) + nshards * sharded->shard_size > size) {
+            fprintf(stderr, "Region '%s' doesn't have %" PRIu64 " shards: check the "
+                    "shards option against the processes'\n", path.c_str(), nshards);
+            return false;
+        }
+        char *shard_mem = (char*)mem + sizeof(ShardedRegion);
+        for (size_t i = 0; i < nshards; i++)
+            shards.push_back((lf_bcast_t*)(shard_mem + i * sharded->shard_size));
+        return true;
+    }
+
+    vector<ShardStats> snapshot()
+    {
+        vector<ShardStats> ret(shards.size());
+        for (size_t i = 0; i < shards.size(); i++) {
+            lf_bcast_stats(shards[i], &ret[i].stats);
+            ret[i].subs.resize(LF_BCAST_MAX_CURSORS);
+            size_t n = lf_bcast_sub_statuses(shards[i], ret[i].subs.data(), ret[i].subs.size());
+            ret[i].subs.resize(n);
+        }
+        return ret;
+    }
+};
+
+static bool alive(u64 pid)
+{
+    return kill((pid_t)pid, 0) == 0 || errno != ESRCH;
+}
+
+// Builds the report of a snapshot, with rates computed against the previous one 'dt' seconds
+// earlier, if there is one
+static zcm::Json::Value report(const Region& region, const vector<ShardStats>& cur,
+                               const vector<ShardStats>& prev, double dt)
+{
+    // Subscribers are matched across snapshots by their record, and their process in case
+    // the record was reused in between
+    map<tuple<size_t, u32, u64>, const lf_bcast_sub_status_t*> prevSubs;
+    for (size_t i = 0; i < prev.size(); i++)
+        for (auto& s : prev[i].subs) prevSubs[make_tuple(i, s.id, s.pid)] = &s;
+
+    auto rate = [dt](u64 now, u64 before) {
+        return dt > 0 && now >= before ? (double)(now - before) / dt : 0.0;
+    };
+
+    zcm::Json::Value root;
+    root["region"] = region.name;
+    root["utime"] = (zcm::Json::UInt64)(wallclock() / 1000);
+    root["shards"] = zcm::Json::Value(zcm::Json::arrayValue);
+
+    i64 now_ns = wallclock();
+    for (size_t i = 0; i < cur.size(); i++) {
+        const lf_bcast_stats_t& st = cur[i].stats;
+        zcm::Json::Value shard;
+        shard["shard"] = (zcm::Json::UInt64)i;
+        shard["depth"] = (zcm::Json::UInt64)st.depth;
+        shard["head"] = (zcm::Json::UInt64)st.head_idx;
+        shard["tail"] = (zcm::Json::UInt64)st.tail_idx;
+        shard["queued"] = (zcm::Json::UInt64)(st.tail_idx - st.head_idx);
+        shard["pub_rate"] = i < prev.size() ? rate(st.tail_idx, prev[i].stats.tail_idx) : 0.0;
+
+        shard["slots"] = zcm::Json::Value(zcm::Json::arrayValue);
+        for (size_t c = 0; c < st.nclasses && c < LF_BCAST_MAX_CLASSES; c++) {
+            zcm::Json::Value cls;
+            cls["size"] = (zcm::Json::UInt64)st.classes[c].elt_sz;
+            cls["count"] = (zcm::Json::UInt64)st.classes[c].num_elts;
+            cls["in_use"] = (zcm::Json::UInt64)(st.classes[c].num_elts - st.classes[c].num_free);
+            shard["slots"].append(cls);
+        }
+
+        shard["subscribers"] = zcm::Json::Value(zcm::Json::arrayValue);
+        for (auto& s : cur[i].subs) {
+            zcm::Json::Value sub;
+            sub["pid"] = (zcm::Json::UInt64)s.pid;
+            sub["name"] = s.name;
+            sub["lossless"] = s.lossless;
+            sub["alive"] = alive(s.pid);
+
+            // Until its first consume, a subscriber's cursor can be past the tail or unknown
+            u64 idx = s.idx < st.tail_idx ? s.idx : st.tail_idx;
+            sub["lag"] = (zcm::Json::UInt64)(st.tail_idx - idx);
+            sub["drops"] = (zcm::Json::UInt64)s.drops;
+            sub["skipped"] = (zcm::Json::UInt64)s.skipped;
+
+            auto it = prevSubs.find(make_tuple(i, s.id, s.pid));
+            const lf_bcast_sub_status_t *p = it == prevSubs.end() ? nullptr : it->second;
+            u64 prevIdx = p && p->idx < st.tail_idx ? p->idx : idx;
+            // The cursor also moves past the messages it dropped or skipped
+            u64 dropped = p && s.drops >= p->drops ? s.drops - p->drops : 0;
+            u64 skipped = p && s.skipped >= p->skipped ? s.skipped - p->skipped : 0;
+            u64 passed = dropped + skipped;
+            sub["consume_rate"] = p && idx >= prevIdx + passed ? rate(idx - passed, prevIdx) : 0.0;
+            sub["drop_rate"] = p ? rate(s.drops, p->drops) : 0.0;
+            sub["skip_rate"] = p ? rate(s.skipped, p->skipped) : 0.0;
+
+            if (s.last_consume_ns > 0 && now_ns > s.last_consume_ns)
+                sub["idle_s"] = (double)(now_ns - s.last_consume_ns) / 1e9;
+            else
+                sub["idle_s"] = zcm::Json::Value();
+            shard["subscribers"].append(sub);
+        }
+        root["shards"].append(shard);
+    }
+    return root;
+}
+
+static void clearscreen()
+{
+    // clear
+    printf("\033[2J");
+
+    // move cursor to (0, 0)
+    printf("\033[0;0H");
+}
+
+static u64 asU64(const zcm::Json::Value& v)
+{
+    return (u64)v.asUInt64();
+}
+
+static void display(const char *url, const zcm::Json::Value& root)
+{
+    clearscreen();
+    printf("  ZCM-SHM-TOP: %s\n\n", url);
+
+    for (auto& shard : root["shards"]) {
+        printf("  Shard %" PRIu64 ": %" PRIu64 " of %" PRIu64 " queued, %.1f msgs/s published\n",
+               asU64(shard["shard"]), asU64(shard["queued"]),
+               asU64(shard["depth"]), shard["pub_rate"].asDouble());
+
+        printf("    %12s %8s %8s\n", "Slot size", "Slots", "In use");
+        for (auto& cls : shard["slots"])
+            printf("    %12" PRIu64 " %8" PRIu64 " %8" PRIu64 "\n", asU64(cls["size"]),
+                   asU64(cls["count"]), asU64(cls["in_use"]));
+
+        if (shard["subscribers"].empty()) {
+            printf("    No subscribers registered\n\n");
+            continue;
+        }
+        printf("    %-15s %8s %-8s %8s %10s %10s %9s %10s %9s %8s\n", "Subscriber", "PID",
+               "Mode", "Lag", "Msgs/s", "Drops", "Drops/s", "Skipped", "Skips/s", "Idle");
+        for (auto& sub : shard["subscribers"]) {
+            const char *mode = !sub["alive"].asBool() ? "dead" :
+                               sub["lossless"].asBool() ? "lossless" : "lossy";
+            char idle[32] = "-";
+            if (!sub["idle_s"].isNull()) snprintf(idle, sizeof(idle), "%.2fs", sub["idle_s"].asDouble());
+            printf("    %-15s %8" PRIu64 " %-8s %8" PRIu64 " %10.1f %10" PRIu64 " %9.1f %10"
+                   PRIu64 " %9.1f %8s\n",
+                   sub["name"].asCString(), asU64(sub["pid"]), mode, asU64(sub["lag"]),
+                   sub["consume_rate"].asDouble(), asU64(sub["drops"]),
+                   sub["drop_rate"].asDouble(), asU64(sub["skipped"]),
+                   sub["skip_rate"].asDouble(), idle);
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    Args args;
+    if (!args.parse(argc, argv)) return 1;
+
+    Region region;
+    if (!region.open(args.zcmurl)) return 1;
+
+    signal(SIGINT,  sighandler);
+    signal(SIGQUIT, sighandler);
+    signal(SIGTERM, sighandler);
+
+    zcm::Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    unique_ptr<zcm::Json::StreamWriter> writer(builder.newStreamWriter());
+
+    u64 period = (u64)(1000000 / args.hz);
+    vector<ShardStats> prev;
+    i64 prev_ns = 0;
+    for (u64 n = 0; !done && (args.count == 0 || n < args.count); n++) {
+        if (n > 0) usleep(period);
+
+        i64 now_ns = wallclock();
+        vector<ShardStats> cur = region.snapshot();
+        double dt = prev_ns ? (double)(now_ns - prev_ns) / 1e9 : 0;
+        zcm::Json::Value root = report(region, cur, prev, dt);
+        prev = move(cur);
+        prev_ns = now_ns;
+
+        if (args.json) {
+            writer->write(root, &cout);
+            cout << endl;
+        } else {
+            display(args.zcmurl, root);
+        }
+    }
+    return 0;
+}
@@ -19,11 +19,13 @@
 #include <iostream>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
 #include <regex>
 using namespace std;
 
 #define RECV_TIMEOUT 100
+#define SEND_RETRY_US 100
 
 // Define a macro to set thread names. The function call is
 // different for some operating systems
@@ -44,6 +46,10 @@ struct Msg
 {
     zcm_msg_t msg;
 
+    // The transport that lent msg, see recvmsg_release() in transport.h. NULL when this
+    // object owns copies of its channel and data
+    zcm_trans_t* lender = nullptr;
+
     // NOTE: copy the provided data into this object
     Msg(uint64_t utime, const char* channel, size_t len, const uint8_t* buf)
     {
@@ -52,16 +58,31 @@ struct Msg
         msg.len = len;
         msg.buf = (uint8_t*)malloc(len);
         memcpy(msg.buf, buf, len);
+        msg.recv_kernel_ns = 0;
+        msg.recv_hw_ns = 0;
+        msg.recv_dequeue_ns = 0;
+    }
+
+    Msg(zcm_msg_t* msg) : Msg(msg->utime, msg->channel, msg->len, msg->buf)
+    {
+        this->msg.recv_kernel_ns = msg->recv_kernel_ns;
+        this->msg.recv_hw_ns = msg->recv_hw_ns;
+        this->msg.recv_dequeue_ns = msg->recv_dequeue_ns;
     }
 
-    Msg(zcm_msg_t* msg) : Msg(msg->utime, msg->channel, msg->len, msg->buf) {}
+    // NOTE: refer to the lent message in place and give it back when destroyed
+    Msg(zcm_msg_t* msg, zcm_trans_t* lender) : msg(*msg), lender(lender) {}
 
     ~Msg()
     {
-        if (msg.channel)
-            free((void*)msg.channel);
-        if (msg.buf)
-            free((void*)msg.buf);
+        if (lender) {
+            zcm_trans_recvmsg_release(lender, &msg);
+        } else {
+            if (msg.channel)
+                free((void*)msg.channel);
+            if (msg.buf)
+                free((void*)msg.buf);
+        }
         memset(&msg, 0, sizeof(msg));
     }
 
@@ -120,7 +141,11 @@ struct zcm_blocking
     int flush(bool block);
 
     int setQueueSize(uint32_t numMsgs, bool block);
+    void setInlineDispatch(bool enable);
+    int setDirectPublish(bool enable);
     int queryDrops(uint64_t *out_drops);
+    int queryStats(zcm_stat_t *stats, size_t *nstats);
+    int validateRecvBuf(const zcm_recv_buf_t* rbuf);
     int writeTopology(string name);
 
   private:
@@ -131,6 +156,7 @@ struct zcm_blocking
     bool startRecvThread();
 
     void dispatchMsg(zcm_msg_t* msg);
+    bool dispatchInline(zcm_msg_t* msg);
     bool dispatchOneMessage(bool returnIfPaused);
     bool sendOneMessage(bool returnIfPaused);
 
@@ -143,6 +169,7 @@ struct zcm_blocking
 
     zcm_t* z;
     zcm_trans_t* zt;
+    bool transLendsMsgs;
     unordered_map<string, SubList> subs;
     unordered_map<string, SubList> subsRegex;
     size_t mtu;
@@ -158,10 +185,16 @@ struct zcm_blocking
     mutex subDispMutex;
     mutex subRecvMutex;
 
+    // The message whose handlers are running, see validateRecvBuf() (use subDispMutex)
+    zcm_msg_t* dispatching {nullptr};
+
     static constexpr size_t QUEUE_SIZE = 16;
     ThreadsafeQueue<Msg> sendQueue {QUEUE_SIZE};
     ThreadsafeQueue<Msg> recvQueue {QUEUE_SIZE};
 
+    // Messages the sendThread failed to send, added to the transport's drops
+    atomic<uint64_t> sendDrops {0};
+
     typedef enum {
         RECV_MODE_NONE = 0,
         RECV_MODE_RUN,
@@ -170,7 +203,13 @@ struct zcm_blocking
     } RecvMode_t;
     RecvMode_t recvMode {RECV_MODE_NONE};
 
-    // This mutex protects read and write access to the recv mode flag
+    // Whether run() and start() have the recvThread call the handlers itself, straight
+    // from the transport's buffer, instead of queueing messages for the hndlThread
+    bool inlineDispatch {false};
+    // Whether the running recvThread dispatches inline. Only set before it's spawned
+    bool recvThreadDispatches {false};
+
+    // This mutex protects read and write access to the recv mode flag and inlineDispatch
     mutex recvModeMutex;
 
     thread sendThread;
@@ -198,6 +237,10 @@ struct zcm_blocking
     // Flag and condition variables used to pause the sendThread (use sendStateMutex)
     // and hndlThread (use hndlStateMutex)
     bool               paused {false};
+
+    // Whether publish() calls the transport itself while the sendQueue is empty, only
+    // possible if its sendmsg() is threadsafe (use sendStateMutex)
+    bool directPublish {false};
     condition_variable sendPauseCond;
     condition_variable hndlPauseCond;
 };
@@ -208,6 +251,9 @@ zcm_blocking_t::zcm_blocking(zcm_t* z_, zcm_trans_t* zt_)
     z = z_;
     zt = zt_;
     mtu = zcm_trans_get_mtu(zt);
+
+    // Messages the transport lends are queued and dispatched in place instead of copied
+    transLendsMsgs = zt->vtbl->recvmsg_release != nullptr;
 }
 
 zcm_blocking_t::~zcm_blocking()
@@ -215,6 +261,9 @@ zcm_blocking_t::~zcm_blocking()
     // Shutdown all threads
     stop(true);
 
+    // Give back the messages the transport lent us before destroying it
+    while (recvQueue.hasMessage()) recvQueue.pop();
+
     // Destroy the transport
     zcm_trans_destroy(zt);
 
@@ -240,6 +289,7 @@ void zcm_blocking_t::run()
         return;
     }
     recvMode = RECV_MODE_RUN;
+    recvThreadDispatches = inlineDispatch;
 
     // Run it!
     {
@@ -264,6 +314,7 @@ void zcm_blocking_t::start()
         return;
     }
     recvMode = RECV_MODE_SPAWN;
+    recvThreadDispatches = inlineDispatch;
 
     unique_lock<mutex> lk2(hndlStateMutex);
     lk1.unlock();
@@ -373,6 +424,8 @@ bool zcm_blocking_t::startRecvThread()
     // If this is the first time handle() is called, we need to start the recv thread
     if (recvMode == RECV_MODE_NONE) {
         recvMode = RECV_MODE_HANDLE;
+        // handle() dispatches on the caller's thread, so messages always go through the queue
+        recvThreadDispatches = false;
 
         unique_lock<mutex> lk2(recvStateMutex);
         lk1.unlock();
@@ -428,18 +481,37 @@ int zcm_blocking_t::publish(const string& channel, const uint8_t* data, uint32_t
     if (channel.size() > ZCM_CHANNEL_MAXLEN) return ZCM_EINVALID;
 
     // If needed: spawn the send thread
+    bool sendDirectly;
     {
         unique_lock<mutex> lk(sendStateMutex);
         if (sendThreadState == THREAD_STATE_STOPPED) {
             sendThreadState = THREAD_STATE_RUNNING;
             sendThread = thread{&zcm_blocking::sendThreadFunc, this};
         }
+        sendDirectly = directPublish && !paused && sendThreadState == THREAD_STATE_RUNNING;
     }
 
-    bool success = sendQueue.pushIfRoom(TimeUtil::utime(), channel.c_str(), len, data);
-    if (!success) {
-        ZCM_DEBUG("sendQueue has no free space");
-        return ZCM_EAGAIN;
+    // Skip the sendQueue if nothing is waiting in it, so messages stay in order
+    int ret = ZCM_EAGAIN;
+    if (sendDirectly && !sendQueue.hasMessage()) {
+        zcm_msg_t msg = {};
+        msg.utime = TimeUtil::utime();
+        msg.channel = channel.c_str();
+        msg.len = len;
+        msg.buf = (uint8_t*)data;
+        ret = zcm_trans_sendmsg(zt, msg);
+    }
+
+    // Otherwise, or if the transport had no room for it, the send thread sends it later
+    if (ret == ZCM_EAGAIN) {
+        bool success = sendQueue.pushIfRoom(TimeUtil::utime(), channel.c_str(), len, data);
+        if (!success) {
+            ZCM_DEBUG("sendQueue has no free space");
+            return ZCM_EAGAIN;
+        }
+    } else if (ret != ZCM_EOK) {
+        ZCM_DEBUG("zcm_trans_sendmsg() returned error, dropping the msg!");
+        return ret;
     }
 
 #ifdef TRACK_TRAFFIC_TOPOLOGY
@@ -550,7 +622,7 @@ int zcm_blocking_t::flush(bool block)
 
         sendQueue.enable();
         n = sendQueue.numMessages();
-        for (size_t i = 0; i < n; ++i) sendOneMessage(false);
+        for (size_t i = 0; i < n;) if (sendOneMessage(false)) ++i;
     }
     sendPauseCond.notify_all();
 
@@ -624,9 +696,41 @@ int zcm_blocking_t::setQueueSize(uint32_t numMsgs, bool block)
     return ZCM_EOK;
 }
 
+void zcm_blocking_t::setInlineDispatch(bool enable)
+{
+    unique_lock<mutex> lk(recvModeMutex);
+    inlineDispatch = enable;
+}
+
+int zcm_blocking_t::setDirectPublish(bool enable)
+{
+    if (enable && !(zcm_trans_caps(zt) & ZCM_TRANS_CAP_THREADSAFE_SEND)) {
+        ZCM_DEBUG("Err: direct publish needs a transport with a threadsafe sendmsg()");
+        return ZCM_EINVALID;
+    }
+    unique_lock<mutex> lk(sendStateMutex);
+    directPublish = enable;
+    return ZCM_EOK;
+}
+
 int zcm_blocking_t::queryDrops(uint64_t *out_drops)
 {
-    return zcm_trans_query_drops(zt, out_drops);
+    int ret = zcm_trans_query_drops(zt, out_drops);
+    if (ret == ZCM_EOK) *out_drops += sendDrops;
+    return ret;
+}
+
+int zcm_blocking_t::queryStats(zcm_stat_t *stats, size_t *nstats)
+{
+    return zcm_trans_query_stats(zt, stats, nstats);
+}
+
+int zcm_blocking_t::validateRecvBuf(const zcm_recv_buf_t* rbuf)
+{
+    // Only valid from the handlers of the message being dispatched, which run on the
+    // thread that set 'dispatching' and with subDispMutex held
+    if (!dispatching || rbuf->data != dispatching->buf) return ZCM_EINVALID;
+    return zcm_trans_recvmsg_validate(zt, dispatching);
 }
 
 void zcm_blocking_t::sendThreadFunc()
@@ -661,7 +765,7 @@ void zcm_blocking_t::recvThreadFunc()
             unique_lock<mutex> lk(recvStateMutex);
             if (recvThreadState == THREAD_STATE_HALTING) break;
         }
-        zcm_msg_t msg;
+        zcm_msg_t msg = {};
         int rc = zcm_trans_recvmsg(zt, &msg, RECV_TIMEOUT);
         if (rc == ZCM_EOK) {
             {
@@ -683,14 +787,24 @@ void zcm_blocking_t::recvThreadFunc()
                         if (foundRegex) break;
                     }
                     // No subscription actually wants the message
-                    if (!foundRegex) continue;
+                    if (!foundRegex) {
+                        zcm_trans_recvmsg_release(zt, &msg);
+                        continue;
+                    }
                 }
             }
 
+            if (recvThreadDispatches) {
+                dispatchInline(&msg);
+                zcm_trans_recvmsg_release(zt, &msg);
+                continue;
+            }
+
             // Note: After this returns, you have either successfully pushed a message
             //       into the queue, or the queue was disabled and you will quit out of
             //       this loop when you re-check the running condition
-            recvQueue.push(&msg);
+            bool pushed = transLendsMsgs ? recvQueue.push(&msg, zt) : recvQueue.push(&msg);
+            if (!pushed) zcm_trans_recvmsg_release(zt, &msg);
         }
     }
     unique_lock<mutex> lk(recvStateMutex);
@@ -713,8 +827,9 @@ void zcm_blocking_t::hndlThreadFunc()
     while (true) {
         {
             unique_lock<mutex> lk(hndlStateMutex);
+            // With inline dispatch, the recvThread does all the work until we're stopped
             hndlPauseCond.wait(lk, [&]{
-                return (!paused && recvQueue.isEnabled()) ||
+                return (!recvThreadDispatches && !paused && recvQueue.isEnabled()) ||
                        hndlThreadState == THREAD_STATE_HALTING;
             });
             if (hndlThreadState == THREAD_STATE_HALTING) break;
@@ -743,6 +858,9 @@ void zcm_blocking_t::dispatchMsg(zcm_msg_t* msg)
     rbuf.zcm = z;
     rbuf.data = msg->buf;
     rbuf.data_size = msg->len;
+    rbuf.recv_kernel_ns = msg->recv_kernel_ns;
+    rbuf.recv_hw_ns = msg->recv_hw_ns;
+    rbuf.recv_dequeue_ns = msg->recv_dequeue_ns;
 
     // Note: We use a lock on dispatch to ensure there is not
     // a race on modifying and reading the 'subs' container.
@@ -751,6 +869,7 @@ void zcm_blocking_t::dispatchMsg(zcm_msg_t* msg)
     bool wasDispatched = false;
     {
         unique_lock<mutex> lk(subDispMutex);
+        dispatching = msg;
 
         // dispatch to a non regex channel
         auto it = subs.find(msg->channel);
@@ -771,6 +890,8 @@ void zcm_blocking_t::dispatchMsg(zcm_msg_t* msg)
                 }
             }
         }
+
+        dispatching = nullptr;
     }
 
 #ifdef TRACK_TRAFFIC_TOPOLOGY
@@ -789,6 +910,22 @@ void zcm_blocking_t::dispatchMsg(zcm_msg_t* msg)
 #endif
 }
 
+// Runs on the recvThread. Waits while dispatch is paused, which holds back the transport,
+// and returns false without dispatching if the hndlThread is halting instead
+bool zcm_blocking_t::dispatchInline(zcm_msg_t* msg)
+{
+    {
+        unique_lock<mutex> lk(hndlStateMutex);
+        hndlPauseCond.wait(lk, [&]{
+            return !paused || hndlThreadState == THREAD_STATE_HALTING;
+        });
+        if (hndlThreadState == THREAD_STATE_HALTING) return false;
+    }
+
+    if (zcm_trans_recvmsg_validate(zt, msg) == ZCM_EOK) dispatchMsg(msg);
+    return true;
+}
+
 bool zcm_blocking_t::dispatchOneMessage(bool returnIfPaused)
 {
     Msg* m = recvQueue.top();
@@ -801,7 +938,10 @@ bool zcm_blocking_t::dispatchOneMessage(bool returnIfPaused)
         if (paused || hndlThreadState == THREAD_STATE_HALTING) return false;
     }
 
-    dispatchMsg(m->get());
+    // Lent messages can be overwritten while they wait in the queue. Those are given back
+    // (and counted as drops by the transport) without being dispatched
+    zcm_msg_t* msg = m->get();
+    if (zcm_trans_recvmsg_validate(zt, msg) == ZCM_EOK) dispatchMsg(msg);
     recvQueue.pop();
     return true;
 }
@@ -825,7 +965,18 @@ bool zcm_blocking_t::sendOneMessage(bool returnIfPaused)
 
     zcm_msg_t* msg = m->get();
     int ret = zcm_trans_sendmsg(zt, *msg);
-    if (ret != ZCM_EOK) ZCM_DEBUG("zcm_trans_sendmsg() returned error, dropping the msg!");
+
+    // Transports that can send from any thread return ZCM_EAGAIN while they have no room.
+    // Keep the message until they do, so that a full transport fills the sendQueue and
+    // pushes back on publish() rather than losing messages it already accepted
+    if (ret == ZCM_EAGAIN && (zcm_trans_caps(zt) & ZCM_TRANS_CAP_THREADSAFE_SEND)) {
+        this_thread::sleep_for(chrono::microseconds(SEND_RETRY_US));
+        return false;
+    }
+    if (ret != ZCM_EOK) {
+        ZCM_DEBUG("zcm_trans_sendmsg() returned error, dropping the msg!");
+        sendDrops++;
+    }
     sendQueue.pop();
     return true;
 }
@@ -952,11 +1103,31 @@ void zcm_blocking_set_queue_size(zcm_blocking_t* zcm, uint32_t sz)
     zcm->setQueueSize(sz, true);
 }
 
+void zcm_blocking_set_inline_dispatch(zcm_blocking_t* zcm, bool enable)
+{
+    zcm->setInlineDispatch(enable);
+}
+
+int  zcm_blocking_set_direct_publish(zcm_blocking_t* zcm, bool enable)
+{
+    return zcm->setDirectPublish(enable);
+}
+
 int  zcm_blocking_query_drops(zcm_blocking_t *zcm, uint64_t *out_drops)
 {
     return zcm->queryDrops(out_drops);
 }
 
+int  zcm_blocking_query_stats(zcm_blocking_t *zcm, zcm_stat_t *stats, size_t *nstats)
+{
+    return zcm->queryStats(stats, nstats);
+}
+
+int  zcm_blocking_validate_recv_buf(zcm_blocking_t *zcm, const zcm_recv_buf_t *rbuf)
+{
+    return zcm->validateRecvBuf(rbuf);
+}
+
 int zcm_blocking_write_topology(zcm_blocking_t* zcm, const char* name)
 {
 #ifdef TRACK_TRAFFIC_TOPOLOGY
@@ -31,7 +31,11 @@ void zcm_blocking_resume(zcm_blocking_t* zcm);
 int  zcm_blocking_handle(zcm_blocking_t* zcm);
 int  zcm_blocking_handle_nonblock(zcm_blocking_t* zcm);
 void zcm_blocking_set_queue_size(zcm_blocking_t* zcm, uint32_t numMsgs);
+void zcm_blocking_set_inline_dispatch(zcm_blocking_t* zcm, bool enable);
+int  zcm_blocking_set_direct_publish(zcm_blocking_t* zcm, bool enable);
 int  zcm_blocking_query_drops(zcm_blocking_t *zcm, uint64_t *out_drops);
+int  zcm_blocking_query_stats(zcm_blocking_t *zcm, zcm_stat_t *stats, size_t *nstats);
+int  zcm_blocking_validate_recv_buf(zcm_blocking_t *zcm, const zcm_recv_buf_t *rbuf);
 
 int zcm_blocking_write_topology(zcm_blocking_t* zcm, const char* name);
 
@@ -91,6 +91,27 @@ int zcm_nonblocking_publish(zcm_nonblocking_t* z, const char* channel,
     return zcm_trans_sendmsg(z->zt, msg);
 }
 
+/* Whether a subscription other than the one at skip_idx is on this channel */
+static bool channelHasOtherSubs(zcm_nonblocking_t* zcm, const char* channel, size_t skip_idx)
+{
+    size_t i;
+    for (i = 0; i < zcm->subInUseEnd; ++i) {
+        if (!zcm->subInUse[i] || i == skip_idx) continue;
+        /* Note: it would be nice if we didn't have to do a string comp to unsubscribe, but
+                 we need to count the number of channel matches so we know when we can disable
+                 the transport's recvmsg_enable */
+        if (strncmp(channel, zcm->subs[i].channel, ZCM_CHANNEL_MAXLEN) == 0) return true;
+    }
+    return false;
+}
+
+/* Undoes the recvmsg_enable of a subscription that couldn't be added */
+static void rejectSub(zcm_nonblocking_t* zcm, const char* channel)
+{
+    if (!channelHasOtherSubs(zcm, channel, ZCM_NONBLOCK_SUBS_MAX))
+        zcm_trans_recvmsg_enable(zcm->zt, channel, false);
+}
+
 zcm_sub_t* zcm_nonblocking_subscribe(zcm_nonblocking_t* zcm, const char* channel,
                                      zcm_msg_handler_t cb, void* usr)
 {
@@ -113,6 +134,7 @@ zcm_sub_t* zcm_nonblocking_subscribe(zcm_nonblocking_t* zcm, const char* channel
         zcm->subIsRegex[i] = isRegexChannel(zcm->subs[i].channel, clen);
         if (zcm->subIsRegex[i] &&
             !isSupportedRegex(zcm->subs[i].channel, clen)) {
+            rejectSub(zcm, channel);
             return NULL;
         }
 
@@ -122,32 +144,20 @@ zcm_sub_t* zcm_nonblocking_subscribe(zcm_nonblocking_t* zcm, const char* channel
 
         return &zcm->subs[i];
     }
+    rejectSub(zcm, channel);
     return NULL;
 }
 
 int zcm_nonblocking_unsubscribe(zcm_nonblocking_t* zcm, zcm_sub_t* sub)
 {
-    size_t i;
     int match_idx = sub - zcm->subs;
-    bool lastChanSub = true;
     int rc = ZCM_EOK;
 
     if (match_idx < 0 || match_idx >= zcm->subInUseEnd) return ZCM_EINVALID;
     if (!zcm->subInUse[match_idx]) return ZCM_EINVALID;
 
-    for (i = 0; i < zcm->subInUseEnd; ++i) {
-        if (!zcm->subInUse[i]) continue;
-        /* Note: it would be nice if we didn't have to do a string comp to unsubscribe, but
-                 we need to count the number of channel matches so we know when we can disable
-                 the transport's recvmsg_enable */
-        if (match_idx != i &&
-            strncmp(sub->channel, zcm->subs[i].channel, ZCM_CHANNEL_MAXLEN) == 0) {
-            lastChanSub = false;
-            break;
-        }
-    }
-
-    if (lastChanSub) rc = zcm_trans_recvmsg_enable(zcm->zt, sub->channel, false);
+    if (!channelHasOtherSubs(zcm, sub->channel, match_idx))
+        rc = zcm_trans_recvmsg_enable(zcm->zt, sub->channel, false);
 
     zcm->subInUse[match_idx] = false;
     while (zcm->subInUseEnd > 0 && !zcm->subInUse[zcm->subInUseEnd - 1]) {
@@ -162,6 +172,11 @@ int zcm_nonblocking_query_drops(zcm_nonblocking_t *zcm, uint64_t *out_drops)
     return zcm_trans_query_drops(zcm->zt, out_drops);
 }
 
+int zcm_nonblocking_query_stats(zcm_nonblocking_t *zcm, zcm_stat_t *stats, size_t *nstats)
+{
+    return zcm_trans_query_stats(zcm->zt, stats, nstats);
+}
+
 static void dispatch_message(zcm_nonblocking_t* zcm, zcm_msg_t* msg)
 {
     zcm_recv_buf_t rbuf;
@@ -191,6 +206,9 @@ static void dispatch_message(zcm_nonblocking_t* zcm, zcm_msg_t* msg)
             rbuf.data = msg->buf;
             rbuf.data_size = msg->len;
             rbuf.recv_utime = msg->utime;
+            rbuf.recv_kernel_ns = msg->recv_kernel_ns;
+            rbuf.recv_hw_ns = msg->recv_hw_ns;
+            rbuf.recv_dequeue_ns = msg->recv_dequeue_ns;
 
             sub = &zcm->subs[i];
             sub->callback(&rbuf, msg->channel, sub->usr);
@@ -207,6 +225,7 @@ int zcm_nonblocking_handle_nonblock(zcm_nonblocking_t* zcm)
     zcm_trans_update(zcm->zt);
 
     /* Try to receive a messages from the transport and dispatch them */
+    memset(&msg, 0, sizeof(msg));
     if ((ret = zcm_trans_recvmsg(zcm->zt, &msg, 0)) != ZCM_EOK) return ret;
 
     dispatch_message(zcm, &msg);
@@ -221,8 +240,11 @@ void zcm_nonblocking_flush(zcm_nonblocking_t* zcm)
     zcm_trans_update(zcm->zt);
 
     zcm_msg_t msg;
-    while (zcm_trans_recvmsg(zcm->zt, &msg, 0) == ZCM_EOK)
+    memset(&msg, 0, sizeof(msg));
+    while (zcm_trans_recvmsg(zcm->zt, &msg, 0) == ZCM_EOK) {
         dispatch_message(zcm, &msg);
+        memset(&msg, 0, sizeof(msg));
+    }
 }
 
 #ifndef ZCM_EMBEDDED
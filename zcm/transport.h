@@ -107,6 +107,39 @@
  *      --------------------------------------------------------------------
  *         Close the transport and cleanup any resources used.
  *
+ *      int query_stats(zcm_trans_t* zt, zcm_stat_t* stats, size_t* nstats);
+ *      --------------------------------------------------------------------
+ *         This method provides the caller access to the transport's named statistics,
+ *         e.g. its drops broken down by cause. On input *nstats is the capacity of the
+ *         stats array. The transport should fill in up to that many, set *nstats to
+ *         the number of statistics it has and return ZCM_EOK. Implementing this is not
+ *         required. If set to NULL in the vtable, zcm_query_stats() returns ZCM_EUNIMPL.
+ *
+ *      int recvmsg_validate(zcm_trans_t* zt, const zcm_msg_t* msg);
+ *      void recvmsg_release(zcm_trans_t* zt, const zcm_msg_t* msg);
+ *      --------------------------------------------------------------------
+ *         These methods are optional, set together and only used with blocking
+ *         transports. Setting them tells the caller that recvmsg() lends it messages
+ *         in place instead of copying them into a transport buffer: a received
+ *         message, including its channel, stays readable until it's passed to
+ *         recvmsg_release(), even across further calls to recvmsg(). Each received
+ *         message must be released exactly once, from any thread, before the
+ *         transport is destroyed.
+ *         The transport may still reuse the memory of a lent message, e.g. when its
+ *         writer laps a slow reader. recvmsg_validate() returns ZCM_EOK if the message
+ *         is still intact and ZCM_EAGAIN if it was overwritten, in which case anything
+ *         read from it before the call must be discarded.
+ *
+ *      uint32_t caps
+ *      --------------------------------------------------------------------
+ *         Not a method: optional flags, after the methods in the vtable, telling the
+ *         caller what else the transport supports. 0 if unset.
+ *         ZCM_TRANS_CAP_THREADSAFE_SEND: sendmsg() may be called from any number of
+ *         threads at once, concurrently with every other method, returns ZCM_EAGAIN
+ *         rather than waiting indefinitely for room, and sends the message without
+ *         needing update() to be called. The caller may then send messages straight
+ *         from the threads publishing them (see zcm_set_direct_publish()).
+ *
  *******************************************************************************
  * Non-Blocking Transport API:
  *
@@ -183,6 +216,14 @@
  *      --------------------------------------------------------------------
  *         Close the transport and cleanup any resources used.
  *
+ *      int query_stats(zcm_trans_t* zt, zcm_stat_t* stats, size_t* nstats);
+ *      --------------------------------------------------------------------
+ *         This method provides the caller access to the transport's named statistics,
+ *         e.g. its drops broken down by cause. On input *nstats is the capacity of the
+ *         stats array. The transport should fill in up to that many, set *nstats to
+ *         the number of statistics it has and return ZCM_EOK. Implementing this is not
+ *         required. If set to NULL in the vtable, zcm_query_stats() returns ZCM_EUNIMPL.
+ *
  ******************************************************************************/
 
 #ifdef __cplusplus
@@ -214,6 +255,12 @@ struct zcm_msg_t
     const char* channel;
     size_t len;
     uint8_t* buf;
+
+    /* Receive only, set by transports that know them. zcm_trans_recvmsg() zeroes them
+       first. Nanoseconds since the epoch, 0 means unknown */
+    uint64_t recv_kernel_ns;  /* arrival in the kernel (software timestamp) */
+    uint64_t recv_hw_ns;      /* arrival at the NIC (hardware timestamp, NIC clock) */
+    uint64_t recv_dequeue_ns; /* when the transport took it from the kernel */
 };
 
 struct zcm_trans_t
@@ -231,8 +278,15 @@ struct zcm_trans_methods_t
     int     (*query_drops)(zcm_trans_t *zt, uint64_t *out_drops);
     int     (*update)(zcm_trans_t* zt);
     void    (*destroy)(zcm_trans_t* zt);
+    int     (*query_stats)(zcm_trans_t* zt, zcm_stat_t* stats, size_t* nstats);
+    int     (*recvmsg_validate)(zcm_trans_t* zt, const zcm_msg_t* msg);
+    void    (*recvmsg_release)(zcm_trans_t* zt, const zcm_msg_t* msg);
+    uint32_t caps;
 };
 
+/* Flags for zcm_trans_methods_t.caps */
+#define ZCM_TRANS_CAP_THREADSAFE_SEND (1u << 0)
+
 /* Helper functions to make the VTbl dispatch cleaner */
 static ZCM_TRANSPORT_INLINE size_t zcm_trans_get_mtu(zcm_trans_t* zt)
 { return zt->vtbl->get_mtu(zt); }
@@ -244,7 +298,13 @@ static ZCM_TRANSPORT_INLINE int zcm_trans_recvmsg_enable(zcm_trans_t* zt, const
 { return zt->vtbl->recvmsg_enable(zt, channel, enable); }
 
 static ZCM_TRANSPORT_INLINE int zcm_trans_recvmsg(zcm_trans_t* zt, zcm_msg_t* msg, unsigned timeout)
-{ return zt->vtbl->recvmsg(zt, msg, timeout); }
+{
+    /* Most transports don't know the receive timestamps and leave them alone */
+    msg->recv_kernel_ns = 0;
+    msg->recv_hw_ns = 0;
+    msg->recv_dequeue_ns = 0;
+    return zt->vtbl->recvmsg(zt, msg, timeout);
+}
 
 static ZCM_TRANSPORT_INLINE int zcm_trans_query_drops(zcm_trans_t* zt, uint64_t *out_drops)
 {
@@ -253,6 +313,29 @@ static ZCM_TRANSPORT_INLINE int zcm_trans_query_drops(zcm_trans_t* zt, uint64_t
     return zt->vtbl->query_drops(zt, out_drops);
 }
 
+static ZCM_TRANSPORT_INLINE int zcm_trans_query_stats(zcm_trans_t* zt, zcm_stat_t* stats,
+                                                      size_t* nstats)
+{
+    /* Possibly unimplemented, return ZCM_EUNIMPL */
+    if (!zt->vtbl->query_stats) return ZCM_EUNIMPL;
+    return zt->vtbl->query_stats(zt, stats, nstats);
+}
+
+static ZCM_TRANSPORT_INLINE int zcm_trans_recvmsg_validate(zcm_trans_t* zt, const zcm_msg_t* msg)
+{
+    /* Messages that weren't lent can't be overwritten */
+    if (!zt->vtbl->recvmsg_validate) return ZCM_EOK;
+    return zt->vtbl->recvmsg_validate(zt, msg);
+}
+
+static ZCM_TRANSPORT_INLINE void zcm_trans_recvmsg_release(zcm_trans_t* zt, const zcm_msg_t* msg)
+{
+    if (zt->vtbl->recvmsg_release) zt->vtbl->recvmsg_release(zt, msg);
+}
+
+static ZCM_TRANSPORT_INLINE uint32_t zcm_trans_caps(zcm_trans_t* zt)
+{ return zt->vtbl->caps; }
+
 static ZCM_TRANSPORT_INLINE int zcm_trans_update(zcm_trans_t* zt)
 { return zt->vtbl->update(zt); }
 
@@ -0,0 +1,25 @@
+#pragma once
+// Layout of ipcshm regions beyond the bcast rings themselves, shared with the tools that
+// inspect them. Include it after any std headers: see lf_machine_assumptions.h
+#include "zcm/transport/lockfree/lf_util.h"
+
+#include <stdio.h>
+#include <string>
+
+// A sharded region starts with this header, followed by the shards: each one is a whole
+// bcast region of its own, shard_size bytes long
+struct __attribute__((aligned(4096))) ShardedRegion
+{
+    u64 nshards;
+    u64 shard_size;
+    u32 waiters;  // subscribers waiting for a message on any shard
+    u32 doorbell; // bumped by publishers, when there are waiters, to wake them up
+};
+static_assert(sizeof(ShardedRegion) == 4096, "");
+
+// The file of a region: under /dev/shm, or under the hugetlbfs mount it was placed on
+static inline std::string ipcshm_region_path(const std::string& hugetlbfs, const char *region_name)
+{
+    std::string dir = hugetlbfs.empty() ? "/dev/shm" : hugetlbfs;
+    return dir + "/zcm/ipcshm/" + region_name;
+}
@@ -1,20 +1,34 @@
 #include "lf_bcast.h"
 #include "lf_pool.h"
 #include "lf_util.h"
+#include <errno.h>
 #include <linux/futex.h>
+#include <signal.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 
 #define LF_BCAST_ALIGN 4096
 
+// An element size class, with its own pool
+typedef struct pool_class pool_class_t;
+struct pool_class
+{
+  u64      elt_sz;       // Size of the elements of the class
+  u64      num_elts;     // Number of elements in its pool
+  size_t   pool_off;     // Memory offset to the element pool
+  size_t   pins_off;     // Memory offset to the pin counts, one per pool element
+};
+
 struct __attribute__((aligned(LF_BCAST_ALIGN))) lf_bcast
 {
   u64      depth_mask;   // Precomputed: "depth-1", used as a mask for slot indicies since depth is a power-of-two
-  u64      elt_sz;       // Size of the elements used in the queue
   u64      head_idx;     // Index of the head of the queue: slot index is "head_idx % depth"
   u64      tail_idx;     // Index of the tail of the queue: slot index is "tail_idx % depth"
-  size_t   pool_off;     // Memory offset to the element pool
-  char     _pad[LF_BCAST_ALIGN - 4*sizeof(u64) - sizeof(size_t)];
+  u64      waiters;      // Number of subscribers blocked in futex_wait(), so publishers only wake when needed
+  u64      nclasses;     // Number of element size classes, smallest first. Their pools follow each other
+  size_t   cursors_off;  // Memory offset to the registered subscriber cursors
+  pool_class_t classes[LF_BCAST_MAX_CLASSES];
+  char     _pad[LF_BCAST_ALIGN - 5*sizeof(u64) - sizeof(size_t) - LF_BCAST_MAX_CLASSES*sizeof(pool_class_t)];
 
   lf_ref_t slots[];      // Queue slots: ref is the tuple (tag=queue_idx, val=element_off)
 };
@@ -28,13 +42,131 @@ struct __attribute__((aligned(16))) sub_impl
   lf_bcast_t * bcast;
   u64          idx;
   u64          drops;
-  bool         active;
-  char         _extra[7];
+  u64          skipped;  // Elements jumped over to catch up, see lf_bcast_sub_set_catchup()
+  u64          behind;   // How far behind the tail it can fall before catching up, 0 to never
+  u64          keep;     // How many of the newest elements it keeps when it does
+  u32          active;   // Number of elements being consumed, from idx on
+  u32          cursor;   // 1 + index of the registered cursor, 0 if unregistered
 };
 static_assert(sizeof(sub_impl_t) == sizeof(lf_bcast_sub_t), "");
 static_assert(alignof(sub_impl_t) == alignof(lf_bcast_sub_t), "");
 
-static inline lf_pool_t *get_pool(lf_bcast_t *b) { return (lf_pool_t*)((char*)b + b->pool_off); }
+static inline lf_pool_t *get_pool(lf_bcast_t *b, size_t c) { return (lf_pool_t*)((char*)b + b->classes[c].pool_off); }
+
+// The size class of an element, found from where its pool lies in the region
+static inline size_t class_of(lf_bcast_t *b, const void *buf)
+{
+  size_t off = (size_t)((const char*)buf - (const char*)b);
+  size_t c = b->nclasses - 1;
+  while (c > 0 && off < b->classes[c].pool_off) c--;
+  return c;
+}
+
+static inline void release_buf(lf_bcast_t *b, void *buf)
+{
+  lf_pool_release(get_pool(b, class_of(b, buf)), buf);
+}
+
+// Pin counts: ref is the tuple (tag=queue_idx the element was published at, val=count|PIN_DROPPED).
+// PIN_DROPPED is set once the element leaves the queue: from then on it can't be pinned anymore,
+// and whoever takes the count to zero returns it to the pool.
+#define PIN_DROPPED (1ul<<63)
+
+static inline lf_ref_t *get_pin(lf_bcast_t *b, const void *buf)
+{
+  size_t c = class_of(b, buf);
+  lf_ref_t *pins = (lf_ref_t*)((char*)b + b->classes[c].pins_off);
+  return &pins[lf_pool_index(get_pool(b, c), buf)];
+}
+
+// The status record of a registered subscriber: its position, for lossless publishers to wait on,
+// and what tools need to tell how it's doing. Only the subscriber writes it, after each consume
+typedef struct cursor cursor_t;
+struct __attribute__((aligned(CACHE_LINE_SZ))) cursor
+{
+  u64  pid;       // Process of the subscriber, 0 if the cursor is free
+  u64  idx;       // Next index the subscriber will consume, UINT64_MAX until it's known
+  u64  drops;     // See lf_bcast_sub_drops()
+  u64  skipped;   // See lf_bcast_sub_skipped()
+  i64  last_ns;   // Wallclock of its last consume
+  u64  lossless;  // Whether lossless publishers wait for it
+  char name[LF_BCAST_NAME_LEN];
+};
+static_assert(sizeof(cursor_t) == CACHE_LINE_SZ, "");
+
+static inline cursor_t *get_cursors(lf_bcast_t *b) { return (cursor_t*)((char*)b + b->cursors_off); }
+
+// Lay out the region: the header, the queue slots, the pin counts of every class, the cursors
+// and finally the pools, smallest class first. Returns false if the parameters are invalid
+static bool layout(size_t depth, const lf_bcast_class_t *classes, size_t nclasses, size_t elt_align,
+                   pool_class_t *out, size_t *_cursors_off, size_t *_size)
+{
+  if (!LF_IS_POW2(depth)) return false;
+  if (nclasses == 0 || nclasses > LF_BCAST_MAX_CLASSES) return false;
+
+  size_t off = sizeof(lf_bcast_t) + depth * sizeof(lf_ref_t);
+  for (size_t i = 0; i < nclasses; i++) {
+    if (classes[i].num_elts == 0) return false;
+    if (i > 0 && classes[i].elt_sz <= classes[i-1].elt_sz) return false;
+    out[i].elt_sz = classes[i].elt_sz;
+    out[i].num_elts = classes[i].num_elts;
+    out[i].pins_off = off;
+    off += classes[i].num_elts * sizeof(lf_ref_t);
+  }
+
+  off = LF_ALIGN_UP(off, alignof(cursor_t));
+  *_cursors_off = off;
+  off += LF_BCAST_MAX_CURSORS * sizeof(cursor_t);
+
+  for (size_t i = 0; i < nclasses; i++) {
+    size_t pool_size, pool_align;
+    if (!lf_pool_footprint(classes[i].num_elts, classes[i].elt_sz, elt_align, &pool_size, &pool_align)) {
+      return false;
+    }
+    off = LF_ALIGN_UP(off, pool_align);
+    out[i].pool_off = off;
+    off += pool_size;
+  }
+
+  *_size = off;
+  return true;
+}
+
+// Publish the subscriber's position and status, if it registered a cursor
+static inline void update_cursor(sub_impl_t *sub)
+{
+  u32 cursor = __atomic_load_n(&sub->cursor, __ATOMIC_ACQUIRE);
+  if (!cursor) return;
+  cursor_t *c = &get_cursors(sub->bcast)[cursor-1];
+  __atomic_store_n(&c->drops, sub->drops, __ATOMIC_RELAXED);
+  __atomic_store_n(&c->skipped, sub->skipped, __ATOMIC_RELAXED);
+  __atomic_store_n(&c->last_ns, wallclock(), __ATOMIC_RELAXED);
+  __atomic_store_n(&c->idx, sub->idx, __ATOMIC_RELEASE);
+}
+
+// Free the cursor of a process that died without unregistering. Returns false if it's alive
+static bool free_if_dead(cursor_t *c, u64 pid)
+{
+  if (kill((pid_t)pid, 0) == 0 || errno != ESRCH) return false;
+  if (LF_U64_CAS(&c->pid, pid, 0)) __atomic_store_n(&c->idx, UINT64_MAX, __ATOMIC_RELEASE);
+  return true;
+}
+
+// Whether a live lossless subscriber has yet to consume the element at 'idx'. The cursors of
+// processes that died without unregistering are freed along the way
+static bool cursor_behind(lf_bcast_t *b, u64 idx)
+{
+  cursor_t *cursors = get_cursors(b);
+  for (size_t i = 0; i < LF_BCAST_MAX_CURSORS; i++) {
+    cursor_t *c = &cursors[i];
+    u64 pid = LF_ATOMIC_LOAD_ACQUIRE(&c->pid);
+    if (!pid || !LF_ATOMIC_LOAD_ACQUIRE(&c->lossless)) continue;
+    if (LF_ATOMIC_LOAD_ACQUIRE(&c->idx) > idx) continue;
+    if (free_if_dead(c, pid)) continue;
+    return true;
+  }
+  return false;
+}
 
 // Determine the futex wait addresss (depending on endianness)
 static inline uint32_t *wait_addr(lf_bcast_t *b)
@@ -97,17 +229,22 @@ static void wait(sub_impl_t *sub, int64_t *_timeout)
     .tv_nsec = timeout % (int64_t)1e9,
   };
 
+  // Publishers skip the wakeup unless they see a waiter. They advance the tail before
+  // checking, and we register before the kernel compares it: one of us sees the other
   uint32_t   val  = (uint32_t)sub->idx;
   uint32_t * addr = wait_addr(sub->bcast);
+  __atomic_add_fetch(&sub->bcast->waiters, 1, __ATOMIC_SEQ_CST);
   futex_wait(addr, val, tm);
+  __atomic_sub_fetch(&sub->bcast->waiters, 1, __ATOMIC_SEQ_CST);
 
   int64_t dt = wallclock() - start;
   *_timeout = dt < timeout ? timeout - dt : 0;
 }
 
-// Wake up all waiters
+// Wake up all waiters, if there are any
 static void wake(lf_bcast_t *bcast)
 {
+  if (__atomic_load_n(&bcast->waiters, __ATOMIC_SEQ_CST) == 0) return;
   futex_wake(wait_addr(bcast), INT32_MAX);
 }
 
@@ -152,36 +289,67 @@ static void *dequeue_head(lf_bcast_t *b, u64 head_idx)
   return buf;
 }
 
+// Mark an element that was just dequeued from 'idx' as dropped. Returns false if it's pinned, in
+// which case the last lf_bcast_unpin() releases it and the caller must not reuse it
+static bool drop_pinned(lf_bcast_t *b, void *buf, u64 idx)
+{
+  lf_ref_t *pin = get_pin(b, buf);
+  while (1) {
+    lf_ref_t cur = *pin;
+    LF_BARRIER_ACQUIRE();
+
+    // Pins only ever match the index the element was published at
+    if (cur.tag != idx || (cur.val & PIN_DROPPED)) return true;
+
+    if (!LF_REF_CAS(pin, cur, LF_REF_MAKE(idx, cur.val | PIN_DROPPED))) {
+      LF_PAUSE();
+      continue;
+    }
+    return cur.val == 0;
+  }
+}
+
 static void try_drop_head(lf_bcast_t *b, u64 head_idx)
 {
   void *buf = dequeue_head(b, head_idx);
   if (!buf) return;
-  lf_pool_release(get_pool(b), buf);
+  if (drop_pinned(b, buf, head_idx)) release_buf(b, buf);
 }
 
-void lf_bcast_pub(lf_bcast_t *b, void *buf)
+// Publish 'n' buffers, in order, to the tail of the queue. Returns how many were published: fewer than
+// 'n' only if a lossless publish had to give up
+static size_t pub_impl(lf_bcast_t *b, void *const *bufs, size_t n, bool lossless)
 {
-  // Compute the buffer offset with sanity checks
-  assert((char*)buf > (char*)b && "invalid buffer");
-  u64 buf_off = (char*)buf - (char*)b;
+  size_t done = 0;
+  u64    tail_idx = b->tail_idx;  // Where we're trying to append: ahead of the shared tail during a batch
+  u64    end_idx = 0;             // Index past the last buffer we appended
+
+  while (done < n) {
+    // Compute the buffer offset with sanity checks
+    void *buf = bufs[done];
+    assert((char*)buf > (char*)b && "invalid buffer");
+    u64 buf_off = (char*)buf - (char*)b;
+    lf_ref_t *pin = get_pin(b, buf);
 
-  while (1) {
     // Start of the trial: load all the shared state to the local stack
     u64        head_idx = b->head_idx;
-    u64        tail_idx = b->tail_idx;
     lf_ref_t * tail_ptr = &b->slots[tail_idx & b->depth_mask];
     lf_ref_t   tail_cur = *tail_ptr;
     LF_BARRIER_ACQUIRE();
 
-    // Stale tail pointer? Try to advance it and try again..
+    // Slot already appended at this index? Move on to the next one. Outside of a batch, also
+    // try to advance the shared tail past it
     if (tail_cur.tag == tail_idx) {
-      LF_U64_CAS(&b->tail_idx, tail_idx, tail_idx+1);
+      if (end_idx == 0) LF_U64_CAS(&b->tail_idx, tail_idx, tail_idx+1);
+      tail_idx++;
       LF_PAUSE();
       continue;
     }
 
-    // Stale tail_idx? Try again..
-    if (tail_cur.tag >= tail_idx) {
+    // Stale tail_idx? Reload it and try again..
+    if (tail_cur.tag > tail_idx) {
+      u64 shared_tail = b->tail_idx;
+      tail_idx = shared_tail > tail_idx ? shared_tail : tail_idx + 1;
       LF_PAUSE();
       continue;
     }
@@ -189,12 +357,18 @@ void lf_bcast_pub(lf_bcast_t *b, void *buf)
     // Slot currently used. Queue is full. Roll off the head and try again..
     if (head_idx <= tail_cur.tag) {
       assert(head_idx == tail_cur.tag);
+      if (lossless && cursor_behind(b, head_idx)) break;
       try_drop_head(b, head_idx);
       LF_PAUSE();
       continue;
     }
 
     // All the queue consistency checks and corrections passed. Try to append the tail.
+    // First make the element pinnable at the index we're about to publish it at. The tag goes
+    // first: until then the stale pins of a previous use still carry PIN_DROPPED
+    __atomic_store_n(&pin->tag, tail_idx, __ATOMIC_RELAXED);
+    __atomic_store_n(&pin->val, 0, __ATOMIC_RELEASE);
+
     // So far so good, try to append the tail
     lf_ref_t tail_next = LF_REF_MAKE(tail_idx, buf_off);
     if (!LF_REF_CAS(tail_ptr, tail_cur, tail_next)) {
@@ -202,20 +376,52 @@ void lf_bcast_pub(lf_bcast_t *b, void *buf)
       continue; // Some other core beat us.. try again..
     }
 
-    // At this point, the enqueue is successfull (committed). We still have to bump the
-    // tail_idx forward and wake any waiter so all consumers can receive it.
-    // NOTE: This CAS can fail if another publish races us. The reason we have others fix up the
-    // tail index is that we could crash right here and leave the queue in an inconsistent
-    // state. But, if they can do a fixup then the queue is fully crash-proof :-)
-    // Thus, we try to do the update and don't check the result: it might fail and that's fine.
-    LF_U64_CAS(&b->tail_idx, tail_idx, tail_idx+1);
+    // At this point, the enqueue is successfull (committed). Carry on with the rest of the batch
+    // right after it, without making it visible yet
+    done++;
+    tail_idx++;
+    end_idx = tail_idx;
+  }
 
-    // Wake up all consumers
-    wake(b);
+  if (end_idx == 0) return done;
 
-    // All done
-    return;
+  // We still have to bump the tail_idx forward and wake any waiter so all consumers can receive the
+  // buffers. Every index up to end_idx has been appended, by us or others, so it can jump there at once.
+  // NOTE: The CAS can fail if another publish races us. The reason we have others fix up the
+  // tail index is that we could crash right here and leave the queue in an inconsistent
+  // state. But, if they can do a fixup then the queue is fully crash-proof :-)
+  // Thus, we only retry while the tail is behind ours: others moving it further is fine.
+  while (1) {
+    u64 cur = b->tail_idx;
+    if (cur >= end_idx || LF_U64_CAS(&b->tail_idx, cur, end_idx)) break;
+    LF_PAUSE();
   }
+
+  // Wake up all consumers
+  wake(b);
+
+  // All done
+  return done;
+}
+
+void lf_bcast_pub(lf_bcast_t *b, void *buf)
+{
+  pub_impl(b, &buf, 1, false);
+}
+
+bool lf_bcast_try_pub(lf_bcast_t *b, void *buf)
+{
+  return pub_impl(b, &buf, 1, true) == 1;
+}
+
+void lf_bcast_pub_n(lf_bcast_t *b, void *const *bufs, size_t n)
+{
+  pub_impl(b, bufs, n, false);
+}
+
+size_t lf_bcast_try_pub_n(lf_bcast_t *b, void *const *bufs, size_t n)
+{
+  return pub_impl(b, bufs, n, true);
 }
 
 void lf_bcast_sub_init(lf_bcast_sub_t *_sub, lf_bcast_t *b)
@@ -226,12 +432,129 @@ void lf_bcast_sub_init(lf_bcast_sub_t *_sub, lf_bcast_t *b)
   sub->idx = b->tail_idx;
 }
 
+uint64_t lf_bcast_tail(lf_bcast_t *b)
+{
+  return LF_ATOMIC_LOAD_ACQUIRE(&b->tail_idx);
+}
+
+void lf_bcast_sub_skip(lf_bcast_sub_t *_sub, uint64_t idx)
+{
+  sub_impl_t *sub = (sub_impl_t*)_sub;
+  assert(!sub->active);
+  if (sub->idx >= idx) return;
+  sub->idx = idx;
+  update_cursor(sub);
+}
+
+bool lf_bcast_sub_register(lf_bcast_sub_t *sub)
+{
+  return lf_bcast_sub_register_named(sub, NULL, true);
+}
+
+bool lf_bcast_sub_register_named(lf_bcast_sub_t *_sub, const char *name, bool lossless)
+{
+  sub_impl_t *sub = (sub_impl_t*)_sub;
+  lf_bcast_t *b   = sub->bcast;
+  if (sub->cursor) return true;
+
+  cursor_t *cursors = get_cursors(b);
+  u64 pid = (u64)getpid();
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; i < LF_BCAST_MAX_CURSORS; i++) {
+      cursor_t *c = &cursors[i];
+      if (!LF_U64_CAS(&c->pid, 0, pid)) continue;
+
+      memset(c->name, 0, sizeof(c->name));
+      if (name) strncpy(c->name, name, sizeof(c->name) - 1);
+      __atomic_store_n(&c->drops, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&c->skipped, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&c->last_ns, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&c->lossless, (u64)lossless, __ATOMIC_RELAXED);
+
+      // Start from where the subscriber will read next. Anything older, it never reads, so
+      // holding on to it would stall lossless publishers for good
+      __atomic_store_n(&c->idx, sub->idx, __ATOMIC_RELEASE);
+      __atomic_store_n(&sub->cursor, (u32)i+1, __ATOMIC_RELEASE);
+      return true;
+    }
+
+    // All taken: free the ones of dead processes and try again
+    for (size_t i = 0; i < LF_BCAST_MAX_CURSORS; i++) {
+      u64 other = LF_ATOMIC_LOAD_ACQUIRE(&cursors[i].pid);
+      if (other) free_if_dead(&cursors[i], other);
+    }
+  }
+  return false;
+}
+
+void lf_bcast_sub_unregister(lf_bcast_sub_t *_sub)
+{
+  sub_impl_t *sub = (sub_impl_t*)_sub;
+  u32 cursor = sub->cursor;
+  if (!cursor) return;
+
+  __atomic_store_n(&sub->cursor, 0, __ATOMIC_RELEASE);
+  cursor_t *c = &get_cursors(sub->bcast)[cursor-1];
+  __atomic_store_n(&c->idx, UINT64_MAX, __ATOMIC_RELEASE);
+  __atomic_store_n(&c->pid, 0, __ATOMIC_RELEASE);
+}
+
+size_t lf_bcast_sub_statuses(lf_bcast_t *b, lf_bcast_sub_status_t *out, size_t max)
+{
+  cursor_t *cursors = get_cursors(b);
+  size_t n = 0;
+  for (size_t i = 0; i < LF_BCAST_MAX_CURSORS && n < max; i++) {
+    cursor_t *c = &cursors[i];
+    u64 pid = LF_ATOMIC_LOAD_ACQUIRE(&c->pid);
+    if (!pid) continue;
+
+    lf_bcast_sub_status_t *st = &out[n++];
+    st->id = (uint32_t)i;
+    st->pid = pid;
+    st->idx = LF_ATOMIC_LOAD_ACQUIRE(&c->idx);
+    st->drops = LF_ATOMIC_LOAD_ACQUIRE(&c->drops);
+    st->skipped = LF_ATOMIC_LOAD_ACQUIRE(&c->skipped);
+    st->last_consume_ns = LF_ATOMIC_LOAD_ACQUIRE(&c->last_ns);
+    st->lossless = !!LF_ATOMIC_LOAD_ACQUIRE(&c->lossless);
+    memcpy(st->name, c->name, sizeof(st->name));
+    st->name[sizeof(st->name) - 1] = 0;
+  }
+  return n;
+}
+
+void lf_bcast_stats(lf_bcast_t *b, lf_bcast_stats_t *stats)
+{
+  memset(stats, 0, sizeof(*stats));
+  stats->depth = b->depth_mask + 1;
+  stats->head_idx = LF_ATOMIC_LOAD_ACQUIRE(&b->head_idx);
+  stats->tail_idx = LF_ATOMIC_LOAD_ACQUIRE(&b->tail_idx);
+  stats->nclasses = b->nclasses;
+  for (size_t c = 0; c < b->nclasses && c < LF_BCAST_MAX_CLASSES; c++) {
+    stats->classes[c].elt_sz = b->classes[c].elt_sz;
+    stats->classes[c].num_elts = b->classes[c].num_elts;
+    stats->classes[c].num_free = lf_pool_num_free(get_pool(b, c));
+  }
+}
+
 uint64_t lf_bcast_sub_drops(lf_bcast_sub_t *_sub)
 {
   sub_impl_t *sub = (sub_impl_t*)_sub;
   return sub->drops;
 }
 
+void lf_bcast_sub_set_catchup(lf_bcast_sub_t *_sub, uint64_t behind, uint64_t keep)
+{
+  sub_impl_t *sub = (sub_impl_t*)_sub;
+  sub->behind = behind;
+  sub->keep = keep < behind ? keep : behind;
+}
+
+uint64_t lf_bcast_sub_skipped(lf_bcast_sub_t *_sub)
+{
+  sub_impl_t *sub = (sub_impl_t*)_sub;
+  return sub->skipped;
+}
+
 const void *lf_bcast_sub_consume_begin(lf_bcast_sub_t *_sub, int64_t timeout)
 {
   sub_impl_t *sub = (sub_impl_t*)_sub;
@@ -242,6 +565,14 @@ const void *lf_bcast_sub_consume_begin(lf_bcast_sub_t *_sub, int64_t timeout)
   while (1) {
     u64 tail_idx = b->tail_idx;
     LF_BARRIER_ACQUIRE();
+
+    // Too far behind? Jump to the newest elements rather than walk through the stale ones
+    if (sub->behind && sub->idx < tail_idx && tail_idx - sub->idx > sub->behind) {
+      u64 idx = tail_idx - sub->keep;
+      sub->skipped += idx - sub->idx;
+      sub->idx = idx;
+    }
+
     if (sub->idx == tail_idx) {
       if (timeout > 0) { /* wait for a wakeup? */
         wait(sub, &timeout);
@@ -266,7 +597,7 @@ const void *lf_bcast_sub_consume_begin(lf_bcast_sub_t *_sub, int64_t timeout)
     u64    buf_off = ref.val;
     void * buf     = (char*)b + buf_off;
 
-    sub->active = true;
+    sub->active = 1;
     return buf;
   }
 }
@@ -274,7 +605,7 @@ const void *lf_bcast_sub_consume_begin(lf_bcast_sub_t *_sub, int64_t timeout)
 bool lf_bcast_sub_consume_end(lf_bcast_sub_t *_sub)
 {
    sub_impl_t *sub = (sub_impl_t*)_sub;
-   assert(sub->active);
+   assert(sub->active == 1);
 
    // We need to check if the buffer we returned in lf_bcast_sub_consume_begin() could have
    // changed while the user was consuming it. The roll-off procedure is just an increment
@@ -286,107 +617,293 @@ bool lf_bcast_sub_consume_end(lf_bcast_sub_t *_sub)
    }
 
    sub->idx++;
-   sub->active = false;
+   sub->active = 0;
+   update_cursor(sub);
    return valid;
 }
 
-void * lf_bcast_buf_acquire(lf_bcast_t *b)
+size_t lf_bcast_sub_consume_begin_n(lf_bcast_sub_t *_sub, int64_t timeout, const void **bufs, size_t max)
+{
+  sub_impl_t *sub = (sub_impl_t*)_sub;
+  lf_bcast_t *b   = sub->bcast;
+  if (max == 0) return 0;
+
+  // Wait for the first one as usual, then extend the run to what's already been published
+  const void *buf = lf_bcast_sub_consume_begin(_sub, timeout);
+  if (!buf) return 0;
+  bufs[0] = buf;
+
+  u64 tail_idx = LF_ATOMIC_LOAD_ACQUIRE(&b->tail_idx);
+  size_t n = 1;
+  while (n < max && n < UINT32_MAX && sub->idx + n < tail_idx) {
+    lf_ref_t ref = b->slots[(sub->idx + n) & b->depth_mask];
+    LF_BARRIER_ACQUIRE();
+    if (ref.tag != sub->idx + n) break; // Already rolled off: the run ends here
+    bufs[n++] = (char*)b + ref.val;
+  }
+
+  sub->active = (u32)n;
+  return n;
+}
+
+size_t lf_bcast_sub_consume_end_n(lf_bcast_sub_t *_sub)
+{
+  sub_impl_t *sub = (sub_impl_t*)_sub;
+  size_t n = sub->active;
+  assert(n > 0);
+
+  // Elements roll off in order, so the ones that were reclaimed are at the start of the run
+  LF_BARRIER_ACQUIRE();
+  u64 head_idx = LF_ATOMIC_LOAD_ACQUIRE(&sub->bcast->head_idx);
+  size_t invalid = 0;
+  if (head_idx > sub->idx) invalid = head_idx - sub->idx < n ? head_idx - sub->idx : n;
+  sub->drops += invalid;
+
+  sub->idx += n;
+  sub->active = 0;
+  update_cursor(sub);
+  return invalid;
+}
+
+bool lf_bcast_sub_consume_borrow(lf_bcast_sub_t *_sub, bool pin, uint64_t *_idx)
+{
+  sub_impl_t *sub = (sub_impl_t*)_sub;
+  assert(sub->active == 1);
+
+  u64 idx = sub->idx;
+  lf_ref_t ref = sub->bcast->slots[idx & sub->bcast->depth_mask];
+  LF_BARRIER_ACQUIRE();
+  const void *buf = (char*)sub->bcast + ref.val;
+
+  sub->idx++;
+  sub->active = 0;
+  update_cursor(sub);
+
+  // Rolled off before we could pin it? Count it as a drop
+  if (pin && (ref.tag != idx || !lf_bcast_pin(sub->bcast, buf, idx))) {
+    sub->drops++;
+    return false;
+  }
+
+  *_idx = idx;
+  return true;
+}
+
+const void *lf_bcast_sub_borrow(lf_bcast_sub_t *sub, int64_t timeout, bool pin, uint64_t *_idx)
+{
+  while (1) {
+    const void *buf = lf_bcast_sub_consume_begin(sub, timeout);
+    if (!buf) return NULL;
+    if (lf_bcast_sub_consume_borrow(sub, pin, _idx)) return buf;
+  }
+}
+
+bool lf_bcast_valid(lf_bcast_t *b, uint64_t idx)
+{
+  // Order the reads of the element before the read of the head
+  LF_BARRIER_ACQUIRE();
+  return idx >= LF_ATOMIC_LOAD_ACQUIRE(&b->head_idx);
+}
+
+bool lf_bcast_pin(lf_bcast_t *b, const void *buf, uint64_t idx)
+{
+  lf_ref_t *pin = get_pin(b, buf);
+  while (1) {
+    lf_ref_t cur = *pin;
+    LF_BARRIER_ACQUIRE();
+
+    // Republished or already off the queue?
+    if (cur.tag != idx || (cur.val & PIN_DROPPED)) return false;
+
+    if (!LF_REF_CAS(pin, cur, LF_REF_MAKE(idx, cur.val + 1))) {
+      LF_PAUSE();
+      continue;
+    }
+    return true;
+  }
+}
+
+void lf_bcast_unpin(lf_bcast_t *b, const void *buf, uint64_t idx)
+{
+  lf_ref_t *pin = get_pin(b, buf);
+  while (1) {
+    lf_ref_t cur = *pin;
+    LF_BARRIER_ACQUIRE();
+    assert(cur.tag == idx && (cur.val & ~PIN_DROPPED) > 0);
+
+    lf_ref_t next = LF_REF_MAKE(idx, cur.val - 1);
+    if (!LF_REF_CAS(pin, cur, next)) {
+      LF_PAUSE();
+      continue;
+    }
+
+    // Last pin of an element that already left the queue: nobody else will release it
+    if (next.val == PIN_DROPPED) release_buf(b, (void*)buf);
+    return;
+  }
+}
+
+static void * acquire_impl(lf_bcast_t *b, size_t sz, bool lossless)
 {
   void *elt;
 
+  // The smallest class the element fits in
+  size_t first = 0;
+  while (first < b->nclasses && b->classes[first].elt_sz < sz) first++;
+  if (first == b->nclasses) return NULL;
+
   // Try aquiring from pool or queue until both seem empty.
   while (1) {
-    // Try to get a buffer from the pool
-    elt = lf_pool_acquire(get_pool(b));
-    if (elt) return elt;
+    // Try to get a buffer from the pools, preferring the smallest elements that fit
+    for (size_t c = first; c < b->nclasses; c++) {
+      elt = lf_pool_acquire(get_pool(b, c));
+      if (elt) return elt;
+    }
 
-    // Pool empty.. chck if the queue has any elements..
+    // Pools empty.. chck if the queue has any elements..
     size_t head_idx = b->head_idx;
     size_t tail_idx = b->tail_idx;
     LF_BARRIER_ACQUIRE();
     if (head_idx == tail_idx) return NULL; // Both queue and pool are empty..
+    if (lossless && cursor_behind(b, head_idx)) return NULL; // Head still needed..
 
-    // Try to get a buffer from the queue head
+    // Try to get a buffer from the queue head, unless a subscriber still has it pinned. If it's
+    // too small, return it to its pool and keep rolling off the queue
     elt = dequeue_head(b, head_idx);
-    if (elt) return elt;
+    if (!elt || !drop_pinned(b, elt, head_idx)) continue;
+    if (class_of(b, elt) >= first) return elt;
+    release_buf(b, elt);
   }
 }
 
+void * lf_bcast_buf_acquire(lf_bcast_t *b)
+{
+  return acquire_impl(b, b->classes[b->nclasses-1].elt_sz, false);
+}
+
+void * lf_bcast_buf_try_acquire(lf_bcast_t *b)
+{
+  return acquire_impl(b, b->classes[b->nclasses-1].elt_sz, true);
+}
+
+void * lf_bcast_buf_acquire_sz(lf_bcast_t *b, size_t sz)
+{
+  return acquire_impl(b, sz, false);
+}
+
+void * lf_bcast_buf_try_acquire_sz(lf_bcast_t *b, size_t sz)
+{
+  return acquire_impl(b, sz, true);
+}
+
+size_t lf_bcast_buf_size(lf_bcast_t *b, const void *ptr)
+{
+  return b->classes[class_of(b, ptr)].elt_sz;
+}
+
 void lf_bcast_buf_release(lf_bcast_t *b, void *ptr)
 {
-  lf_pool_release(get_pool(b), ptr);
+  release_buf(b, ptr);
 }
 
 bool lf_bcast_footprint(size_t depth, size_t elt_sz, size_t elt_align, size_t *_size, size_t *_align)
 {
-  if (!LF_IS_POW2(depth)) return false;
+  lf_bcast_class_t cls = { elt_sz, depth };
+  return lf_bcast_footprint_classes(depth, &cls, 1, elt_align, _size, _align);
+}
 
-  size_t pool_size, pool_align;
-  if (!lf_pool_footprint(depth, elt_sz, elt_align, &pool_size, &pool_align)) {
+bool lf_bcast_footprint_classes(size_t depth, const lf_bcast_class_t *classes, size_t nclasses,
+                                size_t elt_align, size_t *_size, size_t *_align)
+{
+  pool_class_t layout_classes[LF_BCAST_MAX_CLASSES];
+  size_t cursors_off, size;
+  if (!layout(depth, classes, nclasses, elt_align, layout_classes, &cursors_off, &size)) {
     return false;
   }
 
-  size_t size = sizeof(lf_bcast_t);
-  size += depth * sizeof(lf_ref_t);
-  size = LF_ALIGN_UP(size, pool_align);
-  size += pool_size;
-
   if (_size)  *_size  = size;
   if (_align) *_align = alignof(lf_bcast_t);
   return true;
 }
 
 lf_bcast_t * lf_bcast_mem_init(void *mem, size_t depth, size_t elt_sz, size_t elt_align)
+{
+  lf_bcast_class_t cls = { elt_sz, depth };
+  return lf_bcast_mem_init_classes(mem, depth, &cls, 1, elt_align);
+}
+
+lf_bcast_t * lf_bcast_mem_init_classes(void *mem, size_t depth, const lf_bcast_class_t *classes,
+                                       size_t nclasses, size_t elt_align)
 {
   /* Sanity check the parameters */
-  if (!lf_bcast_footprint(depth, elt_sz, elt_align, NULL, NULL)) {
+  lf_bcast_t *b = (lf_bcast_t*)mem;
+  size_t size;
+  if (!layout(depth, classes, nclasses, elt_align, b->classes, &b->cursors_off, &size)) {
     return NULL;
   }
 
-  size_t pool_size, pool_align;
-  lf_pool_footprint(depth, elt_sz, elt_align, &pool_size, &pool_align);
-
-  size_t size     = sizeof(lf_bcast_t) + depth * sizeof(lf_ref_t);
-  size_t pool_off = LF_ALIGN_UP(size, pool_align);
-  void * pool_mem = (char*)mem + pool_off;
-
-  lf_bcast_t *b = (lf_bcast_t*)mem;
   b->depth_mask = depth-1;
-  b->elt_sz = elt_sz;
   b->head_idx = 1; /* Start from 1 because we use 0 to mean "unused" */
   b->tail_idx = 1; /* Start from 1 because we use 0 to mean "unused" */
-  b->pool_off = pool_off;
+  b->waiters = 0;
+  b->nclasses = nclasses;
 
   memset(b->slots, 0, depth * sizeof(lf_ref_t));
 
-  lf_pool_t *pool = lf_pool_mem_init(pool_mem, depth, elt_sz, elt_align);
-  if (!pool) return NULL;
-  assert(pool == pool_mem);
+  cursor_t *cursors = get_cursors(b);
+  for (size_t i = 0; i < LF_BCAST_MAX_CURSORS; i++) {
+    cursors[i].pid = 0;
+    cursors[i].idx = UINT64_MAX;
+  }
+
+  for (size_t c = 0; c < nclasses; c++) {
+    pool_class_t *cls = &b->classes[c];
+    lf_ref_t *pins = (lf_ref_t*)((char*)mem + cls->pins_off);
+    for (size_t i = 0; i < cls->num_elts; i++) pins[i] = LF_REF_MAKE(0, PIN_DROPPED);
+
+    void *pool_mem = (char*)mem + cls->pool_off;
+    lf_pool_t *pool = lf_pool_mem_init(pool_mem, cls->num_elts, cls->elt_sz, elt_align);
+    if (!pool) return NULL;
+    assert(pool == pool_mem);
+  }
 
   return b;
 }
 
 lf_bcast_t * lf_bcast_mem_join(void *mem, size_t depth, size_t elt_sz, size_t elt_align)
+{
+  lf_bcast_class_t cls = { elt_sz, depth };
+  return lf_bcast_mem_join_classes(mem, depth, &cls, 1, elt_align);
+}
+
+lf_bcast_t * lf_bcast_mem_join_classes(void *mem, size_t depth, const lf_bcast_class_t *classes,
+                                       size_t nclasses, size_t elt_align)
 {
   /* Sanity check the parameters */
-  if (!lf_bcast_footprint(depth, elt_sz, elt_align, NULL, NULL)) {
+  pool_class_t layout_classes[LF_BCAST_MAX_CLASSES];
+  size_t cursors_off, size;
+  if (!layout(depth, classes, nclasses, elt_align, layout_classes, &cursors_off, &size)) {
     return NULL;
   }
 
   lf_bcast_t *bcast = (lf_bcast_t *)mem;
   if (depth-1 != bcast->depth_mask) return NULL;
-  if (elt_sz != bcast->elt_sz) return NULL;
-
-  void * pool_mem = (char*)mem + bcast->pool_off;
-  lf_pool_t * pool = lf_pool_mem_join(pool_mem, depth, elt_sz, elt_align);
-  if (!pool) return NULL;
-  assert(pool == pool_mem);
+  if (nclasses != bcast->nclasses) return NULL;
+  if (cursors_off != bcast->cursors_off) return NULL;
+  if (memcmp(layout_classes, bcast->classes, nclasses * sizeof(pool_class_t)) != 0) return NULL;
+
+  for (size_t c = 0; c < nclasses; c++) {
+    pool_class_t *cls = &bcast->classes[c];
+    void * pool_mem = (char*)mem + cls->pool_off;
+    lf_pool_t * pool = lf_pool_mem_join(pool_mem, cls->num_elts, cls->elt_sz, elt_align);
+    if (!pool) return NULL;
+    assert(pool == pool_mem);
+  }
 
   return bcast;
 }
 
 void lf_bcast_mem_leave(lf_bcast_t *b)
 {
-  lf_pool_t *pool = get_pool(b);
-  lf_pool_mem_leave(pool);
+  for (size_t c = 0; c < b->nclasses; c++) lf_pool_mem_leave(get_pool(b, c));
 }
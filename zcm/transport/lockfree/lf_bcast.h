@@ -10,9 +10,25 @@ extern "C" {
 /*************************************************************************************************/
 /* Lockfree Bcast: multi-publisher broadcast to multi-consumer */
 
+/* Subscribers that can register their position for lossless publishers */
+#define LF_BCAST_MAX_CURSORS 64
+
+/* Element size classes a queue can draw its elements from */
+#define LF_BCAST_MAX_CLASSES 8
+
+/* Length of the name a subscriber registers under, including the NULL terminator */
+#define LF_BCAST_NAME_LEN 16
+
+typedef struct lf_bcast_class lf_bcast_class_t;
+struct lf_bcast_class
+{
+  size_t elt_sz;    /* Size of the elements of the class */
+  size_t num_elts;  /* Number of them in the class's pool */
+};
+
 typedef struct lf_bcast      lf_bcast_t;
 typedef struct lf_bcast_sub  lf_bcast_sub_t;
-struct __attribute__((aligned(16))) lf_bcast_sub { char _opaque[32]; };
+struct __attribute__((aligned(16))) lf_bcast_sub { char _opaque[64]; };
 
 /*************************************************************************************************/
 /* New/delete API */
@@ -22,9 +38,18 @@ void         lf_bcast_delete(lf_bcast_t *bcast);
 /*************************************************************************************************/
 /* Buffer pooling API */
 
-/* Acquire a buffer element from the internal shm object pool */
+/* Acquire a buffer element from the internal shm object pool. In a queue with several size classes,
+   the element comes from the largest class */
 void * lf_bcast_buf_acquire(lf_bcast_t *b);
 
+/* Acquire a buffer element of at least 'sz' bytes, from the smallest class that has one left. When
+   every class that fits is empty, elements are rolled off the head of the queue until one fits.
+   Returns NULL if 'sz' is larger than the largest class */
+void * lf_bcast_buf_acquire_sz(lf_bcast_t *b, size_t sz);
+
+/* The size of a buffer element, which is the size of its class */
+size_t lf_bcast_buf_size(lf_bcast_t *b, const void *ptr);
+
 /* Release a buffer element back to the internal shm object pool. This should only be called if
    the buffer will not be published. */
 void   lf_bcast_buf_release(lf_bcast_t *bcast, void *ptr);
@@ -39,6 +64,27 @@ void   lf_bcast_buf_release(lf_bcast_t *bcast, void *ptr);
    internal queue will call release when the buffer is no longer required. */
 void lf_bcast_pub(lf_bcast_t *b, void *buf);
 
+/* Publish 'n' buffers, in order, as with lf_bcast_pub(). They're appended at consecutive indices unless
+   publishes from other threads are interleaved with them, and this call then advances the tail past all
+   of them with a single wakeup. A concurrent publisher may advance the tail over some of them first, so
+   subscribers can see the start of a batch before the rest of it */
+void lf_bcast_pub_n(lf_bcast_t *b, void *const *bufs, size_t n);
+
+/*************************************************************************************************/
+/* Lossless publishing */
+
+/* Like lf_bcast_buf_acquire() and lf_bcast_pub(), except that they never roll off an element that a
+   registered subscriber (see lf_bcast_sub_register()) hasn't consumed yet. They return NULL and false
+   instead and the caller can retry later. On failure, lf_bcast_try_pub() leaves the buffer with the
+   caller. Registered subscribers whose process died are dropped as they're found */
+void * lf_bcast_buf_try_acquire(lf_bcast_t *b);
+void * lf_bcast_buf_try_acquire_sz(lf_bcast_t *b, size_t sz);
+bool   lf_bcast_try_pub(lf_bcast_t *b, void *buf);
+
+/* Batch flavor of lf_bcast_try_pub(): returns how many of the buffers, from the first, were published.
+   The caller keeps the others */
+size_t lf_bcast_try_pub_n(lf_bcast_t *b, void *const *bufs, size_t n);
+
 /*************************************************************************************************/
 /* Subscribing */
 
@@ -47,11 +93,36 @@ void lf_bcast_pub(lf_bcast_t *b, void *buf);
    reading the shared bcast queue. */
 void  lf_bcast_sub_init(lf_bcast_sub_t *sub, lf_bcast_t *b);
 
+/* The index the next published element will get */
+uint64_t lf_bcast_tail(lf_bcast_t *b);
+
+/* Move the subscriber forward to idx, typically an earlier lf_bcast_tail(), skipping what was
+   published before it without counting it as dropped */
+void  lf_bcast_sub_skip(lf_bcast_sub_t *sub, uint64_t idx);
+
+/* Register the subscriber's position in the shared region, so that lossless publishers wait for it
+   to consume elements rather than roll them off. The subscriber must keep consuming or publishers
+   stall. Returns false if all LF_BCAST_MAX_CURSORS are taken by live processes */
+bool  lf_bcast_sub_register(lf_bcast_sub_t *sub);
+void  lf_bcast_sub_unregister(lf_bcast_sub_t *sub);
+
+/* Register a status record for the subscriber, under 'name' (truncated, may be NULL), which
+   lf_bcast_sub_statuses() reports. Publishers only wait for it if 'lossless' is set: as with
+   lf_bcast_sub_register(), which is the same with no name and 'lossless' set */
+bool  lf_bcast_sub_register_named(lf_bcast_sub_t *sub, const char *name, bool lossless);
+
 /* Return the number of drops the sub has experienced. If the consumer is too slow, elements it's
    interested will be reclaimed and rewritten. When the consumer tries to read them, it will discover
    they are missing and count them as a drop. */
 uint64_t lf_bcast_sub_drops(lf_bcast_sub_t *sub);
 
+/* Set the catch-up policy of the subscriber: whenever it finds itself more than 'behind' elements
+   behind the tail of the queue, it jumps ahead to the 'keep' newest ones (at most 'behind'),
+   instead of walking through elements that are stale or already reclaimed. 'behind' of 0, the
+   default, never jumps. The elements jumped over are counted by lf_bcast_sub_skipped(), not as drops */
+void     lf_bcast_sub_set_catchup(lf_bcast_sub_t *sub, uint64_t behind, uint64_t keep);
+uint64_t lf_bcast_sub_skipped(lf_bcast_sub_t *sub);
+
 /* Begin consuming the next buffer in the queue. If no buffer is available, wait up to 'timeout' nanos.
    If available, return a pointer to the buffer.
 
@@ -69,6 +140,83 @@ const void * lf_bcast_sub_consume_begin(lf_bcast_sub_t *sub, int64_t timeout);
    be incorrect to use the data if this function returns 'false'. */
 bool lf_bcast_sub_consume_end(lf_bcast_sub_t *sub);
 
+/* Begin consuming a run of up to 'max' consecutive buffers: waits for the first one like
+   lf_bcast_sub_consume_begin() and adds the ones already published behind it. Returns the number of
+   buffers stored to 'bufs', 0 if none arrived in time. The same precautions apply to all of them */
+size_t lf_bcast_sub_consume_begin_n(lf_bcast_sub_t *sub, int64_t timeout, const void **bufs, size_t max);
+
+/* Finish consuming a run with a single validation. Buffers are reclaimed oldest first, so the ones that
+   didn't remain valid are at the start of the run: returns how many, and counts them as drops. The
+   data read from the others can be used */
+size_t lf_bcast_sub_consume_end_n(lf_bcast_sub_t *sub);
+
+/*************************************************************************************************/
+/* Zero-copy subscribing */
+
+/* Like lf_bcast_sub_consume_begin() followed right away by lf_bcast_sub_consume_end(), except that
+   the buffer isn't validated: the caller keeps reading it in place, possibly while borrowing more
+   buffers, and checks afterwards with lf_bcast_valid() that it wasn't reclaimed in the meantime.
+   '*_idx' is set to the queue index of the buffer.
+
+   If 'pin' is set, the buffer is also pinned with lf_bcast_pin(), skipping buffers that are
+   reclaimed before that succeeds, and must be released with lf_bcast_unpin() */
+const void * lf_bcast_sub_borrow(lf_bcast_sub_t *sub, int64_t timeout, bool pin, uint64_t *_idx);
+
+/* The second half of lf_bcast_sub_borrow(), for a buffer obtained with lf_bcast_sub_consume_begin(): finish
+   consuming it without validating it. Returns false, counting a drop, if it had to be pinned and was
+   reclaimed first; the consume is over either way */
+bool lf_bcast_sub_consume_borrow(lf_bcast_sub_t *sub, bool pin, uint64_t *_idx);
+
+/* Returns whether the buffer published at queue index 'idx' is still in the queue. Like
+   lf_bcast_sub_consume_end(), the reads of the buffer can only be trusted if this returns true
+   after them. Pinned buffers stay intact even once this returns false */
+bool lf_bcast_valid(lf_bcast_t *b, uint64_t idx);
+
+/* Pin the buffer published at queue index 'idx' so that it isn't reused, even once it's rolled
+   off the queue, until lf_bcast_unpin(). Returns false if it was already reclaimed.
+   NOTE: Pinned buffers are taken out of circulation: publishers will fail to acquire buffers if
+   subscribers pin most of the queue. A process that dies with buffers pinned leaks them */
+bool lf_bcast_pin(lf_bcast_t *b, const void *buf, uint64_t idx);
+void lf_bcast_unpin(lf_bcast_t *b, const void *buf, uint64_t idx);
+
+/*************************************************************************************************/
+/* Introspection: these only read the region, so they work on a read-only mapping of it, and the
+   values can be slightly inconsistent with each other while publishers and subscribers run */
+
+typedef struct lf_bcast_sub_status lf_bcast_sub_status_t;
+struct lf_bcast_sub_status
+{
+  uint32_t id;               /* Index of the record, stable until the subscriber unregisters */
+  uint64_t pid;
+  uint64_t idx;              /* Next index the subscriber will consume */
+  uint64_t drops;
+  uint64_t skipped;
+  int64_t  last_consume_ns;  /* Wallclock of its last consume, 0 if none yet */
+  bool     lossless;
+  char     name[LF_BCAST_NAME_LEN];
+};
+
+typedef struct lf_bcast_stats lf_bcast_stats_t;
+struct lf_bcast_stats
+{
+  uint64_t depth;
+  uint64_t head_idx;         /* The queue holds the elements published from head_idx to tail_idx */
+  uint64_t tail_idx;
+  size_t   nclasses;
+  struct {
+    size_t elt_sz;
+    size_t num_elts;
+    size_t num_free;         /* In the pool: neither queued nor held by publishers or pins */
+  } classes[LF_BCAST_MAX_CLASSES];
+};
+
+/* Store the status records of up to 'max' registered subscribers to 'out' and return how many.
+   Records of processes that died without unregistering are included until they're reclaimed */
+size_t lf_bcast_sub_statuses(lf_bcast_t *b, lf_bcast_sub_status_t *out, size_t max);
+
+/* Take a snapshot of the queue's indices and pool occupancy */
+void lf_bcast_stats(lf_bcast_t *b, lf_bcast_stats_t *stats);
+
 /*************************************************************************************************/
 /* Advanced API */
 
@@ -81,6 +229,16 @@ lf_bcast_t * lf_bcast_mem_init(void *mem, size_t depth, size_t elt_sz, size_t el
 /* Join an existing, previously initialized bcast region */
 lf_bcast_t * lf_bcast_mem_join(void *mem, size_t depth, size_t elt_sz, size_t elt_align);
 
+/* Same as the above, for a queue whose elements come from several size classes. Each class is its own
+   pool: 'classes' must be sorted by increasing 'elt_sz', and the sizes must be multiples of 'elt_align'.
+   The queue 'depth' is independent of the number of elements */
+bool lf_bcast_footprint_classes(size_t depth, const lf_bcast_class_t *classes, size_t nclasses,
+                                size_t elt_align, size_t *size, size_t *align);
+lf_bcast_t * lf_bcast_mem_init_classes(void *mem, size_t depth, const lf_bcast_class_t *classes,
+                                       size_t nclasses, size_t elt_align);
+lf_bcast_t * lf_bcast_mem_join_classes(void *mem, size_t depth, const lf_bcast_class_t *classes,
+                                       size_t nclasses, size_t elt_align);
+
 /* Leave the bcast region without destorying it */
 void lf_bcast_mem_leave(lf_bcast_t *lf_bcast);
 
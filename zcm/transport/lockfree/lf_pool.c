@@ -132,3 +132,27 @@ void lf_pool_mem_leave(lf_pool_t *lf_pool)
 {
   /* no-op at the moment */
 }
+
+size_t lf_pool_index(lf_pool_t *pool, const void *elt)
+{
+  size_t idx = (size_t)((const char*)elt - pool->mem) / pool->elt_sz;
+  assert(idx < pool->num_elts);
+  return idx;
+}
+
+size_t lf_pool_num_free(lf_pool_t *pool)
+{
+  // Walk the free list without modifying anything. Elements taken off it during the walk can
+  // send us anywhere, so stop at anything that isn't an element and never count past num_elts
+  size_t   n   = 0;
+  lf_ref_t cur = pool->head;
+  u64      beg = (u64)(pool->mem - (char*)pool);
+  u64      end = beg + pool->num_elts * pool->elt_sz;
+  while (!LF_REF_IS_NULL(cur) && n < pool->num_elts) {
+    u64 off = cur.val;
+    if (off < beg || off >= end || (off - beg) % pool->elt_sz != 0) break;
+    n++;
+    cur = *(lf_ref_t*)((char*)pool + off);
+  }
+  return n;
+}
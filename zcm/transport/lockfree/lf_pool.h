@@ -17,3 +17,5 @@ bool        lf_pool_footprint(size_t num_elts, size_t elt_sz, size_t elt_align,
 lf_pool_t * lf_pool_mem_init(void *mem, size_t num_elts, size_t elt_sz, size_t elt_align);
 lf_pool_t * lf_pool_mem_join(void *mem, size_t num_elts, size_t elt_sz, size_t elt_align);
 void        lf_pool_mem_leave(lf_pool_t *lf_pool);
+size_t      lf_pool_index(lf_pool_t *lf_pool, const void *elt); /* 0..num_elts-1 */
+size_t      lf_pool_num_free(lf_pool_t *lf_pool); /* approximate while others use the pool */
@@ -1,7 +1,9 @@
 #include "lf_shm.h"
 #include <fcntl.h>
+#include <linux/magic.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
@@ -48,7 +50,10 @@ void lf_shm_remove(const char *path)
 
 void * lf_shm_open(const char *path, int flags, size_t * _opt_size, int *_opt_err)
 {
-    int shm_fd = open(path, O_RDWR|O_CLOEXEC);
+    bool rdonly = flags & LF_SHM_FLAG_RDONLY;
+    if (rdonly) flags |= LF_SHM_FLAG_NOFAULT;
+
+    int shm_fd = open(path, (rdonly ? O_RDONLY : O_RDWR)|O_CLOEXEC);
     if (shm_fd < 0) {
         if (_opt_err) *_opt_err = LF_SHM_ERR_OPEN;
         return NULL;
@@ -62,28 +67,34 @@ void * lf_shm_open(const char *path, int flags, size_t * _opt_size, int *_opt_er
     }
     size_t size = st->st_size;
 
-    char *mem = (char*)mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    int mmap_flags = MAP_SHARED;
+    if ((flags & LF_SHM_FLAG_POPULATE) && !(flags & LF_SHM_FLAG_NOFAULT)) mmap_flags |= MAP_POPULATE;
+
+    int prot = rdonly ? PROT_READ : PROT_READ|PROT_WRITE;
+    char *mem = (char*)mmap(NULL, size, prot, mmap_flags, shm_fd, 0);
     if (mem == MAP_FAILED) {
+        int err = errno == ENOMEM ? LF_SHM_ERR_NOMEM : LF_SHM_ERR_MMAP;
         close(shm_fd);
-        if (_opt_err) *_opt_err = LF_SHM_ERR_MMAP;
+        if (_opt_err) *_opt_err = err;
         return NULL;
     }
 
-    // prefault the entire region
-    size_t pagesize = getpagesize();
-    for (char *ptr = mem; ptr < mem+size; ptr += pagesize) {
-        volatile char byte = *(volatile char *)ptr;
-        (void)byte;
+    // ask for huge pages before anything is faulted in
+    if (flags & LF_SHM_FLAG_THP) {
+        if (madvise(mem, size, MADV_HUGEPAGE) != 0) {
+            munmap(mem, size);
+            close(shm_fd);
+            if (_opt_err) *_opt_err = LF_SHM_ERR_MADVISE;
+            return NULL;
+        }
     }
 
-    // mlock it if required
-    if (flags & LF_SHM_FLAG_MLOCK) {
-        int ret = mlock(mem, size);
-        if (ret != 0) {
-            printf("MLCOK FAILED: %d (%s)\n", errno, strerror(errno));
+    if (!(flags & LF_SHM_FLAG_NOFAULT)) {
+        int err = lf_shm_prefault(mem, size, flags);
+        if (err != LF_SHM_SUCCESS) {
             munmap(mem, size);
             close(shm_fd);
-            if (_opt_err) *_opt_err = LF_SHM_ERR_MLOCK;
+            if (_opt_err) *_opt_err = err;
             return NULL;
         }
     }
@@ -99,6 +110,37 @@ void lf_shm_close(void *shm, size_t size)
     munmap(shm, size);
 }
 
+int lf_shm_prefault(void *shm, size_t size, int flags)
+{
+    // prefault the entire region, unless MAP_POPULATE already did
+    char *mem = (char*)shm;
+    if (!(flags & LF_SHM_FLAG_POPULATE) || (flags & LF_SHM_FLAG_NOFAULT)) {
+        size_t pagesize = getpagesize();
+        for (char *ptr = mem; ptr < mem+size; ptr += pagesize) {
+            volatile char byte = *(volatile char *)ptr;
+            (void)byte;
+        }
+    }
+
+    // mlock it if required
+    if (flags & LF_SHM_FLAG_MLOCK) {
+        int ret = mlock(mem, size);
+        if (ret != 0) {
+            printf("MLCOK FAILED: %d (%s)\n", errno, strerror(errno));
+            return LF_SHM_ERR_MLOCK;
+        }
+    }
+    return LF_SHM_SUCCESS;
+}
+
+size_t lf_shm_hugetlbfs_page_size(const char *dir)
+{
+    struct statfs st[1];
+    if (statfs(dir, st) != 0) return 0;
+    if (st->f_type != HUGETLBFS_MAGIC) return 0;
+    return (size_t)st->f_bsize;
+}
+
 const char *lf_shm_errstr(int err)
 {
     switch (err) {
@@ -108,6 +150,8 @@ const char *lf_shm_errstr(int err)
         case LF_SHM_ERR_MMAP: return "LF_SHM_ERR_MMAP";
         case LF_SHM_ERR_SIZE: return "LF_SHM_ERR_SIZE";
         case LF_SHM_ERR_MLOCK: return "LF_SHM_ERR_MLOCK";
+        case LF_SHM_ERR_NOMEM: return "LF_SHM_ERR_NOMEM";
+        case LF_SHM_ERR_MADVISE: return "LF_SHM_ERR_MADVISE";
         default: return "LF_SHM_ERR_UNKNOWN";
     }
 }
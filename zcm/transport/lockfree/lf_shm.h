@@ -13,10 +13,16 @@ enum {
       LF_SHM_ERR_MMAP,
       LF_SHM_ERR_SIZE,
       LF_SHM_ERR_MLOCK,
+      LF_SHM_ERR_NOMEM,    /* mmap couldn't reserve the memory, e.g. not enough huge pages */
+      LF_SHM_ERR_MADVISE,
 };
 
 enum {
-      LF_SHM_FLAG_MLOCK = 1<<0,
+      LF_SHM_FLAG_MLOCK    = 1<<0,
+      LF_SHM_FLAG_POPULATE = 1<<1, /* prefault with MAP_POPULATE rather than by touching each page */
+      LF_SHM_FLAG_THP      = 1<<2, /* ask for transparent huge pages */
+      LF_SHM_FLAG_NOFAULT  = 1<<3, /* leave prefaulting and mlock to a later lf_shm_prefault() */
+      LF_SHM_FLAG_RDONLY   = 1<<4, /* map the region read-only, to inspect it. Implies NOFAULT */
 };
 
 bool   lf_shm_create(const char *path, size_t size);
@@ -24,6 +30,14 @@ void   lf_shm_remove(const char *path);
 void * lf_shm_open(const char *path, int flags, size_t * _opt_size, int *_opt_err);
 void   lf_shm_close(void *shm, size_t size);
 
+/* Prefault the region, and mlock it if LF_SHM_FLAG_MLOCK is set. lf_shm_open() does it unless
+   LF_SHM_FLAG_NOFAULT is set, which lets it be done later or from another thread.
+   Returns LF_SHM_SUCCESS or LF_SHM_ERR_MLOCK */
+int    lf_shm_prefault(void *shm, size_t size, int flags);
+
+/* The page size of a hugetlbfs mount, or 0 if 'dir' isn't one */
+size_t lf_shm_hugetlbfs_page_size(const char *dir);
+
 const char *lf_shm_errstr(int err);
 
 #ifdef __cplusplus
@@ -1,55 +1,228 @@
 #include "lf_bcast.h"
 #include "test_header.h"
+#include <unistd.h>
 
-static bool pub(lf_bcast_t *b, u64 val)
+// Unused elements hold the pool's free-list link, so they can't be any smaller
+#define ELT_SZ 16
+
+static void pub(lf_bcast_t *b, u64 val)
+{
+  void *buf = lf_bcast_buf_acquire(b);
+  REQUIRE(buf);
+  memcpy(buf, &val, sizeof(val));
+  lf_bcast_pub(b, buf);
+}
+
+static void pub_n(lf_bcast_t *b, u64 first, size_t n)
 {
-  return lf_bcast_pub(b, &val, sizeof(val));
+  void *bufs[16];
+  assert(n <= ARRAY_SIZE(bufs));
+  for (size_t i = 0; i < n; i++) {
+    bufs[i] = lf_bcast_buf_acquire(b);
+    REQUIRE(bufs[i]);
+    u64 val = first + i;
+    memcpy(bufs[i], &val, sizeof(val));
+  }
+  lf_bcast_pub_n(b, bufs, n);
 }
 
 static bool sub_next(lf_bcast_sub_t *sub, u64 *val)
 {
-  size_t msg_sz;
-  size_t drops;
-  bool success = lf_bcast_sub_next(sub, val, &msg_sz, &drops);
-  if (!success) return success;
-  assert(msg_sz == sizeof(u64));
-  return true;
+  const void *buf = lf_bcast_sub_consume_begin(sub, 0);
+  if (!buf) return false;
+  memcpy(val, buf, sizeof(*val));
+  return lf_bcast_sub_consume_end(sub);
 }
 
 static void test_simple(void)
 {
   u64 val;
 
-  lf_bcast_t *b = lf_bcast_new(2, sizeof(val));
+  lf_bcast_t *b = lf_bcast_new(2, ELT_SZ, ELT_SZ);
   if (!b) FAIL("Failed to allocate bcast");
 
-  REQUIRE(pub(b, 2));
-  REQUIRE(pub(b, 3));
-
   lf_bcast_sub_t sub_1[1];
-  lf_bcast_sub_begin(sub_1, b);
+  lf_bcast_sub_init(sub_1, b);
+  lf_bcast_sub_t sub_2[1];
+  lf_bcast_sub_init(sub_2, b);
+
+  pub(b, 2);
+  pub(b, 3);
+
   REQUIRE(sub_next(sub_1, &val) && val == 2);
   REQUIRE(sub_next(sub_1, &val) && val == 3);
   REQUIRE(!sub_next(sub_1, &val));
 
-  lf_bcast_sub_t sub_2[1];
-  lf_bcast_sub_begin(sub_2, b);
   REQUIRE(sub_next(sub_2, &val) && val == 2);
   REQUIRE(sub_next(sub_2, &val) && val == 3);
   REQUIRE(!sub_next(sub_2, &val));
 
-  REQUIRE(pub(b, 4));
+  pub(b, 4);
 
   REQUIRE(sub_next(sub_1, &val) && val == 4);
   REQUIRE(!sub_next(sub_1, &val));
   REQUIRE(sub_next(sub_2, &val) && val == 4);
   REQUIRE(!sub_next(sub_2, &val));
 
+  // A subscriber starts at the tail
   lf_bcast_sub_t sub_3[1];
-  lf_bcast_sub_begin(sub_3, b);
-  REQUIRE(sub_next(sub_3, &val) && val == 3);
-  REQUIRE(sub_next(sub_3, &val) && val == 4);
+  lf_bcast_sub_init(sub_3, b);
   REQUIRE(!sub_next(sub_3, &val));
+  pub(b, 5);
+  REQUIRE(sub_next(sub_3, &val) && val == 5);
+  REQUIRE(!sub_next(sub_3, &val));
+
+  lf_bcast_delete(b);
+}
+
+static void test_pub_n(void)
+{
+  u64 val;
+
+  lf_bcast_t *b = lf_bcast_new(8, ELT_SZ, ELT_SZ);
+  if (!b) FAIL("Failed to allocate bcast");
+
+  lf_bcast_sub_t sub[1];
+  lf_bcast_sub_init(sub, b);
+
+  // A batch lands at consecutive indices, in order, and mixes with single publishes
+  u64 tail = lf_bcast_tail(b);
+  pub(b, 1);
+  pub_n(b, 2, 4);
+  pub(b, 6);
+  REQUIRE(lf_bcast_tail(b) == tail + 6);
+  for (u64 i = 1; i <= 6; i++) REQUIRE(sub_next(sub, &val) && val == i);
+  REQUIRE(!sub_next(sub, &val));
+
+  // A batch rolls off what the subscriber hasn't consumed yet, like single publishes
+  pub(b, 7);
+  pub_n(b, 10, 8);
+  REQUIRE(lf_bcast_tail(b) == tail + 15);
+  for (u64 i = 10; i < 18; i++) REQUIRE(sub_next(sub, &val) && val == i);
+  REQUIRE(!sub_next(sub, &val));
+  REQUIRE(lf_bcast_sub_drops(sub) == 1);
+
+  lf_bcast_delete(b);
+}
+
+static void test_try_pub_n(void)
+{
+  u64 val;
+
+  // More elements than queue slots, so that a publisher can hold more buffers than fit
+  lf_bcast_class_t classes[2] = {{ELT_SZ, 4}, {2*ELT_SZ, 4}};
+  size_t mem_sz, mem_align;
+  if (!lf_bcast_footprint_classes(4, classes, 2, ELT_SZ, &mem_sz, &mem_align)) FAIL("Bad footprint");
+  void *mem = aligned_alloc(mem_align, mem_sz);
+  lf_bcast_t *b = lf_bcast_mem_init_classes(mem, 4, classes, 2, ELT_SZ);
+  if (!b) FAIL("Failed to init bcast");
+
+  lf_bcast_sub_t sub[1];
+  lf_bcast_sub_init(sub, b);
+  REQUIRE(lf_bcast_sub_register(sub));
+
+  void *bufs[6];
+  for (size_t i = 0; i < ARRAY_SIZE(bufs); i++) {
+    bufs[i] = lf_bcast_buf_try_acquire_sz(b, sizeof(val));
+    REQUIRE(bufs[i]);
+    val = i;
+    memcpy(bufs[i], &val, sizeof(val));
+  }
+
+  // Only what the registered subscriber leaves room for is published, from the first buffer
+  REQUIRE(lf_bcast_try_pub_n(b, bufs, 6) == 4);
+  REQUIRE(lf_bcast_try_pub_n(b, bufs + 4, 2) == 0);
+  for (u64 i = 0; i < 2; i++) REQUIRE(sub_next(sub, &val) && val == i);
+  REQUIRE(lf_bcast_try_pub_n(b, bufs + 4, 2) == 2);
+
+  for (u64 i = 2; i < 6; i++) REQUIRE(sub_next(sub, &val) && val == i);
+  REQUIRE(!sub_next(sub, &val));
+  REQUIRE(lf_bcast_sub_drops(sub) == 0);
+
+  lf_bcast_sub_unregister(sub);
+  lf_bcast_mem_leave(b);
+  free(mem);
+}
+
+static void test_consume_n(void)
+{
+  u64 val;
+  const void *bufs[8];
+
+  lf_bcast_t *b = lf_bcast_new(8, ELT_SZ, ELT_SZ);
+  if (!b) FAIL("Failed to allocate bcast");
+
+  lf_bcast_sub_t sub[1];
+  lf_bcast_sub_init(sub, b);
+  REQUIRE(lf_bcast_sub_consume_begin_n(sub, 0, bufs, ARRAY_SIZE(bufs)) == 0);
+
+  // A run covers what's already published, up to 'max'
+  pub_n(b, 0, 5);
+  REQUIRE(lf_bcast_sub_consume_begin_n(sub, 0, bufs, 3) == 3);
+  for (u64 i = 0; i < 3; i++) REQUIRE(*(const u64*)bufs[i] == i);
+  REQUIRE(lf_bcast_sub_consume_end_n(sub) == 0);
+  REQUIRE(lf_bcast_sub_consume_begin_n(sub, 0, bufs, ARRAY_SIZE(bufs)) == 2);
+  for (u64 i = 0; i < 2; i++) REQUIRE(*(const u64*)bufs[i] == 3 + i);
+  REQUIRE(lf_bcast_sub_consume_end_n(sub) == 0);
+  REQUIRE(!sub_next(sub, &val));
+
+  // Elements reclaimed while the run is read are a prefix of it, counted as drops
+  pub_n(b, 5, 6);
+  REQUIRE(lf_bcast_sub_consume_begin_n(sub, 0, bufs, ARRAY_SIZE(bufs)) == 6);
+  pub_n(b, 11, 5);
+  REQUIRE(lf_bcast_sub_consume_end_n(sub) == 3);
+  REQUIRE(lf_bcast_sub_drops(sub) == 3);
+  for (u64 i = 11; i < 16; i++) REQUIRE(sub_next(sub, &val) && val == i);
+  REQUIRE(!sub_next(sub, &val));
+
+  lf_bcast_delete(b);
+}
+
+typedef struct waiter waiter_t;
+struct waiter
+{
+  lf_bcast_sub_t sub[1];
+  u64            val;
+  i64            dt;
+};
+
+static void * waiter_func(void *usr)
+{
+  waiter_t *w = (waiter_t*)usr;
+  i64 start = wallclock();
+  const void *buf = lf_bcast_sub_consume_begin(w->sub, (i64)10e9);
+  w->dt = wallclock() - start;
+  if (buf) {
+    memcpy(&w->val, buf, sizeof(w->val));
+    lf_bcast_sub_consume_end(w->sub);
+  }
+  return NULL;
+}
+
+static void test_wakeup(void)
+{
+  lf_bcast_t *b = lf_bcast_new(8, ELT_SZ, ELT_SZ);
+  if (!b) FAIL("Failed to allocate bcast");
+
+  // Publishers only wake subscribers that count themselves as waiting, and those parked in
+  // futex_wait must still be woken well before their timeout, by either kind of publish
+  for (int batch = 0; batch < 2; batch++) {
+    waiter_t w[2] = {};
+    pthread_t threads[2];
+    for (size_t i = 0; i < ARRAY_SIZE(w); i++) {
+      lf_bcast_sub_init(w[i].sub, b);
+      pthread_create(&threads[i], NULL, waiter_func, &w[i]);
+    }
+    usleep(100000);
+
+    if (batch) pub_n(b, 42, 2);
+    else       pub(b, 42);
+    for (size_t i = 0; i < ARRAY_SIZE(w); i++) {
+      pthread_join(threads[i], NULL);
+      REQUIRE(w[i].val == 42);
+      REQUIRE(w[i].dt < (i64)5e9);
+    }
+  }
 
   lf_bcast_delete(b);
 }
@@ -57,5 +230,9 @@ static void test_simple(void)
 int main()
 {
   test_simple();
+  test_pub_n();
+  test_try_pub_n();
+  test_consume_n();
+  test_wakeup();
   return 0;
 }
@@ -2,14 +2,20 @@
 #include "test_header.h"
 
 #define MAX_THREADS 128
+#define MAX_BATCH   8
+
+// Unused elements hold the pool's free-list link, so they can't be any smaller
+#define ELT_SZ 16
 
 typedef struct thread_state thread_state_t;
 struct thread_state
 {
   pthread_t    thread;
   lf_bcast_t * bcast;
+  lf_bcast_sub_t sub[1];
 
   bool         pub;
+  size_t       batch;
   u32          pub_id;
   size_t       pub_msgs;
   size_t       sub_msgs;
@@ -25,11 +31,18 @@ static void thread_func_pub(thread_state_t *t)
   u64 msg = (u64)t->pub_id << 32;
   i64 start_time = wallclock();
 
-  for (size_t i = 0; i < t->pub_msgs; i++) {
-    msg++;
-    bool success = lf_bcast_pub(b, &msg, sizeof(msg));
-    assert(success);
-    t->n_msgs++;
+  void *bufs[MAX_BATCH];
+  for (size_t i = 0; i < t->pub_msgs;) {
+    size_t n = 0;
+    for (; n < t->batch && i < t->pub_msgs; n++, i++) {
+      bufs[n] = lf_bcast_buf_acquire(b);
+      assert(bufs[n]);
+      msg++;
+      memcpy(bufs[n], &msg, sizeof(msg));
+    }
+    if (n == 1) lf_bcast_pub(b, bufs[0]);
+    else        lf_bcast_pub_n(b, bufs, n);
+    t->n_msgs += n;
   }
 
   t->dt = wallclock() - start_time;
@@ -37,30 +50,29 @@ static void thread_func_pub(thread_state_t *t)
 
 static void thread_func_sub(thread_state_t *t)
 {
-  lf_bcast_t *b = t->bcast;
   i64 start_time = wallclock();
 
   u64 last_msg[MAX_THREADS] = {};
 
-  lf_bcast_sub_t sub[1];
-  lf_bcast_sub_begin(sub, b);
-
-  u64 msg;
-  size_t msg_sz;
-  size_t drops;
-  for (size_t i = 0; i < (size_t)1e9; i++) {
-    if (!lf_bcast_sub_next(sub, &msg, &msg_sz, &drops)) continue;
-    assert(msg_sz == sizeof(msg));
-
-    u32 pub_id = msg>>32;
-    assert(pub_id < MAX_THREADS);
-    assert(msg > last_msg[pub_id]);
-    last_msg[pub_id] = msg;
-
-    t->n_msgs++;
-    t->n_drops += drops;
-    if (t->n_msgs + t->n_drops == t->sub_msgs) break; // DONE!
+  const void *bufs[MAX_BATCH];
+  u64 msgs[MAX_BATCH];
+  while (t->n_msgs + lf_bcast_sub_drops(t->sub) < t->sub_msgs) {
+    size_t n = lf_bcast_sub_consume_begin_n(t->sub, (i64)1e6, bufs, t->batch);
+    if (!n) continue;
+    for (size_t i = 0; i < n; i++) memcpy(&msgs[i], bufs[i], sizeof(msgs[i]));
+    size_t invalid = lf_bcast_sub_consume_end_n(t->sub);
+
+    // Only the ones that remained valid can be checked: each publisher's stay in order
+    for (size_t i = invalid; i < n; i++) {
+      u32 pub_id = msgs[i]>>32;
+      REQUIRE(pub_id < MAX_THREADS);
+      REQUIRE(msgs[i] > last_msg[pub_id]);
+      last_msg[pub_id] = msgs[i];
+      t->n_msgs++;
+    }
   }
+  t->n_drops = lf_bcast_sub_drops(t->sub);
+  REQUIRE(t->n_msgs + t->n_drops == t->sub_msgs);
 
   t->dt = wallclock() - start_time;
 }
@@ -73,9 +85,9 @@ static void * thread_func(void *usr)
   return NULL;
 }
 
-static void run_test(const char *test_name, size_t num_pub, size_t num_sub, size_t num_elts)
+static void run_test(const char *test_name, size_t num_pub, size_t num_sub, size_t num_elts, size_t batch)
 {
-  lf_bcast_t *b = lf_bcast_new(num_elts, sizeof(u64));
+  lf_bcast_t *b = lf_bcast_new(num_elts, ELT_SZ, ELT_SZ);
   if (!b) FAIL("Failed to create new bcast");
 
   size_t pub_msgs = (size_t)1e5;
@@ -87,7 +99,9 @@ static void run_test(const char *test_name, size_t num_pub, size_t num_sub, size
     thread_state_t *t = &sub_threads[i];
     t->bcast = b;
     t->pub = false;
+    t->batch = batch;
     t->sub_msgs = sub_msgs;
+    lf_bcast_sub_init(t->sub, b); // Before any publish, so that every message is seen or dropped
     pthread_create(&t->thread, NULL, thread_func, t);
   }
 
@@ -97,6 +111,7 @@ static void run_test(const char *test_name, size_t num_pub, size_t num_sub, size
     thread_state_t *t = &pub_threads[i];
     t->bcast = b;
     t->pub = true;
+    t->batch = batch;
     t->pub_id = (u32)i;
     t->pub_msgs = pub_msgs;
     pthread_create(&t->thread, NULL, thread_func, t);
@@ -126,31 +141,37 @@ static void run_test(const char *test_name, size_t num_pub, size_t num_sub, size
 int main()
 {
   // Stress publishing, rolling around with lots of contention
-  run_test("1pub0sub", 1, 0, 128);
-  run_test("2pub0sub", 2, 0, 128);
-  run_test("4pub0sub", 4, 0, 128);
-  run_test("4pub0sub", 8, 0, 128);
+  run_test("1pub0sub", 1, 0, 128, 1);
+  run_test("2pub0sub", 2, 0, 128, 1);
+  run_test("4pub0sub", 4, 0, 128, 1);
+  run_test("4pub0sub", 8, 0, 128, 1);
   printf("\n");
 
   // Stress publishing with 1 sub
-  run_test("1pub1sub", 1, 1, 2048);
-  run_test("2pub1sub", 2, 1, 2048);
-  run_test("4pub1sub", 4, 1, 2048);
-  run_test("8pub1sub", 8, 1, 2048);
+  run_test("1pub1sub", 1, 1, 2048, 1);
+  run_test("2pub1sub", 2, 1, 2048, 1);
+  run_test("4pub1sub", 4, 1, 2048, 1);
+  run_test("8pub1sub", 8, 1, 2048, 1);
   printf("\n");
 
   // Stress publishing with 2 subs
-  run_test("1pub2sub", 1, 2, 2048);
-  run_test("2pub2sub", 2, 2, 2048);
-  run_test("4pub2sub", 4, 2, 2048);
-  run_test("8pub2sub", 8, 2, 2048);
+  run_test("1pub2sub", 1, 2, 2048, 1);
+  run_test("2pub2sub", 2, 2, 2048, 1);
+  run_test("4pub2sub", 4, 2, 2048, 1);
+  run_test("8pub2sub", 8, 2, 2048, 1);
   printf("\n");
 
   // Stress subscribing
-  run_test("1pub1sub", 1, 1, 2048);
-  run_test("1pub2sub", 1, 2, 2048);
-  run_test("1pub4sub", 1, 4, 2048);
-  run_test("1pub8sub", 1, 8, 2048);
+  run_test("1pub1sub", 1, 1, 2048, 1);
+  run_test("1pub2sub", 1, 2, 2048, 1);
+  run_test("1pub4sub", 1, 4, 2048, 1);
+  run_test("1pub8sub", 1, 8, 2048, 1);
+  printf("\n");
+
+  // Stress batched publishing and subscribing
+  run_test("1pub1sub_batch", 1, 1, 2048, MAX_BATCH);
+  run_test("4pub2sub_batch", 4, 2, 2048, MAX_BATCH);
+  run_test("8pub4sub_batch", 8, 4, 2048, MAX_BATCH);
   printf("\n");
 
   return 0;
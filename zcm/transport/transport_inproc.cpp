@@ -3,52 +3,118 @@
 #include "zcm/transport_register.hpp"
 
 #include "zcm/util/debug.h"
+#include "zcm/util/mpmc_queue.hpp"
 #include "util/TimeUtil.hpp"
 
-#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
 #include <cstring>
-#include <deque>
 #include <mutex>
 #include <condition_variable>
 
 #define ZCM_TRANS_CLASSNAME TransportNonblockInproc
 #define MTU (1<<28)
+#define DEFAULT_DEPTH 4096
+#define MAX_POOLED_BUF_SZ (1<<20)
 
 using namespace std;
 
+// A message on its way from sendmsg() to recvmsg(). Buffers are recycled through a free
+// queue once received, and keep their data allocation, so sending doesn't allocate
+// once the transport is warmed up. The zcm_msg_t handed out by recvmsg() points at
+// 'channel', which is how the buffer is found again when it's released
+struct Buf
+{
+    char     channel[ZCM_CHANNEL_MAXLEN+1];
+    uint64_t utime;
+    size_t   len;
+    size_t   capacity;
+    uint8_t* data;
+};
+static_assert(offsetof(Buf, channel) == 0, "");
+
 struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
 {
-    // Messages are queued into a deque and then dispatched one at a time through recvmsg
-    // using the "inFlight" pointers to store their memory until the next message is dispatched
-    // Note: Have to use free() to clean up chan memory in these because we create them via strdup
-    deque<zcm_msg_t*> msgs;
-    const char*    inFlightChanMem = nullptr;
-          uint8_t* inFlightDataMem = nullptr;
+    // Sent messages wait in msgs until received, then go back to freeBufs. Both are
+    // lock-free, so senders on any thread and the receiver never contend on a lock
+    MpmcQueue<Buf*> msgs;
+    MpmcQueue<Buf*> freeBufs;
 
+    // The nonblocking flavor hands out messages until the next recvmsg(), the blocking
+    // one lends them until recvmsg_release()
+    Buf* inFlight = nullptr;
+
+    // A blocking recvmsg() with nothing to receive sleeps on msgCond, after counting
+    // itself in waiters so that senders only take msgLock when someone is asleep
     condition_variable msgCond;
     mutex msgLock;
+    atomic<uint32_t> waiters {0};
+
+    // Messages sent while msgs was full
+    atomic<uint64_t> drops {0};
 
-    ZCM_TRANS_CLASSNAME(zcm_url_t *url, bool blocking)
+    ZCM_TRANS_CLASSNAME(zcm_url_t *url, bool blocking) :
+        msgs(parseDepth(url)), freeBufs(msgs.getCapacity())
     {
         trans_type = blocking ? ZCM_BLOCKING : ZCM_NONBLOCKING;
-        vtbl = &methods;
+        vtbl = blocking ? &lendingMethods : &methods;
     }
 
-    ~ZCM_TRANS_CLASSNAME()
+    static size_t parseDepth(zcm_url_t *url)
     {
-        for (auto msg: msgs) {
-            free((void*) msg->channel);
-            delete [] msg->buf;
-            delete msg;
+        size_t depth = DEFAULT_DEPTH;
+        zcm_url_opts_t *opts = zcm_url_opts(url);
+        for (size_t i = 0; i < opts->numopts; i++) {
+            if (0 == strcmp(opts->name[i], "depth")) {
+                uint64_t val = strtoull(opts->value[i], nullptr, 10);
+                if (val == 0) continue;
+                depth = val;
+                ZCM_DEBUG("Setting depth=%zu", depth);
+            }
         }
-        msgs.clear();
+        return depth;
+    }
 
-        free((void*) inFlightChanMem);
-        delete [] inFlightDataMem;
+    ~ZCM_TRANS_CLASSNAME()
+    {
+        Buf* b;
+        while (msgs.pop(b)) deleteBuf(b);
+        while (freeBufs.pop(b)) deleteBuf(b);
+        if (inFlight) deleteBuf(inFlight);
     }
 
     bool good() { return true; }
 
+    static void deleteBuf(Buf* b)
+    {
+        free(b->data);
+        delete b;
+    }
+
+    Buf* acquireBuf(size_t len)
+    {
+        Buf* b;
+        if (!freeBufs.pop(b)) {
+            b = new Buf();
+            b->capacity = 0;
+            b->data = nullptr;
+        }
+        if (b->capacity < len) {
+            free(b->data);
+            b->data = (uint8_t*)malloc(len);
+            b->capacity = len;
+        }
+        return b;
+    }
+
+    void releaseBuf(Buf* b)
+    {
+        // Don't hold on to the memory of the odd huge message
+        if (b->capacity > MAX_POOLED_BUF_SZ || !freeBufs.push(b)) deleteBuf(b);
+    }
+
     /********************** METHODS **********************/
     size_t get_mtu() { return MTU; }
 
@@ -67,19 +133,28 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
             return ZCM_EINVALID;
         }
 
-        zcm_msg_t *newMsg = new zcm_msg_t();
-        newMsg->utime = msg.utime;
-        newMsg->len = msg.len;
-        newMsg->channel = strdup(msg.channel);
-        newMsg->buf = new uint8_t[msg.len];
-        std::copy_n(msg.buf, msg.len, newMsg->buf);
+        Buf* b = acquireBuf(msg.len);
+        memcpy(b->channel, msg.channel, chanLen + 1);
+        b->utime = msg.utime;
+        b->len = msg.len;
+        memcpy(b->data, msg.buf, msg.len);
+
+        if (!msgs.push(b)) {
+            ZCM_DEBUG("nonblock_inproc_send failed: queue full");
+            releaseBuf(b);
+            // In blocking mode, the core keeps the message queued until there's room
+            if (trans_type != ZCM_BLOCKING) drops++;
+            return ZCM_EAGAIN;
+        }
 
-        std::unique_lock<mutex> lk(msgLock, defer_lock);
-        if (trans_type == ZCM_BLOCKING) lk.lock();
-        msgs.push_back(newMsg);
+        // Pairs with the increment of waiters in recvmsg(): either we see the receiver
+        // going to sleep, or it sees our message
         if (trans_type == ZCM_BLOCKING) {
-            lk.unlock();
-            msgCond.notify_all();
+            atomic_thread_fence(memory_order_seq_cst);
+            if (waiters.load(memory_order_relaxed) > 0) {
+                { std::unique_lock<mutex> lk(msgLock); }
+                msgCond.notify_all();
+            }
         }
 
         return ZCM_EOK;
@@ -89,41 +164,55 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
 
     int recvmsg(zcm_msg_t *msg, unsigned timeout)
     {
-        std::unique_lock<mutex> lk(msgLock, defer_lock);
+        Buf* b;
+        if (!msgs.pop(b)) {
+            if (trans_type != ZCM_BLOCKING) return ZCM_EAGAIN;
 
-        if (trans_type == ZCM_BLOCKING) {
-            lk.lock();
+            waiters++;
+            std::unique_lock<mutex> lk(msgLock);
             bool available = msgCond.wait_for(lk, chrono::milliseconds(timeout),
-                                              [&](){ return !msgs.empty(); });
+                                              [&](){ return msgs.pop(b); });
+            lk.unlock();
+            waiters--;
             if (!available) return ZCM_EAGAIN;
-        } else {
-            if (msgs.empty()) return ZCM_EAGAIN;
         }
 
-        // Clean up memory from last message
-        free((void*) inFlightChanMem);
-        delete [] inFlightDataMem;
+        // The nonblocking API only guarantees the previous message until now
+        if (trans_type != ZCM_BLOCKING) {
+            if (inFlight) releaseBuf(inFlight);
+            inFlight = b;
+        }
 
-        // Steal the dynamic memory from the front of the queue, but hang onto the
-        // ptrs via the "inFlight" ptrs so we can clean it up later
-        *msg = *(msgs.front());
         msg->utime = TimeUtil::utime();
-        inFlightChanMem = msg->channel;
-        inFlightDataMem = msg->buf;
+        msg->channel = b->channel;
+        msg->len = b->len;
+        msg->buf = b->data;
+        return ZCM_EOK;
+    }
 
-        delete msgs.front();
-        msgs.pop_front();
+    int update() { return ZCM_EOK; }
 
+    int query_drops(uint64_t *out_drops)
+    {
+        if (!out_drops) return ZCM_EINVALID;
+        *out_drops = drops;
         return ZCM_EOK;
     }
 
-    int update() { return ZCM_EOK; }
+    // Lent buffers are only recycled once released, so they stay intact
+    int recvmsg_validate(const zcm_msg_t *msg) { return ZCM_EOK; }
+
+    void recvmsg_release(const zcm_msg_t *msg)
+    {
+        releaseBuf((Buf*)msg->channel);
+    }
 
     /********************** STATICS **********************/
     static zcm_trans_methods_t methods;
+    static zcm_trans_methods_t lendingMethods;
     static ZCM_TRANS_CLASSNAME *cast(zcm_trans_t *zt)
     {
-        assert(zt->vtbl == &methods);
+        assert(zt->vtbl == &methods || zt->vtbl == &lendingMethods);
         return (ZCM_TRANS_CLASSNAME*)zt;
     }
 
@@ -139,12 +228,21 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
     static int _recvmsg(zcm_trans_t *zt, zcm_msg_t *msg, unsigned timeout)
     { return cast(zt)->recvmsg(msg, timeout); }
 
+    static int _query_drops(zcm_trans_t *zt, uint64_t *out_drops)
+    { return cast(zt)->query_drops(out_drops); }
+
     static int _update(zcm_trans_t *zt)
     { return cast(zt)->update(); }
 
     static void _destroy(zcm_trans_t *zt)
     { delete cast(zt); }
 
+    static int _recvmsg_validate(zcm_trans_t *zt, const zcm_msg_t *msg)
+    { return cast(zt)->recvmsg_validate(msg); }
+
+    static void _recvmsg_release(zcm_trans_t *zt, const zcm_msg_t *msg)
+    { cast(zt)->recvmsg_release(msg); }
+
     static const TransportRegister regBlocking;
     static const TransportRegister regNonblocking;
 };
@@ -154,9 +252,24 @@ zcm_trans_methods_t ZCM_TRANS_CLASSNAME::methods = {
     &ZCM_TRANS_CLASSNAME::_sendmsg,
     &ZCM_TRANS_CLASSNAME::_recvmsg_enable,
     &ZCM_TRANS_CLASSNAME::_recvmsg,
-    NULL, // drops
+    &ZCM_TRANS_CLASSNAME::_query_drops,
+    &ZCM_TRANS_CLASSNAME::_update,
+    &ZCM_TRANS_CLASSNAME::_destroy,
+    NULL, // query_stats
+};
+
+zcm_trans_methods_t ZCM_TRANS_CLASSNAME::lendingMethods = {
+    &ZCM_TRANS_CLASSNAME::_get_mtu,
+    &ZCM_TRANS_CLASSNAME::_sendmsg,
+    &ZCM_TRANS_CLASSNAME::_recvmsg_enable,
+    &ZCM_TRANS_CLASSNAME::_recvmsg,
+    &ZCM_TRANS_CLASSNAME::_query_drops,
     &ZCM_TRANS_CLASSNAME::_update,
     &ZCM_TRANS_CLASSNAME::_destroy,
+    NULL, // query_stats
+    &ZCM_TRANS_CLASSNAME::_recvmsg_validate,
+    &ZCM_TRANS_CLASSNAME::_recvmsg_release,
+    ZCM_TRANS_CAP_THREADSAFE_SEND,
 };
 
 static zcm_trans_t *create_blocking(zcm_url_t *url, char **opt_errmsg)
@@ -173,7 +286,8 @@ static zcm_trans_t *create_nonblocking(zcm_url_t *url, char **opt_errmsg)
 
 const TransportRegister ZCM_TRANS_CLASSNAME::regBlocking(
     "block-inproc",
-    "Blocking in-process deterministic transport",
+    "Blocking in-process deterministic transport. Received messages are dispatched "
+    "in place. Use 'depth=N' to set how many messages it holds (default 4096)",
     create_blocking);
 
 const TransportRegister ZCM_TRANS_CLASSNAME::regNonblocking(
@@ -1,9 +1,22 @@
 #include "zcm/transport.h"
 #include "zcm/transport_registrar.h"
 #include "zcm/transport_register.hpp"
+
+// Ahead of the lockfree headers, which can define a static_assert() macro
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
 #include "zcm/transport/lockfree/lf_bcast.h"
 #include "zcm/transport/lockfree/lf_shm.h"
 #include "zcm/transport/lockfree/lf_util.h"
+#include "zcm/transport/ipcshm_region.hpp"
 #include "zcm/util/debug.h"
 #include "util/TimeUtil.hpp"
 
@@ -12,17 +25,25 @@
 #include <cstring>
 #include <cinttypes>
 #include <cassert>
+#include <climits>
 #include <unistd.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #define ZCM_TRANS_NAME TransportIpcShm
 #define DEFAULT_MSG_PAYLOAD_SZ 4096
 #define DEFAULT_DEPTH 128
+#define LOSSLESS_BACKOFF_US 100
 
 typedef struct Msg Msg;
 struct __attribute__((aligned(256))) Msg
 {
     u64  size;
+    u64  chan_hash; // see channel_hash(), for subscribers to filter on
+    u64  type_hash; // first 8 bytes of the payload: the type fingerprint of zcmtypes
     char channel[ZCM_CHANNEL_MAXLEN+1];
 
     __attribute__((aligned(256))) u8 payload[];
@@ -30,6 +51,38 @@ struct __attribute__((aligned(256))) Msg
 static_assert(alignof(Msg) == 256, "");
 static_assert(sizeof(Msg) == 256, "");
 
+// FNV-1a of the channel name
+static inline u64 channel_hash(const char *channel)
+{
+    u64 hash = 14695981039346656037ull;
+    for (const char *c = channel; *c; c++) {
+        hash ^= (u8)*c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static bool isRegexChannel(const char *channel)
+{
+    // These chars are considered regex
+    for (const char *c = channel; *c; c++)
+        if (*c == '(' || *c == ')' || *c == '|' ||
+            *c == '.' || *c == '*' || *c == '+')
+            return true;
+    return false;
+}
+
+// A message lent in place by recvmsg() with zerocopy. The zcm_msg_t's channel points at
+// 'channel', which is how the loan is found again when it's validated and released
+struct Loan
+{
+    char        channel[ZCM_CHANNEL_MAXLEN+1];
+    lf_bcast_t *bcast;
+    const Msg  *m;
+    u64         idx; // queue index of m, see lf_bcast_valid()
+};
+static_assert(offsetof(Loan, channel) == 0, "");
+
 static inline bool parse_u64(const char *s, uint64_t *_num)
 {
     uint64_t num = 0;
@@ -47,6 +100,70 @@ static inline bool parse_u64(const char *s, uint64_t *_num)
     return true;
 }
 
+// Parses a list of slot classes, "<payload size>x<count>,...", such as "4096x256,1048576x4"
+struct SlotClass { u64 payload_sz; u64 count; };
+static bool parse_slot_classes(const char *s, std::vector<SlotClass>& classes)
+{
+    classes.clear();
+    std::string list(s);
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) end = list.size();
+        std::string item = list.substr(start, end - start);
+        start = end + 1;
+
+        size_t x = item.find('x');
+        if (x == std::string::npos) return false;
+        SlotClass c;
+        if (!parse_u64(item.substr(0, x).c_str(), &c.payload_sz)) return false;
+        if (!parse_u64(item.substr(x + 1).c_str(), &c.count)) return false;
+        if (c.payload_sz == 0 || c.count == 0) return false;
+        classes.push_back(c);
+    }
+    std::sort(classes.begin(), classes.end(),
+              [](const SlotClass& a, const SlotClass& b) { return a.payload_sz < b.payload_sz; });
+    for (size_t i = 1; i < classes.size(); i++)
+        if (classes[i].payload_sz == classes[i-1].payload_sz) return false;
+    return classes.size() <= LF_BCAST_MAX_CLASSES;
+}
+
+// The transparent huge page policy of shm, "[advise]" in "always within_size [advise] never deny force"
+static std::string shmem_thp_policy()
+{
+    FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled", "r");
+    if (!f) return "";
+    char line[256] = {};
+    bool ok = fgets(line, sizeof(line), f) != nullptr;
+    fclose(f);
+    if (!ok) return "";
+    const char *start = strchr(line, '[');
+    const char *end = start ? strchr(start, ']') : nullptr;
+    if (!end) return "";
+    return std::string(start + 1, end);
+}
+
+// Parses a channel to shard map, "<channel>:<shard>,...". Returns false if a shard is out of range
+static bool parse_shard_map(const char *s, size_t nshards,
+                            std::unordered_map<std::string, u32>& shardMap)
+{
+    std::string list(s);
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) end = list.size();
+        std::string item = list.substr(start, end - start);
+        start = end + 1;
+
+        size_t colon = item.rfind(':');
+        if (colon == std::string::npos || colon == 0) return false;
+        u64 shard;
+        if (!parse_u64(item.substr(colon + 1).c_str(), &shard) || shard >= nshards) return false;
+        shardMap[item.substr(0, colon)] = (u32)shard;
+    }
+    return true;
+}
+
 static inline char *sprintf_alloc(const char *fmt, ...)
 {
     va_list va1, va2;
@@ -62,20 +179,88 @@ static inline char *sprintf_alloc(const char *fmt, ...)
     return buf;
 }
 
-struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
+// One of the rings of a region, and our position in it
+struct Shard
 {
     lf_bcast_t *bcast = nullptr;
     lf_bcast_sub_t sub[1] = {{}};
 
+    std::atomic<bool> polled {true};      // whether recvmsg() reads it
+    std::atomic<bool> resync {false};     // to skip what was published while it wasn't polled,
+    std::atomic<u64>  resyncIdx {0};      // up to this index
+    std::atomic<bool> registered {false}; // whether a cursor is registered, see recvmsg_enable()
+};
+
+struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
+{
+    // Channels are spread over the shards by hash, or by shardMap, so that publishers on
+    // different channels don't contend. Without sharding, the region is a single ring
+    size_t nshards = 1;
+    std::unique_ptr<Shard[]> shards;
+    ShardedRegion *sharded = nullptr;
+    std::unordered_map<std::string, u32> shardMap;
+    size_t nextShard = 0; // where recvmsg() looks first, to be fair to every shard
+
     Msg *recv = nullptr;
 
     size_t msg_payload_sz = DEFAULT_MSG_PAYLOAD_SZ;
     size_t msg_align = alignof(Msg);
     size_t queue_depth = DEFAULT_DEPTH;
 
+    // Slot size classes, if the region isn't made of queue_depth slots of the mtu
+    std::vector<SlotClass> slotClasses;
+
     void *mem = nullptr;
     size_t shm_size = 0;
 
+    // With prefault=async, the pages of the region are faulted in (and mlocked) by a
+    // background thread, so that creating the transport doesn't wait for it
+    std::thread prefaultThread;
+
+    // With zerocopy, recvmsg() lends messages in the shared region instead of copying
+    // them out, and with pin they also can't be overwritten until they're released
+    bool zerocopy = false;
+    bool pin = false;
+
+    std::mutex loansLock;
+    std::vector<Loan*> freeLoans;
+    size_t numLoans = 0;
+
+    // Lent messages that were overwritten before they were released
+    std::atomic<u64> overwritten {0};
+
+    // Distinct channels and regexes enabled with recvmsg_enable(). The core enables a
+    // channel for each of its subscriptions but disables it once, so these are sets.
+    // Unless a regex is enabled, or nothing is, recvmsg() skips the messages of other
+    // channels by their header alone
+    typedef std::unordered_set<u64> HashSet;
+    std::mutex filterLock;
+    std::unordered_set<std::string> enabledChannels;
+    std::unordered_set<std::string> enabledRegexes;
+    std::atomic<u64> filtered {0};
+
+    // The hashes of the enabled channels, null when not filtering. The set is replaced
+    // rather than changed, under filterLock, which also bumps filterVersion. recvmsg()
+    // keeps its own reference and only takes the lock to refresh it when the version
+    // moved on, so it doesn't for every message
+    std::shared_ptr<const HashSet> filterHashes;
+    std::atomic<u32> filterVersion {0};
+    std::shared_ptr<const HashSet> recvFilterHashes;
+    u32 recvFilterVersion = 0;
+
+    // In lossless mode, publishers wait for the subscribers that registered a cursor
+    // instead of overwriting messages they haven't read, for up to send_timeout_ms
+    // (forever if negative)
+    bool lossless = false;
+    i64 send_timeout_ms = -1;
+
+    // Subscribers more than catchup messages behind jump to the catchup_keep newest ones
+    // instead of reading through the backlog, 0 to never
+    u64 catchup = 0;
+    u64 catchup_keep = 1;
+    std::atomic<u64> sends_blocked {0};
+    std::atomic<u64> sends_timed_out {0};
+
     ZCM_TRANS_CLASSNAME(zcm_url_t *url, char **errmsg)
     {
         // Base class properties we're required to set
@@ -96,6 +281,10 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
         }
 
         int shm_open_flags = LF_SHM_FLAG_MLOCK; // mlock by default unless explicitly disabled
+        bool depth_set = false;
+        bool prefault_async = false;
+        std::string hugetlbfs;
+        const char *shard_map = nullptr;
         for (size_t i = 0; i < opts->numopts; i++) {
             u64 tmp;
             if (0 == strcmp(opts->name[i], "mtu")) {
@@ -108,6 +297,88 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
                 if (parse_u64(opts->value[i], &tmp)) {
                     ZCM_DEBUG("Setting queue_depth=%" PRIu64, tmp);
                     queue_depth = tmp;
+                    depth_set = true;
+                }
+            }
+            if (0 == strcmp(opts->name[i], "slots")) {
+                if (!parse_slot_classes(opts->value[i], slotClasses)) {
+                    char *err = sprintf_alloc("IPCSHM Invalid slots '%s': expected up to %d "
+                                              "distinct classes like '4096x256,1048576x4'",
+                                              opts->value[i], LF_BCAST_MAX_CLASSES);
+                    ZCM_DEBUG("%s", err);
+                    *errmsg = err;
+                    return;
+                }
+                ZCM_DEBUG("Setting slots=%s", opts->value[i]);
+            }
+            if (0 == strcmp(opts->name[i], "shards")) {
+                if (parse_u64(opts->value[i], &tmp) && tmp > 0) {
+                    ZCM_DEBUG("Setting shards=%" PRIu64, tmp);
+                    nshards = tmp;
+                }
+            }
+            if (0 == strcmp(opts->name[i], "shard_map")) {
+                shard_map = opts->value[i];
+            }
+            if (0 == strcmp(opts->name[i], "zerocopy")) {
+                if (parse_u64(opts->value[i], &tmp)) {
+                    ZCM_DEBUG("Setting zerocopy=%" PRIu64, tmp);
+                    zerocopy = tmp != 0;
+                }
+            }
+            if (0 == strcmp(opts->name[i], "pin")) {
+                if (parse_u64(opts->value[i], &tmp)) {
+                    ZCM_DEBUG("Setting pin=%" PRIu64, tmp);
+                    pin = tmp != 0;
+                }
+            }
+            if (0 == strcmp(opts->name[i], "lossless")) {
+                if (parse_u64(opts->value[i], &tmp)) {
+                    ZCM_DEBUG("Setting lossless=%" PRIu64, tmp);
+                    lossless = tmp != 0;
+                }
+            }
+            if (0 == strcmp(opts->name[i], "send_timeout_ms")) {
+                if (parse_u64(opts->value[i], &tmp)) {
+                    ZCM_DEBUG("Setting send_timeout_ms=%" PRIu64, tmp);
+                    send_timeout_ms = (i64)tmp;
+                }
+            }
+            if (0 == strcmp(opts->name[i], "catchup")) {
+                if (parse_u64(opts->value[i], &tmp)) {
+                    ZCM_DEBUG("Setting catchup=%" PRIu64, tmp);
+                    catchup = tmp;
+                }
+            }
+            if (0 == strcmp(opts->name[i], "catchup_keep")) {
+                if (parse_u64(opts->value[i], &tmp) && tmp > 0) {
+                    ZCM_DEBUG("Setting catchup_keep=%" PRIu64, tmp);
+                    catchup_keep = tmp;
+                }
+            }
+            if (0 == strcmp(opts->name[i], "hugetlbfs")) {
+                ZCM_DEBUG("Setting hugetlbfs=%s", opts->value[i]);
+                hugetlbfs = opts->value[i];
+            }
+            if (0 == strcmp(opts->name[i], "thp")) {
+                if (parse_u64(opts->value[i], &tmp) && tmp != 0) {
+                    ZCM_DEBUG("Enabling transparent huge pages");
+                    shm_open_flags |= LF_SHM_FLAG_THP;
+                }
+            }
+            if (0 == strcmp(opts->name[i], "prefault")) {
+                if (0 == strcmp(opts->value[i], "populate")) {
+                    ZCM_DEBUG("Prefaulting with MAP_POPULATE");
+                    shm_open_flags |= LF_SHM_FLAG_POPULATE;
+                } else if (0 == strcmp(opts->value[i], "async")) {
+                    ZCM_DEBUG("Prefaulting in the background");
+                    prefault_async = true;
+                } else if (0 != strcmp(opts->value[i], "sync")) {
+                    char *err = sprintf_alloc("IPCSHM Invalid prefault '%s': expected "
+                                              "'sync', 'populate' or 'async'", opts->value[i]);
+                    ZCM_DEBUG("%s", err);
+                    *errmsg = err;
+                    return;
                 }
             }
             if (0 == strcmp(opts->name[i], "mlock")) {
@@ -120,20 +391,92 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
             }
         }
 
+        shards.reset(new Shard[nshards]);
+        if (shard_map) {
+            if (!parse_shard_map(shard_map, nshards, shardMap)) {
+                char *err = sprintf_alloc("IPCSHM Invalid shard_map '%s': expected a list like "
+                                          "'CHANNEL_A:0,CHANNEL_B:1' of shards below %zu",
+                                          shard_map, nshards);
+                ZCM_DEBUG("%s", err);
+                *errmsg = err;
+                return;
+            }
+            ZCM_DEBUG("Setting shard_map=%s", shard_map);
+        }
+
+        // Without slot classes, the region has a single class: a slot of the mtu per
+        // queue entry. With them, the largest class sets the mtu and, unless it's given,
+        // the queue is deep enough to reference every slot
+        if (slotClasses.empty()) {
+            slotClasses.push_back({msg_payload_sz, queue_depth});
+        } else {
+            msg_payload_sz = slotClasses.back().payload_sz;
+            if (!depth_set) {
+                u64 nslots = 0;
+                for (auto& c : slotClasses) nslots += c.count;
+                queue_depth = 1;
+                while (queue_depth < nslots) queue_depth *= 2;
+            }
+            ZCM_DEBUG("Using %zu slot classes, mtu=%zu, queue_depth=%zu",
+                      slotClasses.size(), msg_payload_sz, queue_depth);
+        }
+
         // Create or join the shm region
-        size_t msg_maxsz = sizeof(Msg) + msg_payload_sz;
-        msg_maxsz = LF_ALIGN_UP(msg_maxsz, msg_align);
+        std::vector<lf_bcast_class_t> classes;
+        for (auto& c : slotClasses) {
+            size_t sz = LF_ALIGN_UP(sizeof(Msg) + c.payload_sz, msg_align);
+            classes.push_back({sz, c.count});
+        }
+        size_t msg_maxsz = classes.back().elt_sz;
+
+        size_t shard_size, region_align;
+        if (!lf_bcast_footprint_classes(queue_depth, classes.data(), classes.size(), msg_align,
+                                        &shard_size, &region_align)) {
+            char *err = sprintf_alloc("IPCSHM Invalid region parameters: depth must be a "
+                                      "power of two and slot sizes distinct");
+            ZCM_DEBUG("%s", err);
+            *errmsg = err;
+            return;
+        }
 
-        size_t region_size, region_align;
-        lf_bcast_footprint(queue_depth, msg_maxsz, msg_align, &region_size, &region_align);
+        // Every shard is a copy of the ring an unsharded region would have
+        size_t region_size = shard_size;
+        if (nshards > 1) {
+            shard_size = LF_ALIGN_UP(shard_size, region_align);
+            region_size = sizeof(ShardedRegion) + nshards * shard_size;
+        }
 
+        // Regions on hugetlbfs are made of its huge pages, and must be sized in them
         size_t page_size = getpagesize();
+        if (!hugetlbfs.empty()) {
+            page_size = lf_shm_hugetlbfs_page_size(hugetlbfs.c_str());
+            if (page_size == 0) {
+                char *err = sprintf_alloc("IPCSHM '%s' is not a hugetlbfs mount\n"
+                                          "NOTE: Huge pages are usually mounted on /dev/hugepages. "
+                                          "Try running 'mount -t hugetlbfs' to list the mounts, or "
+                                          "'mount -t hugetlbfs none <dir>' to create one",
+                                          hugetlbfs.c_str());
+                ZCM_DEBUG("%s", err);
+                *errmsg = err;
+                return;
+            }
+            ZCM_DEBUG("Using hugetlbfs pages of %zu bytes", page_size);
+        }
         assert(LF_IS_POW2(page_size)); // Sanity or paranoia..
         region_size = LF_ALIGN_UP(region_size, page_size);
 
-        char region_path[PATH_MAX+1];
-        snprintf(region_path, sizeof(region_path), "/dev/shm/zcm/ipcshm/%s", region_name);
-        region_path[PATH_MAX] = 0;
+        if (shm_open_flags & LF_SHM_FLAG_THP) {
+            std::string policy = shmem_thp_policy();
+            if (policy == "never" || policy == "deny")
+                fprintf(stderr, "ZCM Warning: ipcshm: thp=1 has no effect while "
+                        "/sys/kernel/mm/transparent_hugepage/shmem_enabled is '%s', "
+                        "set it to 'advise' to allow huge pages\n", policy.c_str());
+        }
+
+        std::string path = ipcshm_region_path(hugetlbfs, region_name);
+        const char *region_path = path.c_str();
+
+        if (prefault_async) shm_open_flags |= LF_SHM_FLAG_NOFAULT;
 
         bool created = lf_shm_create(region_path, region_size);
         ZCM_DEBUG("Shm region created: %s", created ? "true" : "false");
@@ -148,6 +491,22 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
                                     "is limiting the amount of memory that can be locked resident.\n"
                                     "Try running 'ulimit -l' to review and adjust your settings");
 
+            } else if (errcode == LF_SHM_ERR_NOMEM && !hugetlbfs.empty()) {
+                err = sprintf_alloc("IPCSHM Region mmap failed: not enough huge pages\n"
+                                    "NOTE: The region needs %zu free huge pages of %zu bytes. "
+                                    "The kernel only hands out the ones reserved in advance.\n"
+                                    "Try running 'grep Huge /proc/meminfo' to review them and "
+                                    "raise /proc/sys/vm/nr_hugepages (or the nr_hugepages of the "
+                                    "page size under /sys/kernel/mm/hugepages/)",
+                                    region_size / page_size, page_size);
+
+            } else if (errcode == LF_SHM_ERR_MADVISE) {
+                err = sprintf_alloc("IPCSHM Region madvise(MADV_HUGEPAGE) failed\n"
+                                    "NOTE: This usually happens because the kernel is built without "
+                                    "transparent huge pages. Try running "
+                                    "'cat /sys/kernel/mm/transparent_hugepage/shmem_enabled', "
+                                    "or use hugetlbfs instead");
+
             } else {
                 // generic failure
                 err = sprintf_alloc("IPCSHM Region open failed with %s (%d)", lf_shm_errstr(errcode), errcode);
@@ -168,48 +527,129 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
                                       region_name, region_size, shm_size, region_path);
             ZCM_DEBUG("%s", err);
             lf_shm_close(mem, shm_size);
+            mem = nullptr;
             *errmsg = err;
             return;
         }
 
-        if (created) {
-            bcast = lf_bcast_mem_init(mem, queue_depth, msg_maxsz, msg_align);
-        } else {
-            bcast = lf_bcast_mem_join(mem, queue_depth, msg_maxsz, msg_align);
+        char *shard_mem = (char*)mem;
+        if (nshards > 1) {
+            sharded = (ShardedRegion*)mem;
+            shard_mem += sizeof(ShardedRegion);
+            if (created) {
+                sharded->nshards = nshards;
+                sharded->shard_size = shard_size;
+                sharded->waiters = 0;
+                sharded->doorbell = 0;
+            }
         }
 
-        if (!bcast) {
-            ZCM_DEBUG("Failed to init or join shm region");
-            lf_shm_close(mem, shm_size);
+        bool joined = !sharded || (sharded->nshards == nshards && sharded->shard_size == shard_size);
+        for (size_t i = 0; i < nshards && joined; i++) {
+            Shard& sh = shards[i];
+            void *m = shard_mem + i * shard_size;
+            if (created) {
+                sh.bcast = lf_bcast_mem_init_classes(m, queue_depth, classes.data(), classes.size(), msg_align);
+            } else {
+                sh.bcast = lf_bcast_mem_join_classes(m, queue_depth, classes.data(), classes.size(), msg_align);
+            }
+            joined = !!sh.bcast;
+        }
+
+        if (!joined) {
+            char *err = sprintf_alloc("IPCSHM Failed to init or join region '%s'\n"
+                                      "NOTE: Regions created by other versions of ZCM "
+                                      "can't be joined. If the region is unused, you can "
+                                      "simply remove it with 'rm %s'",
+                                      region_name, region_path);
+            ZCM_DEBUG("%s", err);
+            leaveRegion();
+            *errmsg = err;
             return;
         }
 
-        // Init the subscriber tracking struct
-        lf_bcast_sub_init(sub, bcast);
+        // Init the subscriber tracking structs
+        for (size_t i = 0; i < nshards; i++) {
+            lf_bcast_sub_init(shards[i].sub, shards[i].bcast);
+            lf_bcast_sub_set_catchup(shards[i].sub, catchup, catchup_keep);
+        }
+
+        // Pinning only makes sense for messages read in place. Lossless subscribers move
+        // their cursor past lent messages right away, so those need to be pinned too
+        if (pin) zerocopy = true;
+        if (lossless && zerocopy) pin = true;
+        if (zerocopy) vtbl = &lendingMethods;
+
+        // Lossless publishers without a send timeout wait for room for as long as it takes,
+        // which rules out sending straight from the publishing threads
+        if (lossless && send_timeout_ms < 0)
+            vtbl = zerocopy ? &waitingLendingMethods : &waitingMethods;
 
         // Allocate a message element for copying received data into
         int ret = posix_memalign((void**)&recv, msg_align, msg_maxsz);
         if (ret != 0) {
             ZCM_DEBUG("Failed allocate recvbuf");
-            lf_bcast_mem_leave(bcast);
-            lf_shm_close(mem, shm_size);
-            bcast = NULL;
+            leaveRegion();
             return;
         }
 
+        if (prefault_async) {
+            int flags = shm_open_flags & ~LF_SHM_FLAG_NOFAULT;
+            prefaultThread = std::thread([this, flags]() {
+                if (lf_shm_prefault(mem, shm_size, flags) == LF_SHM_ERR_MLOCK)
+                    fprintf(stderr, "ZCM Warning: ipcshm: region mlock failed, the region "
+                            "is not locked resident. Try running 'ulimit -l' to review "
+                            "and adjust your settings\n");
+            });
+        }
+
         ZCM_DEBUG("Created ipcshm transport");
     }
 
     ~ZCM_TRANS_CLASSNAME()
     {
+        if (numLoans != freeLoans.size())
+            ZCM_DEBUG("Destroying ipcshm with %zu messages still lent", numLoans - freeLoans.size());
+        for (Loan *loan : freeLoans) delete loan;
+        if (prefaultThread.joinable()) prefaultThread.join();
         if (recv) free(recv);
-        if (bcast) lf_bcast_mem_leave(bcast);
+        leaveRegion();
+    }
+
+    void leaveRegion()
+    {
+        for (size_t i = 0; shards && i < nshards; i++) {
+            if (!shards[i].bcast) continue;
+            lf_bcast_sub_unregister(shards[i].sub);
+            lf_bcast_mem_leave(shards[i].bcast);
+            shards[i].bcast = nullptr;
+        }
         if (mem) lf_shm_close(mem, shm_size);
+        mem = nullptr;
     }
 
     bool good()
     {
-        return !!bcast;
+        return shards && !!shards[nshards-1].bcast;
+    }
+
+    size_t shardOf(const char *channel, u64 hash)
+    {
+        if (nshards == 1) return 0;
+        if (!shardMap.empty()) {
+            auto it = shardMap.find(channel);
+            if (it != shardMap.end()) return it->second;
+        }
+        return hash % nshards;
+    }
+
+    // Wake up the subscribers waiting on several shards, if there are any. Those reading
+    // a single shard are woken up by the shard itself
+    void ringDoorbell()
+    {
+        if (!sharded || __atomic_load_n(&sharded->waiters, __ATOMIC_SEQ_CST) == 0) return;
+        __atomic_add_fetch(&sharded->doorbell, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &sharded->doorbell, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
     }
 
     /********************** METHODS **********************/
@@ -231,32 +671,212 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
             return ZCM_EINVALID;
         }
 
-        Msg *m = (Msg*)lf_bcast_buf_acquire(bcast);
+        u64 hash = channel_hash(msg.channel);
+        lf_bcast_t *bcast = shards[shardOf(msg.channel, hash)].bcast;
+        if (lossless) return sendLossless(bcast, msg, channel_len, hash);
+
+        Msg *m = (Msg*)lf_bcast_buf_acquire_sz(bcast, sizeof(Msg) + msg.len);
         if (!m) {
-            fprintf(stderr, "IPCSHM Queue and Pool are both empty: "
-                    "this shouldn't happen if sized correctly");
-            abort(); // FIXME?
+            // Only possible when subscribers pin every buffer
+            ZCM_DEBUG("IPCSHM Queue and Pool are both empty");
+            return ZCM_EAGAIN;
         }
 
-        m->size = msg.len;
-        memcpy(m->channel, msg.channel, channel_len+1); // Checked above
-        memcpy(m->payload, msg.buf, msg.len); // Checked above
+        fillMsg(m, msg, channel_len, hash); // Checked above
 
         lf_bcast_pub(bcast, m);
+        ringDoorbell();
         return ZCM_EOK;
     }
 
+    void fillMsg(Msg *m, const zcm_msg_t& msg, size_t channel_len, u64 hash)
+    {
+        m->size = msg.len;
+        m->chan_hash = hash;
+        m->type_hash = 0;
+        memcpy(&m->type_hash, msg.buf, std::min(msg.len, sizeof(m->type_hash)));
+        memcpy(m->channel, msg.channel, channel_len+1);
+        memcpy(m->payload, msg.buf, msg.len);
+    }
+
+    int sendLossless(lf_bcast_t *bcast, const zcm_msg_t& msg, size_t channel_len, u64 hash)
+    {
+        u64 start = TimeUtil::utime();
+        int tries = 0;
+
+        Msg *m;
+        while (!(m = (Msg*)lf_bcast_buf_try_acquire_sz(bcast, sizeof(Msg) + msg.len)))
+            if (!backoff(start, tries)) return ZCM_EAGAIN;
+
+        fillMsg(m, msg, channel_len, hash);
+
+        while (!lf_bcast_try_pub(bcast, m)) {
+            if (!backoff(start, tries)) {
+                lf_bcast_buf_release(bcast, m);
+                return ZCM_EAGAIN;
+            }
+        }
+        ringDoorbell();
+        return ZCM_EOK;
+    }
+
+    // Wait a little for the slowest subscriber. Returns false once the send timed out
+    bool backoff(u64 start, int& tries)
+    {
+        if (tries++ == 0) sends_blocked++;
+        if (send_timeout_ms >= 0 && TimeUtil::utime() - start >= (u64)send_timeout_ms * 1000) {
+            sends_timed_out++;
+            return false;
+        }
+        if (tries < 16) sched_yield();
+        else usleep(LOSSLESS_BACKOFF_US);
+        return true;
+    }
+
     int recvmsg_enable(const char *channel, bool enable)
     {
+        std::unique_lock<std::mutex> lk(filterLock);
+        bool wildcard = !channel || isRegexChannel(channel);
+        auto& enabled = wildcard ? enabledRegexes : enabledChannels;
+        std::string key = channel ? channel : ".*";
+        if (enable) enabled.insert(key);
+        else        enabled.erase(key);
+
+        std::shared_ptr<HashSet> hashes;
+        if (enabledRegexes.empty() && !enabledChannels.empty()) {
+            hashes = std::make_shared<HashSet>();
+            for (auto& c : enabledChannels) hashes->insert(channel_hash(c.c_str()));
+        }
+        filterHashes = hashes;
+        filterVersion++;
+        if (nshards > 1) updatePolledShards();
+
+        // Processes that subscribe to something register a cursor in the shards they read,
+        // which tools like zcm-shm-top report, and lossless publishers wait for
+        for (size_t i = 0; enable && i < nshards; i++) {
+            Shard& sh = shards[i];
+            if (!sh.polled || sh.registered.exchange(true)) continue;
+            if (lf_bcast_sub_register_named(sh.sub, program_invocation_short_name, lossless))
+                continue;
+            if (lossless)
+                fprintf(stderr, "ZCM Warning: ipcshm: all %d subscriber cursors are in use, "
+                        "lossless publishers won't wait for this subscriber\n",
+                        LF_BCAST_MAX_CURSORS);
+            else
+                ZCM_DEBUG("All %d subscriber cursors are in use", LF_BCAST_MAX_CURSORS);
+        }
         return ZCM_EOK;
     }
 
-    int recvmsg(zcm_msg_t *msg, int timeout_millis)
+    // Only poll the shards that the enabled channels map to, unless a regex could match
+    // channels of any of them. Shards with a lossless cursor must keep being polled, or
+    // they'd stall their publishers. Must hold filterLock
+    void updatePolledShards()
+    {
+        std::vector<bool> polled(nshards, !filterHashes);
+        for (auto& c : enabledChannels)
+            polled[shardOf(c.c_str(), channel_hash(c.c_str()))] = true;
+
+        for (size_t i = 0; i < nshards; i++) {
+            Shard& sh = shards[i];
+            bool poll = polled[i] || (lossless && sh.registered);
+            if (poll && !sh.polled) {
+                sh.resyncIdx = lf_bcast_tail(sh.bcast);
+                sh.resync = true;
+            }
+            sh.polled = poll;
+        }
+    }
+
+    // Whether a message, in the middle of being consumed, may be on an enabled channel.
+    // Only its header is read, and a hash torn by a publisher lapping us is harmless:
+    // the consume then fails to validate anyway
+    bool wanted(const Msg *m)
     {
+        u32 version = filterVersion.load(std::memory_order_acquire);
+        if (version != recvFilterVersion) {
+            std::unique_lock<std::mutex> lk(filterLock);
+            recvFilterHashes = filterHashes;
+            recvFilterVersion = filterVersion;
+        }
+        return !recvFilterHashes || recvFilterHashes->count(m->chan_hash) > 0;
+    }
+
+    // Begin consuming the next message on an enabled channel, skipping the others. 'sh'
+    // is set to the shard it's in
+    const Msg *consumeNext(int timeout_millis, Shard *&sh)
+    {
+        u64 deadline = TimeUtil::utime() + (u64)timeout_millis * 1000;
         i64 timeout_nanos = (i64)timeout_millis * 1000000;
+        while (1) {
+            const Msg *m;
+            if (nshards == 1) {
+                sh = &shards[0];
+                m = (const Msg*)lf_bcast_sub_consume_begin(sh->sub, timeout_nanos);
+            } else {
+                m = consumeAnyShard(timeout_nanos, sh);
+            }
+            if (!m) return nullptr;
+            if (wanted(m)) return m;
+
+            lf_bcast_sub_consume_end(sh->sub);
+            filtered++;
+            u64 now = TimeUtil::utime();
+            timeout_nanos = now < deadline ? (i64)(deadline - now) * 1000 : 0;
+        }
+    }
+
+    // Begin consuming the next message of the first polled shard that has one, waiting
+    // for up to timeout_nanos on the doorbell of the region if none does
+    const Msg *consumeAnyShard(i64 timeout_nanos, Shard *&sh)
+    {
+        u64 deadline = TimeUtil::utime() + (u64)(timeout_nanos / 1000);
+        while (1) {
+            const Msg *m = tryShards(sh);
+            if (m || timeout_nanos <= 0) return m;
+
+            // Count ourselves as a waiter before looking again: publishers that we miss
+            // then see us, and ring the doorbell after we've read it
+            __atomic_add_fetch(&sharded->waiters, 1, __ATOMIC_SEQ_CST);
+            u32 bell = __atomic_load_n(&sharded->doorbell, __ATOMIC_SEQ_CST);
+            m = tryShards(sh);
+            if (!m) {
+                struct timespec ts;
+                ts.tv_sec = timeout_nanos / 1000000000;
+                ts.tv_nsec = timeout_nanos % 1000000000;
+                syscall(SYS_futex, &sharded->doorbell, FUTEX_WAIT, bell, &ts, NULL, 0);
+            }
+            __atomic_sub_fetch(&sharded->waiters, 1, __ATOMIC_SEQ_CST);
+            if (m) return m;
+
+            u64 now = TimeUtil::utime();
+            timeout_nanos = now < deadline ? (i64)(deadline - now) * 1000 : 0;
+        }
+    }
+
+    const Msg *tryShards(Shard *&sh)
+    {
+        for (size_t i = 0; i < nshards; i++) {
+            Shard& cur = shards[(nextShard + i) % nshards];
+            if (!cur.polled) continue;
+            if (cur.resync.exchange(false)) lf_bcast_sub_skip(cur.sub, cur.resyncIdx);
+
+            const Msg *m = (const Msg*)lf_bcast_sub_consume_begin(cur.sub, 0);
+            if (!m) continue;
+            nextShard = (nextShard + i + 1) % nshards;
+            sh = &cur;
+            return m;
+        }
+        return nullptr;
+    }
+
+    int recvmsg(zcm_msg_t *msg, int timeout_millis)
+    {
+        if (zerocopy) return lend(msg, timeout_millis);
 
         // Try to get the next message in the queue
-        const Msg *m = (const Msg*)lf_bcast_sub_consume_begin(sub, timeout_nanos);
+        Shard *sh;
+        const Msg *m = consumeNext(timeout_millis, sh);
         if (!m) return ZCM_EAGAIN;
 
         /////////////////////////////////////////////////////////////////////////
@@ -270,8 +890,8 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
         // Data is in a volatile region so it could have a transient state where
         // the size could trigger a buffer overrun!
         size_t size = m->size;
-        if (size > msg_payload_sz) { // Weird size.. drop it
-            lf_bcast_sub_consume_end(sub);
+        if (size > payloadCapacity(sh->bcast, m)) { // Weird size.. drop it
+            lf_bcast_sub_consume_end(sh->sub);
             return ZCM_EAGAIN;
         }
 
@@ -280,7 +900,7 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
         memcpy(recv->payload, m->payload, size);
 
         // Finish consuming and verify it remained valid while we consumed it
-        bool ref_valid = lf_bcast_sub_consume_end(sub);
+        bool ref_valid = lf_bcast_sub_consume_end(sh->sub);
 
         /////////////////////////////////////////////////////////////////////////
         // END VOLATILE REGION
@@ -302,19 +922,133 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
         return ZCM_EOK;
     }
 
+    // How large a payload the slot of a message can hold, which is less than the mtu for
+    // the smaller slot classes
+    size_t payloadCapacity(lf_bcast_t *bcast, const Msg *m)
+    {
+        return std::min(msg_payload_sz, lf_bcast_buf_size(bcast, m) - sizeof(Msg));
+    }
+
+    // The zerocopy flavor of recvmsg(): msg refers to the message in the shared region
+    int lend(zcm_msg_t *msg, int timeout_millis)
+    {
+        u64 idx;
+        Shard *sh;
+        const Msg *m;
+        do {
+            m = consumeNext(timeout_millis, sh);
+            if (!m) return ZCM_EAGAIN;
+        } while (!lf_bcast_sub_consume_borrow(sh->sub, pin, &idx));
+
+        // Only the channel is copied. The size is sanity checked and the channel null
+        // terminated for the same reasons as in recvmsg(), but unpinned messages can still
+        // be overwritten afterwards: it's up to the reader to validate what it reads
+        Loan *loan = newLoan();
+        size_t size = m->size;
+        memcpy(loan->channel, m->channel, sizeof(loan->channel));
+        loan->bcast = sh->bcast;
+        loan->m = m;
+        loan->idx = idx;
+
+        bool valid = size <= payloadCapacity(sh->bcast, m) &&
+                     memchr(loan->channel, 0, sizeof(loan->channel)) &&
+                     (pin || lf_bcast_valid(sh->bcast, idx));
+        if (!valid) {
+            releaseLoan(loan);
+            return ZCM_EAGAIN;
+        }
+
+        msg->utime = TimeUtil::utime();
+        msg->channel = loan->channel;
+        msg->len = size;
+        msg->buf = (uint8_t*)m->payload;
+        return ZCM_EOK;
+    }
+
+    int recvmsg_validate(const zcm_msg_t *msg)
+    {
+        const Loan *loan = (const Loan*)msg->channel;
+        if (pin || lf_bcast_valid(loan->bcast, loan->idx)) return ZCM_EOK;
+        return ZCM_EAGAIN;
+    }
+
+    void recvmsg_release(const zcm_msg_t *msg)
+    {
+        releaseLoan((Loan*)msg->channel);
+    }
+
+    Loan *newLoan()
+    {
+        std::unique_lock<std::mutex> lk(loansLock);
+        if (freeLoans.empty()) {
+            numLoans++;
+            return new Loan();
+        }
+        Loan *loan = freeLoans.back();
+        freeLoans.pop_back();
+        return loan;
+    }
+
+    void releaseLoan(Loan *loan)
+    {
+        if (pin) {
+            lf_bcast_unpin(loan->bcast, loan->m, loan->idx);
+        } else if (!lf_bcast_valid(loan->bcast, loan->idx)) {
+            overwritten++;
+        }
+
+        std::unique_lock<std::mutex> lk(loansLock);
+        freeLoans.push_back(loan);
+    }
+
     int query_drops(uint64_t *out_drops)
     {
         if (!out_drops) return ZCM_EINVALID;
-        uint64_t drops = lf_bcast_sub_drops(sub);
+        uint64_t drops = lapped() + overwritten;
         *out_drops = drops;
         return ZCM_EOK;
     }
 
+    u64 lapped()
+    {
+        u64 n = 0;
+        for (size_t i = 0; i < nshards; i++) n += lf_bcast_sub_drops(shards[i].sub);
+        return n;
+    }
+
+    u64 skipped()
+    {
+        u64 n = 0;
+        for (size_t i = 0; i < nshards; i++) n += lf_bcast_sub_skipped(shards[i].sub);
+        return n;
+    }
+
+    int query_stats(zcm_stat_t *stats, size_t *nstats)
+    {
+        const zcm_stat_t all[] = {
+            {"msgs_lapped",      lapped()},
+            {"msgs_overwritten", overwritten},
+            {"msgs_skipped",     skipped()},
+            {"sends_blocked",    sends_blocked},
+            {"sends_timed_out",  sends_timed_out},
+            {"msgs_filtered",    filtered},
+        };
+        size_t n = sizeof(all) / sizeof(all[0]);
+        for (size_t i = 0; i < n && i < *nstats; i++)
+            stats[i] = all[i];
+        *nstats = n;
+        return ZCM_EOK;
+    }
+
     /********************** STATICS **********************/
     static zcm_trans_methods_t methods;
+    static zcm_trans_methods_t lendingMethods;
+    static zcm_trans_methods_t waitingMethods;
+    static zcm_trans_methods_t waitingLendingMethods;
     static ZCM_TRANS_CLASSNAME *cast(zcm_trans_t *zt)
     {
-        assert(zt->vtbl == &methods);
+        assert(zt->vtbl == &methods || zt->vtbl == &lendingMethods ||
+               zt->vtbl == &waitingMethods || zt->vtbl == &waitingLendingMethods);
         return (ZCM_TRANS_CLASSNAME*)zt;
     }
 
@@ -333,6 +1067,15 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
     static int _query_drops(zcm_trans_t *zt, uint64_t *out_drops)
     { return cast(zt)->query_drops(out_drops); }
 
+    static int _query_stats(zcm_trans_t *zt, zcm_stat_t *stats, size_t *nstats)
+    { return cast(zt)->query_stats(stats, nstats); }
+
+    static int _recvmsg_validate(zcm_trans_t *zt, const zcm_msg_t *msg)
+    { return cast(zt)->recvmsg_validate(msg); }
+
+    static void _recvmsg_release(zcm_trans_t *zt, const zcm_msg_t *msg)
+    { return cast(zt)->recvmsg_release(msg); }
+
     static void _destroy(zcm_trans_t *zt)
     { delete cast(zt); }
 
@@ -348,6 +1091,53 @@ zcm_trans_methods_t ZCM_TRANS_CLASSNAME::methods = {
     &ZCM_TRANS_CLASSNAME::_query_drops,
     NULL, // update
     &ZCM_TRANS_CLASSNAME::_destroy,
+    &ZCM_TRANS_CLASSNAME::_query_stats,
+    NULL, // recvmsg_validate
+    NULL, // recvmsg_release
+    ZCM_TRANS_CAP_THREADSAFE_SEND,
+};
+
+zcm_trans_methods_t ZCM_TRANS_CLASSNAME::lendingMethods = {
+    &ZCM_TRANS_CLASSNAME::_get_mtu,
+    &ZCM_TRANS_CLASSNAME::_sendmsg,
+    &ZCM_TRANS_CLASSNAME::_recvmsg_enable,
+    &ZCM_TRANS_CLASSNAME::_recvmsg,
+    &ZCM_TRANS_CLASSNAME::_query_drops,
+    NULL, // update
+    &ZCM_TRANS_CLASSNAME::_destroy,
+    &ZCM_TRANS_CLASSNAME::_query_stats,
+    &ZCM_TRANS_CLASSNAME::_recvmsg_validate,
+    &ZCM_TRANS_CLASSNAME::_recvmsg_release,
+    ZCM_TRANS_CAP_THREADSAFE_SEND,
+};
+
+// Same as the above, without ZCM_TRANS_CAP_THREADSAFE_SEND: sendmsg() may wait indefinitely
+zcm_trans_methods_t ZCM_TRANS_CLASSNAME::waitingMethods = {
+    &ZCM_TRANS_CLASSNAME::_get_mtu,
+    &ZCM_TRANS_CLASSNAME::_sendmsg,
+    &ZCM_TRANS_CLASSNAME::_recvmsg_enable,
+    &ZCM_TRANS_CLASSNAME::_recvmsg,
+    &ZCM_TRANS_CLASSNAME::_query_drops,
+    NULL, // update
+    &ZCM_TRANS_CLASSNAME::_destroy,
+    &ZCM_TRANS_CLASSNAME::_query_stats,
+    NULL, // recvmsg_validate
+    NULL, // recvmsg_release
+    0,
+};
+
+zcm_trans_methods_t ZCM_TRANS_CLASSNAME::waitingLendingMethods = {
+    &ZCM_TRANS_CLASSNAME::_get_mtu,
+    &ZCM_TRANS_CLASSNAME::_sendmsg,
+    &ZCM_TRANS_CLASSNAME::_recvmsg_enable,
+    &ZCM_TRANS_CLASSNAME::_recvmsg,
+    &ZCM_TRANS_CLASSNAME::_query_drops,
+    NULL, // update
+    &ZCM_TRANS_CLASSNAME::_destroy,
+    &ZCM_TRANS_CLASSNAME::_query_stats,
+    &ZCM_TRANS_CLASSNAME::_recvmsg_validate,
+    &ZCM_TRANS_CLASSNAME::_recvmsg_release,
+    0,
 };
 
 static zcm_trans_t *create(zcm_url_t *url, char **opt_errmsg)
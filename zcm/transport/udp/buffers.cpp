@@ -1,15 +1,8 @@
 #include "buffers.hpp"
 
-static bool sockaddrEqual(struct sockaddr_in *a, struct sockaddr_in *b)
+static FragBufKey makeKey(struct sockaddr_in *from, u32 msg_seqno)
 {
-    return a->sin_addr.s_addr == b->sin_addr.s_addr &&
-           a->sin_port        == b->sin_port &&
-           a->sin_family      == b->sin_family;
-}
-
-bool FragBuf::matchesSockaddr(struct sockaddr_in *addr)
-{
-    return sockaddrEqual(&from, addr);
+    return FragBufKey{from->sin_addr.s_addr, from->sin_port, msg_seqno};
 }
 
 MessagePool::MessagePool(size_t maxSize, size_t maxBuffers)
@@ -82,69 +75,81 @@ void MessagePool::freeMessage(Message *b)
 }
 
 
-FragBuf *MessagePool::addFragBuf(u32 data_size)
+FragBuf *MessagePool::addFragBuf(struct sockaddr_in *from, u32 msg_seqno,
+                                 u32 data_size, u16 fragments_in_msg)
 {
     FragBuf *fbuf = new (mempool.alloc<FragBuf>()) FragBuf{};
-    fbuf->buf = this->allocBuffer(data_size);
-
-    while (totalSize > maxSize || fragbufs.size() > maxBuffers) {
-        // find and remove the least recently updated fragment buffer
-        int idx = -1;
-        FragBuf *eldest = nullptr;
-        for (size_t i = 0; i < fragbufs.size(); i++) {
-            FragBuf *f = fragbufs[i];
-            if (idx == -1 || f->last_packet_utime < eldest->last_packet_utime) {
-                idx = (int)i;
-                eldest = f;
-            }
-        }
-        if (eldest) {
-            _removeFragBuf((size_t)idx);
-            // XXX Need to free the removed FragBuf*
-        }
-    }
-
-    fragbufs.push_back(fbuf);
-    totalSize += data_size;
+    fbuf->from = *from;
+    fbuf->msg_seqno = msg_seqno;
+    fbuf->buf = this->allocBuffer(FRAG_BUF_DATA_OFFSET + data_size);
+    fbuf->received = this->allocBuffer((fragments_in_msg + 7) / 8);
+    memset(fbuf->received.data, 0, fbuf->received.size);
+
+    auto ret = fragbufs.emplace(makeKey(from, msg_seqno), fbuf);
+    assert(ret.second && "Tried to add a duplicate fragbuf");
+    (void)ret;
+    _linkFragBuf(fbuf);
+    totalSize += fbuf->buf.size;
 
     return fbuf;
 }
 
-FragBuf *MessagePool::lookupFragBuf(struct sockaddr_in *key)
+FragBuf *MessagePool::lookupFragBuf(struct sockaddr_in *from, u32 msg_seqno)
 {
-    for (auto& elt : fragbufs)
-        if (elt->matchesSockaddr(key))
-            return elt;
-    return nullptr;
+    auto it = fragbufs.find(makeKey(from, msg_seqno));
+    return it == fragbufs.end() ? nullptr : it->second;
 }
 
-void MessagePool::_removeFragBuf(size_t index)
+void MessagePool::removeFragBuf(FragBuf *fbuf)
 {
-    assert(index < fragbufs.size());
+    size_t erased = fragbufs.erase(makeKey(&fbuf->from, fbuf->msg_seqno));
+    assert(erased == 1 && "Tried to remove invalid fragbuf");
+    (void)erased;
+    _unlinkFragBuf(fbuf);
 
     // Update the total_size of the fragment buffers
-    FragBuf *fbuf = fragbufs[index];
     totalSize -= fbuf->buf.size;
 
-    // delete old element, move last element to this slot, and shrink by 1
-    size_t lastIdx = fragbufs.size()-1;
-    fragbufs[index] = fragbufs[lastIdx];
-    fragbufs.pop_back();
-
     this->freeBuffer(fbuf->buf);
+    this->freeBuffer(fbuf->received);
+    this->freeBuffer(fbuf->parity);
     mempool.free(fbuf);
 }
 
-void MessagePool::removeFragBuf(FragBuf *fbuf)
+void MessagePool::touchFragBuf(FragBuf *fbuf, const Packet *pkt)
 {
-    // NOTE: this is kinda slow...
-    // Search for the fragbuf index
-    for (size_t idx = 0; idx < fragbufs.size(); idx++)
-        if (fragbufs[idx] == fbuf)
-            return this->_removeFragBuf(idx);
+    fbuf->last_packet_utime = pkt->utime;
+    fbuf->last_packet_times = pkt->times;
+    if (fbuf == lruTail) return;
+    _unlinkFragBuf(fbuf);
+    _linkFragBuf(fbuf);
+}
+
+FragBuf *MessagePool::fragBufToEvict(u32 data_size)
+{
+    if (totalSize + FRAG_BUF_DATA_OFFSET + data_size > maxSize ||
+        fragbufs.size() + 1 > maxBuffers)
+        return lruHead;
+    return nullptr;
+}
 
-    // Did not find
-    assert(0 && "Tried to remove invalid fragbuf");
+void MessagePool::_unlinkFragBuf(FragBuf *fbuf)
+{
+    if (fbuf->lru_prev) fbuf->lru_prev->lru_next = fbuf->lru_next;
+    else                lruHead = fbuf->lru_next;
+    if (fbuf->lru_next) fbuf->lru_next->lru_prev = fbuf->lru_prev;
+    else                lruTail = fbuf->lru_prev;
+    fbuf->lru_prev = fbuf->lru_next = nullptr;
+}
+
+// Appends fbuf as the most recently used
+void MessagePool::_linkFragBuf(FragBuf *fbuf)
+{
+    fbuf->lru_prev = lruTail;
+    fbuf->lru_next = nullptr;
+    if (lruTail) lruTail->lru_next = fbuf;
+    else         lruHead = fbuf;
+    lruTail = fbuf;
 }
 
 void MessagePool::transferBufffer(Message *to, FragBuf *from)
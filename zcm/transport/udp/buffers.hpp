@@ -64,6 +64,97 @@ struct MsgHeaderLong
 // ASCII-encoded channel name, followed by the payload data
 // if fragment_no > 0, then header is immediately followed by the payload data
 
+// Forward error correction for a fragmented message. The message (channel, NULL and
+// data) is split into symbols of fragment_size bytes, the last one zero padded, so
+// that symbol i is the payload of fragment i. Every block of fec_n symbols gets fec_k
+// parity symbols, numbered globally by parity_no. Sent after the data fragments.
+struct MsgHeaderParity
+{
+    // Layout
+  private:
+    u32 magic;
+    u32 msg_seqno;
+    u32 fragment_size;
+    u16 fragments_in_msg;
+    u16 parity_no;
+    u8  fec_n;
+    u8  fec_k;
+    u16 reserved;
+
+    // Converted data
+  public:
+    u32  getMagic()              { return ntohl(magic); }
+    void setMagic(u32 v)         { magic = htonl(v); }
+    u32  getMsgSeqno()           { return ntohl(msg_seqno); }
+    void setMsgSeqno(u32 v)      { msg_seqno = htonl(v); }
+    u32  getFragmentSize()       { return ntohl(fragment_size); }
+    void setFragmentSize(u32 v)  { fragment_size = htonl(v); }
+    u16  getFragmentsInMsg()     { return ntohs(fragments_in_msg); }
+    void setFragmentsInMsg(u16 v){ fragments_in_msg = htons(v); }
+    u16  getParityNo()           { return ntohs(parity_no); }
+    void setParityNo(u16 v)      { parity_no = htons(v); }
+    u8   getFecN()               { return fec_n; }
+    u8   getFecK()               { return fec_k; }
+    void setFec(u8 n, u8 k)      { fec_n = n; fec_k = k; reserved = 0; }
+
+    // Computed data
+  public:
+    u8 *getDataPtr() { return (u8*)(this+1); }
+};
+
+// Several short messages coalesced into one datagram by a sender with coalesce_us.
+// Message i of the batch has msg_seqno + i. Each is a u16 (network order) length
+// followed by what a short message carries: the NULL-terminated channel and the data
+struct MsgHeaderBatch
+{
+    // Layout
+  private:
+    u32 magic;
+    u32 msg_seqno;
+    u16 nmsgs;
+    u16 reserved;
+
+    // Converted data
+  public:
+    u32  getMagic()         { return ntohl(magic); }
+    void setMagic(u32 v)    { magic = htonl(v); }
+    u32  getMsgSeqno()      { return ntohl(msg_seqno); }
+    void setMsgSeqno(u32 v) { msg_seqno = htonl(v); }
+    u16  getNumMsgs()       { return ntohs(nmsgs); }
+    void setNumMsgs(u16 v)  { nmsgs = htons(v); reserved = 0; }
+
+    // Computed data
+  public:
+    char *getEntriesPtr() { return (char*)(this+1); }
+};
+
+// Sent by a receiver back to the source address of a fragmented message to request
+// the fragments it is missing
+struct MsgHeaderNack
+{
+    // Layout
+  private:
+    u32 magic;
+    u32 msg_seqno;
+    u16 nfragments;
+    u16 reserved;
+
+    // Converted data
+  public:
+    u32  getMagic()            { return ntohl(magic); }
+    void setMagic(u32 v)       { magic = htonl(v); }
+    u32  getMsgSeqno()         { return ntohl(msg_seqno); }
+    void setMsgSeqno(u32 v)    { msg_seqno = htonl(v); }
+    u16  getNumFragments()     { return ntohs(nfragments); }
+    void setNumFragments(u16 v){ nfragments = htons(v); reserved = 0; }
+
+    // Computed data
+  public:
+    // Note: the requested fragment numbers (u16, network order) follow the header
+    u16 getFragmentNo(size_t i) { return ntohs(((u16*)(this+1))[i]); }
+    size_t getMaxFragments(size_t pktsz) { return (pktsz - sizeof(*this)) / sizeof(u16); }
+};
+
 /******************** message buffer **********************/
 struct Buffer
 {
@@ -92,9 +183,18 @@ struct Buffer
     }
 };
 
+// Receive timestamps in nanoseconds, 0 if unknown
+struct RecvTimes
+{
+    i64 kernel_ns = 0;  // arrival in the kernel
+    i64 hw_ns = 0;      // arrival at the NIC, in the NIC's clock
+    i64 dequeue_ns = 0; // when recvmsg() returned it
+};
+
 struct Message
 {
     i64               utime = 0;          // timestamp of first datagram receipt
+    RecvTimes         times;              // of the last datagram of the message
 
     const char       *channel = nullptr;  // points into 'buf'
     size_t            channellen = 0;     // length of channel
@@ -111,7 +211,11 @@ struct Message
 struct Packet
 {
     i64             utime = 0;      // timestamp of first datagram receipt
+    RecvTimes       times;
     size_t          sz = 0;         // size received
+    size_t          segsz = 0;      // size of each coalesced datagram (GRO), 0 if only one
+    u32             kernel_drops = 0; // datagrams the socket had dropped when this one was
+                                      // queued (SO_RXQ_OVFL), 0 if unknown
 
     struct sockaddr from = {};      // sender
     socklen_t       fromlen = {};
@@ -125,21 +229,70 @@ struct Packet
 };
 
 /******************** fragment buffer **********************/
+// The channel is stored at the beginning of the buffer. The data starts after
+// a fixed size prefix so that fragments can be stored before the first one arrives
+#define FRAG_BUF_DATA_OFFSET (ZCM_CHANNEL_MAXLEN + 1)
+
 struct FragBuf
 {
+    i64     first_packet_utime;
     i64     last_packet_utime;
+    RecvTimes last_packet_times;
+    i64     last_nack_utime;
     u32     msg_seqno;
+    u32     msg_size;
+    u16     fragments_in_msg;
     u16     fragments_remaining;
+    u16     highest_fragment_no;
+    bool    nacked; // a retransmission was requested for this message
 
-    // The channel starts at the beginning of the buffer. The data
-    // follows immediately after the channel and its NULL
+    // Only valid once fragment 0 has been received
+    bool    have_channel;
     size_t  channellen;
     struct sockaddr_in from;
 
+    // Any fragment other than the first, to locate the channel before fragment 0 is
+    // received. Only valid if sample_fragment_no is not 0
+    u16     sample_fragment_no;
+    u32     sample_fragment_offset;
+
+    // Set by the first parity fragment. fec_symsz is 0 until then
+    u32     fec_symsz;
+    u8      fec_n;
+    u8      fec_k;
+    Buffer  parity; // fec_k symbols per block, then one received flag per symbol
+
     // Fields set by the allocator object
     Buffer buf;
+    Buffer received; // one bit per fragment
+    FragBuf *lru_prev; // neighbours by last_packet_utime
+    FragBuf *lru_next;
+
+    bool hasFragment(u16 fragment_no)
+    { return received.data[fragment_no / 8] & (1 << (fragment_no % 8)); }
+    void markFragment(u16 fragment_no)
+    { received.data[fragment_no / 8] |= (1 << (fragment_no % 8)); }
+};
+
+// Fragment buffers are identified by their sender and the sender's message seqno, so
+// several messages from one sender can be reassembled at the same time
+struct FragBufKey
+{
+    u32 addr;
+    u16 port;
+    u32 msg_seqno;
+
+    bool operator==(const FragBufKey& o) const
+    { return addr == o.addr && port == o.port && msg_seqno == o.msg_seqno; }
+};
 
-    bool matchesSockaddr(struct sockaddr_in *addr);
+struct FragBufKeyHash
+{
+    size_t operator()(const FragBufKey& k) const
+    {
+        u64 v = ((u64)k.addr << 16 | k.port) * 0x9e3779b97f4a7c15ull;
+        return (size_t)(v ^ (v >> 29) ^ k.msg_seqno * 0xff51afd7ed558ccdull);
+    }
 };
 
 /************** A pool to handle every alloc/dealloc operation on Message objects ******/
@@ -162,20 +315,38 @@ struct MessagePool
     void freeMessage(Message *b);
 
     // FragBuf
-    FragBuf *addFragBuf(u32 data_size);
-    FragBuf *lookupFragBuf(struct sockaddr_in *key);
+    FragBuf *addFragBuf(struct sockaddr_in *from, u32 msg_seqno,
+                        u32 data_size, u16 fragments_in_msg);
+    FragBuf *lookupFragBuf(struct sockaddr_in *from, u32 msg_seqno);
     void removeFragBuf(FragBuf *fbuf);
+    // Records that a fragment was just received, making fbuf the most recently used
+    void touchFragBuf(FragBuf *fbuf, const Packet *pkt);
+    // Returns the least recently used fragment buffer if there is no room for a new
+    // one holding data_size bytes, or NULL if there is
+    FragBuf *fragBufToEvict(u32 data_size);
+    size_t numFragBufs() { return fragbufs.size(); }
+    // Least recently used first, follow lru_next for the others
+    FragBuf *oldestFragBuf() { return lruHead; }
+
+    // Memory
+    void useHugePages() { mempool.useHugePages(); }
+    // Preallocates what's needed to receive a message of up to maxMsgSize bytes
+    void reserve(size_t maxMsgSize, size_t count)
+    { mempool.reserve(FRAG_BUF_DATA_OFFSET + maxMsgSize, count); }
 
     void transferBufffer(Message *to, FragBuf *from);
     void moveBuffer(Buffer& to, Buffer& from);
 
   private:
     void _freeMessageBuffer(Message *b);
-    void _removeFragBuf(size_t index);
+    void _unlinkFragBuf(FragBuf *fbuf);
+    void _linkFragBuf(FragBuf *fbuf);
 
   private:
     MemPool mempool;
-    vector<FragBuf*> fragbufs;
+    unordered_map<FragBufKey, FragBuf*, FragBufKeyHash> fragbufs;
+    FragBuf *lruHead = nullptr;
+    FragBuf *lruTail = nullptr;
     size_t maxSize;
     size_t maxBuffers;
     size_t totalSize = 0;
@@ -0,0 +1,100 @@
+#include "channelfilter.hpp"
+#include "buffers.hpp"
+
+#ifdef USE_BPF_FILTER
+
+// A socket filter on a UDP socket sees the packet starting at the UDP header
+#define PAYLOAD_OFFSET 8
+#define SHORT_CHANNEL_OFFSET (PAYLOAD_OFFSET + sizeof(MsgHeaderShort))
+#define LONG_CHANNEL_OFFSET  (PAYLOAD_OFFSET + sizeof(MsgHeaderLong))
+#define LONG_FRAGMENT_NO_OFFSET (PAYLOAD_OFFSET + offsetof(MsgHeaderLong, fragment_no))
+
+#define ACCEPT 0xffffffff
+#define DROP 0
+
+bool buildChannelFilter(const vector<string>& channels, vector<struct sock_filter>& prog)
+{
+    // Loads past the end of the packet make the filter drop it, so shorter names are
+    // tested first: a packet is never dropped for being shorter than a name that
+    // comes before its own
+    vector<string> sorted(channels);
+    std::sort(sorted.begin(), sorted.end(),
+              [](const string& a, const string& b) { return a.size() < b.size(); });
+
+    prog.clear();
+    prog.insert(prog.end(), {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, PAYLOAD_OFFSET),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ZCM_MAGIC_LONG, 0, 5),
+
+        // Fragments after the first don't carry the channel
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, LONG_FRAGMENT_NO_OFFSET),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, ACCEPT),
+        BPF_STMT(BPF_LDX | BPF_IMM, LONG_CHANNEL_OFFSET),
+        BPF_JUMP(BPF_JMP | BPF_JA, 3, 0, 0),
+
+        // Neither a short message nor a fragment: NACK, parity or unknown
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ZCM_MAGIC_SHORT, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, ACCEPT),
+        BPF_STMT(BPF_LDX | BPF_IMM, SHORT_CHANNEL_OFFSET),
+    });
+
+    // X now holds the offset of the channel. Compare it, including its NULL
+    // terminator, against each name a word at a time
+    for (const string& channel : sorted) {
+        const u8 *name = (const u8*)channel.c_str();
+        size_t len = channel.size() + 1;
+
+        vector<struct sock_filter> block;
+        for (size_t i = 0; i < len;) {
+            u32 size, val;
+            size_t n;
+            if (len - i >= 4) {
+                size = BPF_W; n = 4;
+                val = (u32)name[i] << 24 | (u32)name[i+1] << 16 | (u32)name[i+2] << 8 | name[i+3];
+            } else if (len - i >= 2) {
+                size = BPF_H; n = 2;
+                val = (u32)name[i] << 8 | name[i+1];
+            } else {
+                size = BPF_B; n = 1;
+                val = name[i];
+            }
+            block.push_back(BPF_STMT(BPF_LD | size | BPF_IND, (u32)i));
+            block.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, val, 0, 0));
+            i += n;
+        }
+        block.push_back(BPF_STMT(BPF_RET | BPF_K, ACCEPT));
+
+        // On a mismatch, skip to the next name
+        for (size_t i = 1; i < block.size(); i += 2) {
+            size_t skip = block.size() - i - 1;
+            if (skip > 255) return false;
+            block[i].jf = (u8)skip;
+        }
+        prog.insert(prog.end(), block.begin(), block.end());
+        if (prog.size() >= BPF_MAXINSNS) return false;
+    }
+
+    prog.push_back(BPF_STMT(BPF_RET | BPF_K, DROP));
+    return true;
+}
+
+void addShardFilter(u32 shard, u32 nshards, vector<struct sock_filter>& prog)
+{
+    vector<struct sock_filter> prefix = {
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 0), // source port
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (u32)SKF_NET_OFF + 12), // source address
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, nshards),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, shard, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, DROP),
+    };
+    if (prog.empty())
+        prog.push_back(BPF_STMT(BPF_RET | BPF_K, ACCEPT));
+    prog.insert(prog.begin(), prefix.begin(), prefix.end());
+}
+
+#endif
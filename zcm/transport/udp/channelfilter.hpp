@@ -0,0 +1,19 @@
+#pragma once
+#include "udp.hpp"
+
+#ifdef USE_BPF_FILTER
+#include <linux/filter.h>
+
+// Generates a classic BPF socket filter that drops, in the kernel, the datagrams of
+// channels that aren't in a set. Only short messages and first fragments carry the
+// channel, so continuation fragments, NACKs and parity packets are always accepted.
+//
+// Returns false if the program would be too large, in which case no filter should be
+// attached and every datagram accepted.
+bool buildChannelFilter(const vector<string>& channels, vector<struct sock_filter>& prog);
+
+// Prefixes prog, where an empty program accepts everything, with a check that drops the
+// datagrams of senders that don't hash, by address and port, to the given shard
+void addShardFilter(u32 shard, u32 nshards, vector<struct sock_filter>& prog);
+
+#endif
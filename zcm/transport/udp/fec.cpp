@@ -0,0 +1,154 @@
+#include "fec.hpp"
+
+/************************* GF(2^8) arithmetic *******************/
+namespace {
+
+struct GF256
+{
+    u8 exp[512];
+    u8 log[256];
+    u8 mul[256][256];
+
+    GF256()
+    {
+        // generator 2 of the field defined by x^8 + x^4 + x^3 + x^2 + 1
+        u32 x = 1;
+        for (int i = 0; i < 255; i++) {
+            exp[i] = exp[i + 255] = (u8)x;
+            log[x] = (u8)i;
+            x <<= 1;
+            if (x & 0x100) x ^= 0x11d;
+        }
+        exp[510] = exp[511] = exp[0];
+        log[0] = 0;
+
+        for (int a = 0; a < 256; a++)
+            for (int b = 0; b < 256; b++)
+                mul[a][b] = (a && b) ? exp[log[a] + log[b]] : 0;
+    }
+
+    u8 inv(u8 a) const { return exp[255 - log[a]]; }
+};
+
+const GF256& gf()
+{
+    static GF256 g;
+    return g;
+}
+
+// dst ^= src, a word at a time so the compiler can vectorize it
+void xorInto(u8 *dst, const u8 *src, size_t len)
+{
+    size_t i = 0;
+    for (; i + sizeof(u64) <= len; i += sizeof(u64)) {
+        u64 a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+    for (; i < len; i++)
+        dst[i] ^= src[i];
+}
+
+// dst ^= c * src
+void mulAddInto(u8 *dst, const u8 *src, u8 c, size_t len)
+{
+    if (c == 0) return;
+    if (c == 1) return xorInto(dst, src, len);
+    const u8 *row = gf().mul[c];
+    for (size_t i = 0; i < len; i++)
+        dst[i] ^= row[src[i]];
+}
+
+}
+
+/************************* FecCodec *******************/
+FecCodec::FecCodec(u8 n, u8 k) : n(n), k(k), coefs((size_t)n * k)
+{
+    assert(isValid(n, k));
+    const GF256& g = gf();
+
+    // Cauchy matrix 1 / (x_j + y_i) with x_j = n + j and y_i = i. Every square
+    // submatrix of it is invertible, and scaling a column keeps that true, so
+    // dividing each column by its first entry keeps the code MDS
+    for (size_t i = 0; i < n; i++) {
+        u8 first = g.inv((u8)(n ^ i));
+        for (u8 j = 0; j < k; j++) {
+            u8 c = g.inv((u8)((n + j) ^ i));
+            coefs[j * n + i] = g.mul[c][g.inv(first)];
+        }
+    }
+}
+
+void FecCodec::encode(const u8 *const *data, size_t nsyms, size_t symsz, u8 j, u8 *parity) const
+{
+    assert(nsyms <= n && j < k);
+    memset(parity, 0, symsz);
+    for (size_t i = 0; i < nsyms; i++)
+        mulAddInto(parity, data[i], coef(j, i), symsz);
+}
+
+bool FecCodec::decode(u8 *const *data, const bool *have, size_t nsyms,
+                      const u8 *const *parity, const u8 *parityNo, size_t nparity,
+                      size_t symsz) const
+{
+    assert(nsyms <= n);
+    const GF256& g = gf();
+
+    vector<size_t> missing;
+    for (size_t i = 0; i < nsyms; i++)
+        if (!have[i]) missing.push_back(i);
+    size_t e = missing.size();
+    if (e == 0) return true;
+    if (nparity < e) return false;
+
+    // Remove the contribution of the symbols we have from e of the parity symbols,
+    // leaving A * missing = s
+    vector<u8> s(e * symsz);
+    vector<u8> a(e * e);
+    for (size_t r = 0; r < e; r++) {
+        u8 *sr = &s[r * symsz];
+        memcpy(sr, parity[r], symsz);
+        for (size_t i = 0; i < nsyms; i++)
+            if (have[i]) mulAddInto(sr, data[i], coef(parityNo[r], i), symsz);
+        for (size_t c = 0; c < e; c++)
+            a[r * e + c] = coef(parityNo[r], missing[c]);
+    }
+
+    // Invert A with Gauss-Jordan elimination
+    vector<u8> ainv(e * e, 0);
+    for (size_t r = 0; r < e; r++) ainv[r * e + r] = 1;
+    for (size_t col = 0; col < e; col++) {
+        size_t pivot = col;
+        while (pivot < e && a[pivot * e + col] == 0) pivot++;
+        if (pivot == e) return false;
+        if (pivot != col) {
+            for (size_t c = 0; c < e; c++) {
+                std::swap(a[pivot * e + c], a[col * e + c]);
+                std::swap(ainv[pivot * e + c], ainv[col * e + c]);
+            }
+        }
+        u8 scale = g.inv(a[col * e + col]);
+        for (size_t c = 0; c < e; c++) {
+            a[col * e + c] = g.mul[scale][a[col * e + c]];
+            ainv[col * e + c] = g.mul[scale][ainv[col * e + c]];
+        }
+        for (size_t r = 0; r < e; r++) {
+            u8 f = a[r * e + col];
+            if (r == col || f == 0) continue;
+            for (size_t c = 0; c < e; c++) {
+                a[r * e + c] ^= g.mul[f][a[col * e + c]];
+                ainv[r * e + c] ^= g.mul[f][ainv[col * e + c]];
+            }
+        }
+    }
+
+    for (size_t c = 0; c < e; c++) {
+        u8 *d = data[missing[c]];
+        memset(d, 0, symsz);
+        for (size_t r = 0; r < e; r++)
+            mulAddInto(d, &s[r * symsz], ainv[c * e + r], symsz);
+    }
+    return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include "udp.hpp"
+
+// Systematic Reed-Solomon erasure code over GF(2^8).
+//
+// Each block of up to N data symbols gets K parity symbols, and any N of the N+K
+// symbols are enough to rebuild the block. The coefficients come from a Cauchy
+// matrix with its columns scaled so that the first parity symbol is the plain XOR
+// of the data symbols, which makes K=1 (and the most common recovery) cheap.
+class FecCodec
+{
+  public:
+    FecCodec(u8 n, u8 k);
+
+    u8 numData() const { return n; }
+    u8 numParity() const { return k; }
+
+    static bool isValid(int n, int k) { return n >= 1 && k >= 1 && n + k <= 256; }
+
+    // Computes parity symbol j of a block of nsyms <= numData() data symbols
+    void encode(const u8 *const *data, size_t nsyms, size_t symsz, u8 j, u8 *parity) const;
+
+    // Rebuilds, in place, the data symbols of a block for which have[i] is false
+    // using the given parity symbols (parityNo[r] is the index of parity[r] within
+    // the block). Returns false if there aren't enough parity symbols.
+    bool decode(u8 *const *data, const bool *have, size_t nsyms,
+                const u8 *const *parity, const u8 *parityNo, size_t nparity,
+                size_t symsz) const;
+
+  private:
+    u8 coef(u8 j, size_t i) const { return coefs[j * n + i]; }
+
+    u8 n, k;
+    vector<u8> coefs; // k rows of n coefficients
+};
@@ -4,23 +4,18 @@
 #include <cstring>
 #include <climits>
 
+#ifdef __linux__
+# include <sys/mman.h>
+#endif
+
+// Smallest block is 2^MINBITS bytes
+static const size_t MINBITS = 6;
+
 MemPool::MemPool()
 {
     memset(sizelists, 0, sizeof(sizelists));
 }
 
-MemPool::~MemPool()
-{
-    for (size_t i = 0; i < NUMLISTS; i++) {
-        Block *blk = sizelists[i];
-        while (blk) {
-            auto *next = blk->next;
-            std::free(blk);
-            blk = next;
-        }
-    }
-}
-
 static bool fitsInU32(size_t v)
 {
     return (v & 0xffffffff) == v;
@@ -31,17 +26,72 @@ static int computeSlot(size_t v)
     // Note: Only works on 32-bit and 64-bit systems
     assert(sizeof(unsigned) == 4 && CHAR_BIT == 8);
     assert(fitsInU32(v));
+    // Everything up to the smallest block size shares the first slot
+    if (v <= (1<<MINBITS))
+        return 0;
     size_t bits = 31 - __builtin_clz((u32)v);
     if ((size_t)(1<<bits) != v)
         bits += 1;
     assert((size_t)(1<<(bits-1)) < v && v <= (size_t)(1<<bits));
-    bits = std::max(bits, (size_t)16);
-    return bits - 16;
+    return bits - MINBITS;
 }
 
 static size_t slotToSize(int slot)
 {
-    return 1 << (slot+16);
+    return 1 << (slot+MINBITS);
+}
+
+MemPool::~MemPool()
+{
+    for (size_t i = 0; i < NUMLISTS; i++) {
+        Block *blk = sizelists[i];
+        while (blk) {
+            auto *next = blk->next;
+            freeBlock((char*)blk, i);
+            blk = next;
+        }
+    }
+}
+
+void MemPool::useHugePages()
+{
+#ifdef __linux__
+    assert(!used && "useHugePages() must be called before any alloc()");
+    hugepages = true;
+#endif
+}
+
+char *MemPool::allocBlock(int slot)
+{
+    size_t sz = slotToSize(slot);
+#ifdef __linux__
+    if (hugepages && sz >= HUGE_BLOCK_SIZE) {
+        void *mem = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem == MAP_FAILED) {
+            // No hugepages reserved, so ask for transparent ones
+            mem = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) return NULL;
+# ifdef MADV_HUGEPAGE
+            madvise(mem, sz, MADV_HUGEPAGE);
+# endif
+        }
+        return (char*)mem;
+    }
+#endif
+    return (char*)malloc(sz);
+}
+
+void MemPool::freeBlock(char *mem, int slot)
+{
+    size_t sz = slotToSize(slot);
+#ifdef __linux__
+    if (hugepages && sz >= HUGE_BLOCK_SIZE) {
+        munmap(mem, sz);
+        return;
+    }
+#endif
+    std::free(mem);
 }
 
 char *MemPool::alloc(size_t sz)
@@ -51,13 +101,14 @@ char *MemPool::alloc(size_t sz)
     assert(fitsInU32(sz));
     int slot = computeSlot(sz);
     assert(0 <= slot && slot < (int)NUMLISTS);
+    used = true;
 
     Block *mem = sizelists[slot];
     if (mem) {
         sizelists[slot] = mem->next;
         return (char*)mem;
     } else {
-        return (char*)malloc(slotToSize(slot));
+        return allocBlock(slot);
     }
 }
 
@@ -74,12 +125,35 @@ void MemPool::free(char *mem, size_t sz)
     sizelists[slot] = newblock;
 }
 
+void MemPool::reserve(size_t maxsz, size_t count)
+{
+    assert(maxsz <= (1<<28));
+    used = true;
+    int maxslot = computeSlot(maxsz);
+    for (int slot = 0; slot <= maxslot; slot++) {
+        for (size_t i = 0; i < count; i++) {
+            char *mem = allocBlock(slot);
+            if (!mem) return;
+            memset(mem, 0, slotToSize(slot));
+            Block *newblock = (Block*)mem;
+            newblock->next = sizelists[slot];
+            sizelists[slot] = newblock;
+        }
+    }
+}
+
 void MemPool::test()
 {
     MemPool pool;
 
+    char *small = pool.alloc(40);
+    assert(small);
+    pool.free(small, 40);
+    char *small2 = pool.alloc(64);
+    assert(small == small2);
+    pool.free(small2, 64);
     char *buf = pool.alloc(70000);
-    assert(buf);
+    assert(buf && buf != small);
     pool.free(buf, 70000);
     char *buf2 = pool.alloc(1<<17);
     assert(buf == buf2);
@@ -17,12 +17,27 @@ class MemPool
     template<class T>
     void free(T *ptr);
 
+    // Back blocks of HUGE_BLOCK_SIZE and up with hugepages (MAP_HUGETLB), or with
+    // transparent hugepages if none are reserved. Must be called before any alloc()
+    void useHugePages();
+
+    // Fills the free lists with 'count' blocks of every size up to 'maxsz', touching
+    // their pages so that the first use doesn't fault them in
+    void reserve(size_t maxsz, size_t count);
+
     static void test();
 
+  private:
+    char *allocBlock(int slot);
+    void freeBlock(char *mem, int slot);
+
   private:
     struct Block { Block *next; };
-    static const size_t NUMLISTS = 13;
-    Block* sizelists[NUMLISTS]; // Pow2 blocks from 2^16 to 2^28
+    static const size_t NUMLISTS = 23;
+    static const size_t HUGE_BLOCK_SIZE = 1 << 21;
+    Block* sizelists[NUMLISTS]; // Pow2 blocks from 2^6 to 2^28
+    bool hugepages = false;
+    bool used = false; // whether any block was handed out yet
 
   private:
     // Disallow copies and moves
@@ -0,0 +1,32 @@
+#include "pacer.hpp"
+
+#include "util/TimeUtil.hpp"
+
+Pacer::Pacer(u64 bytesPerSec, size_t burstBytes) :
+    bytesPerUs(bytesPerSec / 1e6), burst(burstBytes), tokens(burstBytes),
+    last_utime(TimeUtil::utime())
+{}
+
+void Pacer::pace(size_t bytes)
+{
+    i64 wait_us;
+    {
+        std::unique_lock<std::mutex> lk(mut);
+        i64 now = TimeUtil::utime();
+        tokens = std::min(burst, tokens + (now - last_utime) * bytesPerUs);
+        last_utime = now;
+
+        // Concurrent senders queue up behind each other's debt
+        tokens -= bytes;
+        wait_us = tokens < 0 ? (i64)(-tokens / bytesPerUs) + 1 : 0;
+    }
+    bytes_paced += bytes;
+
+    if (wait_us > 0) {
+        // Oversleeping is made up for by the tokens refilled in the meantime, up to
+        // the size of the bucket
+        delays++;
+        delay_us += wait_us;
+        std::this_thread::sleep_for(std::chrono::microseconds(wait_us));
+    }
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include "udp.hpp"
+
+// Token bucket limiting the rate at which datagrams leave a socket. Tokens are bytes,
+// refilled at a fixed rate up to the size of the bucket. A send may take more tokens
+// than there are, in which case it waits until the debt is paid off, so datagrams
+// larger than the bucket are still sent and the average rate still holds.
+//
+// Shared by the sending thread and the thread resending fragments for NACKs.
+class Pacer
+{
+  public:
+    Pacer(u64 bytesPerSec, size_t burstBytes);
+
+    // Blocks until a datagram of the given size may be sent
+    void pace(size_t bytes);
+
+    std::atomic<u64> bytes_paced {0};
+    std::atomic<u64> delays {0};   // sends that had to wait
+    std::atomic<u64> delay_us {0}; // total time spent waiting
+
+  private:
+    std::mutex mut;
+    double bytesPerUs;
+    double burst;
+    double tokens;
+    i64 last_utime;
+};
@@ -0,0 +1,45 @@
+#include "retransmit.hpp"
+
+void SentMessage::getFragment(u16 fragment_no, u32& offset, u32& len) const
+{
+    // first fragment is special.  it carries the channel before the data
+    u32 firstfrag_datasize = fragment_size - (channel.size() + 1);
+    if (fragment_no == 0) {
+        offset = 0;
+        len = std::min(firstfrag_datasize, (u32)data.size());
+    } else {
+        offset = firstfrag_datasize + (u32)(fragment_no - 1) * fragment_size;
+        len = offset < data.size() ? std::min(fragment_size, (u32)data.size() - offset) : 0;
+    }
+}
+
+void RetransmitWindow::add(u32 msg_seqno, const char *channel, const u8 *data, size_t len,
+                           u32 fragment_size, u16 fragments_in_msg)
+{
+    // Too big to ever be retransmitted
+    if (len > maxBytes) return;
+
+    auto sm = std::make_shared<SentMessage>();
+    sm->msg_seqno = msg_seqno;
+    sm->channel = channel;
+    sm->data.assign((const char*)data, (const char*)data + len);
+    sm->fragment_size = fragment_size;
+    sm->fragments_in_msg = fragments_in_msg;
+
+    std::unique_lock<std::mutex> lk(mut);
+    while (!msgs.empty() && bytes + len > maxBytes) {
+        bytes -= msgs.front()->data.size();
+        msgs.pop_front();
+    }
+    msgs.push_back(std::move(sm));
+    bytes += len;
+}
+
+std::shared_ptr<const SentMessage> RetransmitWindow::find(u32 msg_seqno)
+{
+    std::unique_lock<std::mutex> lk(mut);
+    for (auto it = msgs.rbegin(); it != msgs.rend(); ++it)
+        if ((*it)->msg_seqno == msg_seqno)
+            return *it;
+    return nullptr;
+}
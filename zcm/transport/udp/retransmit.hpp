@@ -0,0 +1,40 @@
+#pragma once
+#include "udp.hpp"
+
+#include <deque>
+
+// A copy of a recently sent fragmented message, kept so that fragments can be resent
+struct SentMessage
+{
+    u32          msg_seqno;
+    string       channel;
+    vector<char> data;
+    u32          fragment_size; // payload bytes per fragment, including the channel in the first
+    u16          fragments_in_msg;
+
+    // Returns the offset into 'data' and the number of data bytes of a fragment
+    void getFragment(u16 fragment_no, u32& offset, u32& len) const;
+};
+
+// Bounded (in bytes) window of the most recently sent fragmented messages. It is
+// filled by the sending thread and read by the thread servicing NACKs. Messages are
+// immutable once added, so the NACK thread can resend from one without holding the
+// window lock, and the sending thread never waits behind a resend.
+class RetransmitWindow
+{
+  public:
+    RetransmitWindow(size_t maxBytes) : maxBytes(maxBytes) {}
+
+    void add(u32 msg_seqno, const char *channel, const u8 *data, size_t len,
+             u32 fragment_size, u16 fragments_in_msg);
+
+    // Returns the message with the given seqno, which stays valid after it leaves the
+    // window, or null if it is no longer (or never was) in the window
+    std::shared_ptr<const SentMessage> find(u32 msg_seqno);
+
+  private:
+    std::mutex mut;
+    std::deque<std::shared_ptr<const SentMessage>> msgs;
+    size_t bytes = 0;
+    size_t maxBytes;
+};
@@ -2,12 +2,17 @@
 #include "buffers.hpp"
 #include "udpsocket.hpp"
 #include "mempool.hpp"
+#include "retransmit.hpp"
+#include "fec.hpp"
+#include "channelfilter.hpp"
+#include "pacer.hpp"
 
 #include "zcm/transport.h"
 #include "zcm/transport_registrar.h"
 #include "zcm/transport_register.hpp"
 
 #include "util/StringUtil.hpp"
+#include "util/TimeUtil.hpp"
 
 #define MTU (1<<28)
 
@@ -29,6 +34,43 @@ static i32 utimeInSeconds()
  *                  don't use > 1.  that's just rude.
  * @recv_buf_size:  requested size of the kernel receive buffer, set with
  *                  SO_RCVBUF.  0 indicates to use the default settings.
+ * @gso:            if true, large messages are split into fragments of @gso_size
+ *                  bytes and handed to the kernel in batches (UDP_SEGMENT)
+ * @gro:            if true, the kernel may coalesce received datagrams (UDP_GRO)
+ * @gso_size:       datagram size used for fragments when @gso is set. If 0, it is
+ *                  derived from the MTU of the route to @addr
+ * @nack:           if true, receivers request retransmission of lost fragments and
+ *                  senders keep recently sent messages around to serve those requests
+ * @nack_deadline_ms: how long after its first fragment a receiver keeps trying to
+ *                  recover a message
+ * @nack_window:    bytes of recently sent messages kept for retransmission
+ * @fec_n, @fec_k:  if @fec_k is non-zero, @fec_k parity fragments are sent for every
+ *                  block of @fec_n fragments of a large message
+ * @groups:         if > 1, channels are hashed onto this many consecutive multicast
+ *                  groups starting at @addr, and receivers only join the groups of
+ *                  the channels they are subscribed to
+ * @bpf:            if true, a socket filter drops the datagrams of channels that
+ *                  haven't been enabled in the kernel, before they are copied out.
+ *                  Ignored with @gro, @nack or @fec_k
+ * @hugepages:      if true, large reassembly buffers are backed by hugepages
+ * @prealloc:       if non-zero, buffers to reassemble messages up to this size are
+ *                  allocated, and their pages touched, up front
+ * @coalesce_us:    if non-zero, short messages are packed together into datagrams of up
+ *                  to @coalesce_bytes. A message waits at most this long for others
+ *                  to join it, and not at all once the send queue is empty
+ * @coalesce_bytes: largest datagram that short messages are coalesced into
+ * @busy_poll_us:   if non-zero, receivers spin on their non-blocking socket for up to
+ *                  this long before falling back to waiting in select()
+ * @rx_shards:      if > 1, this many sockets share the port, each read and
+ *                  reassembled by its own thread. Every sender is assigned to one
+ *                  of them by its address and port
+ * @rate_mbps:      if non-zero, outgoing datagrams are paced to this many megabits
+ *                  per second, counting their IP and UDP headers
+ * @burst_kb:       size of the pacer's token bucket: how many kilobytes may be sent
+ *                  back to back after the sender has been idle
+ * @kernel_pacing:  if true, pacing is left to the kernel (SO_MAX_PACING_RATE), which
+ *                  needs the fq qdisc on the outgoing interface to take effect
+ * @sim_loss:       percentage of received fragments to drop, for testing recovery
  *
  */
 struct Params
@@ -40,6 +82,26 @@ struct Params
     size_t         recv_buf_size;
     u8             ttl;
     bool           multicast;
+    bool           gso = false;
+    bool           gro = false;
+    u16            gso_size = 0; // 0 to derive it from the interface MTU
+    bool           nack = false;
+    u32            nack_deadline_ms = ZCM_NACK_DEFAULT_DEADLINE_MS;
+    size_t         nack_window = ZCM_NACK_DEFAULT_WINDOW_SIZE;
+    u8             fec_n = 0;
+    u8             fec_k = 0;
+    u32            groups = 1;
+    bool           bpf = false;
+    bool           hugepages = false;
+    size_t         prealloc = 0;
+    u32            rx_shards = 1;
+    u32            busy_poll_us = 0;
+    u32            coalesce_us = 0;
+    size_t         coalesce_bytes = ZCM_COALESCE_DEFAULT_BYTES;
+    double         rate_mbps = 0;
+    size_t         burst_kb = ZCM_PACER_DEFAULT_BURST_KB;
+    bool           kernel_pacing = false;
+    double         sim_loss = 0;
 
     Params(const string& ip, u16 sub_port, u16 pub_port,
            size_t recv_buf_size, u8 ttl, bool multicast) :
@@ -51,12 +113,72 @@ struct Params
     }
 };
 
+// A receive socket and the reassembly state of the senders whose datagrams reach it.
+// With rx_shards, several of these share the port and each is read by its own thread
+struct RecvShard
+{
+    UDPSocket recvfd;
+    MessagePool pool {MAX_FRAG_BUF_TOTAL_SIZE, MAX_NUM_FRAG_BUFS};
+
+    // Last packet read from the socket. With GRO it may hold several datagrams,
+    // which are consumed one per iteration of readMessage() starting at pktOffset
+    Packet *pkt = nullptr;
+    size_t pktOffset = 0;
+
+    u32 last_kernel_drops = 0; // the socket's own (wrapping) drop counter
+
+    // Highest msg_seqno received from each sender, by address and port
+    unordered_map<u64, u32> senderSeqnos;
+
+    // Recently completed or abandoned messages. Late fragments of these are ignored
+    struct FinishedMsg { struct sockaddr_in from; u32 msg_seqno; };
+    FinishedMsg finished[ZCM_NACK_HISTORY] = {};
+    size_t finishedIdx = 0;
+
+    i64 last_nack_check_utime = 0;
+    std::unique_ptr<FecCodec> rxFecCodec;
+    u32 simLossState = 1;
+
+    // Only with several shards: the thread reading this one, and the messages the
+    // consumer is done with, for that thread to put back in the pool
+    std::thread thread;
+    std::mutex returnedLock;
+    vector<Message*> returned;
+
+    // The messages of a batch that are yet to be returned by readMessage()
+    std::deque<Message*> pending;
+
+    ~RecvShard()
+    {
+        for (Message *msg : pending)
+            pool.freeMessage(msg);
+        if (pkt) pool.freePacket(pkt);
+    }
+};
+
 struct UDP
 {
     Params params;
     UDPAddress destAddr;
 
-    UDPSocket recvfd;
+    // One address per multicast group when channels are mapped onto groups
+    vector<UDPAddress> groupAddrs;
+    vector<bool> groupJoined;
+
+    // Distinct channels and regexes enabled with recvmsgEnable(). The core enables a
+    // channel for each of its subscriptions but disables it once, so these are sets
+    unordered_set<string> enabledChannels;
+    unordered_set<string> enabledRegexes;
+
+    // With bpf, the enabled channels are compiled into a socket filter, unless a regex
+    // is enabled
+    std::atomic<bool> filterAttached {false};
+
+    std::mutex   subLock; // guards the subscription, group and filter state above
+
+    // Always at least one. Multicast datagrams are split between several by a socket
+    // filter on their source, unicast ones by the kernel (SO_REUSEPORT)
+    vector<std::unique_ptr<RecvShard>> shards;
     UDPSocket sendfd;
 
     /* size of the kernel UDP receive buffer */
@@ -64,16 +186,69 @@ struct UDP
     size_t kernel_sbuf_sz = 0;
     bool warned_about_small_kernel_buf = false;
 
-    MessagePool pool {MAX_FRAG_BUF_TOTAL_SIZE, MAX_NUM_FRAG_BUFS};
-
-    /* other variables */
-    u32          udp_rx = 0;            // packets received and processed
-    u32          udp_discarded_bad = 0; // packets discarded because they were bad somehow
-    double       udp_low_watermark = 1.0; // least buffer available
-    i32          udp_last_report_secs = 0;
+    /* receive statistics, also read by queryDrops() and queryStats() */
+    std::atomic<u64> udp_rx {0};            // datagrams received and processed
+    std::atomic<u64> udp_discarded_bad {0}; // datagrams discarded because they were bad somehow
+    std::atomic<u64> kernel_drops {0};      // datagrams dropped by a full socket buffer
+    std::atomic<u64> msgs_missed {0};       // messages of which nothing arrived
+    std::atomic<u64> busy_polls {0};        // reads that spun before waiting
+    std::atomic<u64> busy_poll_hits {0};    // ... and got a packet while spinning
+    std::atomic<u64> busy_poll_us {0};      // total time spent spinning
+    u64          reported_kernel_drops = 0;
+    i64          last_drop_report_utime = 0;
+
+    // Gaps in senders' seqnos are only counted when every message of every sender
+    // is expected to reach our sockets
+    bool         trackSeqnos = false;
+    // A socket filter drops datagrams, which the kernel counts with its own drops
+    bool         socketFiltered = false;
 
     u32          msg_seqno = 0; // rolling counter of how many messages transmitted
 
+    bool         gsoEnabled = false; // cleared if the kernel rejects a segmented send
+
+    /* selective retransmission */
+    std::unique_ptr<RetransmitWindow> retransmitWindow;
+    std::thread  nackThread;
+    std::atomic<bool> nackThreadRunning {false};
+    MessagePool  nackPool {0, 0}; // only used by nackThread
+    i64          nack_interval_us = 0; // minimum time between NACKs for a message
+    std::atomic<u64> nacks_sent {0};
+    std::atomic<u64> nacks_received {0};
+    std::atomic<u64> fragments_retransmitted {0};
+    std::atomic<u64> msgs_recovered {0};
+    std::atomic<u64> msgs_unrecovered {0};
+
+    std::atomic<u64> frag_bufs_evicted {0}; // to make room for newer messages
+    std::atomic<u64> msgs_incomplete {0};   // dropped with fragments missing
+
+    /* forward error correction */
+    std::unique_ptr<FecCodec> txFecCodec;
+    vector<u8>   fecScratch; // only used by the sending thread
+    std::atomic<u64> fec_fragments_recovered {0};
+    std::atomic<u64> fec_msgs_recovered {0};
+
+    /* small-message coalescing, only used by the sending thread */
+    vector<char> batchBuf; // MsgHeaderBatch followed by the messages
+    const UDPAddress *batchDest = nullptr;
+    u32          batchSeqno = 0;
+    u16          batchMsgs = 0;
+    i64          batch_deadline_utime = 0;
+    std::atomic<u64> msgs_coalesced {0};
+    std::atomic<u64> batches_sent {0};
+
+    /* send pacing, when it isn't done by the kernel */
+    std::unique_ptr<Pacer> pacer;
+
+    /* messages reassembled by the shard threads, in the order they completed */
+    struct ShardedMsg { Message *msg; RecvShard *shard; };
+    std::deque<ShardedMsg> rxQueue;
+    size_t       rxQueueBytes = 0;
+    std::mutex   rxLock;
+    std::condition_variable rxReady;
+    std::condition_variable rxSpace;
+    std::atomic<bool> shardsRunning {false};
+
     /***** Methods ******/
     UDP(const string& ip, u16 sub_port, u16 pub_port,
         size_t recv_buf_size, u8 ttl, bool multicast);
@@ -83,23 +258,62 @@ struct UDP
     int handle();
 
     int sendmsg(zcm_msg_t msg);
+    int update();
+    int recvmsgEnable(const char *channel, bool enable);
     int recvmsg(zcm_msg_t *msg, unsigned timeoutMs);
+    int queryDrops(u64 *outDrops);
+    int queryStats(zcm_stat_t *stats, size_t *nstats);
 
   private:
     // These returns non-null when a full message has been received
-    Message *recvShort(Packet *pkt, u32 sz);
-    Message *recvFragment(Packet *pkt, u32 sz);
-    Message *readMessage(unsigned timeoutMs);
-
+    Message *recvShort(RecvShard& sh, Packet *pkt, char *dgram, u32 sz);
+    Message *recvFragment(RecvShard& sh, Packet *pkt, char *dgram, u32 sz);
+    Message *recvParity(RecvShard& sh, Packet *pkt, char *dgram, u32 sz);
+    Message *recvBatch(RecvShard& sh, Packet *pkt, char *dgram, u32 sz);
+    Message *recoverBlock(RecvShard& sh, FragBuf *fbuf, u32 block);
+    Message *completeFragBuf(RecvShard& sh, FragBuf *fbuf);
+    Message *readMessage(RecvShard& sh, unsigned timeoutMs);
+    bool busyPoll(RecvShard& sh, int& sz);
+
+    int sendSegmented(const UDPAddress& dest, const zcm_msg_t& msg, int channel_size,
+                      int fragment_size, int nfragments);
+    void sendParity(const UDPAddress& dest, const zcm_msg_t& msg, u32 seqno,
+                    int channel_size, int fragment_size, int nfragments);
+    bool addToBatch(const UDPAddress& dest, const zcm_msg_t& msg, int channel_size);
+    void flushBatch();
+
+    u32 channelGroup(const char *channel);
+    bool updateGroups();
+    bool updateSocketFilters();
+    const UDPAddress& destinationFor(const char *channel);
+
+    void finishFragBuf(RecvShard& sh, FragBuf *fbuf, bool completed);
+    bool isFinished(RecvShard& sh, struct sockaddr_in *from, u32 msg_seqno);
+    void expireFragBufs(RecvShard& sh, i64 utime);
+    void sendNacks(RecvShard& sh, i64 now);
+    bool simulateLoss(RecvShard& sh);
+    void trackSeqno(RecvShard& sh, struct sockaddr_in *from, u32 msg_seqno);
+
+    void shardThreadFunc(RecvShard& sh);
+    Message *popShardedMessage(unsigned timeoutMs, RecvShard *& shard);
+    void stopShards();
+
+    void nackThreadFunc();
+    void handleNack(Packet *pkt);
+    ssize_t resendFragment(const SentMessage& sm, u16 fragment_no);
+    void pace(size_t dgramBytes, size_t ndgrams = 1);
+
+    // The message last returned by recvmsg(), and the shard it came from
     Message *m = nullptr;
+    RecvShard *mShard = nullptr;
 
     bool selftest();
     void checkForMessageLoss();
 };
 
-Message *UDP::recvShort(Packet *pkt, u32 sz)
+Message *UDP::recvShort(RecvShard& sh, Packet *pkt, char *dgram, u32 sz)
 {
-    MsgHeaderShort *hdr = pkt->asHeaderShort();
+    MsgHeaderShort *hdr = (MsgHeaderShort*)dgram;
 
     size_t clen = hdr->getChannelLen();
     if (clen > ZCM_CHANNEL_MAXLEN) {
@@ -108,25 +322,37 @@ Message *UDP::recvShort(Packet *pkt, u32 sz)
         return NULL;
     }
 
-    udp_rx++;
+    if (trackSeqnos)
+        trackSeqno(sh, (struct sockaddr_in*)&pkt->from, hdr->getMsgSeqno());
 
-    Message *msg = pool.allocMessageEmpty();
+    Message *msg = sh.pool.allocMessageEmpty();
     msg->utime = pkt->utime;
-    msg->channel = hdr->getChannelPtr();
+    msg->times = pkt->times;
     msg->channellen = clen;
-    msg->data = hdr->getDataPtr();
     msg->datalen = hdr->getDataLen(sz);
-    pool.moveBuffer(msg->buf, pkt->buf);
+
+    if (dgram == pkt->buf.data && sz == pkt->sz && sz > ZCM_SMALL_DGRAM_SIZE) {
+        // the datagram is the whole packet, so just take its buffer
+        msg->channel = hdr->getChannelPtr();
+        msg->data = hdr->getDataPtr();
+        sh.pool.moveBuffer(msg->buf, pkt->buf);
+    } else {
+        // the packet holds more coalesced datagrams, so this one must be copied out.
+        // Small ones are too, rather than tying up a whole packet buffer
+        size_t len = sz - sizeof(MsgHeaderShort);
+        msg->buf = sh.pool.allocBuffer(len);
+        memcpy(msg->buf.data, hdr->getChannelPtr(), len);
+        msg->channel = msg->buf.data;
+        msg->data = msg->buf.data + clen + 1;
+    }
 
     return msg;
 }
 
-Message *UDP::recvFragment(Packet *pkt, u32 sz)
+Message *UDP::recvFragment(RecvShard& sh, Packet *pkt, char *dgram, u32 sz)
 {
-    MsgHeaderLong *hdr = pkt->asHeaderLong();
-
-    // any existing fragment buffer for this message source?
-    FragBuf *fbuf = pool.lookupFragBuf((struct sockaddr_in*)&pkt->from);
+    MsgHeaderLong *hdr = (MsgHeaderLong*)dgram;
+    struct sockaddr_in *from = (struct sockaddr_in*)&pkt->from;
 
     u32 msg_seqno = hdr->getMsgSeqno();
     u32 data_size = hdr->getMsgSize();
@@ -136,143 +362,593 @@ Message *UDP::recvFragment(Packet *pkt, u32 sz)
     u32 frag_size = hdr->getFragmentSize(sz);
     char *data_start = hdr->getDataPtr();
 
-    // discard any stale fragments from previous messages
-    if (fbuf && ((fbuf->msg_seqno != msg_seqno) ||
-                 (fbuf->buf.size != data_size + fbuf->channellen+1))) {
-        pool.removeFragBuf(fbuf);
-        ZCM_DEBUG("Dropping message (missing %d fragments)", fbuf->fragments_remaining);
-        fbuf = NULL;
-    }
-
     if (data_size > MTU) {
         ZCM_DEBUG("rejecting huge message (%d bytes)", data_size);
         return NULL;
     }
 
+    if (fragment_no >= fragments_in_msg) {
+        ZCM_DEBUG("dropping invalid fragment (%d / %d)", fragment_no, fragments_in_msg);
+        udp_discarded_bad++;
+        return NULL;
+    }
+
+    // any existing fragment buffer for this message?
+    FragBuf *fbuf = sh.pool.lookupFragBuf(from, msg_seqno);
+    if (fbuf && (fbuf->msg_size != data_size || fbuf->fragments_in_msg != fragments_in_msg)) {
+        ZCM_DEBUG("Dropping message (inconsistent fragments)");
+        finishFragBuf(sh, fbuf, false);
+        return NULL;
+    }
+
     // create a new fragment buffer if necessary
-    if (!fbuf && fragment_no == 0) {
-        char *channel = (char*) (hdr + 1);
-        int channel_sz = strlen(channel);
-        if (channel_sz > ZCM_CHANNEL_MAXLEN) {
-            ZCM_DEBUG("bad channel name length");
-            udp_discarded_bad++;
+    if (!fbuf) {
+        // With the channel filter attached, only a first fragment that made it through
+        // the filter can start a message. Others may be of any channel
+        if (fragment_no != 0 && filterAttached)
             return NULL;
+
+        // late or retransmitted fragment of a message we are already done with
+        if (isFinished(sh, from, msg_seqno))
+            return NULL;
+
+        // discard messages that stopped receiving fragments, then make room
+        if (!params.nack)
+            expireFragBufs(sh, pkt->utime);
+        while (FragBuf *eldest = sh.pool.fragBufToEvict(data_size)) {
+            frag_bufs_evicted++;
+            finishFragBuf(sh, eldest, false);
         }
 
-        fbuf = pool.addFragBuf(channel_sz + 1 + data_size);
+        if (trackSeqnos)
+            trackSeqno(sh, from, msg_seqno);
+
+        fbuf = sh.pool.addFragBuf(from, msg_seqno, data_size, fragments_in_msg);
+        fbuf->first_packet_utime = pkt->utime;
         fbuf->last_packet_utime = pkt->utime;
-        fbuf->msg_seqno = msg_seqno;
+        fbuf->last_packet_times = pkt->times;
+        fbuf->last_nack_utime = 0;
+        fbuf->msg_size = data_size;
+        fbuf->fragments_in_msg = fragments_in_msg;
         fbuf->fragments_remaining = fragments_in_msg;
-        fbuf->channellen = channel_sz;
-        fbuf->from = *(struct sockaddr_in*)&pkt->from;
-        memcpy(fbuf->buf.data, data_start, frag_size);
+        fbuf->highest_fragment_no = 0;
+        fbuf->nacked = false;
+        fbuf->have_channel = false;
+        fbuf->channellen = 0;
+        fbuf->sample_fragment_no = 0;
+        fbuf->fec_symsz = 0;
+    }
 
-        --fbuf->fragments_remaining;
+    // duplicate, e.g. a fragment that was retransmitted for another receiver
+    if (fbuf->hasFragment(fragment_no))
         return NULL;
+
+    sh.recvfd.checkAndWarnAboutSmallBuffer(data_size, kernel_rbuf_sz);
+
+    if (fragment_no > 0 && fbuf->sample_fragment_no == 0) {
+        fbuf->sample_fragment_no = fragment_no;
+        fbuf->sample_fragment_offset = fragment_offset;
     }
 
-    if (!fbuf) return NULL;
-    recvfd.checkAndWarnAboutSmallBuffer(data_size, kernel_rbuf_sz);
+    // first fragment is special.  the channel comes before the data
+    if (fragment_no == 0) {
+        char *channel = data_start;
+        size_t channel_sz = strnlen(channel, std::min(frag_size, (u32)ZCM_CHANNEL_MAXLEN + 1));
+        if (channel_sz > ZCM_CHANNEL_MAXLEN || channel_sz == frag_size) {
+            ZCM_DEBUG("bad channel name length");
+            udp_discarded_bad++;
+            finishFragBuf(sh, fbuf, false);
+            return NULL;
+        }
+        memcpy(fbuf->buf.data, channel, channel_sz + 1);
+        fbuf->channellen = channel_sz;
+        fbuf->have_channel = true;
+        data_start += channel_sz + 1;
+        frag_size -= channel_sz + 1;
+    }
 
-    if (fbuf->channellen+1 + fragment_offset + frag_size > fbuf->buf.size) {
+    if (FRAG_BUF_DATA_OFFSET + fragment_offset + frag_size > fbuf->buf.size) {
         ZCM_DEBUG("dropping invalid fragment (off: %d, %d / %zu)",
                 fragment_offset, frag_size, fbuf->buf.size);
-        pool.removeFragBuf(fbuf);
+        finishFragBuf(sh, fbuf, false);
         return NULL;
     }
 
     // copy data
-    memcpy(fbuf->buf.data + fbuf->channellen+1 + fragment_offset, data_start, frag_size);
+    memcpy(fbuf->buf.data + FRAG_BUF_DATA_OFFSET + fragment_offset, data_start, frag_size);
+    fbuf->markFragment(fragment_no);
+    if (fragment_no > fbuf->highest_fragment_no)
+        fbuf->highest_fragment_no = fragment_no;
+
+    sh.pool.touchFragBuf(fbuf, pkt);
+    if (--fbuf->fragments_remaining > 0) {
+        // parity that already arrived may now be enough to rebuild the rest of the block
+        if (fbuf->fec_symsz)
+            return recoverBlock(sh, fbuf, fragment_no / fbuf->fec_n);
+        return NULL;
+    }
+
+    return completeFragBuf(sh, fbuf);
+}
 
-    fbuf->last_packet_utime = pkt->utime;
-    if (--fbuf->fragments_remaining > 0)
+// Unpacks every message of a batch, returning the first and queueing the rest
+Message *UDP::recvBatch(RecvShard& sh, Packet *pkt, char *dgram, u32 sz)
+{
+    MsgHeaderBatch *hdr = (MsgHeaderBatch*)dgram;
+    if (sz < sizeof(*hdr)) {
+        udp_discarded_bad++;
         return NULL;
+    }
 
-    // we've received all the fragments, return a new Message
-    Message *msg = pool.allocMessageEmpty();
+    u32 msg_seqno = hdr->getMsgSeqno();
+    u16 nmsgs = hdr->getNumMsgs();
+    char *p = hdr->getEntriesPtr();
+    char *end = dgram + sz;
+    for (u16 i = 0; i < nmsgs; i++) {
+        // A batch cut short of its nmsgs entries is as malformed as a bad entry
+        u16 len = 0;
+        size_t clen = 0;
+        bool ok = end - p >= (ssize_t)sizeof(len);
+        if (ok) {
+            memcpy(&len, p, sizeof(len));
+            len = ntohs(len);
+            p += sizeof(len);
+            ok = len <= end - p;
+        }
+        if (ok) {
+            clen = strnlen(p, std::min((size_t)len, (size_t)ZCM_CHANNEL_MAXLEN + 1));
+            ok = clen <= ZCM_CHANNEL_MAXLEN && clen < len;
+        }
+        if (!ok) {
+            ZCM_DEBUG("dropping the rest of a malformed batch (%d / %d)", i, nmsgs);
+            udp_discarded_bad++;
+            break;
+        }
+
+        if (trackSeqnos)
+            trackSeqno(sh, (struct sockaddr_in*)&pkt->from, msg_seqno + i);
+
+        Message *msg = sh.pool.allocMessageEmpty();
+        msg->utime = pkt->utime;
+        msg->times = pkt->times;
+        msg->buf = sh.pool.allocBuffer(len);
+        memcpy(msg->buf.data, p, len);
+        msg->channel = msg->buf.data;
+        msg->channellen = clen;
+        msg->data = msg->buf.data + clen + 1;
+        msg->datalen = len - (clen + 1);
+        sh.pending.push_back(msg);
+        p += len;
+    }
+
+    if (sh.pending.empty())
+        return NULL;
+    Message *msg = sh.pending.front();
+    sh.pending.pop_front();
+    return msg;
+}
+
+// we've received all the fragments, return a new Message
+Message *UDP::completeFragBuf(RecvShard& sh, FragBuf *fbuf)
+{
+    Message *msg = sh.pool.allocMessageEmpty();
     msg->utime = fbuf->last_packet_utime;
+    msg->times = fbuf->last_packet_times;
     msg->channel = fbuf->buf.data;
     msg->channellen = fbuf->channellen;
-    msg->data = fbuf->buf.data + fbuf->channellen + 1;
-    msg->datalen = fbuf->buf.size - (fbuf->channellen + 1);
-    pool.moveBuffer(msg->buf, fbuf->buf);
+    msg->data = fbuf->buf.data + FRAG_BUF_DATA_OFFSET;
+    msg->datalen = fbuf->msg_size;
+    sh.pool.moveBuffer(msg->buf, fbuf->buf);
+
+    if (fbuf->nacked) msgs_recovered++;
 
     // don't need the fragment buffer anymore
-    pool.removeFragBuf(fbuf);
+    finishFragBuf(sh, fbuf, true);
 
     return msg;
 }
 
+Message *UDP::recvParity(RecvShard& sh, Packet *pkt, char *dgram, u32 sz)
+{
+    MsgHeaderParity *hdr = (MsgHeaderParity*)dgram;
+
+    u32 symsz = hdr->getFragmentSize();
+    u16 fragments_in_msg = hdr->getFragmentsInMsg();
+    u16 parity_no = hdr->getParityNo();
+    u8 n = hdr->getFecN();
+    u8 k = hdr->getFecK();
+    if (!FecCodec::isValid(n, k) || sz != sizeof(*hdr) + symsz) {
+        ZCM_DEBUG("dropping invalid parity fragment");
+        udp_discarded_bad++;
+        return NULL;
+    }
+    u32 nblocks = (fragments_in_msg + n - 1) / n;
+    u32 nparity = nblocks * k;
+    if (parity_no >= nparity) {
+        ZCM_DEBUG("dropping invalid parity fragment (%d / %d)", parity_no, nparity);
+        udp_discarded_bad++;
+        return NULL;
+    }
+
+    // Parity is sent after the data fragments, so there is nothing to recover unless
+    // some of those have already been received
+    FragBuf *fbuf = sh.pool.lookupFragBuf((struct sockaddr_in*)&pkt->from, hdr->getMsgSeqno());
+    if (!fbuf || fbuf->fragments_in_msg != fragments_in_msg)
+        return NULL;
+
+    if (!fbuf->fec_symsz) {
+        fbuf->fec_symsz = symsz;
+        fbuf->fec_n = n;
+        fbuf->fec_k = k;
+        fbuf->parity = sh.pool.allocBuffer((size_t)nparity * symsz + nparity);
+        memset(fbuf->parity.data + (size_t)nparity * symsz, 0, nparity);
+    } else if (fbuf->fec_symsz != symsz || fbuf->fec_n != n || fbuf->fec_k != k) {
+        ZCM_DEBUG("dropping inconsistent parity fragment");
+        return NULL;
+    }
+
+    char *received = fbuf->parity.data + (size_t)nparity * symsz;
+    if (received[parity_no])
+        return NULL;
+    memcpy(fbuf->parity.data + (size_t)parity_no * symsz, hdr->getDataPtr(), symsz);
+    received[parity_no] = 1;
+
+    sh.pool.touchFragBuf(fbuf, pkt);
+    return recoverBlock(sh, fbuf, parity_no / k);
+}
+
+// Copies symbol i of a message (see MsgHeaderParity) between its fragment buffer and
+// sym, given the length of the channel
+static void copySymbol(FragBuf *fbuf, size_t channellen, u32 i, u8 *sym, bool toSymbol)
+{
+    size_t symsz = fbuf->fec_symsz;
+    size_t prefix = channellen + 1;
+    size_t start = (size_t)i * symsz;
+    size_t end = std::min(start + symsz, prefix + fbuf->msg_size);
+
+    if (toSymbol) memset(sym, 0, symsz);
+    if (i == 0) {
+        if (toSymbol) memcpy(sym, fbuf->buf.data, prefix);
+        else          memcpy(fbuf->buf.data, sym, prefix);
+        sym += prefix;
+        start = prefix;
+    }
+
+    char *data = fbuf->buf.data + FRAG_BUF_DATA_OFFSET + (start - prefix);
+    if (toSymbol) memcpy(sym, data, end - start);
+    else          memcpy(data, sym, end - start);
+}
+
+// Rebuilds the missing fragments of a block once enough data and parity is in
+Message *UDP::recoverBlock(RecvShard& sh, FragBuf *fbuf, u32 block)
+{
+    u32 n = fbuf->fec_n, k = fbuf->fec_k, symsz = fbuf->fec_symsz;
+    u32 nblocks = (fbuf->fragments_in_msg + n - 1) / n;
+    u32 first = block * n;
+    u32 nsyms = std::min(n, (u32)fbuf->fragments_in_msg - first);
+    char *received = fbuf->parity.data + (size_t)nblocks * k * symsz;
+
+    bool have[256];
+    u32 nhave = 0;
+    for (u32 i = 0; i < nsyms; i++) {
+        have[i] = fbuf->hasFragment(first + i);
+        nhave += have[i];
+    }
+    if (nhave == nsyms)
+        return NULL;
+
+    const u8 *parity[256];
+    u8 parityNo[256];
+    size_t nparity = 0;
+    for (u32 j = 0; j < k; j++) {
+        if (!received[block * k + j]) continue;
+        parity[nparity] = (u8*)fbuf->parity.data + (size_t)(block * k + j) * symsz;
+        parityNo[nparity++] = j;
+    }
+    if (nhave + nparity < nsyms)
+        return NULL;
+
+    // Symbols are offsets into the channel and data, so we need the channel length
+    size_t channellen;
+    if (fbuf->have_channel) {
+        channellen = fbuf->channellen;
+    } else if (fbuf->sample_fragment_no) {
+        i64 c = (i64)fbuf->sample_fragment_no * symsz - fbuf->sample_fragment_offset - 1;
+        if (c < 0 || c > ZCM_CHANNEL_MAXLEN) return NULL;
+        channellen = c;
+    } else {
+        return NULL;
+    }
+    if ((channellen + 1 + fbuf->msg_size + symsz - 1) / symsz != fbuf->fragments_in_msg) {
+        ZCM_DEBUG("parity doesn't match the fragments of message %u", fbuf->msg_seqno);
+        return NULL;
+    }
+
+    if (!sh.rxFecCodec || sh.rxFecCodec->numData() != n || sh.rxFecCodec->numParity() != k)
+        sh.rxFecCodec.reset(new FecCodec(n, k));
+
+    Buffer scratch = sh.pool.allocBuffer((size_t)nsyms * symsz);
+    u8 *syms[256];
+    for (u32 i = 0; i < nsyms; i++) {
+        syms[i] = (u8*)scratch.data + (size_t)i * symsz;
+        if (have[i]) copySymbol(fbuf, channellen, first + i, syms[i], true);
+    }
+
+    bool ok = sh.rxFecCodec->decode(syms, have, nsyms, parity, parityNo, nparity, symsz);
+    if (ok && first == 0 && !have[0] && syms[0][channellen] != '\0')
+        ok = false;
+    if (ok) {
+        for (u32 i = 0; i < nsyms; i++) {
+            if (have[i]) continue;
+            copySymbol(fbuf, channellen, first + i, syms[i], false);
+            fbuf->markFragment(first + i);
+            fbuf->fragments_remaining--;
+            fec_fragments_recovered++;
+        }
+        if (first == 0) {
+            fbuf->have_channel = true;
+            fbuf->channellen = channellen;
+        }
+    }
+    sh.pool.freeBuffer(scratch);
+
+    if (!ok) {
+        ZCM_DEBUG("failed to rebuild block %u of message %u", block, fbuf->msg_seqno);
+        return NULL;
+    }
+    if (fbuf->fragments_remaining > 0)
+        return NULL;
+
+    fec_msgs_recovered++;
+    return completeFragBuf(sh, fbuf);
+}
+
+void UDP::finishFragBuf(RecvShard& sh, FragBuf *fbuf, bool completed)
+{
+    if (!completed) {
+        ZCM_DEBUG("Dropping message (missing %d fragments)", fbuf->fragments_remaining);
+        if (fbuf->nacked) msgs_unrecovered++;
+        msgs_incomplete++;
+    }
+
+    sh.finished[sh.finishedIdx].from = fbuf->from;
+    sh.finished[sh.finishedIdx].msg_seqno = fbuf->msg_seqno;
+    sh.finishedIdx = (sh.finishedIdx + 1) % ZCM_NACK_HISTORY;
+
+    sh.pool.removeFragBuf(fbuf);
+}
+
+bool UDP::isFinished(RecvShard& sh, struct sockaddr_in *from, u32 msg_seqno)
+{
+    for (auto& f : sh.finished)
+        if (f.msg_seqno == msg_seqno &&
+            f.from.sin_addr.s_addr == from->sin_addr.s_addr &&
+            f.from.sin_port == from->sin_port)
+            return true;
+    return false;
+}
+
+// Fragments of a message arrive back to back, so without NACKs the ones still missing
+// from a message that hasn't received any for a while are never coming. With NACKs
+// messages are kept until their recovery deadline passes instead (see sendNacks())
+void UDP::expireFragBufs(RecvShard& sh, i64 utime)
+{
+    i64 timeout = (i64)ZCM_FRAG_BUF_TIMEOUT_MS * 1000;
+    while (FragBuf *fbuf = sh.pool.oldestFragBuf()) {
+        if (utime - fbuf->last_packet_utime <= timeout)
+            break;
+        finishFragBuf(sh, fbuf, false);
+    }
+}
+
+void UDP::sendNacks(RecvShard& sh, i64 now)
+{
+    if (now - sh.last_nack_check_utime < nack_interval_us / 4)
+        return;
+    sh.last_nack_check_utime = now;
+
+    i64 deadline = (i64)params.nack_deadline_ms * 1000;
+
+    char buf[sizeof(MsgHeaderNack) + ZCM_NACK_MAX_FRAGMENTS * sizeof(u16)];
+    MsgHeaderNack *hdr = (MsgHeaderNack*)buf;
+    u16 *fragment_nos = (u16*)(hdr + 1);
+
+    FragBuf *next;
+    for (FragBuf *fbuf = sh.pool.oldestFragBuf(); fbuf; fbuf = next) {
+        next = fbuf->lru_next;
+        if (now - fbuf->first_packet_utime > deadline) {
+            finishFragBuf(sh, fbuf, false);
+            continue;
+        }
+
+        if (now - std::max(fbuf->first_packet_utime, fbuf->last_nack_utime) < nack_interval_us)
+            continue;
+
+        // While fragments are still arriving only ask for the gaps. Once they stop,
+        // also ask for the ones at the end of the message
+        u32 limit = fbuf->fragments_in_msg;
+        if (now - fbuf->last_packet_utime < nack_interval_us)
+            limit = fbuf->highest_fragment_no;
+
+        u16 n = 0;
+        for (u32 f = 0; f < limit && n < ZCM_NACK_MAX_FRAGMENTS; f++)
+            if (!fbuf->hasFragment(f))
+                fragment_nos[n++] = htons(f);
+        if (n == 0)
+            continue;
+
+        hdr->setMagic(ZCM_MAGIC_NACK);
+        hdr->setMsgSeqno(fbuf->msg_seqno);
+        hdr->setNumFragments(n);
+
+        ZCM_DEBUG("requesting %d of %d missing fragments of message %u",
+                  n, fbuf->fragments_remaining, fbuf->msg_seqno);
+        sh.recvfd.sendBuffers(UDPAddress(fbuf->from), buf, sizeof(*hdr) + n * sizeof(u16));
+
+        fbuf->last_nack_utime = now;
+        fbuf->nacked = true;
+        nacks_sent++;
+    }
+}
+
+bool UDP::simulateLoss(RecvShard& sh)
+{
+    // xorshift, so that the loss pattern doesn't depend on the global rand() state
+    sh.simLossState ^= sh.simLossState << 13;
+    sh.simLossState ^= sh.simLossState >> 17;
+    sh.simLossState ^= sh.simLossState << 5;
+    return (sh.simLossState % 10000) < params.sim_loss * 100;
+}
+
+// Warns, at most every ZCM_DROP_WARNING_INTERVAL_S, when the kernel had to drop
+// datagrams because the socket buffer filled up
 void UDP::checkForMessageLoss()
 {
-    // ISSUE-101 TODO: add this back
-    // TODO warn about message loss somewhere else.
-    // u32 ring_capacity = ringbuf->get_capacity();
-    // u32 ring_used = ringbuf->get_used();
-
-    // double buf_avail = ((double)(ring_capacity - ring_used)) / ring_capacity;
-    // if (buf_avail < udp_low_watermark)
-    //     udp_low_watermark = buf_avail;
-
-    // i32 tm = utimeInSeconds();
-    // int elapsedsecs = tm - udp_last_report_secs;
-    // if (elapsedsecs > 2) {
-    //    if (udp_discarded_bad > 0 || udp_low_watermark < 0.5) {
-    //        fprintf(stderr,
-    //                "%d ZCM loss %4.1f%% : %5d err, "
-    //                "buf avail %4.1f%%\n",
-    //                (int) tm,
-    //                udp_discarded_bad * 100.0 / (udp_rx + udp_discarded_bad),
-    //                udp_discarded_bad,
-    //                100.0 * udp_low_watermark);
-
-    //        udp_rx = 0;
-    //        udp_discarded_bad = 0;
-    //        udp_last_report_secs = tm;
-    //        udp_low_watermark = HUGE;
-    //    }
-    // }
+    // With socket filters, the kernel counts filtered datagrams as drops too
+    if (socketFiltered || kernel_drops == reported_kernel_drops)
+        return;
+
+    i64 now = TimeUtil::utime();
+    if (now - last_drop_report_utime < (i64)ZCM_DROP_WARNING_INTERVAL_S * 1000000)
+        return;
+
+    fprintf(stderr, "ZCM Warning: the kernel dropped %lu received UDP datagrams because "
+                    "the socket buffer (%zu bytes) was full. The receiver can't keep up "
+                    "with the incoming rate; consider raising net.core.rmem_default\n",
+            (unsigned long)(kernel_drops - reported_kernel_drops), kernel_rbuf_sz);
+    reported_kernel_drops = kernel_drops;
+    last_drop_report_utime = now;
+}
+
+// Counts the messages skipped over by a sender's seqno
+void UDP::trackSeqno(RecvShard& sh, struct sockaddr_in *from, u32 msg_seqno)
+{
+    u64 key = (u64)from->sin_addr.s_addr << 16 | from->sin_port;
+    auto it = sh.senderSeqnos.find(key);
+    if (it == sh.senderSeqnos.end()) {
+        sh.senderSeqnos.emplace(key, msg_seqno);
+        return;
+    }
+
+    i32 diff = (i32)(msg_seqno - it->second);
+    if (diff > 0) {
+        msgs_missed += diff - 1;
+        it->second = msg_seqno;
+    } else if (diff < -ZCM_SEQNO_REORDER_WINDOW) {
+        // the sender must have restarted
+        it->second = msg_seqno;
+    }
+}
+
+// Tries to read a packet without sleeping for up to busy_poll_us. Returns false if
+// nothing arrived in that time
+bool UDP::busyPoll(RecvShard& sh, int& sz)
+{
+    i64 start = TimeUtil::utime();
+    i64 now = start;
+    do {
+        sz = sh.recvfd.recvPacket(sh.pkt);
+        if (sz >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) break;
+        now = TimeUtil::utime();
+    } while (now - start < (i64)params.busy_poll_us);
+
+    busy_polls++;
+    busy_poll_us += now - start;
+    if (sz < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return false;
+    busy_poll_hits++;
+    return true;
 }
 
 // read continuously until a complete message arrives
-Message *UDP::readMessage(unsigned timeoutMs)
+Message *UDP::readMessage(RecvShard& sh, unsigned timeoutMs)
 {
-    Packet *pkt = pool.allocPacket(ZCM_MAX_UNFRAGMENTED_PACKET_SIZE);
-    UDP::checkForMessageLoss();
+    Packet *&pkt = sh.pkt;
+    size_t& pktOffset = sh.pktOffset;
+
+    i64 deadline = TimeUtil::utime() + (i64)timeoutMs * 1000;
 
     Message *msg = NULL;
     while (!msg) {
-        // // wait for either incoming UDP data, or for an abort message
-        if (!recvfd.waitUntilData(timeoutMs)) break;
+        if (!sh.pending.empty()) {
+            // the rest of a batch
+            msg = sh.pending.front();
+            sh.pending.pop_front();
+            break;
+        }
 
-        int sz = recvfd.recvPacket(pkt);
-        if (sz < 0) {
-            ZCM_DEBUG("udp_read_packet -- recvmsg");
-            udp_discarded_bad++;
-            continue;
+        if (!pkt || pktOffset >= pkt->sz || !pkt->buf.data) {
+            if (!pkt) pkt = sh.pool.allocPacket(ZCM_MAX_UNFRAGMENTED_PACKET_SIZE);
+            // recvShort() may have taken ownership of the last buffer
+            if (!pkt->buf.data) pkt->buf = sh.pool.allocBuffer(ZCM_MAX_UNFRAGMENTED_PACKET_SIZE);
+            pkt->sz = 0;
+            pktOffset = 0;
+
+            unsigned waitMs = timeoutMs;
+            if (params.nack && sh.pool.numFragBufs() > 0) {
+                // wake up periodically to request retransmission of missing fragments
+                i64 now = TimeUtil::utime();
+                sendNacks(sh, now);
+                i64 remainingMs = std::max((i64)0, (deadline - now) / 1000);
+                waitMs = std::min(remainingMs, nack_interval_us / 1000 + 1);
+            }
+
+            int sz;
+            if (!params.busy_poll_us || !busyPoll(sh, sz)) {
+                // // wait for either incoming UDP data, or for an abort message
+                if (!sh.recvfd.waitUntilData(waitMs)) {
+                    if (waitMs < timeoutMs && (i64)TimeUtil::utime() < deadline) continue;
+                    break;
+                }
+                sz = sh.recvfd.recvPacket(pkt);
+            }
+            if (sz < 0) {
+                // e.g. the datagram that woke us up failed its checksum
+                if (errno == EAGAIN || errno == EWOULDBLOCK) continue;
+                ZCM_DEBUG("udp_read_packet -- recvmsg");
+                udp_discarded_bad++;
+                continue;
+            }
+
+            ZCM_DEBUG("Got packet of size %d (segments of %zu)", sz, pkt->segsz);
+
+            if (pkt->kernel_drops != sh.last_kernel_drops) {
+                kernel_drops += (u32)(pkt->kernel_drops - sh.last_kernel_drops);
+                sh.last_kernel_drops = pkt->kernel_drops;
+            }
         }
 
-        ZCM_DEBUG("Got packet of size %d", sz);
+        char *dgram = pkt->buf.data + pktOffset;
+        u32 sz = pkt->sz - pktOffset;
+        if (pkt->segsz && pkt->segsz < sz) sz = pkt->segsz;
+        pktOffset += sz;
 
-        if (sz < (int)sizeof(MsgHeaderShort)) {
+        if (sz < sizeof(MsgHeaderShort)) {
             // packet too short to be ZCM
             udp_discarded_bad++;
             continue;
         }
+        udp_rx++;
 
-        u32 magic = pkt->asHeaderShort()->getMagic();
+        u32 magic = ((MsgHeaderShort*)dgram)->getMagic();
         if (magic == ZCM_MAGIC_SHORT)
-            msg = recvShort(pkt, sz);
-        else if (magic == ZCM_MAGIC_LONG)
-            msg = recvFragment(pkt, sz);
-        else {
+            msg = recvShort(sh, pkt, dgram, sz);
+        else if (magic == ZCM_MAGIC_LONG) {
+            if (params.sim_loss > 0 && simulateLoss(sh)) continue;
+            msg = recvFragment(sh, pkt, dgram, sz);
+            if (params.nack) sendNacks(sh, TimeUtil::utime());
+        } else if (magic == ZCM_MAGIC_PARITY) {
+            if (params.sim_loss > 0 && simulateLoss(sh)) continue;
+            msg = recvParity(sh, pkt, dgram, sz);
+        } else if (magic == ZCM_MAGIC_BATCH) {
+            msg = recvBatch(sh, pkt, dgram, sz);
+        } else {
             ZCM_DEBUG("ZCM: bad magic");
             udp_discarded_bad++;
             continue;
         }
     }
 
-    pool.freePacket(pkt);
     return msg;
 }
 
@@ -284,6 +960,15 @@ int UDP::sendmsg(zcm_msg_t msg)
         return ZCM_EINVALID;
     }
 
+    const UDPAddress& dest = destinationFor(msg.channel);
+
+    // Anything that isn't coalesced must follow the messages that already were
+    if (params.coalesce_us) {
+        if (addToBatch(dest, msg, channel_size))
+            return ZCM_EOK;
+        flushBatch();
+    }
+
     int payload_size = channel_size + 1 + msg.len;
     if (payload_size <= ZCM_SHORT_MESSAGE_MAX_SIZE) {
         // message is short.  send in a single packet
@@ -292,7 +977,8 @@ int UDP::sendmsg(zcm_msg_t msg)
         hdr.setMagic(ZCM_MAGIC_SHORT);
         hdr.setMsgSeqno(msg_seqno);
 
-        ssize_t status = sendfd.sendBuffers(destAddr,
+        pace(sizeof(hdr) + payload_size);
+        ssize_t status = sendfd.sendBuffers(dest,
                               (char*)&hdr, sizeof(hdr),
                               (char*)msg.channel, channel_size+1,
                               (char*)msg.buf, msg.len);
@@ -308,6 +994,22 @@ int UDP::sendmsg(zcm_msg_t msg)
 
     else {
         // message is large.  fragment into multiple packets
+        if (gsoEnabled) {
+            int fragment_size = params.gso_size - sizeof(MsgHeaderLong);
+            int nfragments = payload_size / fragment_size +
+                !!(payload_size % fragment_size);
+            if (nfragments <= 65535) {
+                u32 seqno = msg_seqno;
+                if (retransmitWindow)
+                    retransmitWindow->add(seqno, msg.channel, msg.buf, msg.len,
+                                          fragment_size, nfragments);
+                int ret = sendSegmented(dest, msg, channel_size, fragment_size, nfragments);
+                if (ret == ZCM_EOK && txFecCodec)
+                    sendParity(dest, msg, seqno, channel_size, fragment_size, nfragments);
+                return ret;
+            }
+        }
+
         int fragment_size = ZCM_FRAGMENT_MAX_PAYLOAD;
         int nfragments = payload_size / fragment_size +
             !!(payload_size % fragment_size);
@@ -317,6 +1019,10 @@ int UDP::sendmsg(zcm_msg_t msg)
             return -1;
         }
 
+        if (retransmitWindow)
+            retransmitWindow->add(msg_seqno, msg.channel, msg.buf, msg.len,
+                                  fragment_size, nfragments);
+
         // acquire transmit lock so that all fragments are transmitted
         // together, and so that no other message uses the same sequence number
         // (at least until the sequence # rolls over)
@@ -341,7 +1047,8 @@ int UDP::sendmsg(zcm_msg_t msg)
         int packet_size = sizeof(hdr) + (channel_size + 1) + firstfrag_datasize;
         fragment_offset += firstfrag_datasize;
 
-        ssize_t status = sendfd.sendBuffers(destAddr,
+        pace(packet_size);
+        ssize_t status = sendfd.sendBuffers(dest,
                                             (char*)&hdr, sizeof(hdr),
                                             (char*)msg.channel, channel_size+1,
                                             (char*)msg.buf, firstfrag_datasize);
@@ -352,7 +1059,8 @@ int UDP::sendmsg(zcm_msg_t msg)
             hdr.fragment_no = htons(frag_no);
 
             int fraglen = std::min(fragment_size, (int)msg.len - (int)fragment_offset);
-            status = sendfd.sendBuffers(destAddr,
+            pace(sizeof(hdr) + fraglen);
+            status = sendfd.sendBuffers(dest,
                                         (char*)&hdr, sizeof(hdr),
                                         (char*)(msg.buf + fragment_offset), fraglen);
 
@@ -365,17 +1073,492 @@ int UDP::sendmsg(zcm_msg_t msg)
             assert(fragment_offset == msg.len);
         }
 
+        if (packet_size == status && txFecCodec)
+            sendParity(dest, msg, msg_seqno, channel_size, fragment_size, nfragments);
+
         msg_seqno++;
     }
 
     return 0;
 }
 
+// The send queue is empty, so nothing else is coming to join a batch
+int UDP::update()
+{
+    flushBatch();
+    return ZCM_EOK;
+}
+
+// Appends a short message to the batch, first sending the batch if it is for another
+// destination, has no room left or is due. Returns false if the message is too big to
+// be coalesced
+bool UDP::addToBatch(const UDPAddress& dest, const zcm_msg_t& msg, int channel_size)
+{
+    size_t len = channel_size + 1 + msg.len;
+    size_t entry = sizeof(u16) + len;
+    if (sizeof(MsgHeaderBatch) + entry > params.coalesce_bytes)
+        return false;
+
+    i64 now = TimeUtil::utime();
+    if (batchMsgs > 0 && (batchDest != &dest ||
+                          batchBuf.size() + entry > params.coalesce_bytes ||
+                          now >= batch_deadline_utime))
+        flushBatch();
+
+    if (batchMsgs == 0) {
+        batchBuf.resize(sizeof(MsgHeaderBatch));
+        batchDest = &dest;
+        batchSeqno = msg_seqno;
+        batch_deadline_utime = now + params.coalesce_us;
+    }
+
+    u16 nlen = htons(len);
+    batchBuf.insert(batchBuf.end(), (char*)&nlen, (char*)&nlen + sizeof(nlen));
+    batchBuf.insert(batchBuf.end(), msg.channel, msg.channel + channel_size + 1);
+    batchBuf.insert(batchBuf.end(), (char*)msg.buf, (char*)msg.buf + msg.len);
+    batchMsgs++;
+    msg_seqno++;
+    msgs_coalesced++;
+    return true;
+}
+
+void UDP::flushBatch()
+{
+    if (batchMsgs == 0) return;
+
+    MsgHeaderBatch *hdr = (MsgHeaderBatch*)batchBuf.data();
+    hdr->setMagic(ZCM_MAGIC_BATCH);
+    hdr->setMsgSeqno(batchSeqno);
+    hdr->setNumMsgs(batchMsgs);
+
+    pace(batchBuf.size());
+    ssize_t status = sendfd.sendBuffers(*batchDest, batchBuf.data(), batchBuf.size());
+    ZCM_DEBUG("transmitting %d coalesced messages (%zu byte pkt) status: %zd",
+              batchMsgs, batchBuf.size(), status);
+    batches_sent++;
+    batchMsgs = 0;
+}
+
+// Sends a large message as fragments that all share the same datagram size so that
+// the kernel can do the splitting for up to ZCM_GSO_MAX_SEGMENTS of them per syscall
+int UDP::sendSegmented(const UDPAddress& dest, const zcm_msg_t& msg, int channel_size,
+                       int fragment_size, int nfragments)
+{
+    MsgHeaderLong hdrs[ZCM_GSO_MAX_SEGMENTS];
+    struct iovec iov[ZCM_GSO_MAX_SEGMENTS * 3];
+    size_t segIov[ZCM_GSO_MAX_SEGMENTS + 1]; // index of the first iovec of each segment
+    size_t segLen[ZCM_GSO_MAX_SEGMENTS];
+
+    u16 segsz = sizeof(MsgHeaderLong) + fragment_size;
+    int maxsegs = std::min(ZCM_GSO_MAX_SEGMENTS, ZCM_GSO_MAX_BYTES / (int)segsz);
+
+    ZCM_DEBUG("transmitting %d byte [%s] payload in %d segmented fragments",
+              channel_size + 1 + (int)msg.len, msg.channel, nfragments);
+
+    u32 fragment_offset = 0;
+    int frag_no = 0;
+    while (frag_no < nfragments) {
+        int nsegs = 0;
+        size_t niov = 0;
+        size_t batch_size = 0;
+        for (; nsegs < maxsegs && frag_no < nfragments; nsegs++, frag_no++) {
+            MsgHeaderLong& hdr = hdrs[nsegs];
+            hdr.magic = htonl(ZCM_MAGIC_LONG);
+            hdr.msg_seqno = htonl(msg_seqno);
+            hdr.msg_size = htonl(msg.len);
+            hdr.fragment_offset = htonl(fragment_offset);
+            hdr.fragment_no = htons(frag_no);
+            hdr.fragments_in_msg = htons(nfragments);
+
+            segIov[nsegs] = niov;
+            iov[niov].iov_base = &hdr;
+            iov[niov].iov_len = sizeof(hdr);
+            niov++;
+
+            // first fragment is special.  insert channel before data
+            int fraglen = fragment_size;
+            if (frag_no == 0) {
+                iov[niov].iov_base = (void*)msg.channel;
+                iov[niov].iov_len = channel_size + 1;
+                niov++;
+                fraglen -= channel_size + 1;
+            }
+            fraglen = std::min(fraglen, (int)msg.len - (int)fragment_offset);
+            iov[niov].iov_base = msg.buf + fragment_offset;
+            iov[niov].iov_len = fraglen;
+            niov++;
+
+            segLen[nsegs] = sizeof(hdr) + fraglen + (frag_no == 0 ? channel_size + 1 : 0);
+            batch_size += segLen[nsegs];
+            fragment_offset += fraglen;
+        }
+        segIov[nsegs] = niov;
+
+        pace(batch_size, nsegs);
+        ssize_t status = sendfd.sendSegments(dest, iov, niov, nsegs > 1 ? segsz : 0);
+        if (status == (ssize_t)batch_size) continue;
+
+        // The kernel may refuse segmentation at send time (e.g. the outgoing device
+        // can't checksum it). Only those errors disable it: anything else, such as a
+        // full socket buffer, would fail a plain send just the same
+        bool unsupported = errno == EIO || errno == EINVAL || errno == EOPNOTSUPP;
+        if (status >= 0 || nsegs == 1 || !unsupported) {
+            ZCM_DEBUG("ZCM: failed to send fragments of message %u: %s", msg_seqno,
+                      status >= 0 ? "short send" : strerror(errno));
+            msg_seqno++;
+            return ZCM_EUNKNOWN;
+        }
+
+        // Fall back to one datagram per syscall from now on
+        fprintf(stderr, "ZCM Warning: UDP segmentation offload failed (%s), disabling it\n",
+                strerror(errno));
+        gsoEnabled = false;
+        for (int i = 0; i < nsegs; i++) {
+            status = sendfd.sendSegments(dest, iov + segIov[i],
+                                         segIov[i + 1] - segIov[i], 0);
+            if (status != (ssize_t)segLen[i]) {
+                msg_seqno++;
+                return ZCM_EUNKNOWN;
+            }
+        }
+    }
+
+    assert(fragment_offset == msg.len);
+    msg_seqno++;
+    return ZCM_EOK;
+}
+
+void UDP::sendParity(const UDPAddress& dest, const zcm_msg_t& msg, u32 seqno,
+                     int channel_size, int fragment_size, int nfragments)
+{
+    u8 n = txFecCodec->numData();
+    u8 k = txFecCodec->numParity();
+    int nblocks = (nfragments + n - 1) / n;
+    if (nblocks * k > 65535) {
+        ZCM_DEBUG("too many fragments in message %u for forward error correction", seqno);
+        return;
+    }
+
+    // Most symbols are read straight out of the message. The first (channel and data)
+    // and the last (zero padded) ones are assembled in the scratch buffer
+    size_t symsz = fragment_size;
+    size_t prefix = channel_size + 1;
+    size_t lastStart = (size_t)(nfragments - 1) * symsz;
+    assert(nfragments > 1 && lastStart >= prefix);
+
+    fecScratch.resize(3 * symsz);
+    u8 *firstSym = &fecScratch[0];
+    u8 *lastSym = &fecScratch[symsz];
+    u8 *paritySym = &fecScratch[2 * symsz];
+
+    memcpy(firstSym, msg.channel, prefix);
+    memcpy(firstSym + prefix, msg.buf, symsz - prefix);
+    size_t lastLen = prefix + msg.len - lastStart;
+    memcpy(lastSym, msg.buf + (lastStart - prefix), lastLen);
+    memset(lastSym + lastLen, 0, symsz - lastLen);
+
+    MsgHeaderParity hdr;
+    hdr.setMagic(ZCM_MAGIC_PARITY);
+    hdr.setMsgSeqno(seqno);
+    hdr.setFragmentSize(symsz);
+    hdr.setFragmentsInMsg(nfragments);
+    hdr.setFec(n, k);
+
+    const u8 *syms[256];
+    for (int b = 0; b < nblocks; b++) {
+        int first = b * n;
+        int nsyms = std::min((int)n, nfragments - first);
+        for (int i = 0; i < nsyms; i++) {
+            int fragment_no = first + i;
+            if (fragment_no == 0)                   syms[i] = firstSym;
+            else if (fragment_no == nfragments - 1) syms[i] = lastSym;
+            else syms[i] = msg.buf + (size_t)fragment_no * symsz - prefix;
+        }
+
+        for (u8 j = 0; j < k; j++) {
+            txFecCodec->encode(syms, nsyms, symsz, j, paritySym);
+            hdr.setParityNo(b * k + j);
+            pace(sizeof(hdr) + symsz);
+            sendfd.sendBuffers(dest, (char*)&hdr, sizeof(hdr),
+                               (char*)paritySym, symsz);
+        }
+    }
+}
+
+void UDP::nackThreadFunc()
+{
+    Packet *nackPkt = nackPool.allocPacket(ZCM_MAX_UNFRAGMENTED_PACKET_SIZE);
+    while (nackThreadRunning) {
+        // NACKs are sent to the address our fragments came from: the send socket
+        if (!sendfd.waitUntilData(100)) continue;
+        if (sendfd.recvPacket(nackPkt) < 0) continue;
+        handleNack(nackPkt);
+    }
+    nackPool.freePacket(nackPkt);
+}
+
+void UDP::handleNack(Packet *nackPkt)
+{
+    if (nackPkt->sz < sizeof(MsgHeaderNack)) return;
+
+    MsgHeaderNack *hdr = (MsgHeaderNack*)nackPkt->buf.data;
+    if (hdr->getMagic() != ZCM_MAGIC_NACK) {
+        ZCM_DEBUG("ZCM: bad magic on send socket");
+        return;
+    }
+    nacks_received++;
+
+    u32 msg_seqno = hdr->getMsgSeqno();
+    size_t n = std::min((size_t)hdr->getNumFragments(), hdr->getMaxFragments(nackPkt->sz));
+    // Resending is paced, so it mustn't happen under the window lock
+    auto sm = retransmitWindow->find(msg_seqno);
+    if (!sm) {
+        ZCM_DEBUG("NACK for message %u which is no longer in the retransmit window",
+                  msg_seqno);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        u16 fragment_no = hdr->getFragmentNo(i);
+        if (fragment_no >= sm->fragments_in_msg) continue;
+        if (resendFragment(*sm, fragment_no) > 0)
+            fragments_retransmitted++;
+    }
+}
+
+// Resent fragments go to the same destination as the original ones so that every
+// receiver missing them can use them
+ssize_t UDP::resendFragment(const SentMessage& sm, u16 fragment_no)
+{
+    u32 offset, len;
+    sm.getFragment(fragment_no, offset, len);
+
+    MsgHeaderLong hdr;
+    hdr.magic = htonl(ZCM_MAGIC_LONG);
+    hdr.msg_seqno = htonl(sm.msg_seqno);
+    hdr.msg_size = htonl(sm.data.size());
+    hdr.fragment_offset = htonl(offset);
+    hdr.fragment_no = htons(fragment_no);
+    hdr.fragments_in_msg = htons(sm.fragments_in_msg);
+
+    const UDPAddress& dest = destinationFor(sm.channel.c_str());
+    pace(sizeof(hdr) + len + (fragment_no == 0 ? sm.channel.size() + 1 : 0));
+    if (fragment_no == 0)
+        return sendfd.sendBuffers(dest,
+                                  (char*)&hdr, sizeof(hdr),
+                                  sm.channel.c_str(), sm.channel.size()+1,
+                                  sm.data.data() + offset, len);
+    return sendfd.sendBuffers(dest,
+                              (char*)&hdr, sizeof(hdr),
+                              sm.data.data() + offset, len);
+}
+
+// Waits for the pacer, if any, to let ndgrams datagrams totalling dgramBytes through
+void UDP::pace(size_t dgramBytes, size_t ndgrams)
+{
+    if (pacer)
+        pacer->pace(dgramBytes + ndgrams * ZCM_UDP_IP_HEADER_SIZE);
+}
+
+// FNV-1a, so that every peer maps a channel to the same group
+u32 UDP::channelGroup(const char *channel)
+{
+    u32 hash = 2166136261u;
+    for (const char *c = channel; *c; c++) {
+        hash ^= (u8)*c;
+        hash *= 16777619u;
+    }
+    return hash % groupAddrs.size();
+}
+
+const UDPAddress& UDP::destinationFor(const char *channel)
+{
+    if (groupAddrs.empty()) return destAddr;
+    return groupAddrs[channelGroup(channel)];
+}
+
+static bool isRegexChannel(const char *channel)
+{
+    // These chars are considered regex
+    for (const char *c = channel; *c; c++)
+        if (*c == '(' || *c == ')' || *c == '|' ||
+            *c == '.' || *c == '*' || *c == '+')
+            return true;
+    return false;
+}
+
+#ifdef USE_BPF_FILTER
+// Regenerates the socket filters from the enabled channels and the shards. Must hold
+// subLock
+bool UDP::updateSocketFilters()
+{
+    vector<struct sock_filter> prog;
+    if (params.bpf && enabledRegexes.empty()) {
+        vector<string> channels(enabledChannels.begin(), enabledChannels.end());
+        if (!buildChannelFilter(channels, prog)) {
+            ZCM_DEBUG("too many channels for the socket filter, accepting all");
+            prog.clear();
+        }
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < shards.size(); i++) {
+        UDPSocket& recvfd = shards[i]->recvfd;
+        vector<struct sock_filter> shardProg(prog);
+        if (params.multicast && shards.size() > 1)
+            addShardFilter(i, shards.size(), shardProg);
+
+        if (shardProg.empty()) {
+            ok &= recvfd.detachFilter();
+        } else if (!recvfd.attachFilter(shardProg)) {
+            recvfd.detachFilter();
+            ok = false;
+        }
+    }
+    filterAttached = ok && !prog.empty();
+    return ok;
+}
+#endif
+
+int UDP::recvmsgEnable(const char *channel, bool enable)
+{
+    bool wildcard = !channel || isRegexChannel(channel);
+
+    std::unique_lock<std::mutex> lk(subLock);
+    int ret = ZCM_EOK;
+
+    auto& enabled = wildcard ? enabledRegexes : enabledChannels;
+    string key = channel ? channel : ".*";
+    if (enable) enabled.insert(key);
+    else        enabled.erase(key);
+
+#ifdef USE_BPF_FILTER
+    if (params.bpf && !updateSocketFilters())
+        ret = ZCM_ECONNECT;
+#endif
+
+    if (!updateGroups())
+        ret = ZCM_ECONNECT;
+    return ret;
+}
+
+// Joins the groups of the enabled channels and leaves the others. A regex could match
+// channels in any group. Must hold subLock
+bool UDP::updateGroups()
+{
+    if (groupAddrs.empty()) return true;
+
+    vector<bool> wanted(groupAddrs.size(), !enabledRegexes.empty());
+    if (enabledRegexes.empty())
+        for (auto& ch : enabledChannels)
+            wanted[channelGroup(ch.c_str())] = true;
+
+    bool ok = true;
+    for (u32 g = 0; g < groupAddrs.size(); g++) {
+        if (wanted[g] == groupJoined[g]) continue;
+        struct in_addr addr;
+        inet_aton(groupAddrs[g].getIP().c_str(), &addr);
+        for (auto& sh : shards) {
+            if (wanted[g]) ok &= sh->recvfd.joinMulticastGroup(addr);
+            else           ok &= sh->recvfd.leaveMulticastGroup(addr);
+        }
+        groupJoined[g] = wanted[g];
+    }
+    return ok;
+}
+
+// Reassembles the messages arriving on one shard and queues them for recvmsg()
+void UDP::shardThreadFunc(RecvShard& sh)
+{
+    vector<Message*> returned;
+    while (shardsRunning) {
+        {
+            std::unique_lock<std::mutex> lk(sh.returnedLock);
+            returned.swap(sh.returned);
+        }
+        for (Message *msg : returned)
+            sh.pool.freeMessage(msg);
+        returned.clear();
+
+        Message *msg = readMessage(sh, ZCM_SHARD_POLL_MS);
+        if (!msg) continue;
+
+        // Don't run ahead of the consumer. Datagrams are better left in the socket
+        // buffer, where the kernel counts them if it has to drop some
+        std::unique_lock<std::mutex> lk(rxLock);
+        rxSpace.wait(lk, [&]() {
+            return !shardsRunning || rxQueue.empty() ||
+                   (rxQueue.size() < ZCM_SHARD_QUEUE_DEPTH &&
+                    rxQueueBytes + msg->datalen <= ZCM_SHARD_QUEUE_BYTES);
+        });
+        if (!shardsRunning) {
+            sh.pool.freeMessage(msg);
+            break;
+        }
+        rxQueue.push_back({msg, &sh});
+        rxQueueBytes += msg->datalen;
+        rxReady.notify_one();
+    }
+}
+
+// Messages of a sender all come from the same shard, which queues them in order
+Message *UDP::popShardedMessage(unsigned timeoutMs, RecvShard *& shard)
+{
+    std::unique_lock<std::mutex> lk(rxLock);
+    if (!rxReady.wait_for(lk, std::chrono::milliseconds(timeoutMs),
+                          [&]() { return !rxQueue.empty(); }))
+        return nullptr;
+
+    ShardedMsg sm = rxQueue.front();
+    rxQueue.pop_front();
+    rxQueueBytes -= sm.msg->datalen;
+    rxSpace.notify_all();
+
+    shard = sm.shard;
+    return sm.msg;
+}
+
+void UDP::stopShards()
+{
+    {
+        std::unique_lock<std::mutex> lk(rxLock);
+        shardsRunning = false;
+    }
+    rxSpace.notify_all();
+    for (auto& sh : shards)
+        if (sh->thread.joinable())
+            sh->thread.join();
+
+    for (auto& sm : rxQueue)
+        sm.shard->pool.freeMessage(sm.msg);
+    rxQueue.clear();
+    for (auto& sh : shards) {
+        for (Message *msg : sh->returned)
+            sh->pool.freeMessage(msg);
+        sh->returned.clear();
+    }
+}
+
 int UDP::recvmsg(zcm_msg_t *msg, unsigned timeoutMs)
 {
-    if (m) pool.freeMessage(m);
+    if (m) {
+        if (shards.size() > 1) {
+            // the shard's thread owns its pool
+            std::unique_lock<std::mutex> lk(mShard->returnedLock);
+            mShard->returned.push_back(m);
+        } else {
+            mShard->pool.freeMessage(m);
+        }
+        m = nullptr;
+    }
 
-    m = readMessage(timeoutMs);
+    checkForMessageLoss();
+
+    if (shards.size() > 1) {
+        m = popShardedMessage(timeoutMs, mShard);
+    } else {
+        mShard = shards[0].get();
+        m = readMessage(*mShard, timeoutMs);
+    }
     if (m == nullptr)
         return ZCM_EAGAIN;
 
@@ -383,13 +1566,85 @@ int UDP::recvmsg(zcm_msg_t *msg, unsigned timeoutMs)
     msg->channel = m->channel;
     msg->len = m->datalen;
     msg->buf = (uint8_t*) m->data;
+    msg->recv_kernel_ns = m->times.kernel_ns;
+    msg->recv_hw_ns = m->times.hw_ns;
+    msg->recv_dequeue_ns = m->times.dequeue_ns;
+
+    return ZCM_EOK;
+}
+
+// Messages lost before they could be delivered. When every message of every sender
+// reaches the socket, those of which nothing arrived are found from seqno gaps.
+// Otherwise the datagrams the kernel dropped stand in for them
+int UDP::queryDrops(u64 *outDrops)
+{
+    u64 drops = msgs_incomplete + udp_discarded_bad;
+    if (trackSeqnos)
+        drops += msgs_missed;
+    else if (!socketFiltered)
+        drops += kernel_drops;
+    *outDrops = drops;
+    return ZCM_EOK;
+}
 
+int UDP::queryStats(zcm_stat_t *stats, size_t *nstats)
+{
+    const zcm_stat_t all[] = {
+        {"datagrams_received",      udp_rx},
+        {"datagrams_bad",           udp_discarded_bad},
+        {"kernel_drops",            kernel_drops},
+        {"msgs_missed",             msgs_missed},
+        {"msgs_incomplete",         msgs_incomplete},
+        {"frag_bufs_evicted",       frag_bufs_evicted},
+        {"nacks_sent",              nacks_sent},
+        {"nacks_received",          nacks_received},
+        {"fragments_retransmitted", fragments_retransmitted},
+        {"msgs_recovered",          msgs_recovered},
+        {"msgs_unrecovered",        msgs_unrecovered},
+        {"fec_fragments_recovered", fec_fragments_recovered},
+        {"fec_msgs_recovered",      fec_msgs_recovered},
+        {"msgs_coalesced",          msgs_coalesced},
+        {"batches_sent",            batches_sent},
+        {"busy_polls",              busy_polls},
+        {"busy_poll_hits",          busy_poll_hits},
+        {"busy_poll_us",            busy_poll_us},
+        {"pacer_bytes",             pacer ? pacer->bytes_paced.load() : 0},
+        {"pacer_delays",            pacer ? pacer->delays.load() : 0},
+        {"pacer_delay_us",          pacer ? pacer->delay_us.load() : 0},
+    };
+    size_t n = sizeof(all) / sizeof(all[0]);
+    for (size_t i = 0; i < n && i < *nstats; i++)
+        stats[i] = all[i];
+    *nstats = n;
     return ZCM_EOK;
 }
 
 UDP::~UDP()
 {
-    if (m) pool.freeMessage(m);
+    flushBatch();
+    stopShards();
+    if (nackThreadRunning) {
+        nackThreadRunning = false;
+        nackThread.join();
+    }
+    if (params.nack)
+        ZCM_DEBUG("NACKs sent: %lu, received: %lu, fragments resent: %lu, "
+                  "messages recovered: %lu, unrecovered: %lu",
+                  (unsigned long)nacks_sent, (unsigned long)nacks_received,
+                  (unsigned long)fragments_retransmitted,
+                  (unsigned long)msgs_recovered, (unsigned long)msgs_unrecovered);
+    if (msgs_incomplete)
+        ZCM_DEBUG("Dropped %lu incomplete messages, %lu of them evicted for newer ones",
+                  (unsigned long)msgs_incomplete, (unsigned long)frag_bufs_evicted);
+    if (fec_fragments_recovered)
+        ZCM_DEBUG("FEC rebuilt %lu fragments, completing %lu messages",
+                  (unsigned long)fec_fragments_recovered, (unsigned long)fec_msgs_recovered);
+    if (pacer)
+        ZCM_DEBUG("Paced %lu bytes, delaying %lu sends by %lu us in total",
+                  (unsigned long)pacer->bytes_paced, (unsigned long)pacer->delays,
+                  (unsigned long)pacer->delay_us);
+
+    if (m) mShard->pool.freeMessage(m);
     ZCM_DEBUG("closing zcm context");
 }
 
@@ -413,9 +1668,133 @@ bool UDP::init()
     if (!sendfd.isOpen()) return false;
     kernel_sbuf_sz = sendfd.getSendBufSize();
 
-    recvfd = UDPSocket::createRecvSocket(params.addr, params.sub_port, params.multicast);
-    if (!recvfd.isOpen()) return false;
-    kernel_rbuf_sz = recvfd.getRecvBufSize();
+    if (params.groups > 1) {
+        u32 base = ntohl(params.addr.s_addr);
+        if (!params.multicast || (base >> 28) != 0xe || ((base + params.groups - 1) >> 28) != 0xe) {
+            fprintf(stderr, "ZCM Error: groups=%u needs %u multicast addresses starting at %s\n",
+                    params.groups, params.groups, params.ip.c_str());
+            return false;
+        }
+        for (u32 g = 0; g < params.groups; g++) {
+            struct in_addr addr;
+            addr.s_addr = htonl(base + g);
+            groupAddrs.emplace_back(inet_ntoa(addr), params.pub_port);
+        }
+        groupJoined.assign(params.groups, false);
+    }
+
+#ifndef USE_BPF_FILTER
+    if (params.rx_shards > 1) {
+        fprintf(stderr, "ZCM Warning: rx_shards is unavailable on this platform\n");
+        params.rx_shards = 1;
+    }
+#endif
+
+    // When channels are mapped onto groups, the groups are joined by recvmsgEnable()
+    for (u32 i = 0; i < params.rx_shards; i++) {
+        shards.emplace_back(new RecvShard);
+        UDPSocket& recvfd = shards.back()->recvfd;
+        recvfd = UDPSocket::createRecvSocket(params.addr, params.sub_port, params.multicast,
+                                             groupAddrs.empty(), params.rx_shards > 1);
+        if (!recvfd.isOpen()) return false;
+        if (!groupAddrs.empty() && !recvfd.setMulticastAll(false)) return false;
+        if (params.busy_poll_us && !recvfd.enableBusyPoll(params.busy_poll_us)) return false;
+        recvfd.enableDropCounter();
+    }
+    kernel_rbuf_sz = shards[0]->recvfd.getRecvBufSize();
+
+    if (params.gso) {
+        if (params.gso_size == 0) {
+            // fit each fragment in a single frame on the outgoing interface
+            size_t mtu = UDPSocket::getPathMtu(params.ip, params.pub_port);
+            size_t hdrs = ZCM_UDP_IP_HEADER_SIZE;
+            params.gso_size = ZCM_GSO_DEFAULT_DGRAM_SIZE;
+            if (mtu > hdrs + ZCM_GSO_MIN_DGRAM_SIZE)
+                params.gso_size = std::min(mtu - hdrs, (size_t)ZCM_GSO_MAX_BYTES);
+        }
+        gsoEnabled = sendfd.enableSegmentOffload(params.gso_size);
+        if (!gsoEnabled)
+            fprintf(stderr, "ZCM Warning: UDP segmentation offload unavailable, "
+                            "sending fragments individually\n");
+    }
+    if (params.gro) {
+        bool ok = true;
+        for (auto& sh : shards)
+            ok &= sh->recvfd.enableReceiveOffload();
+        if (!ok)
+            fprintf(stderr, "ZCM Warning: UDP receive offload unavailable\n");
+    }
+
+    if (params.bpf) {
+#ifdef USE_BPF_FILTER
+        // A coalesced GRO packet gets a single verdict from the filter, based on the
+        // first of its datagrams, which may not be of the same channel as the rest
+        if (params.gro) {
+            fprintf(stderr, "ZCM Warning: the channel filter can't be used with gro\n");
+            params.bpf = false;
+        }
+        // Continuation fragments can't start a message with the filter attached, so one
+        // whose first fragment is lost would never be recovered
+        if (params.bpf && (params.nack || params.fec_k)) {
+            fprintf(stderr, "ZCM Warning: the channel filter can't be used with nack or fec\n");
+            params.bpf = false;
+        }
+#else
+        fprintf(stderr, "ZCM Warning: the channel filter is unavailable on this platform\n");
+        params.bpf = false;
+#endif
+    }
+
+#ifdef USE_BPF_FILTER
+    // Multicast datagrams reach every shard, which keeps those of its own senders.
+    // With the channel filter, nothing is enabled yet, so this drops everything but
+    // NACKs and parity
+    if (params.bpf || (params.multicast && shards.size() > 1)) {
+        std::unique_lock<std::mutex> lk(subLock);
+        if (!updateSocketFilters()) return false;
+        socketFiltered = true;
+    }
+#endif
+
+    // Groups and the channel filter keep some messages from reaching the socket, which
+    // would look like gaps in their sender's seqnos. Shards don't: every message of a
+    // sender reaches its shard
+    trackSeqnos = groupAddrs.empty() && !params.bpf;
+
+    if (params.rate_mbps > 0) {
+        u64 bytesPerSec = params.rate_mbps * 1e6 / 8;
+        if (params.kernel_pacing && sendfd.setMaxPacingRate(bytesPerSec)) {
+            ZCM_DEBUG("Pacing sends at %g Mbps in the kernel", params.rate_mbps);
+        } else {
+            if (params.kernel_pacing)
+                fprintf(stderr, "ZCM Warning: kernel pacing unavailable, "
+                                "pacing sends in the transport\n");
+            pacer.reset(new Pacer(bytesPerSec, params.burst_kb * 1024));
+        }
+    }
+
+    for (auto& sh : shards) {
+        if (params.hugepages)
+            sh->pool.useHugePages();
+        if (params.prealloc)
+            sh->pool.reserve(params.prealloc, ZCM_PREALLOC_BUFS);
+    }
+
+    if (params.fec_k)
+        txFecCodec.reset(new FecCodec(params.fec_n, params.fec_k));
+
+    if (params.nack) {
+        nack_interval_us = std::max((i64)1000, (i64)params.nack_deadline_ms * 1000 / 8);
+        retransmitWindow.reset(new RetransmitWindow(params.nack_window));
+        nackThreadRunning = true;
+        nackThread = std::thread(&UDP::nackThreadFunc, this);
+    }
+
+    if (shards.size() > 1) {
+        shardsRunning = true;
+        for (auto& sh : shards)
+            sh->thread = std::thread(&UDP::shardThreadFunc, this, std::ref(*sh));
+    }
 
     if (!this->selftest()) {
         // self test failed.  destroy the read thread
@@ -468,14 +1847,23 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
     { return cast(zt)->udp.sendmsg(msg); }
 
     static int _recvmsgEnable(zcm_trans_t *zt, const char *channel, bool enable)
-    { return ZCM_EOK; }
+    { return cast(zt)->udp.recvmsgEnable(channel, enable); }
 
     static int _recvmsg(zcm_trans_t *zt, zcm_msg_t *msg, unsigned timeout)
     { return cast(zt)->udp.recvmsg(msg, timeout); }
 
+    static int _queryDrops(zcm_trans_t *zt, uint64_t *outDrops)
+    { return cast(zt)->udp.queryDrops(outDrops); }
+
+    static int _update(zcm_trans_t *zt)
+    { return cast(zt)->udp.update(); }
+
     static void _destroy(zcm_trans_t *zt)
     { delete cast(zt); }
 
+    static int _queryStats(zcm_trans_t *zt, zcm_stat_t *stats, size_t *nstats)
+    { return cast(zt)->udp.queryStats(stats, nstats); }
+
     static const TransportRegister regUdpm;
     static const TransportRegister regUdp;
 };
@@ -485,9 +1873,10 @@ zcm_trans_methods_t ZCM_TRANS_CLASSNAME::methods = {
     &ZCM_TRANS_CLASSNAME::_sendmsg,
     &ZCM_TRANS_CLASSNAME::_recvmsgEnable,
     &ZCM_TRANS_CLASSNAME::_recvmsg,
-    NULL, // drops
-    NULL, // update
+    &ZCM_TRANS_CLASSNAME::_queryDrops,
+    &ZCM_TRANS_CLASSNAME::_update,
     &ZCM_TRANS_CLASSNAME::_destroy,
+    &ZCM_TRANS_CLASSNAME::_queryStats,
 };
 
 static const char *optFind(zcm_url_opts_t *opts, const string& key)
@@ -537,6 +1926,76 @@ static zcm_trans_t *createUdp(zcm_url_t *url, char **opt_errmsg)
     auto *trans = new ZCM_TRANS_CLASSNAME(address,
                                           atoi(subPort.c_str()), atoi(pubPort.c_str()),
                                           recv_buf_size, atoi(ttl), isMulticast);
+
+    auto& params = trans->udp.params;
+    auto *gso = optFind(opts, "gso");
+    if (gso) params.gso = atoi(gso) != 0;
+    auto *gro = optFind(opts, "gro");
+    if (gro) params.gro = atoi(gro) != 0;
+    auto *gsoSize = optFind(opts, "gso_size");
+    if (gsoSize) {
+        int sz = atoi(gsoSize);
+        if (sz < ZCM_GSO_MIN_DGRAM_SIZE || sz > ZCM_GSO_MAX_BYTES) {
+            ZCM_DEBUG("ERROR: gso_size must be between %d and %d",
+                      ZCM_GSO_MIN_DGRAM_SIZE, ZCM_GSO_MAX_BYTES);
+            delete trans;
+            return nullptr;
+        }
+        params.gso_size = sz;
+    }
+    auto *nack = optFind(opts, "nack");
+    if (nack) params.nack = atoi(nack) != 0;
+    auto *nackDeadline = optFind(opts, "nack_deadline_ms");
+    if (nackDeadline) params.nack_deadline_ms = atoi(nackDeadline);
+    auto *nackWindow = optFind(opts, "nack_window");
+    if (nackWindow) params.nack_window = strtoul(nackWindow, NULL, 10);
+    auto *fec = optFind(opts, "fec");
+    if (fec) {
+        int n = 0, k = 0;
+        if (sscanf(fec, "%d:%d", &n, &k) != 2 || !FecCodec::isValid(n, k)) {
+            ZCM_DEBUG("ERROR: fec must be <data>:<parity> with at most 256 fragments per block");
+            delete trans;
+            return nullptr;
+        }
+        params.fec_n = n;
+        params.fec_k = k;
+    }
+    auto *groups = optFind(opts, "groups");
+    if (groups) params.groups = std::max(1, atoi(groups));
+    auto *bpf = optFind(opts, "bpf");
+    if (bpf) params.bpf = atoi(bpf) != 0;
+    auto *hugepages = optFind(opts, "hugepages");
+    if (hugepages) params.hugepages = atoi(hugepages) != 0;
+    auto *prealloc = optFind(opts, "prealloc");
+    if (prealloc) {
+        size_t sz = strtoul(prealloc, NULL, 10);
+        if (sz > MAX_FRAG_BUF_TOTAL_SIZE) {
+            fprintf(stderr, "ZCM Warning: prealloc=%zu is larger than the reassembly limit, "
+                            "using %d\n", sz, MAX_FRAG_BUF_TOTAL_SIZE);
+            sz = MAX_FRAG_BUF_TOTAL_SIZE;
+        }
+        params.prealloc = sz;
+    }
+    auto *rxShards = optFind(opts, "rx_shards");
+    if (rxShards) params.rx_shards = std::min(std::max(1, atoi(rxShards)), ZCM_MAX_RX_SHARDS);
+    auto *busyPoll = optFind(opts, "busy_poll_us");
+    if (busyPoll) params.busy_poll_us = std::max(0, atoi(busyPoll));
+    auto *coalesce = optFind(opts, "coalesce_us");
+    if (coalesce) params.coalesce_us = std::max(0, atoi(coalesce));
+    auto *coalesceBytes = optFind(opts, "coalesce_bytes");
+    if (coalesceBytes) {
+        size_t max = sizeof(MsgHeaderShort) + ZCM_SHORT_MESSAGE_MAX_SIZE;
+        params.coalesce_bytes = std::min((size_t)std::max(0, atoi(coalesceBytes)), max);
+    }
+    auto *rate = optFind(opts, "rate_mbps");
+    if (rate) params.rate_mbps = std::max(0.0, atof(rate));
+    auto *burst = optFind(opts, "burst_kb");
+    if (burst) params.burst_kb = std::max(1, atoi(burst));
+    auto *kernelPacing = optFind(opts, "kernel_pacing");
+    if (kernelPacing) params.kernel_pacing = atoi(kernelPacing) != 0;
+    auto *simLoss = optFind(opts, "sim_loss");
+    if (simLoss) params.sim_loss = atof(simLoss);
+
     if (!trans->init()) {
         delete trans;
         return nullptr;
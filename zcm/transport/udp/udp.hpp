@@ -18,9 +18,13 @@
 
 // Headers for C++ library
 #include <algorithm>
+#include <atomic>
+#include <memory>
 #include <vector>
 #include <stack>
+#include <deque>
 #include <unordered_map>
+#include <unordered_set>
 #include <string>
 using namespace std;
 
@@ -56,6 +60,28 @@ typedef int SOCKET;
 # define USE_REUSEPORT
 #endif
 
+// UDP segmentation offload (GSO on send, GRO on receive) is linux-only
+#ifdef __linux__
+# include <netinet/udp.h>
+# if defined(UDP_SEGMENT) && defined(UDP_GRO)
+#  define USE_UDP_OFFLOAD
+# endif
+#endif
+
+// Kernel-side channel filtering with classic BPF socket filters is linux-only
+#ifdef __linux__
+# define USE_BPF_FILTER
+#endif
+
+// Nanosecond software and hardware receive timestamps (SO_TIMESTAMPING)
+#ifdef __linux__
+# include <linux/net_tstamp.h>
+# include <linux/errqueue.h>
+# if defined(SO_TIMESTAMPING) && defined(SCM_TIMESTAMPING)
+#  define USE_TIMESTAMPING
+# endif
+#endif
+
 // Headers needed on Windows
 #ifdef WIN32
 # include "windows/WinPorting.h"
@@ -87,6 +113,9 @@ typedef int64_t  i64;
 /************************* Important Defines *******************/
 #define ZCM_MAGIC_SHORT 0x4c433032   // hex repr of ascii "LC02"
 #define ZCM_MAGIC_LONG  0x4c433033   // hex repr of ascii "LC03"
+#define ZCM_MAGIC_NACK  0x4c433034   // hex repr of ascii "LC04"
+#define ZCM_MAGIC_PARITY 0x4c433035  // hex repr of ascii "LC05"
+#define ZCM_MAGIC_BATCH 0x4c433036   // hex repr of ascii "LC06"
 
 #ifdef __APPLE__
 # define ZCM_SHORT_MESSAGE_MAX_SIZE 1435
@@ -99,8 +128,46 @@ typedef int64_t  i64;
 #define ZCM_RINGBUF_SIZE (200*1024)
 #define ZCM_DEFAULT_RECV_BUFS 2000
 #define ZCM_MAX_UNFRAGMENTED_PACKET_SIZE 65536
+// Datagrams up to this size are copied out of the packet buffer they were received in
+#define ZCM_SMALL_DGRAM_SIZE 4096
+// Blocks of each size preallocated by the prealloc option
+#define ZCM_PREALLOC_BUFS 2
+
+// When segmentation offload is enabled, fragments are sized to fit in a single ethernet
+// frame and up to ZCM_GSO_MAX_SEGMENTS of them are handed to the kernel per syscall
+#define ZCM_GSO_DEFAULT_DGRAM_SIZE 1472 // 1500 byte MTU minus IP and UDP headers, used
+                                        // when the route MTU can't be determined
+#define ZCM_GSO_MIN_DGRAM_SIZE 512
+#define ZCM_GSO_MAX_SEGMENTS 64
+#define ZCM_GSO_MAX_BYTES 65507 // largest UDP payload over IPv4
+#define ZCM_UDP_IP_HEADER_SIZE (20 + 8) // IPv4 and UDP headers, without options
+
+// Small-message coalescing (coalesce_us)
+#define ZCM_COALESCE_DEFAULT_BYTES 8192
+
+// Send pacing (rate_mbps)
+#define ZCM_PACER_DEFAULT_BURST_KB 64
+
+// Selective retransmission of lost fragments (NACK)
+#define ZCM_NACK_DEFAULT_DEADLINE_MS 200
+#define ZCM_NACK_DEFAULT_WINDOW_SIZE (1 << 26) // 64 megabytes of recently sent messages
+#define ZCM_NACK_MAX_FRAGMENTS 256 // fragment numbers requested per NACK packet
+#define ZCM_NACK_HISTORY 256 // finished messages remembered to ignore late retransmits
 
 #define MAX_FRAG_BUF_TOTAL_SIZE (1 << 24)// 16 megabytes
 #define MAX_NUM_FRAG_BUFS 1000
+// Without NACKs, a message that gets no fragment for this long is never completed
+#define ZCM_FRAG_BUF_TIMEOUT_MS 100
+
+// Receive sharding (rx_shards)
+#define ZCM_MAX_RX_SHARDS 64
+#define ZCM_SHARD_POLL_MS 100 // how often shard threads check whether to stop
+#define ZCM_SHARD_QUEUE_DEPTH 1024 // reassembled messages waiting for the consumer
+#define ZCM_SHARD_QUEUE_BYTES (1 << 26) // 64 megabytes
+
+// A sender's seqno going back by more than this means it restarted
+#define ZCM_SEQNO_REORDER_WINDOW 1024
+// Minimum time between warnings about datagrams dropped by the kernel
+#define ZCM_DROP_WARNING_INTERVAL_S 10
 
 #define SELF_TEST_CHANNEL "ZCM_SELF_TEST"
@@ -105,6 +105,33 @@ bool UDPSocket::joinMulticastGroup(struct in_addr multiaddr)
     return true;
 }
 
+bool UDPSocket::leaveMulticastGroup(struct in_addr multiaddr)
+{
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr = multiaddr;
+    mreq.imr_interface.s_addr = INADDR_ANY;
+    ZCM_DEBUG("ZCM: leaving multicast group");
+    if (setsockopt(fd, IPPROTO_IP, IP_DROP_MEMBERSHIP, (char*)&mreq, sizeof(mreq)) < 0) {
+        perror("setsockopt (IPPROTO_IP, IP_DROP_MEMBERSHIP)");
+        return false;
+    }
+    return true;
+}
+
+// By default linux delivers traffic for every group joined by any socket on the host
+// to all sockets bound to the port. Disabling this limits a socket to its own groups
+bool UDPSocket::setMulticastAll(bool enable)
+{
+#if defined(__linux__) && defined(IP_MULTICAST_ALL)
+    int opt = enable;
+    if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_ALL, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt (IPPROTO_IP, IP_MULTICAST_ALL)");
+        return false;
+    }
+#endif
+    return true;
+}
+
 bool UDPSocket::setTTL(u8 ttl, bool multicast)
 {
     if (ttl == 0)
@@ -170,9 +197,67 @@ bool UDPSocket::setReusePort()
     return true;
 }
 
+bool UDPSocket::enableLoadBalancing()
+{
+#ifdef SO_REUSEPORT
+    int opt = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt (SOL_SOCKET, SO_REUSEPORT)");
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool UDPSocket::enableBusyPoll(unsigned us)
+{
+#ifdef WIN32
+    u_long nonblocking = 1;
+    if (ioctlsocket(fd, FIONBIO, &nonblocking) != 0) {
+        perror("ioctlsocket (FIONBIO)");
+        return false;
+    }
+#else
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl (O_NONBLOCK)");
+        return false;
+    }
+#endif
+
+    // Raising SO_BUSY_POLL above net.core.busy_read takes CAP_NET_ADMIN. Without it
+    // the spinning is only done in user space
+#ifdef SO_BUSY_POLL
+    int opt = us;
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &opt, sizeof(opt)) < 0)
+        ZCM_DEBUG("ZCM: SO_BUSY_POLL unavailable (%s)", strerror(errno));
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+    int prefer = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) < 0)
+        ZCM_DEBUG("ZCM: SO_PREFER_BUSY_POLL unavailable (%s)", strerror(errno));
+#endif
+    return true;
+}
+
 bool UDPSocket::enablePacketTimestamp()
 {
     /* Enable per-packet timestamping by the kernel, if available */
+#ifdef USE_TIMESTAMPING
+    // Nanosecond software timestamps, plus hardware ones when the NIC makes them
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+                SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0)
+        return true;
+    ZCM_DEBUG("ZCM: SO_TIMESTAMPING unsupported (%s)", strerror(errno));
+#endif
+#ifdef SO_TIMESTAMPNS
+    int nsopt = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &nsopt, sizeof(nsopt)) == 0)
+        return true;
+#endif
 #ifdef SO_TIMESTAMP
     int opt = 1;
     setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, &opt, sizeof(opt));
@@ -180,6 +265,36 @@ bool UDPSocket::enablePacketTimestamp()
     return true;
 }
 
+// Have the kernel report how many datagrams it dropped for lack of buffer space
+bool UDPSocket::enableDropCounter()
+{
+#ifdef SO_RXQ_OVFL
+    int opt = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &opt, sizeof(opt)) < 0) {
+        ZCM_DEBUG("ZCM: SO_RXQ_OVFL unsupported (%s)", strerror(errno));
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool UDPSocket::setMaxPacingRate(u64 bytesPerSec)
+{
+#ifdef SO_MAX_PACING_RATE
+    // The option is 32 bits wide on older kernels
+    u32 rate = (u32)std::min(bytesPerSec, (u64)UINT32_MAX - 1);
+    if (setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) < 0) {
+        ZCM_DEBUG("ZCM: SO_MAX_PACING_RATE unsupported (%s)", strerror(errno));
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
 bool UDPSocket::enableMulticastLoopback()
 {
     // NOTE: For support on SUN Operating Systems, send_lo_opt should be 'u8'
@@ -192,6 +307,62 @@ bool UDPSocket::enableMulticastLoopback()
     return true;
 }
 
+bool UDPSocket::enableSegmentOffload(u16 segsz)
+{
+#ifdef USE_UDP_OFFLOAD
+    // Probe for kernel support. The segment size is passed per call to sendmsg() instead
+    // of being left on the socket so that short messages are never segmented
+    int opt = segsz;
+    if (setsockopt(fd, SOL_UDP, UDP_SEGMENT, &opt, sizeof(opt)) < 0) {
+        ZCM_DEBUG("ZCM: UDP_SEGMENT unsupported (%s)", strerror(errno));
+        return false;
+    }
+    opt = 0;
+    setsockopt(fd, SOL_UDP, UDP_SEGMENT, &opt, sizeof(opt));
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool UDPSocket::enableReceiveOffload()
+{
+#ifdef USE_UDP_OFFLOAD
+    int opt = 1;
+    if (setsockopt(fd, SOL_UDP, UDP_GRO, &opt, sizeof(opt)) < 0) {
+        ZCM_DEBUG("ZCM: UDP_GRO unsupported (%s)", strerror(errno));
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+#ifdef USE_BPF_FILTER
+bool UDPSocket::attachFilter(const vector<struct sock_filter>& prog)
+{
+    struct sock_fprog fprog;
+    fprog.len = prog.size();
+    fprog.filter = (struct sock_filter*)prog.data();
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+        perror("setsockopt (SOL_SOCKET, SO_ATTACH_FILTER)");
+        return false;
+    }
+    return true;
+}
+
+bool UDPSocket::detachFilter()
+{
+    int opt = 0;
+    if (setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, &opt, sizeof(opt)) < 0 && errno != ENOENT) {
+        perror("setsockopt (SOL_SOCKET, SO_DETACH_FILTER)");
+        return false;
+    }
+    return true;
+}
+#endif
+
 size_t UDPSocket::getRecvBufSize()
 {
     int size;
@@ -255,7 +426,7 @@ int UDPSocket::recvPacket(Packet *pkt)
     // operating systems that provide SO_TIMESTAMP allow us to obtain more
     // accurate timestamps by having the kernel produce timestamps as soon
     // as packets are received.
-    char controlbuf[64];
+    char controlbuf[128];
     msg.msg_control = controlbuf;
     msg.msg_controllen = sizeof(controlbuf);
     msg.msg_flags = 0;
@@ -263,28 +434,78 @@ int UDPSocket::recvPacket(Packet *pkt)
 
     int ret = ::recvmsg(fd, &msg, 0);
     pkt->fromlen = msg.msg_namelen;
+    pkt->sz = ret < 0 ? 0 : ret;
+    pkt->segsz = 0;
+    pkt->kernel_drops = 0;
+    pkt->times = RecvTimes();
+    if (ret < 0) return ret;
 
     bool got_utime = false;
-#ifdef SO_TIMESTAMP
+#ifdef MSG_EXT_HDR
     struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-    /* Get the receive timestamp out of the packet headers if possible */
-    while (!pkt->utime && cmsg) {
+    while (ret >= 0 && cmsg) {
+# ifdef USE_TIMESTAMPING
+        /* Software timestamp first, hardware (raw NIC clock) last */
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            pkt->times.kernel_ns = (i64)ts.ts[0].tv_sec * 1000000000 + ts.ts[0].tv_nsec;
+            pkt->times.hw_ns = (i64)ts.ts[2].tv_sec * 1000000000 + ts.ts[2].tv_nsec;
+        }
+# endif
+# ifdef SO_TIMESTAMPNS
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            pkt->times.kernel_ns = (i64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+# endif
+# ifdef SO_TIMESTAMP
+        /* Get the receive timestamp out of the packet headers if possible */
         if (cmsg->cmsg_level == SOL_SOCKET &&
             cmsg->cmsg_type == SCM_TIMESTAMP) {
             struct timeval *t = (struct timeval*) CMSG_DATA (cmsg);
             pkt->utime = (int64_t) t->tv_sec * 1000000 + t->tv_usec;
             got_utime = true;
-            break;
         }
+# endif
+# ifdef SO_RXQ_OVFL
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SO_RXQ_OVFL) {
+            memcpy(&pkt->kernel_drops, CMSG_DATA(cmsg), sizeof(pkt->kernel_drops));
+        }
+# endif
+# ifdef USE_UDP_OFFLOAD
+        /* Several datagrams of the same size coalesced by the kernel (GRO) */
+        if (cmsg->cmsg_level == SOL_UDP &&
+            cmsg->cmsg_type == UDP_GRO) {
+            int segsz;
+            memcpy(&segsz, CMSG_DATA(cmsg), sizeof(segsz));
+            if (segsz > 0 && (size_t)segsz < pkt->sz) pkt->segsz = segsz;
+        }
+# endif
         cmsg = CMSG_NXTHDR(&msg, cmsg);
     }
 #endif
 
+#ifdef WIN32
     if (!got_utime) {
         struct timeval tv;
         gettimeofday(&tv, NULL);
         pkt->utime = (i64)tv.tv_sec * 1000000 + tv.tv_usec;
     }
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    pkt->times.dequeue_ns = (i64)now.tv_sec * 1000000000 + now.tv_nsec;
+
+    if (pkt->times.kernel_ns)
+        pkt->utime = pkt->times.kernel_ns / 1000;
+    else if (!got_utime)
+        pkt->utime = pkt->times.dequeue_ns / 1000;
+#endif
 
     return ret;
 }
@@ -304,7 +525,7 @@ ssize_t UDPSocket::sendBuffers(const UDPAddress& dest, const char *a, size_t ale
     mhdr.msg_controllen = 0;
     mhdr.msg_flags = 0;
 
-    return::sendmsg(fd, &mhdr, 0);
+    return ::sendmsg(fd, &mhdr, 0);
 }
 
 ssize_t UDPSocket::sendBuffers(const UDPAddress& dest, const char *a, size_t alen,
@@ -325,7 +546,7 @@ ssize_t UDPSocket::sendBuffers(const UDPAddress& dest, const char *a, size_t ale
     mhdr.msg_controllen = 0;
     mhdr.msg_flags = 0;
 
-    return::sendmsg(fd, &mhdr, 0);
+    return ::sendmsg(fd, &mhdr, 0);
 }
 
 ssize_t UDPSocket::sendBuffers(const UDPAddress& dest, const char *a, size_t alen,
@@ -348,7 +569,55 @@ ssize_t UDPSocket::sendBuffers(const UDPAddress& dest, const char *a, size_t ale
     mhdr.msg_controllen = 0;
     mhdr.msg_flags = 0;
 
-    return::sendmsg(fd, &mhdr, 0);
+    return ::sendmsg(fd, &mhdr, 0);
+}
+
+ssize_t UDPSocket::sendSegments(const UDPAddress& dest, struct iovec *iv, size_t iovlen,
+                                u16 segsz)
+{
+    struct msghdr mhdr;
+    mhdr.msg_name = dest.getAddrPtr();
+    mhdr.msg_namelen = dest.getAddrSize();
+    mhdr.msg_iov = iv;
+    mhdr.msg_iovlen = iovlen;
+    mhdr.msg_control = NULL;
+    mhdr.msg_controllen = 0;
+    mhdr.msg_flags = 0;
+
+#ifdef USE_UDP_OFFLOAD
+    char controlbuf[CMSG_SPACE(sizeof(u16))];
+    if (segsz) {
+        memset(controlbuf, 0, sizeof(controlbuf));
+        mhdr.msg_control = controlbuf;
+        mhdr.msg_controllen = sizeof(controlbuf);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mhdr);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(u16));
+        memcpy(CMSG_DATA(cmsg), &segsz, sizeof(segsz));
+    }
+#else
+    assert(segsz == 0 && "segmentation offload is unsupported on this platform");
+#endif
+
+    return ::sendmsg(fd, &mhdr, 0);
+}
+
+size_t UDPSocket::getPathMtu(const string& ip, u16 port)
+{
+    int mtu = 0;
+#if defined(__linux__) && defined(IP_MTU)
+    UDPAddress addr{ip, port};
+    SOCKET testfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (connect(testfd, addr.getAddrPtr(), addr.getAddrSize()) == 0) {
+        socklen_t len = sizeof(mtu);
+        if (getsockopt(testfd, IPPROTO_IP, IP_MTU, &mtu, &len) < 0)
+            mtu = 0;
+    }
+    Platform::closesocket(testfd);
+#endif
+    return mtu;
 }
 
 bool UDPSocket::checkConnection(const string& ip, u16 port)
@@ -397,7 +666,8 @@ UDPSocket UDPSocket::createSendSocket(struct in_addr addr, u8 ttl, bool multicas
     return sock;
 }
 
-UDPSocket UDPSocket::createRecvSocket(struct in_addr addr, u16 port, bool multicast)
+UDPSocket UDPSocket::createRecvSocket(struct in_addr addr, u16 port, bool multicast,
+                                      bool joinGroup, bool shared)
 {
     UDPSocket sock;
     if (!sock.init())                        { sock.close(); return sock; }
@@ -405,9 +675,12 @@ UDPSocket UDPSocket::createRecvSocket(struct in_addr addr, u16 port, bool multic
         if (!sock.setReuseAddr())            { sock.close(); return sock; }
         if (!sock.setReusePort())            { sock.close(); return sock; }
     }
+    if (shared) {
+        if (!sock.enableLoadBalancing())     { sock.close(); return sock; }
+    }
     if (!sock.enablePacketTimestamp())       { sock.close(); return sock; }
     if (!sock.bindPort(port))                { sock.close(); return sock; }
-    if (multicast) {
+    if (multicast && joinGroup) {
         if (!sock.joinMulticastGroup(addr))  { sock.close(); return sock; }
     }
     return sock;
@@ -2,6 +2,10 @@
 #include "udp.hpp"
 #include "buffers.hpp"
 
+#ifdef USE_BPF_FILTER
+#include <linux/filter.h>
+#endif
+
 class UDPAddress
 {
   public:
@@ -16,6 +20,13 @@ class UDPAddress
         this->addr.sin_port = htons(port);
     }
 
+    UDPAddress(const struct sockaddr_in& addr)
+    {
+        this->ip = inet_ntoa(addr.sin_addr);
+        this->port = ntohs(addr.sin_port);
+        this->addr = addr;
+    }
+
     const string& getIP() const { return ip; }
     u16 getPort() const { return port; }
     struct sockaddr* getAddrPtr() const { return (struct sockaddr*)&addr; }
@@ -37,12 +48,30 @@ class UDPSocket
 
     bool init();
     bool joinMulticastGroup(struct in_addr multiaddr);
+    bool leaveMulticastGroup(struct in_addr multiaddr);
+    bool setMulticastAll(bool enable);
     bool setTTL(u8 ttl, bool multicast);
     bool bindPort(u16 port);
     bool setReuseAddr();
     bool setReusePort();
+    // Lets other sockets of this process bind the same port. The kernel spreads unicast
+    // datagrams over them by a hash of their addresses
+    bool enableLoadBalancing();
     bool enablePacketTimestamp();
+    // Makes reads non-blocking, and asks the kernel to poll the device for a while
+    // before reporting that there is nothing to read
+    bool enableBusyPoll(unsigned us);
+    bool enableDropCounter();
     bool enableMulticastLoopback();
+    bool enableSegmentOffload(u16 segsz);
+    bool enableReceiveOffload();
+    // Caps the rate the kernel sends at, which takes effect under the fq qdisc
+    bool setMaxPacingRate(u64 bytesPerSec);
+#ifdef USE_BPF_FILTER
+    // Replaces the socket filter, if any, with prog
+    bool attachFilter(const vector<struct sock_filter>& prog);
+    bool detachFilter();
+#endif
     bool setDestination(const string& ip, u16 port);
 
     size_t getRecvBufSize();
@@ -50,6 +79,8 @@ class UDPSocket
 
     // Returns true when there is a packet available for receiving
     bool waitUntilData(unsigned timeout);
+    // Returns -1 with errno set on failure, EAGAIN if nothing was ready to read on a
+    // non-blocking socket
     int recvPacket(Packet *pkt);
 
     ssize_t sendBuffers(const UDPAddress& dest, const char *a, size_t alen);
@@ -57,12 +88,18 @@ class UDPSocket
                             const char *b, size_t blen);
     ssize_t sendBuffers(const UDPAddress& dest, const char *a, size_t alen,
                         const char *b, size_t blen, const char *c, size_t clen);
+    // Sends the iovecs as one datagram, or when segsz is non-zero, as one super-packet
+    // that the kernel splits into datagrams of segsz bytes (GSO)
+    ssize_t sendSegments(const UDPAddress& dest, struct iovec *iv, size_t iovlen, u16 segsz);
 
     static bool checkConnection(const string& ip, u16 port);
+    // Returns the MTU of the route to ip, or 0 if it can't be determined
+    static size_t getPathMtu(const string& ip, u16 port);
     void checkAndWarnAboutSmallBuffer(size_t datalen, size_t kbufsize);
 
     static UDPSocket createSendSocket(struct in_addr addr, u8 ttl, bool multicast);
-    static UDPSocket createRecvSocket(struct in_addr addr, u16 port, bool multicast);
+    static UDPSocket createRecvSocket(struct in_addr addr, u16 port, bool multicast,
+                                      bool joinGroup = true, bool shared = false);
 
   private:
     SOCKET fd = -1;
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+
+// A bounded, lock-free, multi-producer multi-consumer queue of trivially copyable
+// elements (typically pointers). Each cell carries a sequence number telling producers
+// and consumers whose turn it is, so neither ever waits on a lock: a push or pop only
+// fails when the queue is full or empty. Capacity is rounded up to a power of two.
+template<class Element>
+class MpmcQueue
+{
+    static_assert(std::is_trivially_copyable<Element>::value, "");
+
+    struct Cell
+    {
+        std::atomic<size_t> seq;
+        Element val;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+
+    // Producers and consumers each claim cells from their own counter, kept on separate
+    // cache lines so that they don't slow each other down. Padded rather than aligned so
+    // that the queue can be a member of anything allocated with a plain new
+    char pad0[64];
+    std::atomic<size_t> back {0};
+    char pad1[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> front {0};
+    char pad2[64 - sizeof(std::atomic<size_t>)];
+
+  public:
+    MpmcQueue(size_t capacity)
+    {
+        size_t n = 2;
+        while (n < capacity) n *= 2;
+        cells.reset(new Cell[n]);
+        mask = n - 1;
+        for (size_t i = 0; i < n; i++) cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    size_t getCapacity() const { return mask + 1; }
+
+    bool push(const Element& e)
+    {
+        size_t pos = back.load(std::memory_order_relaxed);
+        while (1) {
+            Cell& cell = cells[pos & mask];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (back.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.val = e;
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // full: the cell still holds the element from a lap ago
+            } else {
+                pos = back.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(Element& e)
+    {
+        size_t pos = front.load(std::memory_order_relaxed);
+        while (1) {
+            Cell& cell = cells[pos & mask];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (front.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    e = cell.val;
+                    cell.seq.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // empty: nothing was pushed to the cell yet
+            } else {
+                pos = front.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
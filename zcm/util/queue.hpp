@@ -61,6 +61,9 @@ class Queue
             ++newBack;
         }
 
+        // Destruct whatever didn't fit
+        while (hasMessage()) pop();
+
         delete[] ((uint8_t*) queue);
         queue = (Element*) newQueue;
         front = 0;
@@ -152,6 +152,20 @@ inline void ZCM::setQueueSize(uint32_t sz)
 }
 #endif
 
+#ifndef ZCM_EMBEDDED
+inline void ZCM::setInlineDispatch(bool enable)
+{
+    zcm_set_inline_dispatch(zcm, enable);
+}
+#endif
+
+#ifndef ZCM_EMBEDDED
+inline int ZCM::setDirectPublish(bool enable)
+{
+    return zcm_set_direct_publish(zcm, enable);
+}
+#endif
+
 #ifndef ZCM_EMBEDDED
 inline int ZCM::writeTopology(const std::string& name)
 {
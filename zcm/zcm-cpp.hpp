@@ -44,6 +44,8 @@ class ZCM
     virtual inline void resume();
     virtual inline int  handle();
     virtual inline void setQueueSize(uint32_t sz);
+    virtual inline void setInlineDispatch(bool enable);
+    virtual inline int  setDirectPublish(bool enable);
     virtual inline int  writeTopology(const std::string& name);
     #endif
     virtual inline int  handleNonblock();
@@ -307,6 +307,22 @@ void zcm_set_queue_size(zcm_t* zcm, uint32_t numMsgs)
 }
 #endif
 
+#ifndef ZCM_EMBEDDED
+void zcm_set_inline_dispatch(zcm_t* zcm, int enable)
+{
+    ZCM_ASSERT(zcm->type == ZCM_BLOCKING);
+    return zcm_blocking_set_inline_dispatch(zcm->impl, enable != 0);
+}
+#endif
+
+#ifndef ZCM_EMBEDDED
+int zcm_set_direct_publish(zcm_t* zcm, int enable)
+{
+    ZCM_ASSERT(zcm->type == ZCM_BLOCKING);
+    return zcm_blocking_set_direct_publish(zcm->impl, enable != 0);
+}
+#endif
+
 #ifndef ZCM_EMBEDDED
 int zcm_write_topology(zcm_t* zcm, const char* name)
 {
@@ -357,6 +373,36 @@ int zcm_query_drops(zcm_t *zcm, uint64_t *out_drops)
     return ret;
 }
 
+int zcm_query_stats(zcm_t *zcm, zcm_stat_t *stats, size_t *nstats)
+{
+    int ret = ZCM_EUNKNOWN;
+#ifndef ZCM_EMBEDDED
+    switch (zcm->type) {
+        case ZCM_BLOCKING:
+            ret = zcm_blocking_query_stats(zcm->impl, stats, nstats);
+            break;
+        case ZCM_NONBLOCKING:
+            ret = zcm_nonblocking_query_stats(zcm->impl, stats, nstats);
+            break;
+    }
+#else
+    ZCM_ASSERT(zcm->type == ZCM_NONBLOCKING);
+    ret = zcm_nonblocking_query_stats(zcm->impl, stats, nstats);
+#endif
+    return ret;
+}
+
+int zcm_recv_buf_validate(const zcm_recv_buf_t* rbuf)
+{
+    int ret = ZCM_EOK;
+#ifndef ZCM_EMBEDDED
+    /* Nonblocking transports always hand over copies */
+    if (rbuf->zcm->type == ZCM_BLOCKING)
+        ret = zcm_blocking_validate_recv_buf(rbuf->zcm->impl, rbuf);
+#endif
+    return ret;
+}
+
 /****************************************************************************/
 /*    NOT FOR GENERAL USE. USED FOR LANGUAGE-SPECIFIC BINDINGS WITH VERY    */
 /*                     SPECIFIC THREADING CONSTRAINTS                       */
@@ -16,6 +16,7 @@ extern "C" {
 #define ZCM_MICRO_VERSION 0
 
 #include <stdint.h>
+#include <stddef.h>
 
 #include <assert.h>
 #define ZCM_ASSERT(X) assert(X)
@@ -56,6 +57,7 @@ typedef struct zcm_trans_t    zcm_trans_t;
 typedef struct zcm_t          zcm_t;
 typedef struct zcm_recv_buf_t zcm_recv_buf_t;
 typedef struct zcm_sub_t      zcm_sub_t;
+typedef struct zcm_stat_t     zcm_stat_t;
 
 /* Generic message handler function type */
 typedef void (*zcm_msg_handler_t)(const zcm_recv_buf_t* rbuf, const char* channel,
@@ -80,6 +82,20 @@ struct zcm_recv_buf_t
     zcm_t*   zcm;
     uint8_t* data; /* NOTE: do not free, the library manages this memory */
     uint32_t data_size;
+
+    /* Receive timestamps in nanoseconds since the epoch, 0 if the transport doesn't
+       provide them. Comparing them to the time of dispatch separates network delay
+       from queuing in the transport and in ZCM */
+    uint64_t recv_kernel_ns;  /* arrival in the kernel */
+    uint64_t recv_hw_ns;      /* arrival at the NIC, in the NIC's clock */
+    uint64_t recv_dequeue_ns; /* when the transport took it from the kernel */
+};
+
+/* A named transport statistic, see zcm_query_stats() */
+struct zcm_stat_t
+{
+    const char* name; /* NOTE: owned by the transport, valid for its lifetime */
+    uint64_t    value;
 };
 
 #ifndef ZCM_EMBEDDED
@@ -152,6 +168,20 @@ int  zcm_handle(zcm_t* zcm); /* returns ZCM_EOK normally, error code on failure.
    messages will not be read from / sent to the transport, which could cause significant
    issues depending on the transport. */
 void zcm_set_queue_size(zcm_t* zcm, uint32_t numMsgs);
+/* When enabled (nonzero), zcm_run() and zcm_start() call handlers from the thread that
+   receives from the transport, on the transport's own buffer, instead of queueing each
+   message for a separate dispatch thread. This saves a copy and a thread wakeup per
+   message, but a slow handler holds up receiving, so the transport may drop messages.
+   Takes effect from the next call to zcm_run() or zcm_start(); zcm_handle() always
+   dispatches on its caller's thread. Disabled by default. */
+void zcm_set_inline_dispatch(zcm_t* zcm, int enable);
+/* When enabled (nonzero), zcm_publish() hands messages to the transport from the calling
+   thread whenever no earlier message is waiting to be sent, instead of copying them for
+   the send thread. Messages the transport has no room for are queued as usual, so they
+   stay in order. Only transports whose sends are threadsafe support this (e.g. ipcshm
+   and block-inproc). Returns ZCM_EOK, or ZCM_EINVALID if the transport doesn't support
+   it. Disabled by default. */
+int zcm_set_direct_publish(zcm_t* zcm, int enable);
 
 /* Write topology file to filename. Returns ZCM_EOK normally, error code on failure */
 int zcm_write_topology(zcm_t* zcm, const char* name);
@@ -162,11 +192,26 @@ int zcm_write_topology(zcm_t* zcm, const char* name);
    error code otherwise */
 int zcm_handle_nonblock(zcm_t* zcm);
 
-/* Query the drop counter on the underlying transport
+/* Query the drop counter on the underlying transport. In blocking mode, this includes
+   published messages that the transport then failed to send
    NOTE: This may be unimplemented, in which case it will return ZCM_EIMPL and
    the out-param will be disregarded. */
 int zcm_query_drops(zcm_t* zcm, uint64_t* out_drops);
 
+/* Query the named statistics of the underlying transport. On input *nstats is the
+   capacity of the stats array, on return it is the number of statistics the
+   transport has, which may be larger, in which case only the first ones are written.
+   NOTE: This may be unimplemented, in which case it will return ZCM_EUNIMPL. */
+int zcm_query_stats(zcm_t* zcm, zcm_stat_t* stats, size_t* nstats);
+
+/* Check that the data of a received message is still intact. Transports that hand
+   messages to handlers in place (e.g. ipcshm with zerocopy=1) may overwrite them while
+   they're being read. A handler reading such a buffer should call this after its last
+   read and discard what it read unless it returns ZCM_EOK. Returns ZCM_EAGAIN if the
+   message was overwritten and ZCM_EINVALID if rbuf isn't the buffer being handled.
+   NOTE: Only call this from the handler that rbuf was passed to */
+int zcm_recv_buf_validate(const zcm_recv_buf_t* rbuf);
+
 /****************************************************************************/
 /*    NOT FOR GENERAL USE. USED FOR LANGUAGE-SPECIFIC BINDINGS WITH VERY    */
 /*                     SPECIFIC THREADING CONSTRAINTS                       */